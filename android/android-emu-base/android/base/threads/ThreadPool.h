@@ -53,6 +53,10 @@
 // pool has no way of detecting it and may potentially get all workers to block,
 // resulting in a hanging application.
 //
+// Items that may block, or that have to be processed in order, can be sharded
+// with enqueueIndexed(): all items with the same index go to the same worker,
+// so a blocked item only holds up its own shard.
+//
 
 namespace android {
 namespace base {
@@ -131,6 +135,31 @@ public:
         }
     }
 
+    // Enqueues |item| on the worker for |index| (modulo the number of
+    // workers). Items with the same index are processed in order, on the same
+    // thread. Returns false, leaving |item| alone, if there's no running
+    // worker to take it.
+    bool enqueueIndexed(size_t index, Item&& item) {
+        const auto worker = indexedWorker(index);
+        if (!worker) {
+            return false;
+        }
+        mWorkers[*worker]->enqueue(std::move(item));
+        return true;
+    }
+
+    // Returns the worker that enqueueIndexed() sends the items for |index|
+    // to: the one for |index|, or the next one if that failed to start.
+    Optional<size_t> indexedWorker(size_t index) const {
+        for (size_t i = 0; i < mWorkers.size(); ++i) {
+            const auto worker = (index + i) % mWorkers.size();
+            if (mWorkers[worker]) {
+                return worker;
+            }
+        }
+        return kNullopt;
+    }
+
     int numWorkers() const { return mValidWorkersCount; }
 
 private:
@@ -0,0 +1,123 @@
+// Copyright (C) 2021 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "android/base/threads/ThreadPool.h"
+
+#include "android/base/synchronization/ConditionVariable.h"
+#include "android/base/synchronization/Lock.h"
+#include "android/base/system/System.h"
+#include "android/base/threads/Thread.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+using android::base::AutoLock;
+using android::base::ConditionVariable;
+using android::base::getCurrentThreadId;
+using android::base::Lock;
+using android::base::ThreadPool;
+
+namespace {
+
+struct Item {
+    int shard;
+    int sequence;
+};
+
+}  // namespace
+
+TEST(ThreadPool, EnqueueIndexedKeepsShardsInOrder) {
+    Lock lock;
+    std::map<int, std::vector<int>> sequences;
+    std::map<int, unsigned long> threads;
+    bool sameThread = true;
+
+    {
+        ThreadPool<Item> pool(3, [&](Item&& item) {
+            AutoLock l(lock);
+            sequences[item.shard].push_back(item.sequence);
+            const auto thread = getCurrentThreadId();
+            auto it = threads.emplace(item.shard, thread).first;
+            sameThread = sameThread && it->second == thread;
+        });
+        ASSERT_TRUE(pool.start());
+        for (int i = 0; i < 100; ++i) {
+            for (int shard = 0; shard < 5; ++shard) {
+                pool.enqueueIndexed(shard, {shard, i});
+            }
+        }
+        pool.done();
+        pool.join();
+    }
+
+    EXPECT_TRUE(sameThread);
+    ASSERT_EQ(5u, sequences.size());
+    for (const auto& shard : sequences) {
+        ASSERT_EQ(100u, shard.second.size());
+        for (int i = 0; i < 100; ++i) {
+            EXPECT_EQ(i, shard.second[i]);
+        }
+    }
+}
+
+TEST(ThreadPool, EnqueueIndexedWithoutWorkers) {
+    std::atomic<int> done{0};
+    ThreadPool<Item> pool(2, [&](Item&&) { ++done; });
+    ASSERT_TRUE(pool.start());
+    EXPECT_TRUE(pool.indexedWorker(3));
+    EXPECT_EQ(1u, *pool.indexedWorker(3));
+
+    pool.done();
+    pool.join();
+    EXPECT_FALSE(pool.indexedWorker(0));
+    EXPECT_FALSE(pool.enqueueIndexed(0, {0, 0}));
+    EXPECT_EQ(0, done.load());
+}
+
+TEST(ThreadPool, BlockedShardDoesNotBlockOthers) {
+    Lock lock;
+    ConditionVariable cv;
+    bool release = false;
+    std::atomic<int> done{0};
+
+    ThreadPool<Item> pool(2, [&](Item&& item) {
+        if (item.shard == 0) {
+            AutoLock l(lock);
+            cv.wait(&lock, [&release] { return release; });
+        }
+        ++done;
+    });
+    ASSERT_TRUE(pool.start());
+
+    pool.enqueueIndexed(0, {0, 0});
+    for (int i = 0; i < 10; ++i) {
+        pool.enqueueIndexed(1, {1, i});
+    }
+    while (done.load() < 10) {
+        android::base::Thread::yield();
+    }
+    EXPECT_EQ(10, done.load());
+
+    {
+        AutoLock l(lock);
+        release = true;
+        cv.broadcastAndUnlock(&l);
+    }
+    pool.done();
+    pool.join();
+    EXPECT_EQ(11, done.load());
+}
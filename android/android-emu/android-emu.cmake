@@ -45,6 +45,7 @@ set(android-emu-common
     android/emulation/AdbVsockPipe.cpp
     android/emulation/address_space_device.cpp
     android/emulation/address_space_graphics.cpp
+    android/emulation/address_space_hmd_pose.cpp
     android/emulation/address_space_host_media.cpp
     android/emulation/address_space_host_memory_allocator.cpp
     android/emulation/address_space_shared_slots_host_memory_allocator.cpp
@@ -228,6 +229,9 @@ set(android-emu-common
     android/snapshot/interface.cpp
     android/snapshot/Loader.cpp
     android/snapshot/MemoryWatch_common.cpp
+    android/snapshot/PageAccessTrace.cpp
+    android/snapshot/PageDelta.cpp
+    android/snapshot/PageStore.cpp
     android/snapshot/PathUtils.cpp
     android/snapshot/Quickboot.cpp
     android/snapshot/RamLoader.cpp
@@ -235,6 +239,7 @@ set(android-emu-common
     android/snapshot/RamSnapshotTesting.cpp
     android/snapshot/Saver.cpp
     android/snapshot/Snapshot.cpp
+    android/snapshot/SnapshotStream.cpp
     android/snapshot/Snapshotter.cpp
     android/snapshot/TextureLoader.cpp
     android/snapshot/TextureSaver.cpp
@@ -429,6 +434,7 @@ target_link_libraries(
          LibXml2::LibXml2
          png
          lz4
+         zstd
          zlib
          android-hw-config)
 
@@ -560,6 +566,7 @@ set(android-emu-min
     android/cmdline-option.cpp
     android/emulation/address_space_device.cpp
     android/emulation/address_space_graphics.cpp
+    android/emulation/address_space_hmd_pose.cpp
     android/emulation/address_space_host_memory_allocator.cpp
     android/emulation/address_space_shared_slots_host_memory_allocator.cpp
     android/emulation/android_pipe_host.cpp
@@ -624,6 +631,9 @@ set(android-emu-min
     android/snapshot/interface.cpp
     android/snapshot/Loader.cpp
     android/snapshot/MemoryWatch_common.cpp
+    android/snapshot/PageAccessTrace.cpp
+    android/snapshot/PageDelta.cpp
+    android/snapshot/PageStore.cpp
     android/snapshot/PathUtils.cpp
     android/snapshot/Quickboot.cpp
     android/snapshot/RamLoader.cpp
@@ -631,6 +641,7 @@ set(android-emu-min
     android/snapshot/RamSnapshotTesting.cpp
     android/snapshot/Saver.cpp
     android/snapshot/Snapshot.cpp
+    android/snapshot/SnapshotStream.cpp
     android/snapshot/Snapshotter.cpp
     android/snapshot/TextureLoader.cpp
     android/snapshot/TextureSaver.cpp
@@ -682,6 +693,7 @@ target_link_libraries(
          # Prebuilt libraries
          png
          lz4
+         zstd
          zlib
          android-hw-config)
 # Here are the windows library and link dependencies. They are public and will
@@ -832,6 +844,7 @@ if(NOT LINUX_AARCH64)
       android/emulation/AdbHub_unittest.cpp
       android/emulation/AdbMessageSniffer_unittest.cpp
       android/emulation/address_space_graphics_unittests.cpp
+      android/emulation/address_space_hmd_pose_unittests.cpp
       android/emulation/address_space_host_memory_allocator_unittests.cpp
       android/emulation/address_space_shared_slots_host_memory_allocator_unittests.cpp
       android/emulation/android_pipe_pingpong_unittest.cpp
@@ -910,6 +923,7 @@ if(NOT LINUX_AARCH64)
       android/snapshot/RamSaver_unittest.cpp
       android/snapshot/RamSnapshot_unittest.cpp
       android/snapshot/Snapshot_unittest.cpp
+      android/snapshot/TextureSnapshot_unittest.cpp
       android/telephony/gsm_unittest.cpp
       android/telephony/modem_unittest.cpp
       android/telephony/SimAccessRules_unittest.cpp
@@ -983,6 +997,23 @@ if(NOT LINUX_AARCH64)
                                                         android-emu)
   add_dependencies(android-emu_unittests studio_discovery_tester)
 
+  # Snapshot RAM save/load benchmarks
+  android_add_executable(
+    TARGET snapshot_benchmark
+    NODISTRIBUTE
+    SRC # cmake-format: sortable
+        android/snapshot/RamSnapshot_benchmark.cpp)
+  target_link_libraries(snapshot_benchmark PRIVATE android-emu emulator-gbench)
+
+  # Camera frame conversion benchmarks
+  android_add_executable(
+    TARGET camera_format_converters_benchmark
+    NODISTRIBUTE
+    SRC # cmake-format: sortable
+        android/camera/CameraFormatConverters_benchmark.cpp)
+  target_link_libraries(camera_format_converters_benchmark
+                        PRIVATE android-emu emulator-gbench)
+
   list(
     APPEND
     # cmake-format: sortable
@@ -27,6 +27,7 @@ set(ANDROID_LIBUI_HEADLESS_SRC_FILES
     android/recording/video/player/VideoPlayerNotifier.cpp
     android/recording/video/VideoFrameSharer.cpp
     android/recording/video/VideoProducer.cpp
+    android/recording/VideoSliceConverter.cpp
     android/resource.c
     android/skin/charmap.c
     android/skin/event-headless.cpp
@@ -73,6 +74,7 @@ set(ANDROID_LIBUI_SRC_FILES
     android/recording/video/player/VideoPlayerNotifier.cpp
     android/recording/video/VideoFrameSharer.cpp
     android/recording/video/VideoProducer.cpp
+    android/recording/VideoSliceConverter.cpp
     android/resource.c
     android/skin/charmap.c
     android/skin/file.c
@@ -419,6 +421,8 @@ if(NOT LINUX_AARCH64)
         android/recording/test/DummyAudioProducer.cpp
         android/recording/test/DummyVideoProducer.cpp
         android/recording/test/FfmpegRecorder_unittest.cpp
+        android/recording/test/VideoSliceConverter_unittest.cpp
+        android/recording/VideoSliceConverter.cpp
         android/skin/keycode-buffer_unittest.cpp
         android/skin/keycode_unittest.cpp
         android/skin/qt/native-keyboard-event-handler_unittest.cpp
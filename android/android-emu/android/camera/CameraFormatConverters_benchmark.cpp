@@ -0,0 +1,146 @@
+// Copyright 2021 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Benchmarks for the camera frame conversions that the camera service does for
+// every frame, comparing the libyuv fast-path with the generic slow path.
+//
+// Each benchmark takes the frame width and height as arguments, and reports the
+// throughput in source pixels.
+
+#include "android/camera/camera-format-converters.h"
+
+#include "benchmark/benchmark_api.h"
+
+#include <stdlib.h>
+#include <vector>
+
+static constexpr float kNoScale = 1.0f;
+
+// A frame with arbitrary, but not uniform, content.
+static std::vector<uint8_t> makeFrame(uint32_t format, int width, int height) {
+    size_t size = 0;
+    calculate_framebuffer_size(format, width, height, &size);
+    std::vector<uint8_t> frame(size);
+    for (size_t i = 0; i < frame.size(); ++i) {
+        frame[i] = (i * 31 + (i >> 8)) & 0xff;
+    }
+    return frame;
+}
+
+static void convertFrames(benchmark::State& state,
+                          uint32_t srcFormat,
+                          uint32_t destFormat,
+                          bool fast,
+                          float expComp) {
+    const int width = state.range_x();
+    const int height = state.range_y();
+    const std::vector<uint8_t> src = makeFrame(srcFormat, width, height);
+    std::vector<uint8_t> dest = makeFrame(destFormat, width, height);
+
+    ClientFrameBuffer framebuffer = {};
+    framebuffer.pixel_format = destFormat;
+    framebuffer.framebuffer = dest.data();
+    framebuffer.width = width;
+    framebuffer.height = height;
+
+    uint8_t* stagingFramebuffer = nullptr;
+    size_t stagingFramebufferSize = 0;
+    ClientFrame resultFrame = {};
+    resultFrame.framebuffers = &framebuffer;
+    resultFrame.framebuffers_count = 1;
+    resultFrame.staging_framebuffer = &stagingFramebuffer;
+    resultFrame.staging_framebuffer_size = &stagingFramebufferSize;
+
+    const auto convert = [&]() {
+        return fast ? convert_frame(src.data(), srcFormat, src.size(), width,
+                                    height, &resultFrame, kNoScale, kNoScale,
+                                    kNoScale, expComp)
+                    : convert_frame_slow(src.data(), srcFormat, src.size(),
+                                         width, height, &framebuffer, 1,
+                                         kNoScale, kNoScale, kNoScale,
+                                         expComp);
+    };
+    if (convert() != 0) {
+        state.SetLabel("conversion failed");
+    }
+
+    while (state.KeepRunning()) {
+        convert();
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations()) * width * height);
+    free(stagingFramebuffer);
+}
+
+// VGA and 720p, the sizes the webcam emulation usually runs at.
+#define FRAME_SIZES(bench) bench->ArgPair(640, 480)->ArgPair(1280, 720)
+
+// Defines a benchmark for the fast-path and one for the slow path.
+#define CONVERT_BENCHMARK(name, src, dest, expComp)         \
+    static void BM_##name##_Fast(benchmark::State& state) { \
+        convertFrames(state, src, dest, true, expComp);     \
+    }                                                       \
+    static void BM_##name##_Slow(benchmark::State& state) { \
+        convertFrames(state, src, dest, false, expComp);    \
+    }                                                       \
+    FRAME_SIZES(BENCHMARK(BM_##name##_Fast));               \
+    FRAME_SIZES(BENCHMARK(BM_##name##_Slow))
+
+CONVERT_BENCHMARK(YuyvToNv21, V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV21, 1.0f);
+CONVERT_BENCHMARK(YuyvToNv21Exposure,
+                  V4L2_PIX_FMT_YUYV,
+                  V4L2_PIX_FMT_NV21,
+                  0.5f);
+CONVERT_BENCHMARK(Rgb32ToYv12, V4L2_PIX_FMT_RGB32, V4L2_PIX_FMT_YVU420, 1.0f);
+CONVERT_BENCHMARK(Rgb32ToNv21, V4L2_PIX_FMT_RGB32, V4L2_PIX_FMT_NV21, 1.0f);
+CONVERT_BENCHMARK(BayerToNv21, V4L2_PIX_FMT_SGRBG8, V4L2_PIX_FMT_NV21, 1.0f);
+
+// A preview and a still capture framebuffer from the same source frame.
+static void BM_YuyvToPreviewAndCapture(benchmark::State& state) {
+    const int width = state.range_x();
+    const int height = state.range_y();
+    const std::vector<uint8_t> src =
+            makeFrame(V4L2_PIX_FMT_YUYV, width, height);
+    std::vector<uint8_t> capture =
+            makeFrame(V4L2_PIX_FMT_NV21, width, height);
+    std::vector<uint8_t> preview =
+            makeFrame(V4L2_PIX_FMT_YVU420, width / 2, height / 2);
+
+    ClientFrameBuffer framebuffers[2] = {};
+    framebuffers[0].pixel_format = V4L2_PIX_FMT_NV21;
+    framebuffers[0].framebuffer = capture.data();
+    framebuffers[0].width = width;
+    framebuffers[0].height = height;
+    framebuffers[1].pixel_format = V4L2_PIX_FMT_YVU420;
+    framebuffers[1].framebuffer = preview.data();
+    framebuffers[1].width = width / 2;
+    framebuffers[1].height = height / 2;
+
+    uint8_t* stagingFramebuffer = nullptr;
+    size_t stagingFramebufferSize = 0;
+    ClientFrame resultFrame = {};
+    resultFrame.framebuffers = framebuffers;
+    resultFrame.framebuffers_count = 2;
+    resultFrame.staging_framebuffer = &stagingFramebuffer;
+    resultFrame.staging_framebuffer_size = &stagingFramebufferSize;
+
+    while (state.KeepRunning()) {
+        convert_frame(src.data(), V4L2_PIX_FMT_YUYV, src.size(), width, height,
+                      &resultFrame, kNoScale, kNoScale, kNoScale, 1.0f);
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations()) * width * height);
+    free(stagingFramebuffer);
+}
+
+FRAME_SIZES(BENCHMARK(BM_YuyvToPreviewAndCapture));
+
+BENCHMARK_MAIN()
@@ -13,6 +13,7 @@
 
 #include <gtest/gtest.h>
 
+#include <utility>
 #include <vector>
 
 // An arbitrary color that's easily recognizable in hex and different for each
@@ -53,8 +54,16 @@ static constexpr uint32_t kSupportedSourceFormats[] = {
         // Aliases for V4L2_PIX_FMT_YUYV.
         V4L2_PIX_FMT_YUY2, V4L2_PIX_FMT_YUNV, V4L2_PIX_FMT_V422,
 
-        // Exclude bayer formats, they are not available in the fast-path so
-        // they don't need comparative testing.
+        // Bayer formats have their own tests, the slow path only converts
+        // them from an even width.
+};
+
+// 8-bit bayer formats, which the fast-path converts.
+static constexpr uint32_t kBayer8Formats[] = {
+        V4L2_PIX_FMT_SBGGR8,
+        V4L2_PIX_FMT_SGBRG8,
+        V4L2_PIX_FMT_SGRBG8,
+        V4L2_PIX_FMT_SRGGB8,
 };
 
 // A list of supported output formats, taken from camera-service.c's
@@ -194,6 +203,49 @@ static std::vector<uint8_t> generateFramebuffer(uint32_t format,
     return dest;
 }
 
+// Generate a bayer framebuffer, where every pixel takes the channel of
+// |colorAt(x, y)| that the pixel measures.
+template <typename ColorAt>
+static std::vector<uint8_t> generateBayerFramebuffer(uint32_t format,
+                                                     int width,
+                                                     int height,
+                                                     ColorAt colorAt) {
+    const char* colorOrder = "";
+    switch (format) {
+        case V4L2_PIX_FMT_SBGGR8:
+            colorOrder = "BGGR";
+            break;
+        case V4L2_PIX_FMT_SGBRG8:
+            colorOrder = "GBRG";
+            break;
+        case V4L2_PIX_FMT_SGRBG8:
+            colorOrder = "GRBG";
+            break;
+        case V4L2_PIX_FMT_SRGGB8:
+            colorOrder = "RGGB";
+            break;
+    }
+
+    std::vector<uint8_t> bayer(bufferSize(format, width, height));
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const uint32_t rgb = colorAt(x, y);
+            switch (colorOrder[((y & 1) << 1) | (x & 1)]) {
+                case 'R':
+                    bayer[y * width + x] = rgb >> 16;
+                    break;
+                case 'G':
+                    bayer[y * width + x] = rgb >> 8;
+                    break;
+                default:
+                    bayer[y * width + x] = rgb;
+                    break;
+            }
+        }
+    }
+    return bayer;
+}
+
 static void compareSumOfSquaredDifferences(const std::vector<uint8_t>& src,
                                            const std::vector<uint8_t>& dest,
                                            double threshold) {
@@ -493,3 +545,205 @@ TEST_P(FrameModifiers, ExpComp) {
 INSTANTIATE_TEST_CASE_P(CameraFormatConverters,
                         FrameModifiers,
                         testing::Values(1.0f, 0.0f, 0.5f, -1.0f, 2.0f));
+
+// Converts |src| with convert_frame and with convert_frame_slow into
+// |destFormat|, and returns both results.
+static std::pair<std::vector<uint8_t>, std::vector<uint8_t>> convertBothPaths(
+        const std::vector<uint8_t>& src,
+        uint32_t srcFormat,
+        uint32_t destFormat,
+        int width,
+        int height,
+        float expComp) {
+    uint8_t* stagingFramebuffer = nullptr;
+    size_t stagingFramebufferSize = 0;
+
+    const size_t destSize = bufferSize(destFormat, width, height);
+    std::vector<uint8_t> dest(destSize);
+    ClientFrameBuffer framebuffer = {};
+    framebuffer.pixel_format = destFormat;
+    framebuffer.framebuffer = dest.data();
+    framebuffer.width = width;
+    framebuffer.height = height;
+
+    ClientFrame resultFrame = {};
+    resultFrame.framebuffers = &framebuffer;
+    resultFrame.framebuffers_count = 1;
+    resultFrame.staging_framebuffer = &stagingFramebuffer;
+    resultFrame.staging_framebuffer_size = &stagingFramebufferSize;
+
+    EXPECT_EQ(0, convert_frame_fast(src.data(), srcFormat, src.size(), width,
+                                    height, &resultFrame, expComp));
+    free(stagingFramebuffer);
+
+    std::vector<uint8_t> destBaseline(destSize);
+    ClientFrameBuffer baselineFramebuffer = {};
+    baselineFramebuffer.pixel_format = destFormat;
+    baselineFramebuffer.framebuffer = destBaseline.data();
+
+    EXPECT_EQ(0, convert_frame_slow(src.data(), srcFormat, src.size(), width,
+                                    height, &baselineFramebuffer, 1,
+                                    kDefaultColorScale, kDefaultColorScale,
+                                    kDefaultColorScale, expComp));
+
+    return {std::move(destBaseline), std::move(dest)};
+}
+
+TEST(CameraFormatConverters, BayerSolidColor) {
+    const auto color = [](int x, int y) {
+        return (uint32_t(kRed) << 16) | (uint32_t(kGreen) << 8) | kBlue;
+    };
+
+    for (const FramebufferSizeParam& param :
+         {FramebufferSizeParam(4, 4), FramebufferSizeParam(16, 16),
+          FramebufferSizeParam(32, 18), FramebufferSizeParam(18, 8)}) {
+        for (uint32_t srcFormat : kBayer8Formats) {
+            const std::vector<uint8_t> src = generateBayerFramebuffer(
+                    srcFormat, param.width, param.height, color);
+
+            for (uint32_t destFormat : kSupportedDestinationFormats) {
+                SCOPED_TRACE(testing::Message()
+                             << param.width << "x" << param.height
+                             << " source=" << fourccToString(srcFormat)
+                             << " dest=" << fourccToString(destFormat));
+
+                const auto converted =
+                        convertBothPaths(src, srcFormat, destFormat,
+                                         param.width, param.height,
+                                         kDefaultExpComp);
+                // The fast-path goes through YUV even for RGB destinations.
+                compareSumOfSquaredDifferences(converted.first,
+                                               converted.second,
+                                               kLenientDifferenceSq);
+                if (HasFatalFailure()) {
+                    return;
+                }
+            }
+        }
+    }
+}
+
+// The slow path takes every bayer pixel through the exposure compensation,
+// which must give back the demosaiced color when there is nothing to
+// compensate.
+TEST(CameraFormatConverters, BayerSlowPathColors) {
+    constexpr int kWidth = 4;
+    constexpr int kHeight = 4;
+    const auto color = [](int x, int y) {
+        return (uint32_t(kRed) << 16) | (uint32_t(kGreen) << 8) | kBlue;
+    };
+
+    for (uint32_t srcFormat : kBayer8Formats) {
+        const std::vector<uint8_t> src =
+                generateBayerFramebuffer(srcFormat, kWidth, kHeight, color);
+
+        for (uint32_t destFormat : {V4L2_PIX_FMT_RGB32, V4L2_PIX_FMT_RGB24}) {
+            SCOPED_TRACE(testing::Message()
+                         << "source=" << fourccToString(srcFormat)
+                         << " dest=" << fourccToString(destFormat));
+
+            const std::vector<uint8_t> expected = generateFramebuffer(
+                    destFormat, kWidth, kHeight, kAlpha, kRed, kGreen, kBlue);
+            std::vector<uint8_t> dest(expected.size());
+            ClientFrameBuffer framebuffer = {};
+            framebuffer.pixel_format = destFormat;
+            framebuffer.framebuffer = dest.data();
+
+            EXPECT_EQ(0, convert_frame_slow(src.data(), srcFormat, src.size(),
+                                            kWidth, kHeight, &framebuffer, 1,
+                                            kDefaultColorScale,
+                                            kDefaultColorScale,
+                                            kDefaultColorScale,
+                                            kDefaultExpComp));
+            compareSumOfSquaredDifferences(expected, dest,
+                                           kLenientDifferenceSq);
+        }
+    }
+}
+
+// The demosaiced colors vary from pixel to pixel, and the fast-path averages
+// the chroma of four pixels where the slow path takes a single one, so only
+// luma is comparable.
+TEST(CameraFormatConverters, BayerGradientLuma) {
+    constexpr int kWidth = 34;
+    constexpr int kHeight = 21;
+    const auto gradient = [](int x, int y) {
+        return (uint32_t(x * 7) << 16) | (uint32_t(y * 12) << 8) |
+               uint32_t((x + y) * 4);
+    };
+
+    for (uint32_t srcFormat : kBayer8Formats) {
+        SCOPED_TRACE(testing::Message()
+                     << "source=" << fourccToString(srcFormat));
+
+        const std::vector<uint8_t> src =
+                generateBayerFramebuffer(srcFormat, kWidth, kHeight, gradient);
+        const auto converted =
+                convertBothPaths(src, srcFormat, V4L2_PIX_FMT_YUV420, kWidth,
+                                 kHeight, kDefaultExpComp);
+
+        // Planar YUV rows are aligned to 16 pixels.
+        const size_t lumaSize = (kWidth + 15) / 16 * 16 * kHeight;
+        compareSumOfSquaredDifferences(
+                std::vector<uint8_t>(converted.first.begin(),
+                                     converted.first.begin() + lumaSize),
+                std::vector<uint8_t>(converted.second.begin(),
+                                     converted.second.begin() + lumaSize),
+                kLenientDifferenceSq);
+    }
+}
+
+// Every framebuffer of a frame gets the exposure compensation exactly once,
+// whatever its size.
+TEST(CameraFormatConverters, MultipleFramebuffers) {
+    constexpr int kWidth = 16;
+    constexpr int kHeight = 16;
+    constexpr float kExpComp = 0.5f;
+
+    uint8_t* stagingFramebuffer = nullptr;
+    size_t stagingFramebufferSize = 0;
+
+    const std::vector<uint8_t> src =
+            generateFramebuffer(V4L2_PIX_FMT_YUYV, kWidth, kHeight, kAlpha,
+                                kRed, kGreen, kBlue);
+
+    std::vector<uint8_t> full(bufferSize(V4L2_PIX_FMT_NV21, kWidth, kHeight));
+    std::vector<uint8_t> quarter(
+            bufferSize(V4L2_PIX_FMT_YVU420, kWidth / 2, kHeight / 2));
+    ClientFrameBuffer framebuffers[2] = {};
+    framebuffers[0].pixel_format = V4L2_PIX_FMT_NV21;
+    framebuffers[0].framebuffer = full.data();
+    framebuffers[0].width = kWidth;
+    framebuffers[0].height = kHeight;
+    framebuffers[1].pixel_format = V4L2_PIX_FMT_YVU420;
+    framebuffers[1].framebuffer = quarter.data();
+    framebuffers[1].width = kWidth / 2;
+    framebuffers[1].height = kHeight / 2;
+
+    ClientFrame resultFrame = {};
+    resultFrame.framebuffers = framebuffers;
+    resultFrame.framebuffers_count = 2;
+    resultFrame.staging_framebuffer = &stagingFramebuffer;
+    resultFrame.staging_framebuffer_size = &stagingFramebufferSize;
+
+    EXPECT_EQ(0, convert_frame_fast(src.data(), V4L2_PIX_FMT_YUYV, src.size(),
+                                    kWidth, kHeight, &resultFrame, kExpComp));
+
+    // The same frame converted to each framebuffer on its own.
+    for (int i = 0; i < 2; ++i) {
+        SCOPED_TRACE(testing::Message() << "framebuffer " << i);
+
+        std::vector<uint8_t> expected(i == 0 ? full.size() : quarter.size());
+        ClientFrameBuffer framebuffer = framebuffers[i];
+        framebuffer.framebuffer = expected.data();
+        resultFrame.framebuffers = &framebuffer;
+        resultFrame.framebuffers_count = 1;
+
+        EXPECT_EQ(0,
+                  convert_frame_fast(src.data(), V4L2_PIX_FMT_YUYV, src.size(),
+                                     kWidth, kHeight, &resultFrame, kExpComp));
+        EXPECT_EQ(expected, i == 0 ? full : quarter);
+    }
+
+    free(stagingFramebuffer);
+}
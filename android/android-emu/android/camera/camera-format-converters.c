@@ -27,6 +27,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+/* SSE2 is part of the x86_64 baseline, other hosts demosaic bayer frames with
+ * the scalar kernel only. */
+#ifdef __x86_64__
+#define BAYER8_SSE2 1
+#include <emmintrin.h>
+#else
+#define BAYER8_SSE2 0
+#endif
+
 #define  E(...)    derror(__VA_ARGS__)
 #define  W(...)    dwarning(__VA_ARGS__)
 #define  D(...)    VERBOSE_PRINT(camera,__VA_ARGS__)
@@ -288,9 +297,9 @@ _change_exposure_RGB_i(int* r, int* g, int* b, float exp_comp)
     uint8_t y, u, v;
     R8G8B8ToYUV(*r, *g, *b, &y, &u, &v);
     y = _change_exposure(y, exp_comp);
-    *r = YUV2RO(y,u,v);
-    *g = YUV2GO(y,u,v);
-    *b = YUV2BO(y,u,v);
+    *r = YUV2R(y,u,v);
+    *g = YUV2G(y,u,v);
+    *b = YUV2B(y,u,v);
 }
 
 /* Computes the pixel value after adjusting the white balance to the current
@@ -1697,6 +1706,28 @@ static bool valid_libyuv_pixformat(const PIXFormat* desc) {
             desc->fourcc_type != V4L2_PIX_FMT_YYVU);
 }
 
+/* Gets the descriptor of an 8-bit bayer format, the only bayer formats that the
+ * fast-path converts.
+ * Param:
+ *  |pixel_format| - V4L2 pixel format.
+ * Return:
+ *  The bayer descriptor, or NULL if |pixel_format| is not an 8-bit bayer
+ *  format.
+ */
+static const BayerDesc* get_bayer8_descriptor(uint32_t pixel_format) {
+    switch (pixel_format) {
+        case V4L2_PIX_FMT_SBGGR8:
+            return &_BG8;
+        case V4L2_PIX_FMT_SGBRG8:
+            return &_GB8;
+        case V4L2_PIX_FMT_SGRBG8:
+            return &_GR8;
+        case V4L2_PIX_FMT_SRGGB8:
+            return &_RG8;
+    }
+    return NULL;
+}
+
 /* Given a source format and |result_frame| structure, determine if the libyuv
  * fast-path should be used to convert to the destination formats. To use the
  * fast-path, all formats should be valid libyuv formats.
@@ -1709,8 +1740,10 @@ static bool valid_libyuv_pixformat(const PIXFormat* desc) {
  */
 static bool libyuv_supported(const PIXFormat* src_desc,
                              ClientFrame* result_frame) {
-    // Use libyuv if all of the formats are valid.
-    bool valid_format = valid_libyuv_pixformat(src_desc);
+    // Use libyuv if all of the formats are valid. 8-bit Bayer sources are
+    // demosaiced into ARGB rows that libyuv takes from there.
+    bool valid_format = valid_libyuv_pixformat(src_desc) ||
+                        get_bayer8_descriptor(src_desc->fourcc_type) != NULL;
 
     int i;
     for (i = 0; i < result_frame->framebuffers_count; ++i) {
@@ -1926,6 +1959,310 @@ bool resize_staging(ClientFrame* result_frame, size_t required) {
     return true;
 }
 
+/* The color a bayer pixel measures, and which neighbors the other two colors
+ * are interpolated from, see _get_bayerRGB. */
+typedef enum BayerSite {
+    /* Red, green from the cross, blue from the diagonals. */
+    BAYER_SITE_RED,
+    /* Blue, green from the cross, red from the diagonals. */
+    BAYER_SITE_BLUE,
+    /* Green, red from the left and right, blue from above and below. */
+    BAYER_SITE_GREEN_RED_ROW,
+    /* Green, blue from the left and right, red from above and below. */
+    BAYER_SITE_GREEN_BLUE_ROW,
+} BayerSite;
+
+static BayerSite _get_bayer_site(const BayerDesc* desc, int x, int y) {
+    switch (_get_bayer_color_sel(desc, x, y)) {
+        case 'R':
+            return BAYER_SITE_RED;
+        case 'B':
+            return BAYER_SITE_BLUE;
+        default:
+            return _get_bayer_color_sel(desc, x + 1, y) == 'R'
+                           ? BAYER_SITE_GREEN_RED_ROW
+                           : BAYER_SITE_GREEN_BLUE_ROW;
+    }
+}
+
+/* Interpolates the pixel at |x| of a row of an 8-bit bayer framebuffer that is
+ * not on any of its edges, so all eight neighbors exist. Produces the same
+ * colors as _get_bayerRGB without going through the descriptor per neighbor.
+ * Param:
+ *  site - What the pixel measures.
+ *  above, row, below - The row of the pixel and its neighboring rows.
+ *  x - Column of the pixel, neither the first nor the last.
+ *  argb - Upon return contains the B, G, R and A bytes of the pixel, which is
+ *      libyuv's ARGB.
+ */
+static __inline__ void
+_bayer8_interior_to_argb(BayerSite site,
+                         const uint8_t* above,
+                         const uint8_t* row,
+                         const uint8_t* below,
+                         int x,
+                         uint8_t* argb)
+{
+    int r, g, b;
+    switch (site) {
+        case BAYER_SITE_RED:
+            r = row[x];
+            g = (row[x - 1] + row[x + 1] + above[x] + below[x]) / 4;
+            b = (above[x - 1] + above[x + 1] + below[x - 1] + below[x + 1]) / 4;
+            break;
+        case BAYER_SITE_BLUE:
+            b = row[x];
+            g = (row[x - 1] + row[x + 1] + above[x] + below[x]) / 4;
+            r = (above[x - 1] + above[x + 1] + below[x - 1] + below[x + 1]) / 4;
+            break;
+        case BAYER_SITE_GREEN_RED_ROW:
+            g = row[x];
+            r = (row[x - 1] + row[x + 1]) / 2;
+            b = (above[x] + below[x]) / 2;
+            break;
+        default:
+            g = row[x];
+            b = (row[x - 1] + row[x + 1]) / 2;
+            r = (above[x] + below[x]) / 2;
+            break;
+    }
+    argb[0] = b;
+    argb[1] = g;
+    argb[2] = r;
+    argb[3] = 0xff;
+}
+
+#if BAYER8_SSE2
+/* Which of the eight 16-bit lanes of a vector measure each color. Lane i holds
+ * column x + i of a line, with x odd. */
+typedef struct Bayer8SiteMasks {
+    __m128i red;
+    __m128i blue;
+    __m128i green;
+    __m128i green_red_row;
+    __m128i green_blue_row;
+} Bayer8SiteMasks;
+
+static __m128i _bayer8_site_mask(BayerSite odd, BayerSite even, BayerSite site)
+{
+    const short o = odd == site ? -1 : 0;
+    const short e = even == site ? -1 : 0;
+    return _mm_set_epi16(e, o, e, o, e, o, e, o);
+}
+
+/* Returns |a| in the lanes set in |mask|, and |b| in the others. */
+static __inline__ __m128i _sse2_select(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/* Loads 8 bytes from |p| as 16-bit lanes. */
+static __inline__ __m128i _sse2_load8_epi16(const uint8_t* p)
+{
+    return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p),
+                             _mm_setzero_si128());
+}
+
+/* Interpolates the 8 interior pixels at |x| to |x| + 7 the way
+ * _bayer8_interior_to_argb does, into 16-bit lanes of |r|, |g| and |b|. */
+static __inline__ void
+_bayer8_interior8_sse2(const Bayer8SiteMasks* masks,
+                       const uint8_t* above,
+                       const uint8_t* row,
+                       const uint8_t* below,
+                       int x,
+                       __m128i* r,
+                       __m128i* g,
+                       __m128i* b)
+{
+    const __m128i center = _sse2_load8_epi16(row + x);
+    const __m128i hor_sum = _mm_add_epi16(_sse2_load8_epi16(row + x - 1),
+                                          _sse2_load8_epi16(row + x + 1));
+    const __m128i vert_sum = _mm_add_epi16(_sse2_load8_epi16(above + x),
+                                           _sse2_load8_epi16(below + x));
+    const __m128i diag_sum =
+            _mm_add_epi16(_mm_add_epi16(_sse2_load8_epi16(above + x - 1),
+                                        _sse2_load8_epi16(above + x + 1)),
+                          _mm_add_epi16(_sse2_load8_epi16(below + x - 1),
+                                        _sse2_load8_epi16(below + x + 1)));
+    const __m128i cross = _mm_srli_epi16(_mm_add_epi16(hor_sum, vert_sum), 2);
+    const __m128i diag = _mm_srli_epi16(diag_sum, 2);
+    const __m128i hor = _mm_srli_epi16(hor_sum, 1);
+    const __m128i vert = _mm_srli_epi16(vert_sum, 1);
+
+    *g = _sse2_select(masks->green, center, cross);
+    *r = _sse2_select(masks->red, center,
+                      _sse2_select(masks->blue, diag,
+                                   _sse2_select(masks->green_red_row, hor,
+                                                vert)));
+    *b = _sse2_select(masks->blue, center,
+                      _sse2_select(masks->red, diag,
+                                   _sse2_select(masks->green_blue_row, hor,
+                                                vert)));
+}
+
+/* Interpolates the interior of a line 16 pixels at a time, starting at column
+ * 1, while all of the neighbors of the 16 pixels are inside the line.
+ * Return:
+ *  The first column that is left for the scalar kernel, which is odd.
+ */
+static int
+_bayer8_interior_to_argb_sse2(BayerSite odd,
+                              BayerSite even,
+                              const uint8_t* above,
+                              const uint8_t* row,
+                              const uint8_t* below,
+                              int width,
+                              uint8_t* argb)
+{
+    Bayer8SiteMasks masks;
+    const __m128i alpha = _mm_set1_epi8((char)0xff);
+    int x;
+
+    masks.red = _bayer8_site_mask(odd, even, BAYER_SITE_RED);
+    masks.blue = _bayer8_site_mask(odd, even, BAYER_SITE_BLUE);
+    masks.green_red_row = _bayer8_site_mask(odd, even, BAYER_SITE_GREEN_RED_ROW);
+    masks.green_blue_row =
+            _bayer8_site_mask(odd, even, BAYER_SITE_GREEN_BLUE_ROW);
+    masks.green = _mm_or_si128(masks.green_red_row, masks.green_blue_row);
+
+    for (x = 1; x + 17 <= width; x += 16) {
+        __m128i r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+        _bayer8_interior8_sse2(&masks, above, row, below, x, &r_lo, &g_lo,
+                               &b_lo);
+        _bayer8_interior8_sse2(&masks, above, row, below, x + 8, &r_hi, &g_hi,
+                               &b_hi);
+
+        const __m128i r = _mm_packus_epi16(r_lo, r_hi);
+        const __m128i g = _mm_packus_epi16(g_lo, g_hi);
+        const __m128i b = _mm_packus_epi16(b_lo, b_hi);
+        const __m128i bg_lo = _mm_unpacklo_epi8(b, g);
+        const __m128i bg_hi = _mm_unpackhi_epi8(b, g);
+        const __m128i ra_lo = _mm_unpacklo_epi8(r, alpha);
+        const __m128i ra_hi = _mm_unpackhi_epi8(r, alpha);
+
+        __m128i* dst = (__m128i*)(argb + x * 4);
+        _mm_storeu_si128(dst, _mm_unpacklo_epi16(bg_lo, ra_lo));
+        _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(bg_lo, ra_lo));
+        _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(bg_hi, ra_hi));
+        _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(bg_hi, ra_hi));
+    }
+    return x;
+}
+#endif  // BAYER8_SSE2
+
+/* Interpolates any pixel of an 8-bit bayer framebuffer into ARGB, taking the
+ * edges of the framebuffer into account. */
+static void
+_bayer8_edge_to_argb(const BayerDesc* desc,
+                     const uint8_t* bayer,
+                     int x,
+                     int y,
+                     int width,
+                     int height,
+                     uint8_t* argb)
+{
+    int r, g, b;
+    _get_bayerRGB(desc, bayer, x, y, width, height, &r, &g, &b);
+    argb[0] = b;
+    argb[1] = g;
+    argb[2] = r;
+    argb[3] = 0xff;
+}
+
+/* Demosaics line |y| of an 8-bit bayer framebuffer into |width| ARGB pixels. */
+static void
+_bayer8_line_to_argb(const BayerDesc* desc,
+                     const uint8_t* bayer,
+                     int y,
+                     int width,
+                     int height,
+                     uint8_t* argb)
+{
+    int x;
+    if (y > 0 && y < height - 1 && width > 2) {
+        const uint8_t* row = bayer + y * width;
+        const BayerSite odd = _get_bayer_site(desc, 1, y);
+        const BayerSite even = _get_bayer_site(desc, 2, y);
+
+        // Sites alternate along a line, so the interior is walked in pairs
+        // with the site decided once per line.
+#if BAYER8_SSE2
+        x = _bayer8_interior_to_argb_sse2(odd, even, row - width, row,
+                                          row + width, width, argb);
+#else
+        x = 1;
+#endif
+        for (; x + 2 < width; x += 2) {
+            _bayer8_interior_to_argb(odd, row - width, row, row + width, x,
+                                     argb + x * 4);
+            _bayer8_interior_to_argb(even, row - width, row, row + width,
+                                     x + 1, argb + (x + 1) * 4);
+        }
+        if (x + 1 < width) {
+            _bayer8_interior_to_argb(odd, row - width, row, row + width, x,
+                                     argb + x * 4);
+        }
+
+        // The first and last pixels average over fewer neighbors.
+        _bayer8_edge_to_argb(desc, bayer, 0, y, width, height, argb);
+        _bayer8_edge_to_argb(desc, bayer, width - 1, y, width, height,
+                             argb + (width - 1) * 4);
+        return;
+    }
+
+    for (x = 0; x < width; x++) {
+        _bayer8_edge_to_argb(desc, bayer, x, y, width, height, argb + x * 4);
+    }
+}
+
+/* Converts an 8-bit bayer framebuffer to I420, two lines at a time through
+ * |argb_lines|, which must hold 2 * |width| ARGB pixels. */
+static int
+bayer8_to_i420(const BayerDesc* desc,
+               const uint8_t* bayer,
+               int width,
+               int height,
+               YUVInfo info,
+               uint8_t* y_staging,
+               uint8_t* u_staging,
+               uint8_t* v_staging,
+               uint8_t* argb_lines)
+{
+    const int argb_stride = width * 4;
+    int y;
+    for (y = 0; y < height; y += 2) {
+        const int lines = (y + 1 < height) ? 2 : 1;
+        _bayer8_line_to_argb(desc, bayer, y, width, height, argb_lines);
+        if (lines == 2) {
+            _bayer8_line_to_argb(desc, bayer, y + 1, width, height,
+                                 argb_lines + argb_stride);
+        }
+
+        uint8_t* dst_y = y_staging + y * info.y_stride;
+        uint8_t* dst_u = u_staging + (y / 2) * info.u_or_v_stride;
+        uint8_t* dst_v = v_staging + (y / 2) * info.u_or_v_stride;
+        const int result = ARGBToI420(argb_lines,          // src_argb
+                                      argb_stride,         // src_stride_argb
+                                      dst_y,               // dst_y
+                                      info.y_stride,       // dst_stride_y
+                                      dst_u,               // dst_u
+                                      info.u_or_v_stride,  // dst_stride_u
+                                      dst_v,               // dst_v
+                                      info.u_or_v_stride,  // dst_stride_v
+                                      width,               // width
+                                      lines);              // height
+        if (result != 0) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+/* Converts |src_frame| to I420 at the start of the staging framebuffer. 8-bit
+ * bayer frames additionally need 2 * |width| ARGB pixels of scratch space right
+ * after the I420 frame.
+ */
 int convert_to_i420(const void* src_frame,
                     uint32_t pixel_format,
                     size_t framebuffer_size,
@@ -1938,9 +2275,19 @@ int convert_to_i420(const void* src_frame,
     uint8_t* y_staging = *result_frame->staging_framebuffer;
     uint8_t* u_staging = y_staging + info.y_size;
     uint8_t* v_staging = u_staging + info.u_or_v_size;
+    const BayerDesc* bayer_desc = get_bayer8_descriptor(pixel_format);
 
     int result = 0;
-    if (pixel_format == V4L2_PIX_FMT_YUV420) {
+    if (bayer_desc != NULL) {
+        if (framebuffer_size < (size_t)width * height) {
+            W("%s: Bayer frame of %d bytes is too small for %dx%d",
+              __FUNCTION__, (int)framebuffer_size, width, height);
+            return -1;
+        }
+        result = bayer8_to_i420(bayer_desc, src_frame, width, height, info,
+                                y_staging, u_staging, v_staging,
+                                y_staging + staging_size);
+    } else if (pixel_format == V4L2_PIX_FMT_YUV420) {
         memcpy(y_staging, src_frame, staging_size);
     } else if (pixel_format == V4L2_PIX_FMT_YVU420) {
         // YVU420 is 16-byte aligned, but there is no way to specify alignment
@@ -2001,32 +2348,75 @@ int convert_frame_fast(const void* src_frame,
                        int src_height,
                        ClientFrame* result_frame,
                        float exp_comp) {
+    const YUVInfo frame_info = get_yuv_info(src_width, src_height);
+    const size_t frame_size = frame_info.y_size + 2 * frame_info.u_or_v_size;
+
+    // The source is converted to I420 once, and every framebuffer is scaled
+    // and converted from there. The space after it holds the scaled frame, or
+    // the demosaiced lines of a bayer source while converting.
+    size_t scratch_size = 0;
+    if (get_bayer8_descriptor(pixel_format) != NULL) {
+        scratch_size = 2 * (size_t)src_width * 4;
+    }
     int n;
+    for (n = 0; n < result_frame->framebuffers_count; ++n) {
+        const int result_width = result_frame->framebuffers[n].width;
+        const int result_height = result_frame->framebuffers[n].height;
+        if (src_width != result_width || src_height != result_height) {
+            const YUVInfo result_info =
+                    get_yuv_info(result_width, result_height);
+            const size_t result_size =
+                    result_info.y_size + 2 * result_info.u_or_v_size;
+            if (result_size > scratch_size) {
+                scratch_size = result_size;
+            }
+        }
+    }
+
+    if (!resize_staging(result_frame, frame_size + scratch_size)) {
+        D("%s: Failed to resize the camera staging buffer", __FUNCTION__);
+        return -1;
+    }
+
+    // Convert to I420, the intermediate format required for libyuv.
+    int result = convert_to_i420(src_frame, pixel_format, framebuffer_size,
+                                 src_width, src_height, frame_info,
+                                 result_frame);
+    if (result != 0) {
+        W("%s: Failed to convert the camera frame", __FUNCTION__);
+        return result;
+    }
+
+    // Apply exposure compensation. Scaling picks pixels without filtering, so
+    // it can be applied once to the source rather than to every framebuffer.
+    if (exp_comp != 1.0f) {
+        uint8_t exposure[256];
+        int i;
+        for (i = 0; i < 256; ++i) {
+            exposure[i] = _change_exposure(i, exp_comp);
+        }
+
+        int row;
+        int x;
+        for (row = 0; row < src_height; ++row) {
+            uint8_t* y_row = *result_frame->staging_framebuffer +
+                             row * frame_info.y_stride;
+            for (x = 0; x < src_width; ++x) {
+                y_row[x] = exposure[y_row[x]];
+            }
+        }
+    }
+
     for (n = 0; n < result_frame->framebuffers_count; ++n) {
         int result_width = result_frame->framebuffers[n].width;
         int result_height = result_frame->framebuffers[n].height;
         const bool has_resize =
             (src_width != result_width || src_height != result_height);
-        YUVInfo src_info = get_yuv_info(src_width, src_height);
+        YUVInfo src_info = frame_info;
         YUVInfo result_info = get_yuv_info(result_width, result_height);
-        size_t src_size = src_info.y_size + 2 * src_info.u_or_v_size;
+        size_t src_size = frame_size;
         const size_t result_size =
             result_info.y_size + 2 * result_info.u_or_v_size;
-        const size_t required_staging_size =
-            src_size + (has_resize ? result_size : 0);
-
-        if (!resize_staging(result_frame, required_staging_size)) {
-            D("%s: Failed to resize the camera staging buffer", __FUNCTION__);
-            return -1;
-        }
-
-        // Convert to I420, the intermediate format required for libyuv.
-        int result = convert_to_i420(src_frame, pixel_format, framebuffer_size,
-                                     src_width, src_height, src_info, result_frame);
-        if (result != 0) {
-            W("%s: Failed to convert the camera frame", __FUNCTION__);
-            return result;
-        }
 
         uint8_t* src_y = *result_frame->staging_framebuffer;
         uint8_t* src_u = src_y + src_info.y_size;
@@ -2068,18 +2458,6 @@ int convert_frame_fast(const void* src_frame,
             src_size = result_size;
         }
 
-        // Apply exposure compensation.
-        if (exp_comp != 1.0f) {
-            int row;
-            int x;
-            for (row = 0; row < result_height; ++row) {
-                uint8_t* y_row = src_y + row * src_info.y_stride;
-                for (x = 0; x < result_width; ++x) {
-                    y_row[x] = _change_exposure(y_row[x], exp_comp);
-                }
-            }
-        }
-
         // Convert to the target framebuffer formats.
         void* dest = result_frame->framebuffers[n].framebuffer;
         const uint32_t dest_format = pixel_format_to_libyuv(
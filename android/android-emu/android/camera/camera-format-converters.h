@@ -87,7 +87,8 @@ extern int convert_frame_slow(const void* src_frame,
 /* Converts a frame into multiple framebuffers using the fast path. If the frame
  * cannot be converted with the fast path, this function may return failure.
  *
- * If different resolutions are specified, a resize may be performed.
+ * If different resolutions are specified, a resize may be performed. The frame
+ * is converted to I420 once, and every framebuffer is produced from that.
  *
  * Param:
  *  |src_frame| - Frame to convert.
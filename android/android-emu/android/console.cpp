@@ -44,6 +44,7 @@
 #include "android/network/control.h"
 #include "android/network/globals.h"
 #include "android/network/wifi.h"
+#include "android/opengles.h"
 #include "android/recording/screen-recorder-constants.h"
 #include "android/shaper.h"
 #include "android/snapshot/Icebox.h"
@@ -3784,6 +3785,88 @@ static const CommandDefRec icebox_commands[] = {
 
         {NULL, NULL, NULL, NULL, NULL, NULL}};
 
+/********************************************************************************************/
+/********************************************************************************************/
+/*****                                                                                 ******/
+/*****                     F R A M E   T R A C E   C O M M A N D S                     ******/
+/*****                                                                                 ******/
+/********************************************************************************************/
+/********************************************************************************************/
+
+static int do_frametrace_enable(ControlClient client, bool enable) {
+    const auto& renderer = android_getOpenglesRenderer();
+    if (!renderer) {
+        control_write(client, "KO: host GPU rendering is not in use\r\n");
+        return -1;
+    }
+    renderer->setFrameTracing(enable);
+    return 0;
+}
+
+static int do_frametrace_start(ControlClient client, char* args) {
+    return do_frametrace_enable(client, true);
+}
+
+static int do_frametrace_stop(ControlClient client, char* args) {
+    return do_frametrace_enable(client, false);
+}
+
+static int do_frametrace_stats(ControlClient client, char* args) {
+    const auto& renderer = android_getOpenglesRenderer();
+    if (!renderer) {
+        control_write(client, "KO: host GPU rendering is not in use\r\n");
+        return -1;
+    }
+    std::istringstream input(renderer->getFrameTraceSummary());
+    for (std::string line; std::getline(input, line);) {
+        control_write(client, "%s\r\n", line.c_str());
+    }
+    return 0;
+}
+
+static int do_frametrace_export(ControlClient client, char* args) {
+    if (!args || !*args) {
+        control_write(client, "KO: file name required\r\n");
+        return -1;
+    }
+    const auto& renderer = android_getOpenglesRenderer();
+    if (!renderer) {
+        control_write(client, "KO: host GPU rendering is not in use\r\n");
+        return -1;
+    }
+    if (!renderer->exportFrameTrace(args)) {
+        control_write(client, "KO: could not write '%s'\r\n", args);
+        return -1;
+    }
+    return 0;
+}
+
+static const CommandDefRec frametrace_commands[] = {
+        {"start", "start tracing the latency of posted frames",
+         "'frametrace start' drops the frames traced so far and starts "
+         "timestamping\r\n"
+         "every posted frame at each stage of the host's post pipeline.\r\n",
+         NULL, do_frametrace_start, NULL},
+
+        {"stop", "stop tracing frames",
+         "'frametrace stop' stops tracing; the frames traced so far are "
+         "kept.\r\n",
+         NULL, do_frametrace_stop, NULL},
+
+        {"stats", "show frame latency percentiles",
+         "'frametrace stats' shows the p50, p99 and max latency of each "
+         "pipeline stage\r\n"
+         "over the last 1024 traced frames, in microseconds.\r\n",
+         NULL, do_frametrace_stats, NULL},
+
+        {"export", "save the traced frames as Chrome trace JSON",
+         "'frametrace export <filename>' writes the last 1024 traced frames "
+         "to <filename>,\r\n"
+         "which chrome://tracing and ui.perfetto.dev can open.\r\n",
+         NULL, do_frametrace_export, NULL},
+
+        {NULL, NULL, NULL, NULL, NULL, NULL}};
+
 /********************************************************************************************/
 /********************************************************************************************/
 /*****                                                                                 ******/
@@ -4223,6 +4306,12 @@ extern const CommandDefRec main_commands[] = {
         {"nodraw", "turn on/off NoDraw mode. (experimental)",
          NULL, NULL, do_no_draw, NULL},
 
+        {"frametrace", "trace the latency of posted frames",
+         "allows you to see how long guest frames take to reach the "
+         "emulator window\r\n"
+         "and the headset, stage by stage\r\n",
+         NULL, NULL, frametrace_commands},
+
         {NULL, NULL, NULL, NULL, NULL, NULL}};
 
 }  // namespace
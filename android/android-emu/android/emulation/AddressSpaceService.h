@@ -38,6 +38,7 @@ enum AddressSpaceDeviceType {
     GenericPipe = 4,
     HostMemoryAllocator = 5,
     SharedSlotsHostMemoryAllocator = 6,
+    HmdPose = 7,
     VirtioGpuGraphics = 10,
 };
 
@@ -14,6 +14,7 @@
 #include "android/emulation/address_space_device.h"
 #include "android/emulation/AddressSpaceService.h"
 #include "android/emulation/address_space_graphics.h"
+#include "android/emulation/address_space_hmd_pose.h"
 #ifndef AEMU_MIN
 #include "android/emulation/address_space_host_media.h"
 #endif
@@ -365,6 +366,9 @@ private:
             return DeviceContextPtr(new AddressSpaceSharedSlotsHostMemoryAllocatorContext(
                 get_address_space_device_control_ops(),
                 get_address_space_device_hw_funcs()));
+        case AddressSpaceDeviceType::HmdPose:
+            return DeviceContextPtr(new AddressSpaceHmdPoseContext(
+                get_address_space_device_control_ops()));
 
         case AddressSpaceDeviceType::VirtioGpuGraphics:
             asg::AddressSpaceGraphicsContext::init(get_address_space_device_control_ops());
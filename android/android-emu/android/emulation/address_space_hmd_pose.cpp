@@ -0,0 +1,134 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "android/emulation/address_space_hmd_pose.h"
+#include "android/base/AlignedBuf.h"
+#include "android/base/memory/LazyInstance.h"
+#include "android/crashreport/crash-handler.h"
+
+namespace android {
+namespace emulation {
+
+namespace {
+
+#if defined(__APPLE__) && defined(__arm64__)
+constexpr uint64_t kPageSize = 16384;
+#else
+constexpr uint64_t kPageSize = 4096;
+#endif
+
+struct PoseRingHolder {
+    PoseRingHolder()
+        : size(((sizeof(hmd_pose_ring) + kPageSize - 1) / kPageSize) *
+               kPageSize),
+          ring(static_cast<hmd_pose_ring*>(
+                  android::aligned_buf_alloc(kPageSize, size))) {
+        memset(ring, 0, size);
+        hmd_pose_ring_init(ring);
+    }
+
+    const uint64_t size;
+    hmd_pose_ring* const ring;
+};
+
+android::base::LazyInstance<PoseRingHolder> sPoseRing = LAZY_INSTANCE_INIT;
+
+}  // namespace
+
+AddressSpaceHmdPoseContext::AddressSpaceHmdPoseContext(
+    const address_space_device_control_ops *ops)
+  : m_ops(ops) {
+}
+
+AddressSpaceHmdPoseContext::~AddressSpaceHmdPoseContext() {
+    unmap();
+}
+
+// static
+hmd_pose_ring* AddressSpaceHmdPoseContext::ring() {
+    return sPoseRing->ring;
+}
+
+// static
+uint64_t AddressSpaceHmdPoseContext::ringSize() {
+    return sPoseRing->size;
+}
+
+void AddressSpaceHmdPoseContext::perform(AddressSpaceDevicePingInfo *info) {
+    uint64_t result;
+
+    switch (static_cast<HmdPoseCommand>(info->metadata)) {
+    case HmdPoseCommand::GetSize:
+        info->size = ringSize();
+        result = 0;
+        break;
+
+    case HmdPoseCommand::Map:
+        result = map(info->phys_addr) ? 0 : -1;
+        break;
+
+    case HmdPoseCommand::Unmap:
+        result = unmap() ? 0 : -1;
+        break;
+
+    default:
+        result = -1;
+        break;
+    }
+
+    info->metadata = result;
+}
+
+bool AddressSpaceHmdPoseContext::map(uint64_t phys_addr) {
+    if (m_mappedPhysAddr || !phys_addr) {
+        return false;
+    }
+    if (!m_ops->add_memory_mapping(phys_addr, ring(), ringSize())) {
+        return false;
+    }
+    m_mappedPhysAddr = phys_addr;
+    return true;
+}
+
+bool AddressSpaceHmdPoseContext::unmap() {
+    if (!m_mappedPhysAddr) {
+        return false;
+    }
+    if (!m_ops->remove_memory_mapping(m_mappedPhysAddr, ring(), ringSize())) {
+        crashhandler_die("Failed remove a memory mapping {phys_addr=%lx, host_ptr=%p, size=%lu}",
+                         m_mappedPhysAddr, ring(), ringSize());
+    }
+    m_mappedPhysAddr = 0;
+    return true;
+}
+
+AddressSpaceDeviceType AddressSpaceHmdPoseContext::getDeviceType() const {
+    return AddressSpaceDeviceType::HmdPose;
+}
+
+// The poses themselves aren't saved: they're stale by the time a snapshot
+// loads, and the host keeps publishing into the same ring.
+void AddressSpaceHmdPoseContext::save(base::Stream* stream) const {
+    stream->putBe64(m_mappedPhysAddr);
+}
+
+bool AddressSpaceHmdPoseContext::load(base::Stream* stream) {
+    unmap();
+
+    const uint64_t phys_addr = stream->getBe64();
+    return !phys_addr || map(phys_addr);
+}
+
+}  // namespace emulation
+}  // namespace android
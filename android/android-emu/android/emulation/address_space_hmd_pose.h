@@ -0,0 +1,59 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include "android/emulation/AddressSpaceService.h"
+#include "android/emulation/address_space_device.h"
+#include "android/emulation/hmd_pose_ring.h"
+
+namespace android {
+namespace emulation {
+
+// Maps the host's HMD pose ring (hmd_pose_ring.h) into the guest.
+//
+// Guest workflow: ping(GetSize) for the size to allocate, allocate a block of
+// that size in the address space device, ping(Map) with its physical address
+// and mmap it. All contexts see the same ring.
+class AddressSpaceHmdPoseContext : public AddressSpaceDeviceContext {
+public:
+    enum class HmdPoseCommand {
+        GetSize = 1,
+        Map = 2,
+        Unmap = 3,
+    };
+
+    AddressSpaceHmdPoseContext(const address_space_device_control_ops* ops);
+    ~AddressSpaceHmdPoseContext();
+
+    void perform(AddressSpaceDevicePingInfo* info) override;
+
+    AddressSpaceDeviceType getDeviceType() const override;
+    void save(base::Stream* stream) const override;
+    bool load(base::Stream* stream) override;
+
+    // The ring the host publishes poses to; it lives as long as the process.
+    static struct hmd_pose_ring* ring();
+    // Size of the ring's mapping, rounded up to whole pages.
+    static uint64_t ringSize();
+
+private:
+    bool map(uint64_t phys_addr);
+    bool unmap();
+
+    uint64_t m_mappedPhysAddr = 0;
+    const address_space_device_control_ops* m_ops;  // do not save/load
+};
+
+}  // namespace emulation
+}  // namespace android
@@ -0,0 +1,207 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "android/emulation/address_space_hmd_pose.h"
+
+#include "android/base/files/MemStream.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+
+namespace android {
+namespace emulation {
+
+namespace {
+constexpr uint64_t BAD_GPA = 0x1234000;
+constexpr uint64_t GOOD_GPA = 0x10001000;
+
+int sMappings = 0;
+
+int test_add_memory_mapping(uint64_t gpa, void *ptr, uint64_t size) {
+    if (gpa == BAD_GPA) {
+        return 0;
+    }
+    ++sMappings;
+    return 1;
+}
+
+int test_remove_memory_mapping(uint64_t gpa, void *ptr, uint64_t size) {
+    --sMappings;
+    return 1;
+}
+
+struct address_space_device_control_ops create_address_space_device_control_ops() {
+    struct address_space_device_control_ops ops = {};
+
+    ops.add_memory_mapping = &test_add_memory_mapping;
+    ops.remove_memory_mapping = &test_remove_memory_mapping;
+
+    return ops;
+}
+
+AddressSpaceDevicePingInfo createRequest(
+        AddressSpaceHmdPoseContext::HmdPoseCommand command,
+        uint64_t phys_addr = 0) {
+    AddressSpaceDevicePingInfo req = {};
+
+    req.metadata = static_cast<uint64_t>(command);
+    req.phys_addr = phys_addr;
+
+    return req;
+}
+
+void publish(hmd_pose_ring* ring, uint64_t timestamp) {
+    hmd_pose_slot* slot = hmd_pose_ring_begin_write(ring);
+    slot->device_count = 1;
+    slot->timestamp_ns = timestamp;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            slot->poses[0].device_to_absolute[i][j] = float(timestamp);
+        }
+    }
+    slot->poses[0].flags = HMD_POSE_FLAG_VALID | HMD_POSE_FLAG_CONNECTED;
+    hmd_pose_ring_end_write(ring, slot);
+}
+}  // namespace
+
+TEST(AddressSpaceHmdPoseContext, getDeviceType) {
+    struct address_space_device_control_ops ops =
+        create_address_space_device_control_ops();
+
+    AddressSpaceHmdPoseContext ctx(&ops);
+
+    EXPECT_EQ(ctx.getDeviceType(), AddressSpaceDeviceType::HmdPose);
+}
+
+TEST(AddressSpaceHmdPoseContext, MapUnmap) {
+    struct address_space_device_control_ops ops =
+        create_address_space_device_control_ops();
+    sMappings = 0;
+
+    {
+        AddressSpaceHmdPoseContext ctx(&ops);
+        AddressSpaceDevicePingInfo req;
+
+        req = createRequest(AddressSpaceHmdPoseContext::HmdPoseCommand::GetSize);
+        ctx.perform(&req);
+        EXPECT_EQ(req.metadata, 0);
+        EXPECT_GE(req.size, sizeof(hmd_pose_ring));
+        EXPECT_EQ(req.size % 4096, 0);
+
+        req = createRequest(AddressSpaceHmdPoseContext::HmdPoseCommand::Map, BAD_GPA);
+        ctx.perform(&req);
+        EXPECT_NE(req.metadata, 0);
+
+        req = createRequest(AddressSpaceHmdPoseContext::HmdPoseCommand::Map, GOOD_GPA);
+        ctx.perform(&req);
+        EXPECT_EQ(req.metadata, 0);
+        EXPECT_EQ(sMappings, 1);
+
+        // Only one mapping per context.
+        req = createRequest(AddressSpaceHmdPoseContext::HmdPoseCommand::Map, GOOD_GPA);
+        ctx.perform(&req);
+        EXPECT_NE(req.metadata, 0);
+
+        req = createRequest(AddressSpaceHmdPoseContext::HmdPoseCommand::Unmap);
+        ctx.perform(&req);
+        EXPECT_EQ(req.metadata, 0);
+        EXPECT_EQ(sMappings, 0);
+
+        req = createRequest(AddressSpaceHmdPoseContext::HmdPoseCommand::Map, GOOD_GPA);
+        ctx.perform(&req);
+        EXPECT_EQ(req.metadata, 0);
+    }
+    // Unmapped on destruction.
+    EXPECT_EQ(sMappings, 0);
+}
+
+TEST(AddressSpaceHmdPoseContext, SaveLoad) {
+    struct address_space_device_control_ops ops =
+        create_address_space_device_control_ops();
+    sMappings = 0;
+
+    base::MemStream stream;
+    {
+        AddressSpaceHmdPoseContext ctx(&ops);
+        AddressSpaceDevicePingInfo req =
+            createRequest(AddressSpaceHmdPoseContext::HmdPoseCommand::Map, GOOD_GPA);
+        ctx.perform(&req);
+        EXPECT_EQ(req.metadata, 0);
+        ctx.save(&stream);
+    }
+    EXPECT_EQ(sMappings, 0);
+
+    AddressSpaceHmdPoseContext ctx(&ops);
+    EXPECT_TRUE(ctx.load(&stream));
+    EXPECT_EQ(sMappings, 1);
+}
+
+TEST(HmdPoseRing, ReadLatestAndHistory) {
+    hmd_pose_ring ring;
+    hmd_pose_ring_init(&ring);
+
+    hmd_pose_slot slot;
+    EXPECT_EQ(hmd_pose_ring_read_latest(&ring, &slot), 0);
+
+    for (uint64_t i = 1; i <= HMD_POSE_RING_SLOTS + 3; ++i) {
+        publish(&ring, i * 10);
+    }
+
+    ASSERT_EQ(hmd_pose_ring_read_latest(&ring, &slot), 1);
+    EXPECT_EQ(slot.frame, HMD_POSE_RING_SLOTS + 3);
+    EXPECT_EQ(slot.timestamp_ns, (HMD_POSE_RING_SLOTS + 3) * 10);
+
+    // Older frames are there until they get overwritten.
+    ASSERT_EQ(hmd_pose_ring_read(&ring, 4, &slot), 1);
+    EXPECT_EQ(slot.timestamp_ns, 40);
+    EXPECT_EQ(hmd_pose_ring_read(&ring, 3, &slot), 0);
+    EXPECT_EQ(hmd_pose_ring_read(&ring, HMD_POSE_RING_SLOTS + 4, &slot), 0);
+}
+
+TEST(HmdPoseRing, ConcurrentReadersSeeWholeFrames) {
+    hmd_pose_ring ring;
+    hmd_pose_ring_init(&ring);
+
+    std::atomic<bool> done(false);
+    std::atomic<int> torn(0);
+    std::thread reader([&ring, &done, &torn] {
+        hmd_pose_slot slot;
+        while (!done) {
+            if (!hmd_pose_ring_read_latest(&ring, &slot)) {
+                continue;
+            }
+            for (int i = 0; i < 3; ++i) {
+                for (int j = 0; j < 4; ++j) {
+                    if (slot.poses[0].device_to_absolute[i][j] !=
+                        float(slot.timestamp_ns)) {
+                        ++torn;
+                    }
+                }
+            }
+        }
+    });
+
+    for (uint64_t i = 1; i <= 100000; ++i) {
+        publish(&ring, i);
+    }
+    done = true;
+    reader.join();
+
+    EXPECT_EQ(torn, 0);
+}
+
+}  // namespace emulation
+}  // namespace android
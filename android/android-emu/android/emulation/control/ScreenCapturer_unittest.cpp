@@ -278,6 +278,10 @@ public:
             android::snapshot::Snapshotter::Operation op,
             android::snapshot::Snapshotter::Stage stage) {}
 
+    void setFrameTracing(bool enabled) {}
+    std::string getFrameTraceSummary() { return {}; }
+    bool exportFrameTrace(const char* path) { return false; }
+
     void addListener(FrameBufferChangeEventListener* listener) override {};
     void removeListener(FrameBufferChangeEventListener* listener)  override {};
 
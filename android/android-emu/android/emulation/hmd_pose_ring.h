@@ -0,0 +1,148 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// HMD pose ring================================================================
+//
+// The host publishes the tracked device poses of every headset frame into a
+// shared memory block (a few dozen KB, rounded up to whole pages) that the
+// guest maps through the address space device (see address_space_hmd_pose.h),
+// so guest apps can read them without a VM exit or a trip through the network
+// stack.
+//
+// There is one writer, the host's VR compositor thread. Readers never block
+// it: each slot is guarded by a sequence count that is odd while the slot is
+// being written, and readers retry if it was odd or changed under them. The
+// ring keeps the last HMD_POSE_RING_SLOTS frames, so a reader can also look
+// at the history, e.g. to match a frame's poses by timestamp.
+//
+// The layout is shared with guest code and only ever extended at the end;
+// bump HMD_POSE_RING_VERSION on incompatible changes.
+
+#define HMD_POSE_RING_MAGIC 0x504d4448  // 'HDMP'
+#define HMD_POSE_RING_VERSION 1
+#define HMD_POSE_RING_SLOTS 8
+#define HMD_POSE_MAX_DEVICES 64
+
+#define HMD_POSE_FLAG_VALID (1 << 0)
+#define HMD_POSE_FLAG_CONNECTED (1 << 1)
+
+// Mirrors OpenVR's TrackedDevicePose_t, with a fixed layout.
+struct hmd_device_pose {
+    float device_to_absolute[3][4];  // Row major, meters.
+    float velocity[3];               // Meters per second.
+    float angular_velocity[3];       // Radians per second.
+    uint32_t tracking_result;        // vr::ETrackingResult.
+    uint32_t flags;                  // HMD_POSE_FLAG_*
+};
+
+struct hmd_pose_slot {
+    uint32_t seq;
+    uint32_t device_count;
+    uint64_t frame;
+    // Host monotonic time the poses were predicted at, in nanoseconds.
+    uint64_t timestamp_ns;
+    struct hmd_device_pose poses[HMD_POSE_MAX_DEVICES];
+};
+
+struct hmd_pose_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t max_devices;
+    // Frame number of the newest complete slot; 0 until the first one.
+    uint64_t latest;
+    uint64_t padding[5];
+    struct hmd_pose_slot slots[HMD_POSE_RING_SLOTS];
+    // Written by the guest: the frame number of the poses the frame it
+    // swaps next was rendered with, so the host can correct it for the head
+    // motion since. 0 if unknown.
+    uint64_t guest_render_frame;
+};
+
+static inline void hmd_pose_ring_init(struct hmd_pose_ring* r) {
+    memset(r, 0, sizeof(*r));
+    r->magic = HMD_POSE_RING_MAGIC;
+    r->version = HMD_POSE_RING_VERSION;
+    r->slot_count = HMD_POSE_RING_SLOTS;
+    r->max_devices = HMD_POSE_MAX_DEVICES;
+}
+
+// Writer side: returns the slot to fill in for the next frame. Only fill in
+// device_count, timestamp_ns and poses, then call hmd_pose_ring_end_write().
+static inline struct hmd_pose_slot* hmd_pose_ring_begin_write(
+        struct hmd_pose_ring* r) {
+    const uint64_t frame = __atomic_load_n(&r->latest, __ATOMIC_RELAXED) + 1;
+    struct hmd_pose_slot* slot = &r->slots[frame % HMD_POSE_RING_SLOTS];
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->frame = frame;
+    return slot;
+}
+
+static inline void hmd_pose_ring_end_write(struct hmd_pose_ring* r,
+                                           struct hmd_pose_slot* slot) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->latest, slot->frame, __ATOMIC_RELEASE);
+}
+
+// Reader side: copies the slot of |frame| into |out|. Returns 0 if that
+// frame was overwritten or not published yet.
+static inline int hmd_pose_ring_read(const struct hmd_pose_ring* r,
+                                     uint64_t frame,
+                                     struct hmd_pose_slot* out) {
+    const struct hmd_pose_slot* slot = &r->slots[frame % HMD_POSE_RING_SLOTS];
+    for (;;) {
+        if (!frame || frame > __atomic_load_n(&r->latest, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        const uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(out, slot, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+            return out->frame == frame;
+        }
+    }
+}
+
+// Copies the newest poses into |out|. Returns 0 if there are none yet.
+static inline int hmd_pose_ring_read_latest(const struct hmd_pose_ring* r,
+                                            struct hmd_pose_slot* out) {
+    for (;;) {
+        const uint64_t frame = __atomic_load_n(&r->latest, __ATOMIC_ACQUIRE);
+        if (!frame) {
+            return 0;
+        }
+        if (hmd_pose_ring_read(r, frame, out)) {
+            return 1;
+        }
+    }
+}
+
+// Guest side: call before swapping a frame rendered with the poses of |frame|.
+static inline void hmd_pose_ring_set_render_frame(struct hmd_pose_ring* r,
+                                                  uint64_t frame) {
+    __atomic_store_n(&r->guest_render_frame, frame, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t hmd_pose_ring_get_render_frame(
+        const struct hmd_pose_ring* r) {
+    return __atomic_load_n(&r->guest_render_frame, __ATOMIC_ACQUIRE);
+}
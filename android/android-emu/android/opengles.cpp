@@ -22,6 +22,7 @@
 #include "android/emulation/address_space_device.h"
 #include "android/emulation/address_space_graphics.h"
 #include "android/emulation/address_space_graphics_types.h"
+#include "android/emulation/address_space_hmd_pose.h"
 #include "android/emulation/GoldfishDma.h"
 #include "android/emulation/RefcountPipe.h"
 #include "android/featurecontrol/FeatureControl.h"
@@ -247,6 +248,8 @@ android_startOpenglesRenderer(int width, int height, bool guestPhoneApi, int gue
     sRenderLib->setDmaOps(dma_ops);
     sRenderLib->setVmOps(*vm_operations);
     sRenderLib->setAddressSpaceDeviceControlOps(get_address_space_device_control_ops());
+    sRenderLib->setHmdPoseRing(
+            android::emulation::AddressSpaceHmdPoseContext::ring());
     sRenderLib->setWindowOps(*window_agent, *multi_display_agent);
     sRenderLib->setUsageTracker(android::base::CpuUsage::get(),
                                 android::base::MemoryTracker::get());
@@ -36,10 +36,14 @@
 #include "android/base/Log.h"                   // for LogStream, LogMessage
 #include "android/base/memory/ScopedPtr.h"      // for FuncDelete
 #include "android/base/synchronization/Lock.h"  // for Lock, AutoLock
+#include "android/base/synchronization/MessageChannel.h"  // for MessageC...
 #include "android/base/system/System.h"         // for System
+#include "android/base/threads/FunctorThread.h"  // for FunctorThread
+#include "android/base/threads/ThreadPool.h"    // for ThreadPool
 #include "android/recording/AVScopedPtr.h"      // for makeAVScopedPtr
 #include "android/recording/Frame.h"            // for Frame, AVFormat, getV...
 #include "android/recording/Producer.h"         // for Producer
+#include "android/recording/VideoSliceConverter.h"  // for VideoSliceCon...
 #include "android/recording/codecs/Codec.h"     // for Codec, CodecParams
 #include "android/utils/debug.h"                // for VERBOSE_record, VERBO...
 
@@ -73,6 +77,7 @@ struct SwsContext;
 #include <stdarg.h>                             // for va_list
 #include <stdio.h>                              // for vprintf, NULL
 #include <string.h>                             // for memcpy
+#include <algorithm>                            // for max, min
 #include <cstdint>                              // for uint8_t
 #include <functional>                           // for __base
 #include <string>                               // for string, basic_string
@@ -85,24 +90,54 @@ namespace android {
 namespace recording {
 
 using android::base::AutoLock;
+using android::base::FunctorThread;
 using android::base::Lock;
+using android::base::MessageChannel;
 using android::base::PathUtils;
+using android::base::ThreadPool;
 
 namespace {
 
+// Number of video frames in each stage of the video pipeline.
+static constexpr int kVideoPipelineDepth = 3;
+// Encoded video packets waiting to be written to the file.
+static constexpr int kMaxPendingVideoPackets = 16;
+// A frame is converted in up to this many slices at the same time.
+static constexpr int kMaxConvertSlices = 4;
+
 // a wrapper around a single output AVStream
 struct VideoOutputStream {
     // These two pointers are owned by the output context
     AVStream* stream = nullptr;
     AVScopedPtr<AVCodecContext> codecCtx;
-    AVScopedPtr<AVFrame> frame;
+    // The frames that the convert stage fills in for the encoder.
+    AVScopedPtr<AVFrame> frames[kVideoPipelineDepth];
     AVScopedPtr<AVFrame> tmpFrame;
     AVScopedPtr<SwsContext> swsCtx;
+    // When the frames are not scaled, the rows of the frame are cut into
+    // slices that are converted in parallel.
+    std::unique_ptr<VideoSliceConverter> sliceConverter;
 
     uint64_t frameCount = 0;
     uint64_t writeFrameCount = 0;
 };
 
+// The packet that ends the stream of encoded video packets.
+AVPacket endOfStreamPacket() {
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    pkt.data = nullptr;
+    pkt.size = 0;
+    return pkt;
+}
+
+// A slice of a captured frame for a convert worker.
+struct ConvertSlice {
+    int index = 0;
+    const Frame* capture = nullptr;
+    AVFrame* frame = nullptr;
+};
+
 struct AudioOutputStream {
     // These two pointers are owned by the output context
     AVStream* stream = nullptr;
@@ -140,6 +175,7 @@ public:
     virtual bool addVideoTrack(
             std::unique_ptr<Producer> producer,
             const Codec<SwsContext*>* codec) override;
+    virtual void setFrameDropPolicy(FrameDropPolicy policy) override;
 
 private:
     // Initalizes the output context for the muxer. This call is required for
@@ -154,6 +190,25 @@ private:
     bool encodeAudioFrame(const Frame* audioFrame);
     bool encodeVideoFrame(const Frame* videoFrame);
 
+    // Sets up the slices that frames of |c| are converted in, if it converts
+    // without scaling.
+    bool initConvertSlices(const AVCodecContext* c);
+
+    // The stages of the video pipeline after the capture, see
+    // encodeVideoFrame(). Each one runs on its own thread.
+    void convertVideoFrames();
+    void encodeVideoFrames();
+    void muxVideoPackets();
+
+    void convertVideoFrame(const Frame& capture, AVFrame* frame);
+    void convertVideoSlice(const ConvertSlice& slice);
+
+    bool startVideoPipeline();
+    // Waits for the video pipeline threads to finish. With |drain|, every
+    // captured frame is encoded and written first, otherwise they are
+    // discarded.
+    void finishVideoPipeline(bool drain);
+
     // Interleave the packets
     bool writeFrame(const AVCodecContext* c, AVStream* stream, AVPacket* pkt);
 
@@ -226,6 +281,25 @@ private:
     uint8_t mTimeLimit = 0;
     std::unique_ptr<Producer> mAudioProducer;
     std::unique_ptr<Producer> mVideoProducer;
+
+    // The video pipeline. Captured frames and converted frames each come from
+    // a fixed pool, and go back to their mFree* channel once the next stage is
+    // done with them. A null frame or an empty packet ends the stream.
+    FrameDropPolicy mDropPolicy = FrameDropPolicy::DropOldest;
+    std::vector<Frame> mCaptures;
+    MessageChannel<Frame*, kVideoPipelineDepth> mFreeCaptures;
+    MessageChannel<Frame*, kVideoPipelineDepth> mCaptured;
+    MessageChannel<AVFrame*, kVideoPipelineDepth> mFreeConverted;
+    MessageChannel<AVFrame*, kVideoPipelineDepth> mConverted;
+    MessageChannel<AVPacket, kMaxPendingVideoPackets> mEncoded;
+    MessageChannel<int, kMaxConvertSlices> mSlicesDone;
+    std::unique_ptr<ThreadPool<ConvertSlice>> mSliceWorkers;
+    FunctorThread mConvertThread{[this]() { convertVideoFrames(); }};
+    FunctorThread mEncodeThread{[this]() { encodeVideoFrames(); }};
+    FunctorThread mMuxThread{[this]() { muxVideoPackets(); }};
+    bool mVideoPipelineStarted = false;
+    uint64_t mCapturedFrames = 0;
+    uint64_t mDroppedFrames = 0;
 };
 
 FfmpegRecorderImpl::FfmpegRecorderImpl(
@@ -332,6 +406,13 @@ bool FfmpegRecorderImpl::start() {
     mStarted = true;
     mStartTimeUs = android::base::System::get()->getHighResTimeUs();
 
+    if (!startVideoPipeline()) {
+        LOG(ERROR) << "Could not start the video encoding threads";
+        finishVideoPipeline(false);
+        mStarted = false;
+        return false;
+    }
+
     mVideoProducer->start();
     if (mHasAudioTrack) {
         // The audio track add may have failed, so don't start
@@ -353,6 +434,7 @@ void FfmpegRecorderImpl::abortRecording() {
     }
     mVideoProducer->stop();
     mVideoProducer->wait();
+    finishVideoPipeline(false);
 
     mValid = false;
 }
@@ -372,22 +454,9 @@ bool FfmpegRecorderImpl::stop() {
     mVideoProducer->stop();
     mVideoProducer->wait();
 
-    // flush video encoding with a NULL frame
-    if (mHasVideoTrack) {
-        while (true) {
-            AVPacket pkt = {0};
-            int gotPacket = 0;
-            av_init_packet(&pkt);
-            int ret = avcodec_encode_video2(mVideoStream.codecCtx.get(), &pkt,
-                                            nullptr, &gotPacket);
-            if (ret < 0 || !gotPacket) {
-                break;
-            }
-            VLOG(record) << "Writing video frame "
-                         << mVideoStream.writeFrameCount++;
-            writeFrame(mVideoStream.codecCtx.get(), mVideoStream.stream, &pkt);
-        }
-    }
+    // Encode and write the frames that are still in the pipeline, and flush
+    // the video encoder.
+    finishVideoPipeline(true);
 
     // flush the remaining audio packet
     if (mHasAudioTrack) {
@@ -633,13 +702,15 @@ bool FfmpegRecorderImpl::addVideoTrack(
         return false;
     }
 
-    // allocate and init a re-usable frame
-    auto frame = allocVideoFrame(c->pix_fmt, c->width, c->height);
-    if (!frame) {
-        LOG(ERROR) << "Could not allocate video frame";
-        return false;
+    // allocate and init the re-usable frames of the pipeline
+    for (auto& frame : ost->frames) {
+        auto avframe = allocVideoFrame(c->pix_fmt, c->width, c->height);
+        if (!avframe) {
+            LOG(ERROR) << "Could not allocate video frame";
+            return false;
+        }
+        frame = makeAVScopedPtr(avframe);
     }
-    mVideoStream.frame = makeAVScopedPtr(frame);
 
     // If the output format is not YUV420P, then a temporary YUV420P
     // picture is needed too. It is then converted to the required
@@ -662,10 +733,48 @@ bool FfmpegRecorderImpl::addVideoTrack(
     }
     ost->swsCtx = makeAVScopedPtr(swsCtx);
 
+    if (initConvertSlices(c)) {
+        VLOG(record) << "Converting video frames in "
+                     << ost->sliceConverter->slices() << " slices";
+    }
+
+    // Fill the pools of the video pipeline.
+    mCaptures.resize(kVideoPipelineDepth);
+    for (auto& capture : mCaptures) {
+        mFreeCaptures.send(&capture);
+    }
+    for (auto& frame : ost->frames) {
+        mFreeConverted.send(frame.get());
+    }
+
     mHasVideoTrack = true;
     return true;
 }
 
+bool FfmpegRecorderImpl::initConvertSlices(const AVCodecContext* c) {
+    VideoOutputStream* ost = &mVideoStream;
+    ost->sliceConverter.reset();
+
+    // Every slice is converted on its own, which only gives the same result
+    // as a single sws_scale() when there is no scaling.
+    if (c->width != mFbWidth || c->height != mFbHeight) {
+        return false;
+    }
+    const AVPixelFormat srcFmt =
+            toAVPixelFormat(mVideoProducer->getFormat().videoFormat);
+    if (srcFmt == AV_PIX_FMT_NONE) {
+        return false;
+    }
+
+    // Leave half of the cores to the encoder and the rest of the emulator.
+    const int cores = android::base::System::get()->getCpuCoreCount();
+    // The flags of the codec's own conversion context.
+    ost->sliceConverter = VideoSliceConverter::create(
+            c->width, c->height, srcFmt, c->pix_fmt, SWS_BICUBIC,
+            std::min(kMaxConvertSlices, cores / 2));
+    return ost->sliceConverter != nullptr;
+}
+
 bool FfmpegRecorderImpl::encodeAudioFrame(const Frame* frame) {
     assert(mValid);
     if (!mHasAudioTrack || !frame) {
@@ -734,22 +843,98 @@ bool FfmpegRecorderImpl::encodeAudioFrame(const Frame* frame) {
     return true;
 }
 
+void FfmpegRecorderImpl::setFrameDropPolicy(FrameDropPolicy policy) {
+    if (mStarted) {
+        LOG(ERROR) << "The frame drop policy can't change while recording";
+        return;
+    }
+    mDropPolicy = policy;
+}
+
+// The video pipeline has four stages, each one on its own thread:
+//   - capture: encodeVideoFrame() copies the frames of the producer,
+//   - convert: convertVideoFrames() does the color conversion to the pixel
+//     format of the codec, in slices on |mSliceWorkers| when possible,
+//   - encode: encodeVideoFrames() runs the codec,
+//   - mux: muxVideoPackets() writes the packets to the file.
+// Only the capture stage runs on the producer thread, and it never waits for
+// the others unless the policy is FrameDropPolicy::Block.
 bool FfmpegRecorderImpl::encodeVideoFrame(const Frame* frame) {
     assert(mValid);
-    if (!mHasVideoTrack) {
+    if (!mHasVideoTrack || !frame) {
         return false;
     }
 
-    VideoOutputStream* ost = &mVideoStream;
+    mCapturedFrames++;
+    Frame* capture = nullptr;
+    if (!mFreeCaptures.tryReceive(&capture)) {
+        switch (mDropPolicy) {
+            case FrameDropPolicy::Block:
+                if (!mFreeCaptures.receive(&capture)) {
+                    return false;
+                }
+                break;
+            case FrameDropPolicy::DropOldest:
+                // Reuse the oldest frame that is still waiting to be
+                // converted. The convert stage may have just taken it, in which
+                // case it gives back the frame it was converting.
+                if (mCaptured.tryReceive(&capture)) {
+                    mDroppedFrames++;
+                } else if (!mFreeCaptures.tryReceive(&capture)) {
+                    mDroppedFrames++;
+                    return true;
+                }
+                break;
+            case FrameDropPolicy::DropNewest:
+                mDroppedFrames++;
+                return true;
+        }
+    }
+
+    capture->tsUs = frame->tsUs;
+    capture->format = frame->format;
+    capture->dataVec.assign(frame->dataVec.begin(), frame->dataVec.end());
+    return mCaptured.send(capture);
+}
+
+void FfmpegRecorderImpl::convertVideoFrames() {
+    Frame* capture = nullptr;
+    while (mCaptured.receive(&capture) && capture) {
+        AVFrame* frame = nullptr;
+        if (!mFreeConverted.receive(&frame)) {
+            return;
+        }
+        convertVideoFrame(*capture, frame);
+        mFreeCaptures.send(capture);
+        mConverted.send(frame);
+    }
+    mConverted.send(nullptr);
+}
 
-    const int linesize[1] = {getVideoFormatSize(frame->format.videoFormat) *
-                             mFbWidth};
+void FfmpegRecorderImpl::convertVideoFrame(const Frame& capture,
+                                           AVFrame* frame) {
+    VideoOutputStream* ost = &mVideoStream;
 
     // To test the speed of sws_scale()
     auto startUs = android::base::System::get()->getHighResTimeUs();
-    auto data = frame->dataVec.data();
-    sws_scale(ost->swsCtx.get(), (const uint8_t* const*)&data, linesize, 0,
-              mFbHeight, ost->frame->data, ost->frame->linesize);
+    if (mSliceWorkers) {
+        // Slice 0 is converted on this thread while the workers do the rest.
+        const int slices = ost->sliceConverter->slices();
+        for (int i = 1; i < slices; ++i) {
+            mSliceWorkers->enqueueIndexed(i, {i, &capture, frame});
+        }
+        convertVideoSlice({0, &capture, frame});
+        int done;
+        for (int i = 1; i < slices; ++i) {
+            mSlicesDone.receive(&done);
+        }
+    } else {
+        const int linesize[1] = {
+                getVideoFormatSize(capture.format.videoFormat) * mFbWidth};
+        auto data = capture.dataVec.data();
+        sws_scale(ost->swsCtx.get(), (const uint8_t* const*)&data, linesize,
+                  0, mFbHeight, frame->data, frame->linesize);
+    }
     VLOG(record)
             << "Time to sws_scale: ["
             << (long long)(android::base::System::get()->getHighResTimeUs() -
@@ -757,13 +942,104 @@ bool FfmpegRecorderImpl::encodeVideoFrame(const Frame* frame) {
                        1000
             << " ms]";
 
-    uint64_t elapsedUS = frame->tsUs - mStartTimeUs;
-    ost->frame->pts = (int64_t)(elapsedUS);
+    uint64_t elapsedUS = capture.tsUs - mStartTimeUs;
+    frame->pts = (int64_t)(elapsedUS);
+}
+
+void FfmpegRecorderImpl::convertVideoSlice(const ConvertSlice& slice) {
+    const int linesize =
+            getVideoFormatSize(slice.capture->format.videoFormat) * mFbWidth;
+    mVideoStream.sliceConverter->convert(
+            slice.index, slice.capture->dataVec.data(), linesize, slice.frame);
+}
+
+void FfmpegRecorderImpl::encodeVideoFrames() {
+    AVFrame* frame = nullptr;
+    while (mConverted.receive(&frame) && frame) {
+        writeVideoFrame(frame);
+        mHasVideoFrames = true;
+        mFreeConverted.send(frame);
+    }
+
+    // flush video encoding with a NULL frame, unless the recording was
+    // aborted.
+    if (!mConverted.isStopped()) {
+        while (writeVideoFrame(nullptr)) {
+        }
+    }
+
+    mEncoded.send(endOfStreamPacket());
+}
+
+void FfmpegRecorderImpl::muxVideoPackets() {
+    AVPacket pkt;
+    while (mEncoded.receive(&pkt) && pkt.size > 0) {
+        VLOG(record) << "Writing video frame "
+                     << mVideoStream.writeFrameCount++;
+        if (!writeFrame(mVideoStream.codecCtx.get(), mVideoStream.stream,
+                        &pkt)) {
+            LOG(ERROR) << "Error while writing video frame";
+        }
+    }
+}
+
+bool FfmpegRecorderImpl::startVideoPipeline() {
+    mVideoPipelineStarted = true;
+    mCapturedFrames = 0;
+    mDroppedFrames = 0;
+
+    VideoOutputStream* ost = &mVideoStream;
+    if (ost->sliceConverter) {
+        // Slice 0 is converted on the convert thread.
+        mSliceWorkers.reset(new ThreadPool<ConvertSlice>(
+                ost->sliceConverter->slices() - 1,
+                [this](ConvertSlice&& slice) {
+                    convertVideoSlice(slice);
+                    mSlicesDone.send(slice.index);
+                }));
+        if (!mSliceWorkers->start()) {
+            LOG(WARNING) << "Could not start the video conversion workers, "
+                            "converting on a single thread";
+            mSliceWorkers.reset();
+        }
+    }
+
+    if (!mMuxThread.start()) {
+        return false;
+    }
+    if (!mEncodeThread.start()) {
+        mEncoded.send(endOfStreamPacket());
+        return false;
+    }
+    return mConvertThread.start();
+}
 
-    bool ret = writeVideoFrame(ost->frame.get());
-    mHasVideoFrames = true;
+void FfmpegRecorderImpl::finishVideoPipeline(bool drain) {
+    if (!mVideoPipelineStarted) {
+        return;
+    }
+    mVideoPipelineStarted = false;
 
-    return ret;
+    if (drain) {
+        mCaptured.send(nullptr);
+    } else {
+        // The packets channel keeps running, the encode thread always ends it
+        // and the mux thread takes care of every packet that was sent.
+        mFreeCaptures.stop();
+        mCaptured.stop();
+        mFreeConverted.stop();
+        mConverted.stop();
+    }
+    mConvertThread.wait();
+    mEncodeThread.wait();
+    mMuxThread.wait();
+    mSliceWorkers.reset();
+
+    if (mDroppedFrames > 0) {
+        LOG(INFO) << "Dropped " << mDroppedFrames << " of "
+                  << mCapturedFrames
+                  << " video frames, the encoder could not keep up";
+    }
 }
 
 bool FfmpegRecorderImpl::writeFrame(const AVCodecContext* c, AVStream* stream, AVPacket* pkt) {
@@ -897,8 +1173,9 @@ bool FfmpegRecorderImpl::writeVideoFrame(AVFrame* frame) {
             return false;
         }
 
+        // The packet is written to the file by the mux thread.
         if (gotPacket && pkt.size > 0) {
-            ret = writeFrame(mVideoStream.codecCtx.get(), mVideoStream.stream, &pkt) ? 0 : -1;
+            ret = mEncoded.send(pkt) ? 0 : -1;
         } else {
             ret = 0;
         }
@@ -986,9 +1263,12 @@ void FfmpegRecorderImpl::closeAudioContext() {
 
 void FfmpegRecorderImpl::closeVideoContext() {
     mVideoStream.codecCtx.reset();
-    mVideoStream.frame.reset();
+    for (auto& frame : mVideoStream.frames) {
+        frame.reset();
+    }
     mVideoStream.tmpFrame.reset();
     mVideoStream.swsCtx.reset();
+    mVideoStream.sliceConverter.reset();
 }
 
 // static
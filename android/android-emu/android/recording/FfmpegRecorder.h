@@ -56,6 +56,19 @@ struct SwsContext;
 namespace android {
 namespace recording {
 
+// What the recorder does with a new video frame when all the frames before it
+// are still being converted and encoded.
+enum class FrameDropPolicy {
+    // Wait for the oldest frame to get through, which holds up the video
+    // producer.
+    Block,
+    // Drop the oldest frame that is still waiting to be converted, so the
+    // recording keeps the latest content.
+    DropOldest,
+    // Drop the new frame.
+    DropNewest,
+};
+
 // Class to record audio and video from the emulator. This class is thread safe,
 // so one can encode audio and video frames on separate threads.
 class FfmpegRecorder {
@@ -101,6 +114,11 @@ public:
     virtual bool addVideoTrack(std::unique_ptr<Producer> producer,
                                const Codec<SwsContext*>* codec) = 0;
 
+    // Sets what happens to video frames that arrive faster than they can be
+    // encoded. Must be called before start(), the default is
+    // FrameDropPolicy::DropOldest.
+    virtual void setFrameDropPolicy(FrameDropPolicy policy) = 0;
+
     virtual ~FfmpegRecorder() {}
 
     // Creates a FfmpegRecorder instance.
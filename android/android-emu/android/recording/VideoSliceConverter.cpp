@@ -0,0 +1,119 @@
+// Copyright 2021 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+#include "android/recording/VideoSliceConverter.h"
+
+#include "android/base/Log.h"              // for LogStream, LOG
+
+#include <algorithm>                       // for min, max
+
+extern "C" {
+#include "libavutil/common.h"              // for AV_CEIL_RSHIFT
+#include "libavutil/imgutils.h"            // for av_image_copy_plane
+#include "libavutil/pixdesc.h"             // for av_pix_fmt_desc_get
+#include "libswscale/swscale.h"            // for sws_getContext, sws_scale
+}
+
+namespace android {
+namespace recording {
+
+VideoSliceConverter::VideoSliceConverter(int width, AVPixelFormat dstFmt)
+    : mWidth(width), mDstFmt(dstFmt) {}
+
+std::unique_ptr<VideoSliceConverter> VideoSliceConverter::create(
+        int width,
+        int height,
+        AVPixelFormat srcFmt,
+        AVPixelFormat dstFmt,
+        int flags,
+        int maxSlices) {
+    // Only planar YUV destinations have rows that can be cut apart. The
+    // chroma of a slice is scaled by exactly the subsampling factor, like in
+    // the whole frame, only if the height is a multiple of it.
+    const AVPixFmtDescriptor* srcDesc = av_pix_fmt_desc_get(srcFmt);
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(dstFmt);
+    if (!srcDesc || (srcDesc->flags & AV_PIX_FMT_FLAG_PLANAR) || !desc ||
+        !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) ||
+        (desc->flags & AV_PIX_FMT_FLAG_RGB) ||
+        height % (1 << desc->log2_chroma_h) != 0) {
+        return nullptr;
+    }
+
+    const int slices = std::min(maxSlices, height / kSliceAlignment);
+    if (slices < 2) {
+        return nullptr;
+    }
+    const int sliceHeight = (height / slices + kSliceAlignment - 1) /
+                            kSliceAlignment * kSliceAlignment;
+
+    std::unique_ptr<VideoSliceConverter> converter(
+            new VideoSliceConverter(width, dstFmt));
+    converter->mLog2ChromaHeight = desc->log2_chroma_h;
+    for (int top = 0; top < height; top += sliceHeight) {
+        Slice slice;
+        slice.top = top;
+        slice.bottom = std::min(top + sliceHeight, height);
+        slice.convertTop = std::max(0, top - kOverlapRows);
+        slice.convertBottom = std::min(slice.bottom + kOverlapRows, height);
+        const int convertHeight = slice.convertBottom - slice.convertTop;
+
+        SwsContext* swsCtx =
+                sws_getContext(width, convertHeight, srcFmt, width,
+                               convertHeight, dstFmt, flags, nullptr, nullptr,
+                               nullptr);
+        AVFrame* scratch = av_frame_alloc();
+        if (scratch) {
+            scratch->format = dstFmt;
+            scratch->width = width;
+            scratch->height = convertHeight;
+            if (av_frame_get_buffer(scratch, 32) < 0) {
+                av_frame_free(&scratch);
+            }
+        }
+        slice.swsCtx = makeAVScopedPtr(swsCtx);
+        slice.scratch = makeAVScopedPtr(scratch);
+        if (!swsCtx || !scratch) {
+            LOG(ERROR) << "Could not initialize the slice conversion context";
+            return nullptr;
+        }
+        converter->mSlices.push_back(std::move(slice));
+    }
+    return converter;
+}
+
+void VideoSliceConverter::convert(int index,
+                                  const uint8_t* src,
+                                  int srcLinesize,
+                                  AVFrame* dst) {
+    Slice& slice = mSlices[index];
+    const uint8_t* srcRows = src + slice.convertTop * srcLinesize;
+    sws_scale(slice.swsCtx.get(), &srcRows, &srcLinesize, 0,
+              slice.convertBottom - slice.convertTop, slice.scratch->data,
+              slice.scratch->linesize);
+
+    // Drop the overlap, which the neighboring slices produce.
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && dst->data[i]; ++i) {
+        // Planes 1 and 2 are the (possibly subsampled) chroma planes.
+        const int shift = (i == 1 || i == 2) ? mLog2ChromaHeight : 0;
+        const int top = slice.top >> shift;
+        const int rows = AV_CEIL_RSHIFT(slice.bottom, shift) - top;
+        const int scratchTop = top - (slice.convertTop >> shift);
+        av_image_copy_plane(
+                dst->data[i] + top * dst->linesize[i], dst->linesize[i],
+                slice.scratch->data[i] +
+                        scratchTop * slice.scratch->linesize[i],
+                slice.scratch->linesize[i],
+                av_image_get_linesize(mDstFmt, mWidth, i), rows);
+    }
+}
+
+}  // namespace recording
+}  // namespace android
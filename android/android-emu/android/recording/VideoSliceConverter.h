@@ -0,0 +1,88 @@
+// Copyright 2021 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+#pragma once
+
+#include "android/base/Compiler.h"          // for DISALLOW_COPY_AND_ASSIGN
+#include "android/recording/AVScopedPtr.h"  // for AVScopedPtr
+
+#include <cstdint>                          // for uint8_t
+#include <memory>                           // for unique_ptr
+#include <vector>                           // for vector
+
+extern "C" {
+#include "libavutil/frame.h"                // for AVFrame
+#include "libavutil/pixfmt.h"               // for AVPixelFormat
+}
+
+namespace android {
+namespace recording {
+
+// Converts video frames to another pixel format of the same size in row
+// slices, which can be converted on different threads at the same time. The
+// result is the same as a single sws_scale() of the whole frame.
+//
+// The filters of a conversion read a few rows past the rows they produce, e.g.
+// to subsample the chroma. So each slice also converts kOverlapRows rows above
+// and below itself into a scratch frame of its own, and only copies its own
+// rows into the destination frame.
+class VideoSliceConverter {
+    DISALLOW_COPY_AND_ASSIGN(VideoSliceConverter);
+
+public:
+    // Slices start at a multiple of this many rows, which keeps them aligned
+    // with the subsampled chroma rows and with the dither pattern of swscale.
+    static constexpr int kSliceAlignment = 16;
+    // The rows a slice converts past each of its edges. This covers the
+    // vertical filter of every scaler swscale has for a 2:1 chroma subsampling.
+    static constexpr int kOverlapRows = 16;
+
+    // Creates a converter of |width| x |height| frames from |srcFmt|, a packed
+    // format, to |dstFmt|, a planar YUV format, in up to |maxSlices| slices.
+    // |flags| are the sws_getContext() flags of the single sws_scale() this
+    // replaces. Returns nullptr if the frames can't be cut in at least two
+    // slices.
+    static std::unique_ptr<VideoSliceConverter> create(int width,
+                                                       int height,
+                                                       AVPixelFormat srcFmt,
+                                                       AVPixelFormat dstFmt,
+                                                       int flags,
+                                                       int maxSlices);
+
+    int slices() const { return mSlices.size(); }
+
+    // Converts slice |index| of |src|, which has |srcLinesize| bytes per row,
+    // into |dst|. Different slices of a frame can be converted at the same
+    // time, but a slice can only convert one frame at a time.
+    void convert(int index, const uint8_t* src, int srcLinesize, AVFrame* dst);
+
+private:
+    struct Slice {
+        // The rows of the destination frame this slice produces.
+        int top;
+        int bottom;
+        // The rows it converts, including the overlap with its neighbors.
+        int convertTop;
+        int convertBottom;
+        AVScopedPtr<SwsContext> swsCtx;
+        AVScopedPtr<AVFrame> scratch;
+    };
+
+    VideoSliceConverter(int width, AVPixelFormat dstFmt);
+
+    const int mWidth;
+    const AVPixelFormat mDstFmt;
+    int mLog2ChromaHeight = 0;
+    std::vector<Slice> mSlices;
+};
+
+}  // namespace recording
+}  // namespace android
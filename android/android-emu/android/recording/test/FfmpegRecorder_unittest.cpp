@@ -87,16 +87,39 @@ static void checkMediaFile(StringView file,
     }
 }
 
+static int countVideoPackets(StringView file) {
+    AVFormatContext* fmtCtx = nullptr;
+
+    EXPECT_TRUE(avformat_open_input(&fmtCtx, c_str(file), nullptr, nullptr) ==
+                0);
+    AVScopedPtr<AVFormatContext> pFmtCtx = makeAVScopedPtr(fmtCtx);
+    EXPECT_TRUE(avformat_find_stream_info(fmtCtx, nullptr) >= 0);
+
+    int packets = 0;
+    AVPacket pkt;
+    while (av_read_frame(fmtCtx, &pkt) == 0) {
+        if (pFmtCtx->streams[pkt.stream_index]->codec->codec_type ==
+            AVMEDIA_TYPE_VIDEO) {
+            ++packets;
+        }
+        av_packet_unref(&pkt);
+    }
+    return packets;
+}
+
 // Test recording with parameters and codec configurations that the emulator
 // is using. Returns output file on success.
-static std::string setupRecordingTest(VideoFormat videoFmt,
-                                      AudioFormat audioFmt,
-                                      uint32_t outputWidth,
-                                      uint32_t outputHeight,
-                                      StringView outputFile) {
+static std::string setupRecordingTest(
+        VideoFormat videoFmt,
+        AudioFormat audioFmt,
+        uint32_t outputWidth,
+        uint32_t outputHeight,
+        StringView outputFile,
+        FrameDropPolicy dropPolicy = FrameDropPolicy::DropOldest) {
     auto recorder = FfmpegRecorder::create(kFbWidth, kFbHeight, outputFile,
                                            kContainerFormat);
     EXPECT_TRUE(recorder->isValid());
+    recorder->setFrameDropPolicy(dropPolicy);
 
     // Indicators for when the producers are finished so we can stop the
     // recording.
@@ -718,6 +741,36 @@ TEST(FfmpegRecorder, scaledRecording) {
                        800, outputFile);
 }
 
+TEST(FfmpegRecorder, BlockingRecordingKeepsEveryFrame) {
+    TestSystem system("/progdir", System::kProgramBitness, "/homedir",
+                      "/appdir");
+    // Enough cores to convert the frames in slices.
+    system.setCpuCoreCount(8);
+    TestTempDir* dir = system.getTempRoot();
+    std::string outputFile = dir->makeSubPath("unittest_block.webm");
+
+    setupRecordingTest(VideoFormat::RGBA8888, AudioFormat::AUD_FMT_S16,
+                       kFbWidth, kFbHeight, outputFile,
+                       FrameDropPolicy::Block);
+    EXPECT_EQ(kFPS * kDurationSecs, countVideoPackets(outputFile));
+}
+
+TEST(FfmpegRecorder, DropOldestRecording) {
+    TestSystem system("/progdir", System::kProgramBitness, "/homedir",
+                      "/appdir");
+    TestTempDir* dir = system.getTempRoot();
+    std::string outputFile = dir->makeSubPath("unittest_drop_oldest.webm");
+
+    // The dummy producer sends the frames as fast as it can, the latest frame
+    // is kept so the recording still covers its whole duration.
+    setupRecordingTest(VideoFormat::RGBA8888, AudioFormat::AUD_FMT_S16,
+                       kFbWidth, kFbHeight, outputFile,
+                       FrameDropPolicy::DropOldest);
+    const int packets = countVideoPackets(outputFile);
+    EXPECT_GT(packets, 0);
+    EXPECT_LE(packets, kFPS * kDurationSecs);
+}
+
 TEST(GifConverter, ConvertWebmToGif) {
     TestSystem system("/progdir", System::kProgramBitness, "/homedir",
                       "/appdir");
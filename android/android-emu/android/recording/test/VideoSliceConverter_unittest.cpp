@@ -0,0 +1,113 @@
+// Copyright (C) 2021 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "android/recording/VideoSliceConverter.h"
+
+#include <gtest/gtest.h>                     // for Test, EXPECT_EQ, TEST
+#include <cstdint>                           // for uint8_t
+#include <vector>                            // for vector
+
+#include "android/recording/AVScopedPtr.h"   // for makeAVScopedPtr
+
+extern "C" {
+#include <libavutil/imgutils.h>              // for av_image_get_linesize
+#include <libavutil/pixdesc.h>               // for av_get_pix_fmt_name
+#include <libswscale/swscale.h>              // for sws_getContext, SWS_B...
+}
+
+using namespace android::recording;
+
+static constexpr int kWidth = 96;
+// Cut into 4 slices of 64 rows, the last one short.
+static constexpr int kHeight = 200;
+
+static AVScopedPtr<AVFrame> allocFrame(AVPixelFormat format) {
+    AVFrame* frame = av_frame_alloc();
+    frame->format = format;
+    frame->width = kWidth;
+    frame->height = kHeight;
+    EXPECT_EQ(0, av_frame_get_buffer(frame, 32));
+    return makeAVScopedPtr(frame);
+}
+
+// Content that changes from row to row, so a filter that reaches across the
+// edge of a slice changes the result.
+static std::vector<uint8_t> makeFrame(int linesize) {
+    std::vector<uint8_t> frame(linesize * kHeight);
+    uint32_t seed = 1;
+    for (auto& byte : frame) {
+        seed = seed * 1103515245 + 12345;
+        byte = seed >> 24;
+    }
+    return frame;
+}
+
+// Slices convert like a single sws_scale() of the whole frame, down to the
+// chroma rows at the edges of the slices.
+TEST(VideoSliceConverter, SlicesMatchWholeFrame) {
+    for (AVPixelFormat srcFmt :
+         {AV_PIX_FMT_RGBA, AV_PIX_FMT_BGRA, AV_PIX_FMT_RGB565}) {
+        SCOPED_TRACE(av_get_pix_fmt_name(srcFmt));
+        const int linesize = av_image_get_linesize(srcFmt, kWidth, 0);
+        const std::vector<uint8_t> src = makeFrame(linesize);
+        const uint8_t* srcData = src.data();
+
+        auto whole = allocFrame(AV_PIX_FMT_YUV420P);
+        auto swsCtx = makeAVScopedPtr(
+                sws_getContext(kWidth, kHeight, srcFmt, kWidth, kHeight,
+                               AV_PIX_FMT_YUV420P, SWS_BICUBIC, nullptr,
+                               nullptr, nullptr));
+        ASSERT_NE(nullptr, swsCtx.get());
+        sws_scale(swsCtx.get(), &srcData, &linesize, 0, kHeight, whole->data,
+                  whole->linesize);
+
+        auto converter = VideoSliceConverter::create(
+                kWidth, kHeight, srcFmt, AV_PIX_FMT_YUV420P, SWS_BICUBIC, 4);
+        ASSERT_NE(nullptr, converter.get());
+        EXPECT_EQ(4, converter->slices());
+        auto sliced = allocFrame(AV_PIX_FMT_YUV420P);
+        for (int i = 0; i < converter->slices(); ++i) {
+            converter->convert(i, srcData, linesize, sliced.get());
+        }
+
+        for (int plane = 0; plane < 3; ++plane) {
+            const int rows = plane == 0 ? kHeight : kHeight / 2;
+            const int bytes = plane == 0 ? kWidth : kWidth / 2;
+            for (int row = 0; row < rows; ++row) {
+                const uint8_t* expected =
+                        whole->data[plane] + row * whole->linesize[plane];
+                const uint8_t* actual =
+                        sliced->data[plane] + row * sliced->linesize[plane];
+                ASSERT_EQ(std::vector<uint8_t>(expected, expected + bytes),
+                          std::vector<uint8_t>(actual, actual + bytes))
+                        << "plane " << plane << " row " << row;
+            }
+        }
+    }
+}
+
+TEST(VideoSliceConverter, NeedsTwoSlices) {
+    EXPECT_EQ(nullptr,
+              VideoSliceConverter::create(kWidth, kHeight, AV_PIX_FMT_RGBA,
+                                          AV_PIX_FMT_YUV420P, SWS_BICUBIC, 1));
+    EXPECT_EQ(nullptr,
+              VideoSliceConverter::create(kWidth, 24, AV_PIX_FMT_RGBA,
+                                          AV_PIX_FMT_YUV420P, SWS_BICUBIC, 4));
+}
+
+TEST(VideoSliceConverter, OddHeightIsNotSliced) {
+    EXPECT_EQ(nullptr, VideoSliceConverter::create(
+                               kWidth, kHeight + 1, AV_PIX_FMT_RGBA,
+                               AV_PIX_FMT_YUV420P, SWS_BICUBIC, 4));
+}
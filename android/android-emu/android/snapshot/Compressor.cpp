@@ -12,11 +12,15 @@
 #include "android/snapshot/Compressor.h"
 
 #include "android/base/system/System.h"
+#include "android/snapshot/Decompressor.h"
+#include "android/utils/debug.h"
 
 #include "lz4.h"
+#include "zstd.h"
 
 #include <algorithm>
 #include <cassert>
+#include <cstdlib>
 #include <utility>
 
 namespace android {
@@ -40,6 +44,184 @@ int32_t compress(const uint8_t* data,
     return compressedSize;
 }
 
+namespace {
+
+class Lz4Codec final : public Codec {
+public:
+    Lz4Codec() : Codec(Type::Lz4, 0, {}) {}
+
+    int32_t compress(const uint8_t* data,
+                     int32_t size,
+                     uint8_t* out,
+                     int32_t outSize) const override {
+        return compress::compress(data, size, out, outSize);
+    }
+
+    bool decompress(const uint8_t* data,
+                    int32_t size,
+                    uint8_t* out,
+                    int32_t outSize) const override {
+        return Decompressor::decompress(data, size, out, outSize);
+    }
+};
+
+class ZstdCodec final : public Codec {
+public:
+    ZstdCodec(int level, std::vector<uint8_t> dictionary)
+        : Codec(Type::Zstd, level, std::move(dictionary)) {
+        if (!this->dictionary().empty()) {
+            mCDict = ZSTD_createCDict(this->dictionary().data(),
+                                      this->dictionary().size(),
+                                      compressionLevel());
+            mDDict = ZSTD_createDDict(this->dictionary().data(),
+                                      this->dictionary().size());
+        }
+    }
+
+    ~ZstdCodec() {
+        ZSTD_freeCDict(mCDict);
+        ZSTD_freeDDict(mDDict);
+    }
+
+    bool valid() const { return dictionary().empty() || (mCDict && mDDict); }
+
+    int32_t compress(const uint8_t* data,
+                     int32_t size,
+                     uint8_t* out,
+                     int32_t outSize) const override {
+        auto cctx = contexts().cctx;
+        const size_t res =
+                mCDict ? ZSTD_compress_usingCDict(cctx, out, size_t(outSize),
+                                                  data, size_t(size), mCDict)
+                       : ZSTD_compressCCtx(cctx, out, size_t(outSize), data,
+                                           size_t(size), compressionLevel());
+        return ZSTD_isError(res) ? 0 : int32_t(res);
+    }
+
+    bool decompress(const uint8_t* data,
+                    int32_t size,
+                    uint8_t* out,
+                    int32_t outSize) const override {
+        auto dctx = contexts().dctx;
+        const size_t res =
+                mDDict ? ZSTD_decompress_usingDDict(dctx, out, size_t(outSize),
+                                                    data, size_t(size), mDDict)
+                       : ZSTD_decompressDCtx(dctx, out, size_t(outSize), data,
+                                             size_t(size));
+        if (ZSTD_isError(res) || res != size_t(outSize)) {
+            derror("zstd decompression failed: %s",
+                   ZSTD_isError(res) ? ZSTD_getErrorName(res) : "short output");
+            return false;
+        }
+        return true;
+    }
+
+private:
+    // Contexts are expensive to create and can't be shared between
+    // concurrent calls, so each compressing/decompressing thread keeps its
+    // own pair.
+    struct Contexts {
+        ZSTD_CCtx* cctx = ZSTD_createCCtx();
+        ZSTD_DCtx* dctx = ZSTD_createDCtx();
+
+        ~Contexts() {
+            ZSTD_freeCCtx(cctx);
+            ZSTD_freeDCtx(dctx);
+        }
+    };
+
+    static Contexts& contexts() {
+        static thread_local Contexts sContexts;
+        return sContexts;
+    }
+
+    int compressionLevel() const {
+        return level() ? level() : ZSTD_CLEVEL_DEFAULT;
+    }
+
+    ZSTD_CDict* mCDict = nullptr;
+    ZSTD_DDict* mDDict = nullptr;
+};
+
+}  // namespace
+
+Codec::Codec(Type type, int level, std::vector<uint8_t> dictionary)
+    : mType(type), mLevel(level), mDictionary(std::move(dictionary)) {}
+
+// static
+CodecPtr Codec::lz4() {
+    static const CodecPtr sLz4 = std::make_shared<Lz4Codec>();
+    return sLz4;
+}
+
+// static
+CodecPtr Codec::create(Type type, int level, std::vector<uint8_t> dictionary) {
+    switch (type) {
+        case Type::Lz4:
+            if (level != 0 || !dictionary.empty()) {
+                return nullptr;
+            }
+            return lz4();
+        case Type::Zstd: {
+            if (level < ZSTD_minCLevel() || level > ZSTD_maxCLevel()) {
+                return nullptr;
+            }
+            auto codec =
+                    std::make_shared<ZstdCodec>(level, std::move(dictionary));
+            if (!codec->valid()) {
+                return nullptr;
+            }
+            return codec;
+        }
+    }
+    return nullptr;
+}
+
+// static
+CodecPtr Codec::fromString(base::StringView spec) {
+    if (spec == "lz4") {
+        return lz4();
+    }
+    if (spec == "zstd") {
+        return create(Type::Zstd);
+    }
+    if (spec.size() > 5 && spec.str().compare(0, 5, "zstd:") == 0) {
+        const std::string levelStr = spec.str().substr(5);
+        char* end = nullptr;
+        const long level = strtol(levelStr.c_str(), &end, 10);
+        if (end && *end == '\0') {
+            return create(Type::Zstd, int(level));
+        }
+    }
+    return nullptr;
+}
+
+void Codec::save(base::Stream& out) const {
+    out.putByte(uint8_t(mType));
+    out.putBe32(uint32_t(mLevel));
+    out.putBe32(uint32_t(mDictionary.size()));
+    out.write(mDictionary.data(), mDictionary.size());
+}
+
+// static
+CodecPtr Codec::load(base::Stream& in) {
+    // Real dictionaries are ~100KB; anything huge is a corrupted index.
+    static constexpr uint32_t kMaxDictionarySize = 16 * 1024 * 1024;
+
+    const auto type = Type(in.getByte());
+    const auto level = int(int32_t(in.getBe32()));
+    const auto dictionarySize = in.getBe32();
+    if (dictionarySize > kMaxDictionarySize) {
+        return nullptr;
+    }
+    std::vector<uint8_t> dictionary(dictionarySize);
+    if (in.read(dictionary.data(), dictionary.size()) !=
+        ssize_t(dictionary.size())) {
+        return nullptr;
+    }
+    return create(type, level, std::move(dictionary));
+}
+
 }  // namespace compress
 
 }  // namespace snapshot
@@ -11,8 +11,14 @@
 
 #pragma once
 
+#include "android/base/StringView.h"
+#include "android/base/files/Stream.h"
+
 #include <cstdint>
+#include <memory>
+#include <vector>
 #include "lz4.h"
+#include "zstd.h"
 
 namespace android {
 namespace snapshot {
@@ -24,10 +30,73 @@ int32_t compress(const uint8_t* data,
                  uint8_t* out,
                  int32_t outSize);
 
+// Big enough for the output of any of the codecs below.
 constexpr int32_t maxCompressedSize(int32_t dataSize) {
-    return LZ4_COMPRESSBOUND(dataSize);
+    return int32_t(LZ4_COMPRESSBOUND(dataSize)) >
+                           int32_t(ZSTD_COMPRESSBOUND(dataSize))
+                   ? int32_t(LZ4_COMPRESSBOUND(dataSize))
+                   : int32_t(ZSTD_COMPRESSBOUND(dataSize));
 }
 
+//
+// Codec - compresses and decompresses individual RAM pages. The codec used
+// for a snapshot is recorded in its RAM index, so loading always picks the
+// same one regardless of the current settings.
+//
+// All methods are thread-safe.
+//
+class Codec {
+public:
+    enum class Type : uint8_t {
+        Lz4 = 0,
+        Zstd = 1,
+    };
+
+    // The codec used by all snapshots before codecs became configurable.
+    static std::shared_ptr<const Codec> lz4();
+
+    // |level| is codec-specific, with 0 meaning its default. |dictionary|
+    // is only used by zstd; it may be any raw content or one trained on
+    // sample pages with 'zstd --train'.
+    // Returns nullptr if the parameters are invalid.
+    static std::shared_ptr<const Codec> create(
+            Type type,
+            int level = 0,
+            std::vector<uint8_t> dictionary = {});
+
+    // Parses "lz4", "zstd" or "zstd:<level>".
+    static std::shared_ptr<const Codec> fromString(base::StringView spec);
+
+    virtual ~Codec() = default;
+
+    Type type() const { return mType; }
+    int level() const { return mLevel; }
+    const std::vector<uint8_t>& dictionary() const { return mDictionary; }
+
+    // Returns the compressed size, or 0 if compression failed.
+    virtual int32_t compress(const uint8_t* data,
+                             int32_t size,
+                             uint8_t* out,
+                             int32_t outSize) const = 0;
+    virtual bool decompress(const uint8_t* data,
+                            int32_t size,
+                            uint8_t* out,
+                            int32_t outSize) const = 0;
+
+    void save(base::Stream& out) const;
+    static std::shared_ptr<const Codec> load(base::Stream& in);
+
+protected:
+    Codec(Type type, int level, std::vector<uint8_t> dictionary);
+
+private:
+    const Type mType;
+    const int mLevel;
+    const std::vector<uint8_t> mDictionary;
+};
+
+using CodecPtr = std::shared_ptr<const Codec>;
+
 }  // namespace compress
 }  // namespace snapshot
 }  // namespace android
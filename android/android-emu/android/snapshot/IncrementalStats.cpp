@@ -18,6 +18,7 @@ namespace snapshot {
 
 constexpr char IncrementalStats::kActionFormat[];
 constexpr char IncrementalStats::kTimeFormat[];
+constexpr char IncrementalStats::kWorkerTimeFormat[];
 
 #if SNAPSHOT_PROFILE > 1
 
@@ -47,6 +48,18 @@ void IncrementalStats::print(const char* prefixFormat, ...) {
     formatFromArray(kActionFormat, mActions,
                     [](int64_t x) { return (unsigned long long)x; });
     formatFromArray(kTimeFormat, mTimes, [](int64_t x) { return x / 1000.0; });
+
+    for (int i = 0; i < kMaxWorkers; ++i) {
+        const auto& times = mWorkerTimes[i];
+        const auto zeroCheck = times[int(WorkerTime::ZeroCheck)].load(
+                std::memory_order_relaxed);
+        const auto hashing = times[int(WorkerTime::Hashing)].load(
+                std::memory_order_relaxed);
+        if (!zeroCheck && !hashing) {
+            continue;
+        }
+        printf(kWorkerTimeFormat, i, zeroCheck / 1000.0, hashing / 1000.0);
+    }
 }
 
 #endif  // SNAPSHOT_PROFILE > 1
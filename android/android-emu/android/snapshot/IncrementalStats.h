@@ -15,6 +15,7 @@
 
 #include <array>
 #include <atomic>
+#include <cassert>
 #include <utility>
 
 namespace android {
@@ -28,10 +29,13 @@ namespace snapshot {
 // it won't do anything more than call the passed callbacks as-is.
 //
 // It can track two types of values - counts and time measurements, and
-// got separate enums and separate functions for those.
+// got separate enums and separate functions for those. Time measurements
+// for work that's sharded across several threads can additionally be
+// tracked per worker via measureWorker().
 //
 // print() function outputs the tracked stats to stdout, using the supplied
-// format string and arguments to format the prefix for the information.
+// format string and arguments to format the prefix for the information;
+// timeUs() returns a single time measurement (always 0 if not tracking).
 //
 
 class IncrementalStats {
@@ -46,6 +50,7 @@ public:
         ReusedPos,
         NewZeroPage,
         AppendedPos,
+        DeltaPage,
         /////////////////////
         Count
     };
@@ -54,7 +59,8 @@ public:
             "\tPages: total %llu\n"
             "\t\tsame %llu [not loaded %llu; still empty %llu; "
             "same hash %llu]\n"
-            "\t\tnew  %llu [reused %llu, empty %llu, appended %llu]\n";
+            "\t\tnew  %llu [reused %llu, empty %llu, appended %llu]\n"
+            "\t\tdelta %llu\n";
 
     enum class Time : int {
         Hashing,
@@ -75,23 +81,52 @@ public:
             "lz4 %.03f, waitdisk %.03f, totalHandlingPageSave %.03f, "
             "diskWriteCombine %.03f, diskIndexWrite %.03f\n";
 
+    // Maximum number of workers tracked separately by measureWorker().
+    static constexpr int kMaxWorkers = 16;
+
+    enum class WorkerTime : int {
+        ZeroCheck,
+        Hashing,
+        /////////////////////
+        Count
+    };
+
+    static constexpr char kWorkerTimeFormat[] =
+            "\t\tworker %d: iszero %.03f, hash %.03f\n";
+
 #if SNAPSHOT_PROFILE <= 1
     template <class Func>
     auto measure(Time time, Func&& func) -> decltype(func()) {
         return func();
     }
 
+    template <class Func>
+    auto measureWorker(WorkerTime time, int worker, Func&& func)
+            -> decltype(func()) {
+        return func();
+    }
+
     void count(Action action) {}
     void countMultiple(Action action, int64_t howMany) {}
 
     void print(const char* prefixFormat, ...) {}
 
+    int64_t timeUs(Time time) const { return 0; }
+
 #else   // SNAPSHOT_PROFILE > 1
     template <class Func>
     auto measure(Time time, Func&& func) -> decltype(func()) {
         return base::measure(mTimes[int(time)], std::forward<Func>(func));
     }
 
+    template <class Func>
+    auto measureWorker(WorkerTime time, int worker, Func&& func)
+            -> decltype(func()) {
+        assert(worker >= 0 && worker < kMaxWorkers);
+        return base::measure(mWorkerTimes[worker][int(time)],
+                             std::forward<Func>(func));
+    }
+
     void count(Action action) {
         countMultiple(action, 1);
     }
@@ -102,9 +137,16 @@ public:
 
     void print(const char* prefixFormat, ...);
 
+    int64_t timeUs(Time time) const {
+        return mTimes[int(time)].load(std::memory_order_relaxed);
+    }
+
 private:
     std::array<std::atomic<int64_t>, int(Action::Count)> mActions{};
     std::array<std::atomic<int64_t>, int(Time::Count)> mTimes{};
+    std::array<std::array<std::atomic<int64_t>, int(WorkerTime::Count)>,
+               kMaxWorkers>
+            mWorkerTimes{};
 #endif  // SNAPSHOT_PROFILE > 1
 };
 
@@ -15,6 +15,7 @@
 #include "android/base/files/FileShareOpen.h"
 #include "android/base/files/PathUtils.h"
 #include "android/base/files/StdioStream.h"
+#include "android/snapshot/SnapshotStream.h"
 #include "android/snapshot/TextureLoader.h"
 #include "android/utils/path.h"
 #include "android/utils/file_io.h"
@@ -62,6 +63,15 @@ Loader::Loader(const Snapshot& snapshot, int error)
         mRamLoader.emplace(StdioStream(ram, StdioStream::kOwner),
                            RamLoader::Flags::OnDemandAllowed,
                            emptyRamBlockStructure);
+        mRamLoader->setAccessTracePath(PathUtils::join(
+                mSnapshot.dataDir(), kRamAccessTraceFileName));
+        // The RAM pages of a snapshot streamed from another emulator may
+        // still be on their way.
+        if (auto receiver = SnapshotReceiver::active(mSnapshot.dataDir())) {
+            mRamLoader->setDataWaiter([receiver](int64_t pos, int64_t size) {
+                return receiver->waitForRamData(pos, size);
+            });
+        }
     }
     {
         const auto textures = android::base::fsopen(
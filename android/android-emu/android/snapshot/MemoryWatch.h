@@ -77,5 +77,31 @@ private:
     std::unique_ptr<Impl> mImpl;
 };
 
+// MemoryWriteWatch - write-protects host memory ranges and reports the first
+// write into each protected page, while the writer is kept blocked.
+// |writeCallback| runs on a separate thread with the page-aligned address; it
+// must call unprotect() for the page to let the writer continue.
+class MemoryWriteWatch {
+public:
+    static bool isSupported();
+
+    using WriteCallback = std::function<void(void*)>;
+
+    explicit MemoryWriteWatch(WriteCallback&& writeCallback);
+    ~MemoryWriteWatch();
+
+    bool valid() const;
+    bool protectRange(void* start, size_t length);
+    void start();
+    bool unprotect(void* ptr, size_t length);
+
+    // Removes protection from all ranges and stops the watching thread.
+    void join();
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> mImpl;
+};
+
 }  // namespace snapshot
 }  // namespace android
@@ -28,6 +28,7 @@
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <cassert>
 #include <utility>
@@ -43,6 +44,16 @@
 #endif
 #endif
 
+// Write-protecting pages that were never touched (and so aren't populated
+// yet) is only reliable with this feature, which older headers lack.
+#if defined(UFFDIO_WRITEPROTECT) && !defined(UFFD_FEATURE_WP_UNPOPULATED)
+#define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+#endif
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
 namespace fc = android::featurecontrol;
 using fc::Feature;
 
@@ -299,5 +310,279 @@ void MemoryAccessWatch::join() {
     }
 }
 
+#ifdef UFFDIO_WRITEPROTECT
+
+// Returns the userfaultfd features the kernel has, asking a scratch
+// userfaultfd as the API handshake can only succeed once per descriptor.
+static uint64_t getUserfaultFdFeatures() {
+    base::ScopedFd ufd(int(syscall(__NR_userfaultfd, O_CLOEXEC)));
+    if (!ufd.valid()) {
+        return 0;
+    }
+
+    uffdio_api apiStruct;
+    memset(&apiStruct, 0x0, sizeof(uffdio_api));
+    apiStruct.api = UFFD_API;
+    if (ioctl(ufd.get(), UFFDIO_API, &apiStruct)) {
+        return 0;
+    }
+    return apiStruct.features;
+}
+
+// Sets |*populate| when the kernel can't write-protect unpopulated pages, so
+// the ranges have to be populated before they're protected.
+static bool checkUserfaultFdWriteProtectCaps(int ufd, bool* populate) {
+    if (ufd < 0) {
+        return false;
+    }
+
+    const uint64_t features = getUserfaultFdFeatures();
+    if (!(features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        VERBOSE_PRINT(snapshot,
+                      "userfault write protection is unsupported by the "
+                      "kernel, saving RAM without copy-on-write");
+        return false;
+    }
+
+    uffdio_api apiStruct;
+    memset(&apiStruct, 0x0, sizeof(uffdio_api));
+    apiStruct.api = UFFD_API;
+    apiStruct.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP |
+                         (features & UFFD_FEATURE_WP_UNPOPULATED);
+
+    if (ioctl(ufd, UFFDIO_API, &apiStruct)) {
+        VERBOSE_PRINT(snapshot, "userfault write protection is unsupported: %s",
+                      strerror(errno));
+        return false;
+    }
+
+    uint64_t ioctlMask = 1ull << _UFFDIO_REGISTER | 1ull << _UFFDIO_UNREGISTER;
+    if ((apiStruct.ioctls & ioctlMask) != ioctlMask) {
+        return false;
+    }
+
+    *populate = !(features & UFFD_FEATURE_WP_UNPOPULATED);
+    if (*populate) {
+        VERBOSE_PRINT(snapshot,
+                      "userfault can't write-protect unpopulated pages "
+                      "(needs Linux 6.4), populating RAM before protecting it");
+    }
+    return true;
+}
+
+// Makes every page of the range resident and writable. The guest is stopped
+// while its RAM gets protected, so rewriting a byte of each page with its own
+// value is safe where MADV_POPULATE_WRITE (Linux 5.14) is missing.
+static void populateForWrite(void* start, size_t length) {
+    if (!madvise(start, length, MADV_POPULATE_WRITE)) {
+        return;
+    }
+    const size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+    auto ptr = static_cast<volatile uint8_t*>(start);
+    for (size_t offset = 0; offset < length; offset += pageSize) {
+        ptr[offset] = ptr[offset];
+    }
+}
+
+class MemoryWriteWatch::Impl {
+public:
+    Impl(MemoryWriteWatch::WriteCallback&& writeCallback)
+        : mWriteCallback(std::move(writeCallback)),
+          mPagefaultThread([this]() { pagefaultWorker(); }) {
+        mUserfaultFd = base::ScopedFd(
+                int(syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK)));
+        if (!checkUserfaultFdWriteProtectCaps(mUserfaultFd.get(),
+                                              &mPopulateBeforeProtect)) {
+            mUserfaultFd.close();
+        }
+        mExitFd = base::ScopedFd(eventfd(0, EFD_CLOEXEC));
+        assert(mExitFd.get() >= 0);
+    }
+
+    ~Impl() { stop(); }
+
+    void* readNextWriteAddr() const {
+        uffd_msg msg;
+        const auto ret =
+                HANDLE_EINTR(read(mUserfaultFd.get(), &msg, sizeof(msg)));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && errno != EAGAIN) {
+                derror("%s: Failed to read full userfault message: %s",
+                       __func__, strerror(errno));
+            }
+            return nullptr;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT ||
+            !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+            derror("%s: Read unexpected event %ud from userfaultfd", __func__,
+                   msg.event);
+            return nullptr;
+        }
+        return reinterpret_cast<void*>(uintptr_t(msg.arg.pagefault.address));
+    }
+
+    void pagefaultWorker() {
+        for (;;) {
+            pollfd pfd[] = {{mExitFd.get(), POLLIN},
+                            {mUserfaultFd.get(), POLLIN}};
+            if (HANDLE_EINTR(poll(pfd, ARRAY_SIZE(pfd), -1)) == -1) {
+                derror("%s: userfault poll: %s", __func__, strerror(errno));
+                break;
+            }
+            if (pfd[1].revents) {
+                while (auto ptr = readNextWriteAddr()) {
+                    mWriteCallback(ptr);
+                }
+            }
+            if (pfd[0].revents) {
+                break;
+            }
+        }
+    }
+
+    bool setProtection(void* start, uint64_t length, bool protect) {
+        uffdio_writeprotect wpStruct = {
+                {(uintptr_t)start, length},
+                protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0};
+        if (ioctl(mUserfaultFd.get(), UFFDIO_WRITEPROTECT, &wpStruct)) {
+            derror("%s: userfault writeprotect(%p, %d, %d): %s", __func__,
+                   start, int(length), int(protect), strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    void stop() {
+        if (mStopped) {
+            return;
+        }
+        mStopped = true;
+
+        // Unprotecting wakes up everyone still waiting on a write fault, so
+        // the thread handling them isn't needed anymore.
+        for (auto&& range : mRanges) {
+            setProtection(range.first, range.second, false);
+            uffdio_range rangeStruct{(uintptr_t)range.first, range.second};
+            if (ioctl(mUserfaultFd.get(), UFFDIO_UNREGISTER, &rangeStruct)) {
+                derror("%s: userfault unregister %p - %s", __func__,
+                       range.first, strerror(errno));
+            }
+        }
+        mRanges.clear();
+
+        HANDLE_EINTR(eventfd_write(mExitFd.get(), 1));
+        mPagefaultThread.wait();
+    }
+
+    MemoryWriteWatch::WriteCallback mWriteCallback;
+
+    base::ScopedFd mUserfaultFd;
+    base::ScopedFd mExitFd;
+
+    std::vector<std::pair<void*, uint64_t>> mRanges;
+    bool mStopped = false;
+    bool mPopulateBeforeProtect = false;
+
+    base::FunctorThread mPagefaultThread;
+};
+
+// static
+bool MemoryWriteWatch::isSupported() {
+    if (android::featurecontrol::isEnabled(
+            android::featurecontrol::QuickbootFileBacked)) {
+        return false;
+    }
+
+    base::ScopedFd ufd(int(syscall(__NR_userfaultfd, O_CLOEXEC)));
+    bool populate = false;
+    return checkUserfaultFdWriteProtectCaps(ufd.get(), &populate);
+}
+
+MemoryWriteWatch::MemoryWriteWatch(WriteCallback&& writeCallback)
+    : mImpl(new Impl(std::move(writeCallback))) {}
+
+MemoryWriteWatch::~MemoryWriteWatch() {
+    join();
+}
+
+bool MemoryWriteWatch::valid() const {
+    return mImpl->mUserfaultFd.valid();
+}
+
+bool MemoryWriteWatch::protectRange(void* start, size_t length) {
+    if (!valid()) {
+        return false;
+    }
+
+    if (mImpl->mPopulateBeforeProtect) {
+        populateForWrite(start, length);
+    }
+
+    uffdio_register regStruct = {{(uintptr_t)start, length},
+                                 UFFDIO_REGISTER_MODE_WP};
+    if (ioctl(mImpl->mUserfaultFd.get(), UFFDIO_REGISTER, &regStruct)) {
+        VERBOSE_PRINT(snapshot, "%s userfault register(%p, %d): %s", __func__,
+                      start, int(length), strerror(errno));
+        return false;
+    }
+    if (!(regStruct.ioctls & (1ull << _UFFDIO_WRITEPROTECT)) ||
+        !mImpl->setProtection(start, length, true)) {
+        uffdio_range rangeStruct{(uintptr_t)start, length};
+        ioctl(mImpl->mUserfaultFd.get(), UFFDIO_UNREGISTER, &rangeStruct);
+        return false;
+    }
+
+    mImpl->mRanges.emplace_back(start, length);
+    return true;
+}
+
+void MemoryWriteWatch::start() {
+    if (valid()) {
+        mImpl->mPagefaultThread.start();
+    }
+}
+
+bool MemoryWriteWatch::unprotect(void* ptr, size_t length) {
+    // Clearing the protection also wakes up the blocked writer.
+    return mImpl->setProtection(ptr, length, false);
+}
+
+void MemoryWriteWatch::join() {
+    if (mImpl && valid()) {
+        mImpl->stop();
+    }
+}
+
+#else  // !UFFDIO_WRITEPROTECT
+
+class MemoryWriteWatch::Impl {};
+
+// static
+bool MemoryWriteWatch::isSupported() {
+    return false;
+}
+
+MemoryWriteWatch::MemoryWriteWatch(WriteCallback&& writeCallback) {}
+
+MemoryWriteWatch::~MemoryWriteWatch() {}
+
+bool MemoryWriteWatch::valid() const {
+    return false;
+}
+
+bool MemoryWriteWatch::protectRange(void* start, size_t length) {
+    return false;
+}
+
+void MemoryWriteWatch::start() {}
+
+bool MemoryWriteWatch::unprotect(void* ptr, size_t length) {
+    return false;
+}
+
+void MemoryWriteWatch::join() {}
+
+#endif  // !UFFDIO_WRITEPROTECT
+
 }  // namespace snapshot
 }  // namespace android
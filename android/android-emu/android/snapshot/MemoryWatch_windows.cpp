@@ -284,5 +284,33 @@ void MemoryAccessWatch::join() {
     if (mImpl) { mImpl->join(); }
 }
 
+// Write-protection tracking isn't implemented on this platform.
+class MemoryWriteWatch::Impl {};
+
+// static
+bool MemoryWriteWatch::isSupported() {
+    return false;
+}
+
+MemoryWriteWatch::MemoryWriteWatch(WriteCallback&& writeCallback) {}
+
+MemoryWriteWatch::~MemoryWriteWatch() {}
+
+bool MemoryWriteWatch::valid() const {
+    return false;
+}
+
+bool MemoryWriteWatch::protectRange(void* start, size_t length) {
+    return false;
+}
+
+void MemoryWriteWatch::start() {}
+
+bool MemoryWriteWatch::unprotect(void* ptr, size_t length) {
+    return false;
+}
+
+void MemoryWriteWatch::join() {}
+
 }  // namespace snapshot
 }  // namespace android
@@ -0,0 +1,117 @@
+// Copyright 2020 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+#include "android/snapshot/PageAccessTrace.h"
+
+#include "android/base/files/StdioStream.h"
+#include "android/utils/file_io.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace android {
+namespace snapshot {
+
+using android::base::StdioStream;
+
+static constexpr uint32_t kFormatVersion = 1;
+
+PageAccessTrace::PageAccessTrace(std::vector<std::string> blocks)
+    : mBlocks(std::move(blocks)) {}
+
+void PageAccessTrace::add(int block, uint32_t page) {
+    if (mAdded.insert(key(block, page)).second) {
+        mPages.push_back({uint16_t(block), page});
+    }
+}
+
+void PageAccessTrace::merge(const PageAccessTrace& older) {
+    std::vector<int> blockMap;
+    blockMap.reserve(older.mBlocks.size());
+    for (const auto& name : older.mBlocks) {
+        auto it = std::find(mBlocks.begin(), mBlocks.end(), name);
+        if (it == mBlocks.end()) {
+            it = mBlocks.insert(mBlocks.end(), name);
+        }
+        blockMap.push_back(int(it - mBlocks.begin()));
+    }
+    for (const Entry& entry : older.mPages) {
+        add(blockMap[entry.block], entry.page);
+    }
+}
+
+void PageAccessTrace::save(base::Stream& out) const {
+    out.putBe32(kFormatVersion);
+    out.putBe32(uint32_t(mBlocks.size()));
+    for (const auto& name : mBlocks) {
+        out.putString(name);
+    }
+    out.putBe32(uint32_t(mPages.size()));
+    for (const Entry& entry : mPages) {
+        out.putBe16(entry.block);
+        out.putBe32(entry.page);
+    }
+}
+
+bool PageAccessTrace::load(base::Stream& in) {
+    mBlocks.clear();
+    mPages.clear();
+    mAdded.clear();
+
+    if (in.getBe32() != kFormatVersion) {
+        return false;
+    }
+    const auto blockCount = in.getBe32();
+    if (blockCount > UINT16_MAX) {
+        return false;
+    }
+    mBlocks.reserve(blockCount);
+    for (uint32_t i = 0; i < blockCount; ++i) {
+        mBlocks.push_back(in.getString());
+    }
+    const auto pageCount = in.getBe32();
+    for (uint32_t i = 0; i < pageCount; ++i) {
+        const auto block = in.getBe16();
+        const auto page = in.getBe32();
+        if (block >= blockCount) {
+            return false;
+        }
+        add(block, page);
+    }
+    return true;
+}
+
+bool PageAccessTrace::save(base::StringView path) const {
+    StdioStream stream(android_fopen(base::c_str(path), "wb"),
+                       StdioStream::kOwner);
+    if (!stream.get()) {
+        return false;
+    }
+    save(stream);
+    return fflush(stream.get()) == 0 && !ferror(stream.get());
+}
+
+bool PageAccessTrace::load(base::StringView path) {
+    StdioStream stream(android_fopen(base::c_str(path), "rb"),
+                       StdioStream::kOwner);
+    if (!stream.get()) {
+        return false;
+    }
+    const bool res = load(stream) && !ferror(stream.get()) &&
+                     !feof(stream.get());
+    if (!res) {
+        *this = PageAccessTrace();
+    }
+    return res;
+}
+
+}  // namespace snapshot
+}  // namespace android
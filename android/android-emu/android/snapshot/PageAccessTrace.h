@@ -0,0 +1,75 @@
+// Copyright 2020 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+#pragma once
+
+#include "android/base/StringView.h"
+#include "android/base/files/Stream.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace android {
+namespace snapshot {
+
+//
+// PageAccessTrace - the order in which the guest first touched its RAM pages
+// after a lazy snapshot load. RamLoader records one for a while after the
+// load, and the next load of the same snapshot prefetches pages in that order
+// instead of the file order.
+//
+// Pages are addressed by RAM block name and page index in the block, so the
+// trace stays valid when the snapshot is saved again.
+//
+class PageAccessTrace {
+public:
+    struct Entry {
+        uint16_t block;  // Index into blocks().
+        uint32_t page;
+    };
+
+    // How long to record guest accesses after the load started.
+    static constexpr int64_t kRecordingDurationUs = 10 * 1000 * 1000;
+
+    PageAccessTrace() = default;
+    explicit PageAccessTrace(std::vector<std::string> blocks);
+
+    const std::vector<std::string>& blocks() const { return mBlocks; }
+    const std::vector<Entry>& pages() const { return mPages; }
+    bool empty() const { return mPages.empty(); }
+
+    // Appends a page unless it's in the trace already.
+    void add(int block, uint32_t page);
+
+    // Appends the pages of |older| that aren't in this trace yet: pages
+    // prefetched in time don't fault, but they're still needed early.
+    void merge(const PageAccessTrace& older);
+
+    void save(base::Stream& out) const;
+    bool load(base::Stream& in);
+
+    bool save(base::StringView path) const;
+    bool load(base::StringView path);
+
+private:
+    static uint64_t key(int block, uint32_t page) {
+        return (uint64_t(block) << 32) | page;
+    }
+
+    std::vector<std::string> mBlocks;
+    std::vector<Entry> mPages;
+    std::unordered_set<uint64_t> mAdded;
+};
+
+}  // namespace snapshot
+}  // namespace android
@@ -0,0 +1,132 @@
+// Copyright 2020 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+#include "android/snapshot/PageDelta.h"
+
+#include <cstring>
+
+namespace android {
+namespace snapshot {
+namespace delta {
+
+// A record costs at least two bytes of header, so don't end a replaced run
+// on fewer equal bytes than that.
+static constexpr int32_t kMinSkip = 3;
+
+static bool putNum(uint32_t num, uint8_t* out, int32_t outSize, int32_t* pos) {
+    do {
+        if (*pos == outSize) {
+            return false;
+        }
+        uint8_t byte = num & 0x7f;
+        num >>= 7;
+        out[(*pos)++] = byte | (num ? 0x80 : 0);
+    } while (num);
+    return true;
+}
+
+static bool getNum(const uint8_t* in, int32_t inSize, int32_t* pos,
+                   uint32_t* num) {
+    uint32_t res = 0;
+    for (int shift = 0; shift < 32; shift += 7) {
+        if (*pos == inSize) {
+            return false;
+        }
+        const uint8_t byte = in[(*pos)++];
+        res |= uint32_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *num = res;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int32_t skipEqual(const uint8_t* base,
+                         const uint8_t* page,
+                         int32_t pos,
+                         int32_t pageSize) {
+    // Most of a slightly changed page is equal, compare a word at a time.
+    while (pos + int32_t(sizeof(uint64_t)) <= pageSize) {
+        uint64_t baseWord;
+        uint64_t pageWord;
+        memcpy(&baseWord, base + pos, sizeof(baseWord));
+        memcpy(&pageWord, page + pos, sizeof(pageWord));
+        if (baseWord != pageWord) {
+            break;
+        }
+        pos += sizeof(uint64_t);
+    }
+    while (pos < pageSize && base[pos] == page[pos]) {
+        ++pos;
+    }
+    return pos;
+}
+
+int32_t encode(const uint8_t* base,
+               const uint8_t* page,
+               int32_t pageSize,
+               uint8_t* out,
+               int32_t outSize) {
+    int32_t outPos = 0;
+    int32_t pos = 0;
+    for (;;) {
+        const int32_t changeStart = skipEqual(base, page, pos, pageSize);
+        if (changeStart == pageSize) {
+            break;
+        }
+
+        int32_t changeEnd = changeStart + 1;
+        for (int32_t i = changeEnd; i < pageSize && i - changeEnd < kMinSkip;
+             ++i) {
+            if (base[i] != page[i]) {
+                changeEnd = i + 1;
+            }
+        }
+
+        const int32_t length = changeEnd - changeStart;
+        if (!putNum(uint32_t(changeStart - pos), out, outSize, &outPos) ||
+            !putNum(uint32_t(length), out, outSize, &outPos) ||
+            outSize - outPos < length) {
+            return 0;
+        }
+        memcpy(out + outPos, page + changeStart, size_t(length));
+        outPos += length;
+        pos = changeEnd;
+    }
+    return outPos;
+}
+
+bool apply(const uint8_t* diff, int32_t diffSize, uint8_t* page,
+           int32_t pageSize) {
+    int32_t diffPos = 0;
+    int32_t pos = 0;
+    while (diffPos < diffSize) {
+        uint32_t skip;
+        uint32_t length;
+        if (!getNum(diff, diffSize, &diffPos, &skip) ||
+            !getNum(diff, diffSize, &diffPos, &length) ||
+            skip > uint32_t(pageSize - pos) ||
+            length > uint32_t(pageSize - pos) - skip ||
+            length > uint32_t(diffSize - diffPos)) {
+            return false;
+        }
+        pos += int32_t(skip);
+        memcpy(page + pos, diff + diffPos, length);
+        pos += int32_t(length);
+        diffPos += int32_t(length);
+    }
+    return true;
+}
+
+}  // namespace delta
+}  // namespace snapshot
+}  // namespace android
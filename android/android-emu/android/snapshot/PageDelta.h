@@ -0,0 +1,43 @@
+// Copyright 2020 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+#pragma once
+
+#include <cstdint>
+
+namespace android {
+namespace snapshot {
+namespace delta {
+
+// Run-length diffs between two versions of a RAM page, for pages that only
+// changed in a few places since the previous snapshot.
+//
+// A diff is a sequence of (skip, length, bytes) records: |skip| bytes stay
+// as they are in the base page, and the next |length| bytes are replaced
+// with |bytes|. Both numbers are LEB128-encoded.
+
+// Writes the diff that turns |base| into |page| to |out|, which has room for
+// |outSize| bytes. Returns the diff size, or 0 if the pages are the same or
+// the diff doesn't fit.
+int32_t encode(const uint8_t* base,
+               const uint8_t* page,
+               int32_t pageSize,
+               uint8_t* out,
+               int32_t outSize);
+
+// Applies |diff| to |page|, which has the base page contents on input.
+// Returns false if the diff is malformed.
+bool apply(const uint8_t* diff, int32_t diffSize, uint8_t* page,
+           int32_t pageSize);
+
+}  // namespace delta
+}  // namespace snapshot
+}  // namespace android
@@ -0,0 +1,402 @@
+// Copyright 2020 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+#include "android/snapshot/PageStore.h"
+
+#include "android/base/EintrWrapper.h"
+#include "android/base/files/FileShareOpen.h"
+#include "android/base/files/PathUtils.h"
+#include "android/base/files/preadwrite.h"
+#include "android/base/memory/LazyInstance.h"
+#include "android/base/misc/FileUtils.h"
+#include "android/base/system/System.h"
+#include "android/snapshot/PathUtils.h"
+#include "android/snapshot/common.h"
+#include "android/utils/debug.h"
+#include "android/utils/path.h"
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <unordered_set>
+#include <utility>
+
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+
+namespace android {
+namespace snapshot {
+
+using android::base::AutoLock;
+using android::base::PathUtils;
+using android::base::StdioStream;
+
+static constexpr char kDataFileName[] = "pages.bin";
+static constexpr char kIndexFileName[] = "pages.idx";
+static constexpr char kRefsFileSuffix[] = ".refs";
+
+// "AEMUPGS" + format version.
+static constexpr uint64_t kDataFileMagic = 0x41454d5550475301ull;
+static constexpr int64_t kDataFileHeaderSize = 8;
+
+static constexpr int kIndexRecordSize = 16 + 8;
+static constexpr uint64_t kFreedPageBit = 1ull << 63;
+
+namespace {
+
+// All users of a store in the process share one instance of it, so
+// collecting garbage can't race with adding pages.
+struct OpenStores {
+    base::Lock lock;
+    std::unordered_map<std::string, std::weak_ptr<PageStore>> stores;
+};
+
+}  // namespace
+
+static android::base::LazyInstance<OpenStores> sOpenStores =
+        LAZY_INSTANCE_INIT;
+
+static FILE* openOrCreate(const std::string& path) {
+    if (auto file = android::base::fsopen(path.c_str(), "rb+",
+                                          android::base::FileShare::Write)) {
+        return file;
+    }
+    return android::base::fsopen(path.c_str(), "wb+",
+                                 android::base::FileShare::Write);
+}
+
+// static
+std::string PageStore::dataPath(base::StringView dir) {
+    return PathUtils::join(dir, kDataFileName);
+}
+
+// static
+std::string PageStore::refsPath(base::StringView ramFile) {
+    return ramFile.str() + kRefsFileSuffix;
+}
+
+// static
+bool PageStore::writeRefs(base::StringView path,
+                          const std::vector<int64_t>& offsets) {
+    StdioStream refs(android::base::fsopen(base::c_str(path), "wb",
+                                           android::base::FileShare::Write),
+                     StdioStream::kOwner);
+    if (!refs.get()) {
+        return false;
+    }
+    for (const auto offset : offsets) {
+        refs.putBe64(uint64_t(offset));
+    }
+    fflush(refs.get());
+    return ferror(refs.get()) == 0;
+}
+
+static bool readRefs(const std::string& path,
+                     std::unordered_set<int64_t>* offsets) {
+    if (!base::System::get()->pathExists(path)) {
+        return true;
+    }
+    const auto contents = android::readFileIntoString(path);
+    if (!contents || contents->size() % 8 != 0) {
+        return false;
+    }
+    const auto data = reinterpret_cast<const uint8_t*>(contents->data());
+    for (size_t pos = 0; pos < contents->size(); pos += 8) {
+        uint64_t offset = 0;
+        for (size_t i = 0; i < 8; ++i) {
+            offset = (offset << 8) | data[pos + i];
+        }
+        offsets->insert(int64_t(offset));
+    }
+    return true;
+}
+
+// static
+void PageStore::collectAvdGarbage() {
+    const auto dir = PathUtils::join(getAvdDir(), kPageStoreDirName);
+    if (!base::System::get()->pathIsDir(dir)) {
+        return;
+    }
+    auto store = open(dir);
+    if (!store) {
+        return;
+    }
+    std::vector<std::string> refsFiles;
+    for (const auto& name : getSnapshotDirEntries()) {
+        refsFiles.push_back(refsPath(
+                PathUtils::join(getSnapshotDir(name.c_str()), kRamFileName)));
+    }
+    if (const auto freed = store->collectGarbage(refsFiles)) {
+        VERBOSE_PRINT(snapshot, "Freed %zu unused pages in page store '%s'",
+                      freed, dir.c_str());
+    }
+}
+
+// static
+PageStore::Ptr PageStore::open(base::StringView dir) {
+    auto& openStores = sOpenStores.get();
+    base::AutoLock lock(openStores.lock);
+    auto& openStore = openStores.stores[dir.str()];
+    if (auto store = openStore.lock()) {
+        return store;
+    }
+
+    if (path_mkdir_if_needed_no_cow(base::c_str(dir), 0777) != 0) {
+        return nullptr;
+    }
+
+    StdioStream data(openOrCreate(dataPath(dir)), StdioStream::kOwner);
+    StdioStream index(openOrCreate(PathUtils::join(dir, kIndexFileName)),
+                      StdioStream::kOwner);
+    if (!data.get() || !index.get()) {
+        return nullptr;
+    }
+
+    Ptr store(new PageStore(dir, std::move(data), std::move(index)));
+    if (!store->readIndex()) {
+        return nullptr;
+    }
+    openStore = store;
+    return store;
+}
+
+PageStore::PageStore(std::string dir,
+                     base::StdioStream&& data,
+                     base::StdioStream&& index)
+    : mDir(std::move(dir)),
+      mData(std::move(data)),
+      mIndex(std::move(index)),
+      mDataFd(fileno(mData.get())) {}
+
+bool PageStore::readIndex() {
+    base::System::FileSize dataSize = 0;
+    if (!base::System::get()->fileSize(mDataFd, &dataSize)) {
+        return false;
+    }
+
+    if (dataSize < kDataFileHeaderSize) {
+        // A new store.
+        mData.putBe64(kDataFileMagic);
+        fflush(mData.get());
+        mDataEnd = kDataFileHeaderSize;
+        return ferror(mData.get()) == 0;
+    }
+
+    fseeko64(mData.get(), 0, SEEK_SET);
+    if (mData.getBe64() != kDataFileMagic) {
+        derror("%s: unknown page store format in '%s'", __func__,
+               mDir.c_str());
+        return false;
+    }
+
+    // Only trust the records for complete pages: the store might have been
+    // interrupted in the middle of writing any of its files.
+    const int64_t completeDataEnd =
+            kDataFileHeaderSize +
+            (int64_t(dataSize) - kDataFileHeaderSize) / kPageSize * kPageSize;
+    mDataEnd = kDataFileHeaderSize;
+
+    fseeko64(mIndex.get(), 0, SEEK_SET);
+    int64_t validIndexSize = 0;
+    for (;;) {
+        Hash hash;
+        if (mIndex.read(hash.data(), hash.size()) != ssize_t(hash.size())) {
+            break;
+        }
+        const auto record = mIndex.getBe64();
+        if (feof(mIndex.get())) {
+            break;
+        }
+        validIndexSize += kIndexRecordSize;
+
+        const auto offset = int64_t(record & ~kFreedPageBit);
+        if (record & kFreedPageBit) {
+            auto it = mOffsets.find(hash);
+            if (it != mOffsets.end() && it->second == offset) {
+                mOffsets.erase(it);
+            }
+            continue;
+        }
+        // Skip the pages that didn't make it to disk, or were cut off when
+        // the file was shrunk after freeing them.
+        if (offset < kDataFileHeaderSize ||
+            offset + kPageSize > completeDataEnd) {
+            continue;
+        }
+        mOffsets[hash] = offset;
+    }
+
+    // Slots of the freed pages get reused.
+    std::vector<int64_t> used;
+    used.reserve(mOffsets.size());
+    for (const auto& page : mOffsets) {
+        used.push_back(page.second);
+    }
+    std::sort(used.begin(), used.end());
+    auto usedIt = used.begin();
+    for (int64_t offset = kDataFileHeaderSize;
+         usedIt != used.end(); offset += kPageSize) {
+        if (offset == *usedIt) {
+            ++usedIt;
+        } else {
+            mFreeSlots.push_back(offset);
+        }
+    }
+    mDataEnd = used.empty() ? kDataFileHeaderSize : used.back() + kPageSize;
+    std::reverse(mFreeSlots.begin(), mFreeSlots.end());
+
+    // New records go right after the last valid one.
+    clearerr(mIndex.get());
+    HANDLE_EINTR(fseeko64(mIndex.get(), validIndexSize, SEEK_SET));
+
+    VERBOSE_PRINT(snapshot, "Opened page store '%s' with %zu pages",
+                  mDir.c_str(), mOffsets.size());
+    return true;
+}
+
+int64_t PageStore::put(const Hash& hash, const uint8_t* data, bool* added) {
+    AutoLock lock(mLock);
+    auto it = mOffsets.find(hash);
+    if (it != mOffsets.end()) {
+        *added = false;
+        return it->second;
+    }
+
+    const auto offset = mFreeSlots.empty() ? mDataEnd : mFreeSlots.back();
+    if (HANDLE_EINTR(base::pwrite(mDataFd, data, kPageSize, offset)) !=
+        kPageSize) {
+        derror("%s: failed to write a page to '%s': %s", __func__,
+               mDir.c_str(), strerror(errno));
+        *added = false;
+        return 0;
+    }
+    if (offset == mDataEnd) {
+        mDataEnd += kPageSize;
+    } else {
+        mFreeSlots.pop_back();
+    }
+    mOffsets.emplace(hash, offset);
+    mUnflushed.emplace_back(hash, offset);
+    *added = true;
+    return offset;
+}
+
+bool PageStore::flush() {
+    AutoLock lock(mLock);
+    for (const auto& record : mUnflushed) {
+        mIndex.write(record.first.data(), record.first.size());
+        mIndex.putBe64(uint64_t(record.second));
+    }
+    mUnflushed.clear();
+    fflush(mIndex.get());
+    return ferror(mIndex.get()) == 0;
+}
+
+void PageStore::startWriting() {
+    AutoLock lock(mLock);
+    ++mWriters;
+}
+
+void PageStore::finishWriting() {
+    AutoLock lock(mLock);
+    assert(mWriters > 0);
+    --mWriters;
+}
+
+size_t PageStore::collectGarbage(const std::vector<std::string>& refsFiles,
+                                 int minDeadPercent) {
+    AutoLock lock(mLock);
+    if (mWriters > 0) {
+        return 0;
+    }
+
+    std::unordered_set<int64_t> live;
+    for (const auto& path : refsFiles) {
+        if (!readRefs(path, &live)) {
+            dwarning("%s: can't read page store refs '%s'", __func__,
+                     path.c_str());
+            return 0;
+        }
+    }
+
+    std::vector<std::pair<Hash, int64_t>> dead;
+    for (const auto& page : mOffsets) {
+        if (!live.count(page.second)) {
+            dead.push_back(page);
+        }
+    }
+    if (dead.empty() ||
+        dead.size() * 100 < mOffsets.size() * size_t(minDeadPercent)) {
+        return 0;
+    }
+
+    // Tombstones go to disk before the pages are gone, or a store reopened
+    // after a crash could hand out a page that's not there anymore.
+    for (const auto& page : dead) {
+        mIndex.write(page.first.data(), page.first.size());
+        mIndex.putBe64(uint64_t(page.second) | kFreedPageBit);
+        mOffsets.erase(page.first);
+    }
+    fflush(mIndex.get());
+    if (ferror(mIndex.get())) {
+        // The pages aren't handed out anymore, but they stay where they are
+        // in case the tombstones didn't make it.
+        derror("%s: failed to free pages in '%s'", __func__, mDir.c_str());
+        return 0;
+    }
+
+    std::vector<int64_t> offsets;
+    offsets.reserve(dead.size());
+    for (const auto& page : dead) {
+        offsets.push_back(page.second);
+    }
+    releaseSpace(std::move(offsets));
+    return dead.size();
+}
+
+void PageStore::releaseSpace(std::vector<int64_t> offsets) {
+    mFreeSlots.insert(mFreeSlots.end(), offsets.begin(), offsets.end());
+    std::sort(mFreeSlots.begin(), mFreeSlots.end(), std::greater<int64_t>());
+
+    // Free slots at the end of pages.bin are cut off.
+    auto tailEnd = mFreeSlots.begin();
+    while (tailEnd != mFreeSlots.end() && *tailEnd + kPageSize == mDataEnd) {
+        ++tailEnd;
+        mDataEnd -= kPageSize;
+    }
+    if (tailEnd != mFreeSlots.begin()) {
+        mFreeSlots.erase(mFreeSlots.begin(), tailEnd);
+        android::setFileSize(mDataFd, mDataEnd);
+    }
+
+#ifdef __linux__
+    // Punch the rest out of the file; elsewhere they only get reused.
+    std::sort(offsets.begin(), offsets.end());
+    for (size_t i = 0; i < offsets.size() && offsets[i] < mDataEnd;) {
+        const auto start = offsets[i];
+        auto end = start + kPageSize;
+        while (++i < offsets.size() && offsets[i] == end && end < mDataEnd) {
+            end += kPageSize;
+        }
+        fallocate(mDataFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start,
+                  end - start);
+    }
+#endif
+}
+
+size_t PageStore::pageCount() const {
+    AutoLock lock(mLock);
+    return mOffsets.size();
+}
+
+}  // namespace snapshot
+}  // namespace android
@@ -0,0 +1,133 @@
+// Copyright 2020 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+#pragma once
+
+#include "android/base/Compiler.h"
+#include "android/base/StringView.h"
+#include "android/base/files/StdioStream.h"
+#include "android/base/synchronization/Lock.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace android {
+namespace snapshot {
+
+//
+// PageStore - a content-addressed store of RAM pages shared by all snapshots
+// of an AVD. Pages are keyed by the same 128-bit MurmurHash3 that RamSaver
+// computes for incremental saving, so each distinct page is written to disk
+// (and occupies the page cache) only once no matter how many snapshots
+// contain it.
+//
+// The store is a directory with two files:
+//  - pages.bin: 8-byte header, then uncompressed pages back to back. A page
+//    never moves once written, so its offset is its permanent address.
+//  - pages.idx: append-only (hash, offset) records for pages.bin, and
+//    (hash, offset | kFreedPageBit) tombstones for the pages freed since.
+//
+// A ram.bin that uses the store only keeps the index, with page file
+// positions pointing into pages.bin, and lists the pages it uses in a refs
+// file next to it (see refsPath()). Deleting or overwriting a snapshot drops
+// its references, and collectGarbage() frees the pages nothing references
+// anymore: they get a tombstone record in pages.idx, their space is given
+// back to the file system and their slots are reused for new pages.
+//
+class PageStore {
+    DISALLOW_COPY_AND_ASSIGN(PageStore);
+
+public:
+    using Hash = std::array<char, 16>;
+    using Ptr = std::shared_ptr<PageStore>;
+
+    static constexpr int32_t kPageSize = 4096;
+
+    // Opens or creates the store in |dir|. Returns nullptr on failure.
+    static Ptr open(base::StringView dir);
+
+    // Returns the pages.bin path for the store in |dir|.
+    static std::string dataPath(base::StringView dir);
+
+    // Returns the path of the refs file for the snapshot RAM in |ramFile|.
+    static std::string refsPath(base::StringView ramFile);
+
+    // Writes the list of store pages a snapshot uses, as returned by put().
+    static bool writeRefs(base::StringView path,
+                          const std::vector<int64_t>& offsets);
+
+    // Collects garbage in the current AVD's store, if it has one, keeping
+    // the pages of all of its snapshots.
+    static void collectAvdGarbage();
+
+    const std::string& dir() const { return mDir; }
+
+    // Returns the offset of the page with |hash| in pages.bin, writing
+    // |data| there first if it's a new page; sets |*added| accordingly.
+    // Returns 0 on error.
+    int64_t put(const Hash& hash, const uint8_t* data, bool* added);
+
+    // Makes all pages added so far findable by the next open().
+    bool flush();
+
+    // A snapshot that is being saved hasn't written its refs yet, so no
+    // garbage is collected between these two calls.
+    void startWriting();
+    void finishWriting();
+
+    // Frees the pages that aren't listed in any of |refsFiles|, if there are
+    // at least |minDeadPercent| percent of such pages in the store. Missing
+    // refs files are skipped; an unreadable one cancels the collection.
+    // Returns the number of pages freed.
+    static constexpr int kDefaultMinDeadPercent = 25;
+    size_t collectGarbage(const std::vector<std::string>& refsFiles,
+                          int minDeadPercent = kDefaultMinDeadPercent);
+
+    size_t pageCount() const;
+
+private:
+    struct HashHasher {
+        size_t operator()(const Hash& hash) const {
+            // It's a MurmurHash already, any part of it is good enough.
+            size_t res;
+            memcpy(&res, hash.data(), sizeof(res));
+            return res;
+        }
+    };
+
+    PageStore(std::string dir,
+              base::StdioStream&& data,
+              base::StdioStream&& index);
+
+    bool readIndex();
+    void releaseSpace(std::vector<int64_t> offsets);
+
+    const std::string mDir;
+    base::StdioStream mData;
+    base::StdioStream mIndex;
+    int mDataFd;
+
+    mutable base::Lock mLock;
+    std::unordered_map<Hash, int64_t, HashHasher> mOffsets;
+    std::vector<std::pair<Hash, int64_t>> mUnflushed;
+    // Unused page slots below mDataEnd, highest first.
+    std::vector<int64_t> mFreeSlots;
+    int64_t mDataEnd = 0;
+    int mWriters = 0;
+};
+
+}  // namespace snapshot
+}  // namespace android
@@ -43,6 +43,20 @@ std::string getAvdDir() {
     return avdInfo_getContentPath(android_avdInfo);
 }
 
+std::string getAvdRelativePath(base::StringView path) {
+    if (!android_avdInfo) {
+        return path.str();
+    }
+    return base::PathUtils::relativeTo(getAvdDir(), path);
+}
+
+std::string resolveAvdRelativePath(base::StringView path) {
+    if (!android_avdInfo || base::PathUtils::isAbsolute(path)) {
+        return path.str();
+    }
+    return base::PathUtils::join(getAvdDir(), path);
+}
+
 std::string getSnapshotBaseDir() {
     auto avdDir = avdInfo_getContentPath(android_avdInfo);
     auto path = base::PathUtils::join(avdDir, "snapshots");
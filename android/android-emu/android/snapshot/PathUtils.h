@@ -25,6 +25,11 @@ std::string getSnapshotDepsFileName();
 std::vector<std::string> getSnapshotDirEntries();
 std::vector<std::string> getQcow2Files(std::string avdDir);
 std::string getAvdDir();
+// Makes |path| relative to the AVD directory if it's inside of it, so it
+// stays valid when the AVD is moved; other paths are returned unchanged.
+std::string getAvdRelativePath(base::StringView path);
+// Turns a path from getAvdRelativePath() back into a full one.
+std::string resolveAvdRelativePath(base::StringView path);
 std::string getQuickbootChoiceIniPath();
 
 base::System::FileSize folderSize(const std::string& snapshotName);
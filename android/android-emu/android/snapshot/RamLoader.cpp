@@ -23,7 +23,7 @@
 #include "android/base/memory/MemoryHints.h"
 #include "android/base/misc/StringUtils.h"
 #include "android/snapshot/Compressor.h"
-#include "android/snapshot/Decompressor.h"
+#include "android/snapshot/PageDelta.h"
 #include "android/snapshot/PathUtils.h"
 #include "android/snapshot/interface.h"
 #include "android/utils/debug.h"
@@ -45,6 +45,9 @@ using android::base::Stopwatch;
 namespace android {
 namespace snapshot {
 
+// Largest single read of consecutive pages.
+static constexpr size_t kMaxReadBatchSize = 1024 * 1024;
+
 void RamLoader::FileIndex::clear() {
     decltype(pages)().swap(pages);
     decltype(blocks)().swap(blocks);
@@ -87,6 +90,7 @@ RamLoader::~RamLoader() {
             mAccessWatch.clear();
         }
         assert(hasError() || !mAccessWatch);
+        saveAccessTrace();
     }
     mIndex.clear();
 }
@@ -158,6 +162,12 @@ bool RamLoader::start(bool isQuickboot) {
         mHasError = true;
         return false;
     }
+    if (!mAccessTracePath.empty()) {
+        loadPrefetchOrder();
+        mRecordingEndTime =
+                mStartTime + PageAccessTrace::kRecordingDurationUs;
+        mRecordingAccesses = true;
+    }
     mBackgroundPageIt = mIndex.pages.begin();
     mAccessWatch->doneRegistering();
     mReaderThread.start();
@@ -196,6 +206,7 @@ void RamLoader::join() {
         mAccessWatch.clear();
     }
     mStream.close();
+    saveAccessTrace();
 
 #if SNAPSHOT_PROFILE > 1
     printf("Finished remaining RAM load in %f ms\n", sw.elapsedUs() / 1000.0f);
@@ -211,6 +222,7 @@ void RamLoader::interrupt() {
         mAccessWatch.clear();
     }
     mStream.close();
+    saveAccessTrace();
 }
 
 // Touches all pages that are currently file-backed, making sure
@@ -278,10 +290,32 @@ bool RamLoader::readIndex() {
     MemStream stream(std::move(buffer));
 
     mVersion = stream.getBe32();
-    if (mVersion < 1 || mVersion > 2) {
+    if (mVersion < 1 || mVersion > 4) {
         return false;
     }
     mIndex.flags = IndexFlags(stream.getBe32());
+    if (mVersion > 2) {
+        mCodec = compress::Codec::load(stream);
+        if (!mCodec) {
+            return false;
+        }
+    }
+    mDataFd = mStreamFd;
+    if (nonzero(mIndex.flags & IndexFlags::PageStore)) {
+        if (mVersion < 3) {
+            return false;
+        }
+        const auto storePath = resolveAvdRelativePath(stream.getString());
+        auto storeFile = android_fopen(storePath.c_str(), "rb");
+        if (!storeFile) {
+            derror("Failed to open snapshot page store '%s'",
+                   storePath.c_str());
+            return false;
+        }
+        mPageStoreStream = base::StdioStream(storeFile,
+                                             base::StdioStream::kOwner);
+        mDataFd = fileno(mPageStoreStream.get());
+    }
     const bool compressed = nonzero(mIndex.flags & IndexFlags::CompressedPages);
     auto pageCount = stream.getBe32();
 
@@ -305,7 +339,9 @@ bool RamLoader::readIndex() {
                        &prevPageSizeOnDisk);
     }
 
-    if (mVersion > 1) {
+    // A page store has no gaps to reuse: its pages are shared with other
+    // snapshots.
+    if (mVersion > 1 && !nonzero(mIndex.flags & IndexFlags::PageStore)) {
         mGaps = compressed ? GapTracker::Ptr(new GenericGapTracker())
                            : GapTracker::Ptr(new OneSizeGapTracker());
         mGaps->load(stream);
@@ -449,11 +485,18 @@ void RamLoader::readBlockPages(base::Stream* stream,
                 page.sizeOnDisk *= uint32_t(block.ramBlock.pageSize);
                 posDelta *= block.ramBlock.pageSize;
             }
-            if (mVersion == 2) {
+            if (mVersion >= 2) {
                 stream->read(page.hash.data(), page.hash.size());
             }
             runningFilePos += posDelta;
             page.filePos = uint64_t(runningFilePos);
+            if (mVersion >= 4) {
+                page.baseSizeOnDisk = uint32_t(stream->getPackedNum());
+                if (page.baseSizeOnDisk) {
+                    page.baseFilePos = uint64_t(
+                            runningFilePos + stream->getPackedSignedNum());
+                }
+            }
         }
     }
 
@@ -527,17 +570,45 @@ RamLoader::Page& RamLoader::page(void* ptr) {
 }
 
 void RamLoader::readerWorker() {
-    while (auto pagePtr = mReadingQueue.receive()) {
-        Page* page = *pagePtr;
-        if (!page) {
-            mReadDataQueue.send(nullptr);
-            mReadingQueue.stop();
+    std::vector<Page*> batch;
+    std::vector<Page*> readPages;
+    batch.reserve(mReadingQueue.capacity());
+    bool endOfPages = false;
+    while (!endOfPages) {
+        auto pagePtr = mReadingQueue.receive();
+        if (!pagePtr) {
             break;
         }
 
-        if (readDataFromDisk(page)) {
+        // Take everything that's queued already, so neighboring pages can be
+        // read with a single syscall.
+        batch.clear();
+        for (Page* page = *pagePtr;;) {
+            if (!page) {
+                endOfPages = true;
+                break;
+            }
+            batch.push_back(page);
+            if (batch.size() == mReadingQueue.capacity() ||
+                !mReadingQueue.tryReceive(&page)) {
+                break;
+            }
+        }
+        std::sort(batch.begin(), batch.end(),
+                  [](const Page* l, const Page* r) {
+                      return l->filePos < r->filePos;
+                  });
+
+        readPages.clear();
+        readDataFromDisk(batch.data(), batch.size(), &readPages);
+        for (Page* page : readPages) {
             mReadDataQueue.send(page);
         }
+
+        if (endOfPages) {
+            mReadDataQueue.send(nullptr);
+            mReadingQueue.stop();
+        }
     }
 
     mEndTime = base::System::get()->getHighResTimeUs();
@@ -547,6 +618,12 @@ void RamLoader::readerWorker() {
 #endif
 }
 
+static bool needsBackgroundLoad(const RamLoader::Page& page) {
+    auto state = page.state.load(std::memory_order_acquire);
+    return state == uint8_t(RamLoader::State::Empty) ||
+           (state == uint8_t(RamLoader::State::Read) && !page.data);
+}
+
 MemoryAccessWatch::IdleCallbackResult RamLoader::backgroundPageLoad() {
     if (mReadingQueue.isStopped() && mReadDataQueue.isStopped()) {
         return MemoryAccessWatch::IdleCallbackResult::AllDone;
@@ -560,13 +637,24 @@ MemoryAccessWatch::IdleCallbackResult RamLoader::backgroundPageLoad() {
     }
 
     for (int i = 0; i < int(mReadingQueue.capacity()); ++i) {
+        // Pages the guest needed first the last time go before the rest.
+        if (Page* const page = nextPrefetchPage()) {
+            if (page->state.load(std::memory_order_relaxed) ==
+                uint8_t(State::Read)) {
+                ++mPrefetchPos;
+                return fillPageInBackground(page);
+            }
+            if (mReadingQueue.trySend(page)) {
+                ++mPrefetchPos;
+                continue;
+            }
+            return mJoining ? MemoryAccessWatch::IdleCallbackResult::RunAgain
+                            : MemoryAccessWatch::IdleCallbackResult::Wait;
+        }
+
         // Find next page to queue.
-        mBackgroundPageIt = std::find_if(
-                mBackgroundPageIt, mIndex.pages.end(), [](const Page& page) {
-                    auto state = page.state.load(std::memory_order_acquire);
-                    return state == uint8_t(State::Empty) ||
-                           (state == uint8_t(State::Read) && !page.data);
-                });
+        mBackgroundPageIt = std::find_if(mBackgroundPageIt, mIndex.pages.end(),
+                                         needsBackgroundLoad);
 #if SNAPSHOT_PROFILE > 2
         const auto count = int(mBackgroundPageIt - mIndex.pages.begin());
         if ((count % 10000) == 0 || count == int(mIndex.pages.size())) {
@@ -641,6 +729,9 @@ void RamLoader::loadRamPage(void* ptr) {
     }
 
     Page& page = this->page(ptr);
+    if (mRecordingAccesses.load(std::memory_order_relaxed)) {
+        recordAccess(&page);
+    }
     readDataFromDisk(&page, nullptr);
     fillPageData(&page);
 }
@@ -654,6 +745,115 @@ bool RamLoader::readDataFromDisk(Page* pagePtr, uint8_t* preallocatedBuffer) {
         return true;
     }
 
+    if (!claimForReading(&page)) {
+        return false;
+    }
+    return readClaimedPage(&page, preallocatedBuffer, nullptr);
+}
+
+bool RamLoader::readDataFromDisk(Page** pages,
+                                 size_t count,
+                                 std::vector<Page*>* readPages) {
+    std::vector<Page*> run;
+    std::vector<uint8_t> runBuffer;
+    bool res = true;
+
+    size_t i = 0;
+    while (i < count) {
+        // Collect the next run of pages that are back to back in the file.
+        run.clear();
+        size_t runSize = 0;
+        // Uncompressed pages that are contiguous in guest RAM as well get
+        // read in place when loading eagerly.
+        bool intoGuest = !mAccessWatch;
+        for (; i < count; ++i) {
+            Page* const page = pages[i];
+            if (page->sizeOnDisk == 0) {
+                if (readDataFromDisk(page, mAccessWatch ? nullptr
+                                                        : pagePtr(*page)) &&
+                    readPages) {
+                    readPages->push_back(page);
+                }
+                continue;
+            }
+            if (!run.empty()) {
+                const Page& prev = *run.back();
+                if (page->filePos != prev.filePos + prev.sizeOnDisk ||
+                    runSize + page->sizeOnDisk > kMaxReadBatchSize) {
+                    break;
+                }
+            }
+            if (!claimForReading(page)) {
+                continue;
+            }
+            intoGuest = intoGuest && !isCompressed(*page) &&
+                        (run.empty() || pagePtr(*page) == pagePtr(*run.back()) +
+                                                          pageSize(*run.back()));
+            run.push_back(page);
+            runSize += page->sizeOnDisk;
+        }
+
+        if (run.empty()) {
+            continue;
+        }
+
+        const Page& first = *run.front();
+        if (run.size() == 1) {
+            if (!readClaimedPage(run.front(), mAccessWatch ? nullptr
+                                                           : pagePtr(first),
+                                 nullptr)) {
+                res = false;
+                continue;
+            }
+        } else {
+            uint8_t* dest = pagePtr(first);
+            if (!intoGuest) {
+                runBuffer.resize(runSize);
+                dest = runBuffer.data();
+            }
+            auto read = readFromDisk(dest, runSize, int64_t(first.filePos));
+            if (read != int64_t(runSize)) {
+                VERBOSE_PRINT(snapshot,
+                              "Error: (%d) Reading %d pages at %lld from disk "
+                              "returned less data: %d of %d",
+                              errno, int(run.size()),
+                              static_cast<long long>(first.filePos), int(read),
+                              int(runSize));
+                for (Page* page : run) {
+                    page->state.store(uint8_t(State::Error));
+                }
+                mHasError = true;
+                res = false;
+                continue;
+            }
+
+            bool runRead = true;
+            for (Page* page : run) {
+                if (intoGuest) {
+                    page->data = pagePtr(*page);
+                    page->state.store(uint8_t(State::Read),
+                                      std::memory_order_release);
+                } else {
+                    runRead &= readClaimedPage(
+                            page, mAccessWatch ? nullptr : pagePtr(*page),
+                            dest + (page->filePos - first.filePos));
+                }
+            }
+            if (!runRead) {
+                res = false;
+                continue;
+            }
+        }
+
+        if (readPages) {
+            readPages->insert(readPages->end(), run.begin(), run.end());
+        }
+    }
+    return res;
+}
+
+bool RamLoader::claimForReading(Page* pagePtr) {
+    Page& page = *pagePtr;
     auto state = uint8_t(State::Empty);
     if (!page.state.compare_exchange_strong(state, uint8_t(State::Reading),
                                             std::memory_order_acquire)) {
@@ -664,12 +864,25 @@ bool RamLoader::readDataFromDisk(Page* pagePtr, uint8_t* preallocatedBuffer) {
         }
         return false;
     }
+    return true;
+}
+
+bool RamLoader::isCompressed(const Page& page) const {
+    return nonzero(mIndex.flags & IndexFlags::CompressedPages) &&
+           (mVersion == 1 || page.sizeOnDisk < kDefaultPageSize);
+}
+
+bool RamLoader::readClaimedPage(Page* pagePtr,
+                                uint8_t* preallocatedBuffer,
+                                const uint8_t* readData) {
+    Page& page = *pagePtr;
+    if (page.baseSizeOnDisk) {
+        return readDeltaPage(pagePtr, preallocatedBuffer, readData);
+    }
 
     uint8_t compressedBuf[compress::maxCompressedSize(kDefaultPageSize)];
     auto size = page.sizeOnDisk;
-    const bool compressed =
-            nonzero(mIndex.flags & IndexFlags::CompressedPages) &&
-            (mVersion == 1 || page.sizeOnDisk < kDefaultPageSize);
+    const bool compressed = isCompressed(page);
 
     // We need to allocate a dynamic buffer if:
     // - page is compressed and there's a decompressing thread pool
@@ -680,8 +893,12 @@ bool RamLoader::readDataFromDisk(Page* pagePtr, uint8_t* preallocatedBuffer) {
                           !preallocatedBuffer;
     auto buf = allocateBuffer ? new uint8_t[size]
                               : compressed ? compressedBuf : preallocatedBuffer;
-    auto read = HANDLE_EINTR(
-            base::pread(mStreamFd, buf, size, int64_t(page.filePos)));
+    auto read = int64_t(size);
+    if (readData) {
+        memcpy(buf, readData, size);
+    } else {
+        read = readFromDisk(buf, size, int64_t(page.filePos));
+    }
     if (read != int64_t(size)) {
         VERBOSE_PRINT(snapshot,
                       "Error: (%d) Reading page %p from disk returned less "
@@ -707,8 +924,8 @@ bool RamLoader::readDataFromDisk(Page* pagePtr, uint8_t* preallocatedBuffer) {
             auto decompressed = preallocatedBuffer
                                         ? preallocatedBuffer
                                         : new uint8_t[pageSize(page)];
-            if (!Decompressor::decompress(buf, int32_t(size), decompressed,
-                                          int32_t(pageSize(page)))) {
+            if (!mCodec->decompress(buf, int32_t(size), decompressed,
+                                    int32_t(pageSize(page)))) {
                 VERBOSE_PRINT(snapshot,
                               "Error: Decompressing page %p @%llu (%d -> %d) "
                               "failed",
@@ -738,6 +955,66 @@ bool RamLoader::readDataFromDisk(Page* pagePtr, uint8_t* preallocatedBuffer) {
     return true;
 }
 
+int64_t RamLoader::readFromDisk(void* buffer, size_t size, int64_t pos) {
+    // Pages in a page store are all there, only the snapshot's own RAM file
+    // may still be arriving.
+    if (mDataWaiter && mDataFd == mStreamFd &&
+        !mDataWaiter(pos, int64_t(size))) {
+        errno = EIO;
+        return -1;
+    }
+    return HANDLE_EINTR(base::pread(mDataFd, buffer, size, pos));
+}
+
+bool RamLoader::readDeltaPage(Page* pagePtr,
+                              uint8_t* preallocatedBuffer,
+                              const uint8_t* readData) {
+    Page& page = *pagePtr;
+    const auto size = pageSize(page);
+    auto out = preallocatedBuffer ? preallocatedBuffer : new uint8_t[size];
+
+    // Read the base page first, right into the output if it's uncompressed.
+    uint8_t storedBase[compress::maxCompressedSize(kDefaultPageSize)];
+    uint8_t diff[kDefaultPageSize];
+    const bool baseCompressed = page.baseSizeOnDisk < size;
+    bool res = size == kDefaultPageSize &&
+               page.baseSizeOnDisk <= kDefaultPageSize &&
+               page.sizeOnDisk < kDefaultPageSize;
+    if (res) {
+        res = readFromDisk(baseCompressed ? storedBase : out,
+                           page.baseSizeOnDisk,
+                           int64_t(page.baseFilePos)) ==
+                      int64_t(page.baseSizeOnDisk) &&
+              (!baseCompressed ||
+               mCodec->decompress(storedBase, int32_t(page.baseSizeOnDisk),
+                                  out, int32_t(size)));
+    }
+    if (res && !readData) {
+        res = readFromDisk(diff, page.sizeOnDisk, int64_t(page.filePos)) ==
+              int64_t(page.sizeOnDisk);
+        readData = diff;
+    }
+    res = res && delta::apply(readData, int32_t(page.sizeOnDisk), out,
+                              int32_t(size));
+    if (!res) {
+        VERBOSE_PRINT(snapshot,
+                      "Error: Reading delta page %p @%llu (base @%llu) "
+                      "failed",
+                      this->pagePtr(page), (unsigned long long)page.filePos,
+                      (unsigned long long)page.baseFilePos);
+        if (!preallocatedBuffer) {
+            delete[] out;
+        }
+        page.state.store(uint8_t(State::Error));
+        mHasError = true;
+        return false;
+    }
+
+    page.data = out;
+    page.state.store(uint8_t(State::Read), std::memory_order_release);
+    return true;
+}
+
 void RamLoader::fillPageData(Page* pagePtr) {
     Page& page = *pagePtr;
     auto state = uint8_t(State::Read);
@@ -821,11 +1098,9 @@ bool RamLoader::readAllPages() {
 #if SNAPSHOT_PROFILE > 1
     ScopedMemoryProfiler memProf("readingDataFromDisk to decompress finish");
 #endif
-    for (Page* page : sortedPages) {
-        if (!readDataFromDisk(page, pagePtr(*page))) {
-            mHasError = true;
-            return false;
-        }
+    if (!readDataFromDisk(sortedPages.data(), sortedPages.size(), nullptr)) {
+        mHasError = true;
+        return false;
     }
 
     mDecompressor.clear();
@@ -834,7 +1109,7 @@ bool RamLoader::readAllPages() {
 
 void RamLoader::startDecompressor() {
     mDecompressor.emplace([this](Page* page) {
-        const bool res = Decompressor::decompress(
+        const bool res = mCodec->decompress(
                 page->data, int32_t(page->sizeOnDisk), pagePtr(*page),
                 int32_t(pageSize(*page)));
         delete[] page->data;
@@ -850,5 +1125,91 @@ void RamLoader::startDecompressor() {
     }
 }
 
+void RamLoader::loadPrefetchOrder() {
+    if (!mPrevAccessTrace.load(mAccessTracePath)) {
+        return;
+    }
+
+    std::vector<int> blockMap;
+    for (const auto& name : mPrevAccessTrace.blocks()) {
+        const auto blockIt = std::find_if(
+                mIndex.blocks.begin(), mIndex.blocks.end(),
+                [&name](const FileIndex::Block& b) {
+                    return name == b.ramBlock.id;
+                });
+        blockMap.push_back(blockIt == mIndex.blocks.end()
+                                   ? -1
+                                   : int(blockIt - mIndex.blocks.begin()));
+    }
+
+    mPrefetchPages.reserve(mPrevAccessTrace.pages().size());
+    for (const auto& entry : mPrevAccessTrace.pages()) {
+        const int blockIndex = blockMap[entry.block];
+        if (blockIndex < 0) {
+            continue;
+        }
+        const FileIndex::Block& block = mIndex.blocks[size_t(blockIndex)];
+        if (entry.page < uint32_t(block.pagesEnd - block.pagesBegin)) {
+            mPrefetchPages.push_back(&*(block.pagesBegin + entry.page));
+        }
+    }
+    VERBOSE_PRINT(snapshot, "Prefetching %d RAM pages in recorded order",
+                  int(mPrefetchPages.size()));
+}
+
+RamLoader::Page* RamLoader::nextPrefetchPage() {
+    while (mPrefetchPos < mPrefetchPages.size()) {
+        Page* const page = mPrefetchPages[mPrefetchPos];
+        if (needsBackgroundLoad(*page)) {
+            return page;
+        }
+        ++mPrefetchPos;
+    }
+    return nullptr;
+}
+
+void RamLoader::recordAccess(Page* page) {
+    if (page->sizeOnDisk == 0) {
+        // Zero pages cost nothing to load.
+        return;
+    }
+    if (base::System::get()->getHighResTimeUs() > mRecordingEndTime) {
+        mRecordingAccesses.store(false, std::memory_order_relaxed);
+        return;
+    }
+    base::AutoLock lock(mAccessedPagesLock);
+    mAccessedPages.push_back(page);
+}
+
+void RamLoader::saveAccessTrace() {
+    if (mAccessTracePath.empty() || !mOnDemandEnabled) {
+        return;
+    }
+    mRecordingAccesses = false;
+
+    std::vector<std::string> blockNames;
+    blockNames.reserve(mIndex.blocks.size());
+    for (const auto& block : mIndex.blocks) {
+        blockNames.emplace_back(block.ramBlock.id);
+    }
+    PageAccessTrace trace(std::move(blockNames));
+    {
+        base::AutoLock lock(mAccessedPagesLock);
+        for (const Page* page : mAccessedPages) {
+            const auto& block = mIndex.blocks[page->blockIndex];
+            trace.add(page->blockIndex,
+                      uint32_t(page - &*block.pagesBegin));
+        }
+        decltype(mAccessedPages)().swap(mAccessedPages);
+    }
+    trace.merge(mPrevAccessTrace);
+
+    if (!trace.empty() && !trace.save(mAccessTracePath)) {
+        dwarning("Failed to save RAM access trace to '%s'",
+                 mAccessTracePath.c_str());
+    }
+    mAccessTracePath.clear();
+}
+
 }  // namespace snapshot
 }  // namespace android
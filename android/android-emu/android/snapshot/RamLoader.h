@@ -15,17 +15,21 @@
 #include "android/base/EnumFlags.h"
 #include "android/base/Optional.h"
 #include "android/base/files/StdioStream.h"
+#include "android/base/synchronization/Lock.h"
 #include "android/base/synchronization/MessageChannel.h"
 #include "android/base/system/System.h"
 #include "android/base/threads/FunctorThread.h"
 #include "android/base/threads/ThreadPool.h"
+#include "android/snapshot/Compressor.h"
 #include "android/snapshot/GapTracker.h"
 #include "android/snapshot/MemoryWatch.h"
+#include "android/snapshot/PageAccessTrace.h"
 #include "android/snapshot/common.h"
 
 #include <array>
 #include <atomic>
 #include <cstdint>
+#include <functional>
 #include <string>
 #include <utility>
 #include <vector>
@@ -84,6 +88,17 @@ public:
 
     void loadRam(void* ptr, uint64_t size);
     void registerBlock(const RamBlock& block);
+    // Prefetch pages in the order the guest needed them after the previous
+    // lazy load, and record the order for this one into the same |path|.
+    // Call before start(); does nothing unless loading on demand.
+    void setAccessTracePath(std::string path) {
+        mAccessTracePath = std::move(path);
+    }
+
+    // Called before reading [pos, pos + size) of the RAM file, for files
+    // that are still arriving; returns false if that data never will.
+    using DataWaiter = std::function<bool(int64_t pos, int64_t size)>;
+    void setDataWaiter(DataWaiter waiter) { mDataWaiter = std::move(waiter); }
     bool start(bool isQuickboot);
     bool wasStarted() const { return mWasStarted; }
     void join();
@@ -103,6 +118,7 @@ public:
     }
     uint64_t diskSize() const { return mDiskSize; }
     int version() const { return mVersion; }
+    const compress::CodecPtr& codec() const { return mCodec; }
     uint64_t indexOffset() const { return mIndexPos; }
 
     const Page* findPage(int blockIndex, const char* id, int pageIndex) const;
@@ -142,6 +158,22 @@ private:
 
     void loadRamPage(void* ptr);
     bool readDataFromDisk(Page* pagePtr, uint8_t* preallocatedBuffer = nullptr);
+    // Reads |pages|, sorted by file position, coalescing the ones that are
+    // consecutive in the file into a single read. Adds the pages this call
+    // has read to |readPages|.
+    bool readDataFromDisk(Page** pages,
+                          size_t count,
+                          std::vector<Page*>* readPages);
+    bool claimForReading(Page* page);
+    bool isCompressed(const Page& page) const;
+    // |readData| has the page's bytes if they were read from disk already.
+    bool readClaimedPage(Page* page,
+                         uint8_t* preallocatedBuffer,
+                         const uint8_t* readData);
+    int64_t readFromDisk(void* buffer, size_t size, int64_t pos);
+    bool readDeltaPage(Page* page,
+                       uint8_t* preallocatedBuffer,
+                       const uint8_t* readData);
     void fillPageData(Page* pagePtr);
 
     void readerWorker();
@@ -152,8 +184,17 @@ private:
     bool readAllPages();
     void startDecompressor();
 
+    void loadPrefetchOrder();
+    Page* nextPrefetchPage();
+    void recordAccess(Page* page);
+    void saveAccessTrace();
+
     base::StdioStream mStream;
     int mStreamFd;  // An FD for the |mStream|'s underlying open file.
+    // Page data lives in a shared page store instead of |mStream| when the
+    // index has IndexFlags::PageStore set.
+    base::StdioStream mPageStoreStream;
+    int mDataFd = -1;  // An FD to read the page data from.
     bool mWasStarted = false;
     std::atomic<bool> mHasError{false};
 
@@ -168,11 +209,22 @@ private:
 
     base::Optional<base::ThreadPool<Page*>> mDecompressor;
 
+    std::string mAccessTracePath;
+    DataWaiter mDataWaiter;
+    PageAccessTrace mPrevAccessTrace;
+    std::vector<Page*> mPrefetchPages;
+    size_t mPrefetchPos = 0;
+    std::atomic<bool> mRecordingAccesses{false};
+    base::System::Duration mRecordingEndTime = 0;
+    base::Lock mAccessedPagesLock;
+    std::vector<Page*> mAccessedPages;
+
     FileIndex mIndex;
     GapTracker::Ptr mGaps;
     uint64_t mDiskSize = 0;
     uint64_t mIndexPos = 0;
     int mVersion = 0;
+    compress::CodecPtr mCodec = compress::Codec::lz4();
 
     base::System::Duration mStartTime = 0;
     base::System::Duration mEndTime = 0;
@@ -206,6 +258,9 @@ struct RamLoader::Page {
     uint16_t blockIndex;
     uint32_t sizeOnDisk;
     uint64_t filePos;
+    // Delta pages are a diff against the full page here; size 0 otherwise.
+    uint32_t baseSizeOnDisk = 0;
+    uint64_t baseFilePos = 0;
     std::array<char, 16> hash;
     uint8_t* data;
 
@@ -216,6 +271,8 @@ struct RamLoader::Page {
           blockIndex(other.blockIndex),
           sizeOnDisk(other.sizeOnDisk),
           filePos(other.filePos),
+          baseSizeOnDisk(other.baseSizeOnDisk),
+          baseFilePos(other.baseFilePos),
           data(other.data) {}
 
     Page& operator=(Page&& other) {
@@ -224,6 +281,8 @@ struct RamLoader::Page {
         blockIndex = other.blockIndex;
         sizeOnDisk = other.sizeOnDisk;
         filePos = other.filePos;
+        baseSizeOnDisk = other.baseSizeOnDisk;
+        baseFilePos = other.baseFilePos;
         data = other.data;
         return *this;
     }
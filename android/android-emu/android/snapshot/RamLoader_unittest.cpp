@@ -16,6 +16,7 @@
 #include "android/base/misc/FileUtils.h"
 #include "android/base/system/System.h"
 #include "android/base/testing/TestTempDir.h"
+#include "android/snapshot/PageAccessTrace.h"
 #include "android/snapshot/RamSnapshotTesting.h"
 
 #include <gtest/gtest.h>
@@ -57,5 +58,49 @@ protected:
 //                        path);
 // }
 
+TEST_F(RamLoaderTest, AccessTraceRoundTrip) {
+    const auto path = mTempDir->makeSubPath("ram_access.bin");
+
+    PageAccessTrace trace({"pc.ram", "vga.vram"});
+    trace.add(0, 42);
+    trace.add(1, 7);
+    trace.add(0, 42);
+    trace.add(0, 3);
+    ASSERT_TRUE(trace.save(path));
+
+    PageAccessTrace loaded;
+    ASSERT_TRUE(loaded.load(path));
+    EXPECT_EQ(trace.blocks(), loaded.blocks());
+    ASSERT_EQ(3U, loaded.pages().size());
+    EXPECT_EQ(0, loaded.pages()[0].block);
+    EXPECT_EQ(42U, loaded.pages()[0].page);
+    EXPECT_EQ(1, loaded.pages()[1].block);
+    EXPECT_EQ(7U, loaded.pages()[1].page);
+    EXPECT_EQ(3U, loaded.pages()[2].page);
+
+    EXPECT_FALSE(loaded.load(mTempDir->makeSubPath("missing.bin")));
+    EXPECT_TRUE(loaded.empty());
+}
+
+TEST_F(RamLoaderTest, AccessTraceMergeKeepsNewOrderFirst) {
+    PageAccessTrace older({"vga.vram", "pc.ram"});
+    older.add(1, 1);
+    older.add(0, 5);
+    older.add(1, 2);
+
+    PageAccessTrace newer({"pc.ram"});
+    newer.add(0, 2);
+    newer.merge(older);
+
+    ASSERT_EQ(2U, newer.blocks().size());
+    EXPECT_EQ("vga.vram", newer.blocks()[1]);
+    ASSERT_EQ(3U, newer.pages().size());
+    EXPECT_EQ(2U, newer.pages()[0].page);
+    EXPECT_EQ(0, newer.pages()[1].block);
+    EXPECT_EQ(1U, newer.pages()[1].page);
+    EXPECT_EQ(1, newer.pages()[2].block);
+    EXPECT_EQ(5U, newer.pages()[2].page);
+}
+
 }  // namespace snapshot
 }  // namespace android
@@ -23,6 +23,8 @@
 #include "android/base/misc/FileUtils.h"
 #include "android/base/system/System.h"
 #include "android/snapshot/MemoryWatch.h"
+#include "android/snapshot/PageDelta.h"
+#include "android/snapshot/PathUtils.h"
 #include "android/snapshot/RamLoader.h"
 #include "android/utils/debug.h"
 
@@ -60,8 +62,17 @@ void RamSaver::FileIndex::clear() {
 RamSaver::RamSaver(const std::string& fileName,
                    Flags preferredFlags,
                    RamLoader* loader,
-                   bool isOnExit)
-    : mStream(nullptr) {
+                   bool isOnExit,
+                   compress::CodecPtr codec,
+                   PageStore::Ptr pageStore)
+    : mStream(nullptr),
+      mCodec(std::move(codec)),
+      mPageStore(std::move(pageStore)) {
+    assert(!loader || !mPageStore);
+    if (mPageStore) {
+        mPageStore->startWriting();
+        mPageRefsFile = PageStore::refsPath(fileName);
+    }
     bool incremental = false;
     if (loader) {
         // check if we're ok to proceed with incremental saving
@@ -93,6 +104,14 @@ RamSaver::RamSaver(const std::string& fileName,
             mFlags |= RamSaver::Flags::Async;
         }
 
+        mCodec = loader->codec();
+        // Pages of a snapshot with deltas may still reference their bases.
+        mDeltaPages = loader->compressed() &&
+                      (nonzero(preferredFlags & RamSaver::Flags::DeltaPages) ||
+                       loader->version() > 3);
+        if (mDeltaPages) {
+            mIndex.version = 4;
+        }
         mLoader = loader;
         mLoaderOnDemand = loader->onDemandEnabled();
         mStream = base::StdioStream(
@@ -127,8 +146,20 @@ RamSaver::RamSaver(const std::string& fileName,
         mIndex.flags |= int32_t(FileIndex::Flags::SeparateBackingStore);
     }
 
+    if (mPageStore) {
+        // Pages from different snapshots can only be shared if they are
+        // stored as-is.
+        mFlags &= ~Flags::Compress;
+        mIndex.flags |= int32_t(FileIndex::Flags::PageStore);
+        mIndex.version = 3;
+    }
+
     if (nonzero(mFlags & Flags::Compress)) {
         mIndex.flags |= int32_t(FileIndex::Flags::CompressedPages);
+        if (mCodec->type() != compress::Codec::Type::Lz4) {
+            // Older loaders only know LZ4, make sure they reject the file.
+            mIndex.version = 3;
+        }
 
         auto compressBuffers = new CompressBuffer[kCompressBufferCount];
         mCompressBufferMemory.reset(compressBuffers);
@@ -149,6 +180,19 @@ RamSaver::RamSaver(const std::string& fileName,
         mHasError = true;
         return;
     }
+    mHashers.emplace(std::min(compress::workerCount(),
+                              IncrementalStats::kMaxWorkers),
+                     [this](HashShard&& shard) {
+                         processHashShard(shard);
+                         base::AutoLock lock(mHashShardLock);
+                         if (--mHashShardsPending == 0) {
+                             mHashShardCv.signalAndUnlock(&lock);
+                         }
+                     });
+    if (!mHashers->start()) {
+        // Not fatal: zero checks and hashing will just run inline.
+        mHashers.clear();
+    }
     mWriter.emplace([this](WriteInfo&& wi) {
         if (wi.blockIndex == -1) {
             return base::WorkerProcessingResult::Stop;
@@ -160,6 +204,20 @@ RamSaver::RamSaver(const std::string& fileName,
         mHasError = true;
         return;
     }
+
+    if (copyOnWrite()) {
+        mWriteWatch.emplace([this](void* ptr) { onGuestWrite(ptr); });
+        if (mWriteWatch->valid()) {
+            mWriteWatch->start();
+            mCowThread.emplace([this] { saveInBackground(); });
+        } else {
+            VERBOSE_PRINT(snapshot,
+                          "Copy-on-write RAM saving is unavailable, saving "
+                          "synchronously");
+            mWriteWatch.clear();
+            mFlags &= ~Flags::CopyOnWrite;
+        }
+    }
 }
 
 RamSaver::~RamSaver() {
@@ -168,6 +226,11 @@ RamSaver::~RamSaver() {
 }
 
 void RamSaver::registerBlock(const RamBlock& block) {
+    if (mPageStore && block.pageSize != PageStore::kPageSize) {
+        derror("Snapshot page store can't hold %d-byte pages of '%s'",
+               int(block.pageSize), block.id);
+        mHasError = true;
+    }
     mIndex.blocks.push_back({block, {}});
 }
 
@@ -217,217 +280,223 @@ void RamSaver::savePage(int64_t blockOffset,
         return;
     }
 
-    if (block.pages.empty()) {
-        // First time we see a page for this block - save all its pages now.
-        auto& ramBlock = block.ramBlock;
+    if (!block.pages.empty()) {
+        return;
+    }
 
-        // bug: 113126623
-        // TODO: Figure out how to deal with pages sizes != 4k
-        ramBlock.pageSize = kDefaultPageSize;
+    // First time we see a page for this block - save all its pages now.
+    auto& ramBlock = block.ramBlock;
 
-        assert(ramBlock.totalSize % ramBlock.pageSize == 0);
-        auto numPages = int32_t(ramBlock.totalSize / ramBlock.pageSize);
-        mIndex.blocks[size_t(mLastBlockIndex)].pages.resize(size_t(numPages));
-        mIndex.totalPages += numPages;
+    // bug: 113126623
+    // TODO: Figure out how to deal with pages sizes != 4k
+    ramBlock.pageSize = kDefaultPageSize;
 
-        // Short-circuit the fastest cases right here.
+    assert(ramBlock.totalSize % ramBlock.pageSize == 0);
+    auto numPages = int32_t(ramBlock.totalSize / ramBlock.pageSize);
+    block.pages.resize(size_t(numPages));
+    mIndex.totalPages += numPages;
 
-        // Stats counting vars (for speed, avoid atomic ops)
-        int totalZero = 0;
-        int changedTotal = 0;
-        int samePage = 0;
-        int notLoadedPage = 0;
-        int stillZero = 0;
-        int sameHash = 0;
+    if (copyOnWrite() && protectBlock(mLastBlockIndex)) {
+        // The pages are saved in the background after the guest resumes.
+        mCowPendingBlocks.push_back(mLastBlockIndex);
+        return;
+    }
 
-        mIncStats.countMultiple(StatAction::TotalPages, numPages);
+    saveBlock(mLastBlockIndex);
+}
 
-        mIncStats.measure(StatTime::ZeroCheck, [&] {
+void RamSaver::saveBlock(int blockIndex) {
+    auto& block = mIndex.blocks[size_t(blockIndex)];
+    const auto numPages = int32_t(block.pages.size());
 
-            // Hint that we will access sequentially.
-            android::base::memoryHint(
-                block.ramBlock.hostPtr,
-                numPages * block.ramBlock.pageSize,
-                MemoryHint::Sequential);
+    // Short-circuit the fastest cases right here.
 
-            // Initialize Pages and check for all-zero pages.
-            uint8_t* zeroCheckPtr = block.ramBlock.hostPtr;
+    // Stats counting vars (for speed, avoid atomic ops)
+    int totalZero = 0;
+    int changedTotal = 0;
+    int samePage = 0;
+    int notLoadedPage = 0;
+    int stillZero = 0;
+    int sameHash = 0;
 
-            {
+    mIncStats.countMultiple(StatAction::TotalPages, numPages);
 
-                // RAM decommit: when checking for zero pages or hashing, we need to make sure
-                // that the memory does not become resident, or useful memory might
-                // get paged out and the save itself will have to compete with
-                // paging out, which can slow things down.
-                //
-                // Track continguous 16mb ranges to decommit.  This is so that zero
-                // check causes extra RAM to be resident only up to 16 mb, while
-                // avoiding issuing frequent system calls.
+    mIncStats.measure(StatTime::ZeroCheck, [&] {
 
-                // Zero pages can actually be zeroed out and MADV_FREE'ed.
-                ContiguousRangeMapper zeroPageDeleter([](uintptr_t start, uintptr_t size) {
-                    android::base::memoryHint((void*)start, size, MemoryHint::DontNeed);
-                }, kDecommitChunkSize);
+        // Hint that we will access sequentially.
+        android::base::memoryHint(
+            block.ramBlock.hostPtr,
+            numPages * block.ramBlock.pageSize,
+            MemoryHint::Sequential);
 
+        // Initialize Pages and check for all-zero pages, sharded
+        // across the hashing workers.
 #if SNAPSHOT_PROFILE > 1
-                ScopedMemoryProfiler mem("zeroCheck");
+        ScopedMemoryProfiler mem("zeroCheck");
 #endif
+        runHashShards(blockIndex, numPages,
+                      HashShard::Phase::ZeroCheck);
+        for (int32_t shardZeroPages : mHashShardZeroPages) {
+            totalZero += shardZeroPages;
+        }
 
-                for (int32_t i = 0; i < numPages;
-                     ++i,
-                     zeroCheckPtr += (uintptr_t)block.ramBlock.pageSize) {
+        changedTotal = totalZero;
 
-                    bool isZero = isBufferZeroed(zeroCheckPtr,
-                                                 block.ramBlock.pageSize);
+        // Initialize the incremental save case
+        if (mLoader) {
 
+            // Check for not-yet-loaded pages if we are doing
+            // on-demand RAM loading
+            if (mLoaderOnDemand) {
+                for (int32_t i = 0; i < numPages; ++i) {
                     auto& page = block.pages[size_t(i)];
-                    page.same = false;
-                    page.hashFilled = false;
-                    page.filePos = 0;
-                    page.loaderPage = nullptr;
-
-                    // Don't branch for the isZero decision
-                    page.sizeOnDisk = kDefaultPageSize * !isZero;
-                    totalZero += isZero;
-
-                    // Decommit or free in chunks of 16 mb.
-                    if (page.sizeOnDisk == 0) {
-                        zeroPageDeleter.add((uintptr_t)zeroCheckPtr, block.ramBlock.pageSize);
-                    }
-                }
-            }
-
-            changedTotal = totalZero;
-
-            // Initialize the incremental save case
-            if (mLoader) {
-
-                // Check for not-yet-loaded pages if we are doing
-                // on-demand RAM loading
-                if (mLoaderOnDemand) {
-                    for (int32_t i = 0; i < numPages; ++i) {
-                        auto& page = block.pages[size_t(i)];
-                        // Find all corresponding loader pages
-                        page.loaderPage =
-                            mLoader->findPage(mLastBlockIndex, block.ramBlock.id, i);
-                        auto loaderPage = page.loaderPage;
-                        if (loaderPage &&
-                            loaderPage->state.load(std::memory_order_relaxed) <
-                            int(RamLoader::State::Filled)) {
-                            // not loaded yet: definitely not changed
-                            samePage++;
-                            notLoadedPage++;
-                            page.same = true;
-                            page.filePos = loaderPage->filePos;
-                            page.sizeOnDisk = loaderPage->sizeOnDisk;
-                            if (page.sizeOnDisk) {
-                                page.hash = loaderPage->hash;
-                                page.hashFilled = true;
-                            }
+                    // Find all corresponding loader pages
+                    page.loaderPage =
+                        mLoader->findPage(blockIndex, block.ramBlock.id, i);
+                    auto loaderPage = page.loaderPage;
+                    if (loaderPage &&
+                        loaderPage->state.load(std::memory_order_relaxed) <
+                        int(RamLoader::State::Filled)) {
+                        // not loaded yet: definitely not changed
+                        samePage++;
+                        notLoadedPage++;
+                        page.same = true;
+                        page.filePos = loaderPage->filePos;
+                        page.sizeOnDisk = loaderPage->sizeOnDisk;
+                        page.baseFilePos = loaderPage->baseFilePos;
+                        page.baseSizeOnDisk = loaderPage->baseSizeOnDisk;
+                        if (page.sizeOnDisk) {
+                            page.hash = loaderPage->hash;
+                            page.hashFilled = true;
                         }
                     }
+                }
 
-                } else {
-                    // Find all corresponding loader pages
-                    for (int32_t i = 0; i < numPages; ++i) {
-                        auto& page = block.pages[size_t(i)];
-                        page.loaderPage =
-                            mLoader->findPage(mLastBlockIndex, block.ramBlock.id, i);
-                    }
+            } else {
+                // Find all corresponding loader pages
+                for (int32_t i = 0; i < numPages; ++i) {
+                    auto& page = block.pages[size_t(i)];
+                    page.loaderPage =
+                        mLoader->findPage(blockIndex, block.ramBlock.id, i);
                 }
             }
-        });
+        }
+    });
 
-        // Calculate all hashes and if applicable, compare with previous
-        // snapshot, computing all changed nonzero pages
-        mIncStats.measure(StatTime::Hashing, [&] {
+    // Calculate all hashes and if applicable, compare with previous
+    // snapshot, computing all changed nonzero pages
+    mIncStats.measure(StatTime::Hashing, [&] {
 
 #if SNAPSHOT_PROFILE > 1
-            ScopedMemoryProfiler mem("hashing");
+        ScopedMemoryProfiler mem("hashing");
 #endif
 
-            uint8_t* hashPtr = block.ramBlock.hostPtr;
-            for (int32_t i = 0; i < numPages; ++i,
-                 hashPtr += (uintptr_t)block.ramBlock.pageSize) {
-                auto& page = block.pages[size_t(i)];
-                if (page.sizeOnDisk && !page.hashFilled) {
-                    calcHash(page, block, hashPtr);
-                }
-            }
-
+        runHashShards(blockIndex, numPages, HashShard::Phase::Hashing);
 
-            // Comparison with previous snapshot
-            if (mLoader) {
-                mIncStats.measure(StatTime::Hashing, [&] {
+        // Comparison with previous snapshot
+        if (mLoader) {
+            mIncStats.measure(StatTime::Hashing, [&] {
 
-                for (int32_t i = 0; i < numPages; ++i) {
-                    auto& page = block.pages[size_t(i)];
-                    auto loaderPage = page.loaderPage;
-                    if (loaderPage && loaderPage->zeroed() && !page.sizeOnDisk) {
-                        ++stillZero;
-                        page.same = true;
-                        page.sizeOnDisk = 0;
-                    } else if (page.hash == loaderPage->hash) {
-                        ++sameHash;
-                        page.same = true;
-                        page.filePos = loaderPage->filePos;
-                        page.sizeOnDisk = loaderPage->sizeOnDisk;
-                    }
-                }
-
-                // Don't count stillZero pages in the total changed pages set.
-                changedTotal -= stillZero;
-
-                });
-            }
-
-            // These are the pages that will actually be written to disk;
-            // the nonzero and changed pages.
             for (int32_t i = 0; i < numPages; ++i) {
                 auto& page = block.pages[size_t(i)];
-                if (!page.same && page.sizeOnDisk) {
-                    block.nonzeroChangedPages.push_back(i);
+                auto loaderPage = page.loaderPage;
+                if (loaderPage && loaderPage->zeroed() && !page.sizeOnDisk) {
+                    ++stillZero;
+                    page.same = true;
+                    page.sizeOnDisk = 0;
+                } else if (page.hash == loaderPage->hash) {
+                    ++sameHash;
+                    page.same = true;
+                    page.filePos = loaderPage->filePos;
+                    page.sizeOnDisk = loaderPage->sizeOnDisk;
+                    page.baseFilePos = loaderPage->baseFilePos;
+                    page.baseSizeOnDisk = loaderPage->baseSizeOnDisk;
                 }
             }
 
-            changedTotal += block.nonzeroChangedPages.size();
+            // Don't count stillZero pages in the total changed pages set.
+            changedTotal -= stillZero;
 
-        });
+            });
+        }
 
-        // Pass them to the save handler in chunks of kCompressBufferBatchSize.
-        int32_t start = 0;
-        int32_t end = 0;
-        for (int32_t i = 0; i < block.nonzeroChangedPages.size(); ++i) {
-            if (i == block.nonzeroChangedPages.size() - 1 ||
-                (i - start + 1) == kCompressBufferBatchSize) {
-                end = i + 1;
-                passToSaveHandler({mLastBlockIndex, start, end});
-                start = end;
+        // These are the pages that will actually be written to disk;
+        // the nonzero and changed pages.
+        // The rest is saved already, the guest may write there freely.
+        for (int32_t i = 0; i < numPages; ++i) {
+            auto& page = block.pages[size_t(i)];
+            if (!page.same && page.sizeOnDisk) {
+                block.nonzeroChangedPages.push_back(i);
+            } else {
+                markPageSaved(blockIndex, i);
             }
         }
 
-        // Record most stats right here.
-        mIncStats.countMultiple(StatAction::SamePage, samePage);
-        mIncStats.countMultiple(StatAction::NotLoadedPage, notLoadedPage);
-        mIncStats.countMultiple(StatAction::ChangedPage, changedTotal);
-        mIncStats.countMultiple(StatAction::StillZeroPage, stillZero);
-        mIncStats.countMultiple(StatAction::NewZeroPage, totalZero - stillZero);
-        mIncStats.countMultiple(StatAction::SameHashPage, sameHash);
-        mIncStats.countMultiple(StatAction::SamePage, sameHash + stillZero);
+        changedTotal += block.nonzeroChangedPages.size();
+
+    });
+
+    // Pass them to the save handler in chunks of kCompressBufferBatchSize.
+    int32_t start = 0;
+    int32_t end = 0;
+    for (int32_t i = 0; i < block.nonzeroChangedPages.size(); ++i) {
+        if (i == block.nonzeroChangedPages.size() - 1 ||
+            (i - start + 1) == kCompressBufferBatchSize) {
+            end = i + 1;
+            passToSaveHandler({blockIndex, start, end});
+            start = end;
+        }
     }
+
+    // Record most stats right here.
+    mIncStats.countMultiple(StatAction::SamePage, samePage);
+    mIncStats.countMultiple(StatAction::NotLoadedPage, notLoadedPage);
+    mIncStats.countMultiple(StatAction::ChangedPage, changedTotal);
+    mIncStats.countMultiple(StatAction::StillZeroPage, stillZero);
+    mIncStats.countMultiple(StatAction::NewZeroPage, totalZero - stillZero);
+    mIncStats.countMultiple(StatAction::SameHashPage, sameHash);
+    mIncStats.countMultiple(StatAction::SamePage, sameHash + stillZero);
 }
 
 void RamSaver::complete() {
+    mHashers.clear();
     mWorkers->done();
 }
 
 static constexpr int kStopMarkerIndex = -1;
 
+void RamSaver::continueInBackground() {
+    if (!mCowThread || mCowStarted) {
+        return;
+    }
+    mCowStarted = true;
+    if (!mCowThread->start()) {
+        // Can't leave it for later, finish the save right here.
+        saveInBackground();
+    }
+}
+
+void RamSaver::onBackgroundSaveDone(std::function<void()> func) {
+    {
+        base::AutoLock lock(mCowDoneLock);
+        if (mCowThread && !mCowDone) {
+            mOnCowDone = std::move(func);
+            return;
+        }
+    }
+    func();
+}
+
 void RamSaver::join() {
     if (mJoined) {
         return;
     }
-    passToSaveHandler({kStopMarkerIndex, 0});
+    if (mCowThread) {
+        continueInBackground();
+        mCowThread->wait();
+    } else {
+        passToSaveHandler({kStopMarkerIndex, 0});
+    }
     mJoined = true;
 }
 
@@ -436,6 +505,149 @@ void RamSaver::cancel() {
     join();
 }
 
+bool RamSaver::protectBlock(int blockIndex) {
+    if (!mWriteWatch) {
+        return false;
+    }
+
+    // All blocks are registered by now, and the vector must not be resized
+    // after the first range is protected as onGuestWrite() reads it.
+    if (mCowBlocks.empty()) {
+        mCowBlocks.resize(mIndex.blocks.size());
+    }
+
+    const auto& block = mIndex.blocks[size_t(blockIndex)];
+    const auto numPages = block.pages.size();
+    auto& cow = mCowBlocks[size_t(blockIndex)];
+    cow.pageStates.reset(new std::atomic<int32_t>[numPages]());
+    cow.pageCopies.reset(new std::unique_ptr<uint8_t[]>[numPages]);
+
+    if (!mWriteWatch->protectRange(block.ramBlock.hostPtr,
+                                   block.ramBlock.totalSize)) {
+        cow = CowBlock();
+        return false;
+    }
+    return true;
+}
+
+void RamSaver::onGuestWrite(void* ptr) {
+    auto pagePtr = reinterpret_cast<uint8_t*>(
+            uintptr_t(ptr) & ~uintptr_t(kDefaultPageSize - 1));
+
+    for (size_t i = 0; i < mCowBlocks.size(); ++i) {
+        auto& cow = mCowBlocks[i];
+        const auto& ramBlock = mIndex.blocks[i].ramBlock;
+        if (!cow.pageStates || pagePtr < ramBlock.hostPtr ||
+            pagePtr >= ramBlock.hostPtr + ramBlock.totalSize) {
+            continue;
+        }
+
+        const auto pageIndex =
+                size_t((pagePtr - ramBlock.hostPtr) / ramBlock.pageSize);
+        auto& state = cow.pageStates[pageIndex];
+        for (;;) {
+            int32_t readers = 0;
+            if (state.compare_exchange_weak(readers, CowBlock::kCopying,
+                                            std::memory_order_acquire)) {
+                auto copy = new uint8_t[size_t(ramBlock.pageSize)];
+                memcpy(copy, pagePtr, size_t(ramBlock.pageSize));
+                cow.pageCopies[pageIndex].reset(copy);
+                state.store(CowBlock::kCopied, std::memory_order_release);
+                break;
+            }
+            if (readers == CowBlock::kCopied || readers == CowBlock::kSaved) {
+                break;
+            }
+            // Someone's reading the original page, let them finish.
+            base::Thread::yield();
+        }
+        break;
+    }
+
+    mWriteWatch->unprotect(pagePtr, kDefaultPageSize);
+}
+
+void RamSaver::saveInBackground() {
+    for (int blockIndex : mCowPendingBlocks) {
+        if (mCanceled.load(std::memory_order_acquire)) {
+            break;
+        }
+        saveBlock(blockIndex);
+    }
+    passToSaveHandler({kStopMarkerIndex, 0});
+
+    // Nothing reads the guest RAM anymore, let it run unobstructed.
+    mWriteWatch.clear();
+    decltype(mCowBlocks)().swap(mCowBlocks);
+
+    std::function<void()> onDone;
+    {
+        base::AutoLock lock(mCowDoneLock);
+        mCowDone = true;
+        onDone = std::move(mOnCowDone);
+    }
+    if (onDone) {
+        onDone();
+    }
+}
+
+template <class Func>
+void RamSaver::withGuestPage(int blockIndex, int32_t pageIndex, Func&& func) {
+    const auto& ramBlock = mIndex.blocks[size_t(blockIndex)].ramBlock;
+    const uint8_t* hostPage =
+            ramBlock.hostPtr + int64_t(pageIndex) * ramBlock.pageSize;
+    if (mCowBlocks.empty() || !mCowBlocks[size_t(blockIndex)].pageStates) {
+        func(hostPage);
+        return;
+    }
+
+    auto& cow = mCowBlocks[size_t(blockIndex)];
+    auto& state = cow.pageStates[size_t(pageIndex)];
+    for (;;) {
+        int32_t readers = state.load(std::memory_order_acquire);
+        // Nothing reads a page after it's saved.
+        assert(readers != CowBlock::kSaved);
+        if (readers == CowBlock::kCopied) {
+            func(cow.pageCopies[size_t(pageIndex)].get());
+            return;
+        }
+        if (readers >= 0 &&
+            state.compare_exchange_weak(readers, readers + 1,
+                                        std::memory_order_acquire)) {
+            break;
+        }
+        base::Thread::yield();
+    }
+
+    // The page is still write-protected, and onGuestWrite() won't let the
+    // guest in until all readers are gone.
+    func(hostPage);
+    state.fetch_sub(1, std::memory_order_release);
+}
+
+void RamSaver::markPageSaved(int blockIndex, int32_t pageIndex) {
+    if (mCowBlocks.empty() || !mCowBlocks[size_t(blockIndex)].pageStates) {
+        return;
+    }
+
+    auto& cow = mCowBlocks[size_t(blockIndex)];
+    auto& state = cow.pageStates[size_t(pageIndex)];
+    for (;;) {
+        int32_t readers = 0;
+        if (state.compare_exchange_weak(readers, CowBlock::kSaved,
+                                        std::memory_order_acq_rel)) {
+            return;
+        }
+        if (readers == CowBlock::kCopied) {
+            state.store(CowBlock::kSaved, std::memory_order_release);
+            cow.pageCopies[size_t(pageIndex)].reset();
+            return;
+        }
+        // The guest is copying the page out right now.
+        base::Thread::yield();
+    }
+}
+
 void RamSaver::calcHash(FileIndex::Block::Page& page,
                         const FileIndex::Block& block,
                         const void* ptr) {
@@ -443,6 +655,114 @@ void RamSaver::calcHash(FileIndex::Block::Page& page,
     page.hashFilled = true;
 }
 
+void RamSaver::runHashShards(int blockIndex,
+                             int32_t numPages,
+                             HashShard::Phase phase) {
+    mHashShardZeroPages.fill(0);
+
+    const int shards =
+            mHashers ? std::max(1, std::min(mHashers->numWorkers(),
+                                            numPages / kMinPagesPerHashShard))
+                     : 1;
+    if (shards == 1) {
+        processHashShard({blockIndex, 0, 0, numPages, phase});
+        return;
+    }
+
+    // ThreadPool hands out consecutive items to different workers, so each
+    // worker gets exactly one contiguous range of the block.
+    const int32_t pagesPerShard = (numPages + shards - 1) / shards;
+    {
+        base::AutoLock lock(mHashShardLock);
+        mHashShardsPending = shards;
+    }
+    for (int i = 0; i < shards; ++i) {
+        const int32_t start = i * pagesPerShard;
+        const int32_t end = std::min(numPages, start + pagesPerShard);
+        mHashers->enqueue({blockIndex, i, start, end, phase});
+    }
+
+    base::AutoLock lock(mHashShardLock);
+    mHashShardCv.wait(&lock, [this] { return mHashShardsPending == 0; });
+}
+
+void RamSaver::processHashShard(const HashShard& shard) {
+    auto& block = mIndex.blocks[size_t(shard.blockIndex)];
+    const int32_t pageSize = block.ramBlock.pageSize;
+
+    if (shard.phase == HashShard::Phase::Hashing) {
+        mIncStats.measureWorker(
+                IncrementalStats::WorkerTime::Hashing, shard.worker, [&] {
+                    for (int32_t i = shard.pageStart; i < shard.pageEnd;
+                         ++i) {
+                        auto& page = block.pages[size_t(i)];
+                        if (page.sizeOnDisk && !page.hashFilled) {
+                            withGuestPage(shard.blockIndex, i,
+                                          [&](const uint8_t* data) {
+                                              calcHash(page, block, data);
+                                          });
+                        }
+                    }
+                });
+        return;
+    }
+
+    mIncStats.measureWorker(
+            IncrementalStats::WorkerTime::ZeroCheck, shard.worker, [&] {
+                // RAM decommit: when checking for zero pages or hashing, we
+                // need to make sure that the memory does not become resident,
+                // or useful memory might get paged out and the save itself
+                // will have to compete with paging out, which can slow things
+                // down.
+                //
+                // Track continguous 16mb ranges to decommit.  This is so that
+                // zero check causes extra RAM to be resident only up to 16 mb
+                // per worker, while avoiding issuing frequent system calls.
+
+                // Zero pages can actually be zeroed out and MADV_FREE'ed,
+                // unless the guest is already running and may write there.
+                const bool guestRunning =
+                        !mCowBlocks.empty() &&
+                        mCowBlocks[size_t(shard.blockIndex)].pageStates;
+                ContiguousRangeMapper zeroPageDeleter(
+                        [](uintptr_t start, uintptr_t size) {
+                            android::base::memoryHint((void*)start, size,
+                                                      MemoryHint::DontNeed);
+                        },
+                        kDecommitChunkSize);
+
+                int32_t totalZero = 0;
+                uint8_t* zeroCheckPtr = block.ramBlock.hostPtr +
+                                        int64_t(shard.pageStart) * pageSize;
+                for (int32_t i = shard.pageStart; i < shard.pageEnd;
+                     ++i, zeroCheckPtr += (uintptr_t)pageSize) {
+                    bool isZero = false;
+                    withGuestPage(shard.blockIndex, i,
+                                  [&](const uint8_t* data) {
+                                      isZero = isBufferZeroed(data, pageSize);
+                                  });
+
+                    auto& page = block.pages[size_t(i)];
+                    page.same = false;
+                    page.hashFilled = false;
+                    page.filePos = 0;
+                    page.baseFilePos = 0;
+                    page.baseSizeOnDisk = 0;
+                    page.loaderPage = nullptr;
+
+                    // Don't branch for the isZero decision
+                    page.sizeOnDisk = kDefaultPageSize * !isZero;
+                    totalZero += isZero;
+
+                    // Decommit or free in chunks of 16 mb.
+                    if (page.sizeOnDisk == 0 && !guestRunning) {
+                        zeroPageDeleter.add((uintptr_t)zeroCheckPtr, pageSize);
+                    }
+                }
+                mHashShardZeroPages[size_t(shard.worker)] = totalZero;
+            });
+}
+
 void RamSaver::passToSaveHandler(QueuedPageInfo&& pi) {
     if (pi.blockIndex != kStopMarkerIndex &&
         !mCanceled.load(std::memory_order_acquire)) {
@@ -452,13 +772,20 @@ void RamSaver::passToSaveHandler(QueuedPageInfo&& pi) {
             return;
         mStopping.store(true, std::memory_order_release);
 
+        mHashers.clear();
         mWorkers.clear();
         if (mWriter) {
             mWriter->enqueue({-1});
             mWriter.clear();
+            if (mPageStore && !(mPageStore->flush() && writePageRefs())) {
+                mHasError = true;
+            }
             mIndex.startPosInFile = mCurrentStreamPos;
             writeIndex();
         }
+        if (mPageStore) {
+            mPageStore->finishWriting();
+        }
 
         mEndTime = System::get()->getHighResTimeUs();
 
@@ -488,6 +815,13 @@ bool RamSaver::handlePageSave(QueuedPageInfo&& pi) {
         uint8_t* compressBufferData = compressBuffer->data();
         uintptr_t compressBufferOffset = 0;
 
+        DeltaBases deltaBases;
+        if (mDeltaPages) {
+            mIncStats.measure(StatTime::WaitingForDisk, [&] {
+                readDeltaBases(block, pi, &deltaBases);
+            });
+        }
+
         mIncStats.measure(StatTime::Compressing, [&] {
 
             for (int32_t nzcIndex = pi.nonzeroChangedIndexStart;
@@ -498,17 +832,45 @@ bool RamSaver::handlePageSave(QueuedPageInfo&& pi) {
                 auto ptr = block.ramBlock.hostPtr +
                     int64_t(pageIndex) * block.ramBlock.pageSize;
 
-                auto compressedSize =
-                    compress::compress(
-                            ptr, block.ramBlock.pageSize,
+                int32_t compressedSize = 0;
+                int32_t deltaSize = 0;
+                uint8_t delta[kDefaultPageSize / 2];
+                withGuestPage(pi.blockIndex, pageIndex,
+                              [&](const uint8_t* data) {
+                    compressedSize = mCodec->compress(
+                            data, block.ramBlock.pageSize,
                             compressBufferData + compressBufferOffset,
                             compress::maxCompressedSize(kDefaultPageSize));
+                    const int32_t baseOffset =
+                            mDeltaPages ? deltaBases.offsets[size_t(
+                                                  nzcIndex -
+                                                  pi.nonzeroChangedIndexStart)]
+                                        : -1;
+                    if (baseOffset >= 0) {
+                        // A delta costs an extra read on load, so it has to
+                        // be worth it.
+                        const int32_t fullSize =
+                                compressedSize > 0 ? compressedSize
+                                                   : kDefaultPageSize;
+                        deltaSize = encodeDelta(
+                                &page, data,
+                                deltaBases.data.data() + baseOffset, delta,
+                                std::min<int32_t>(fullSize / 2,
+                                                  sizeof(delta)));
+                    }
+                });
 
-                assert(compressedSize > 0);
-
-                // Invariant: The page is compressed iff
-                // its sizeOnDisk is strictly less than the page size.
-                if (compressedSize >= block.ramBlock.pageSize) {
+                if (deltaSize > 0) {
+                    // Delta pages are always smaller than the page size too,
+                    // the loader tells them apart by the base position.
+                    memcpy(compressBufferData + compressBufferOffset, delta,
+                           size_t(deltaSize));
+                    page.sizeOnDisk = deltaSize;
+                    page.writePtr = compressBufferData + compressBufferOffset;
+                    compressBufferOffset += deltaSize;
+                    mIncStats.count(StatAction::DeltaPage);
+                } else if (compressedSize <= 0 ||
+                    compressedSize >= block.ramBlock.pageSize) {
                     // Screw this, the page is better off uncompressed.
                     page.sizeOnDisk = block.ramBlock.pageSize;
                     page.writePtr = ptr;
@@ -543,6 +905,13 @@ void RamSaver::writeIndex() {
     bool compressed = (mIndex.flags & int(IndexFlags::CompressedPages)) != 0;
     stream.putBe32(uint32_t(mIndex.version));
     stream.putBe32(uint32_t(mIndex.flags));
+    if (mIndex.version > 2) {
+        mCodec->save(stream);
+        if (mPageStore) {
+            stream.putString(getAvdRelativePath(
+                    PageStore::dataPath(mPageStore->dir())));
+        }
+    }
     stream.putBe32(uint32_t(mIndex.totalPages));
     int64_t prevFilePos = 8;
     int32_t prevPageSizeOnDisk = 0;
@@ -593,6 +962,13 @@ void RamSaver::writeIndex() {
                     assert(page.hashFilled ||
                            mCanceled.load(std::memory_order_acquire));
                     stream.write(page.hash.data(), page.hash.size());
+                    if (mIndex.version > 3) {
+                        stream.putPackedNum(uint64_t(page.baseSizeOnDisk));
+                        if (page.baseSizeOnDisk) {
+                            stream.putPackedSignedNum(page.baseFilePos -
+                                                      page.filePos);
+                        }
+                    }
                     prevFilePos = page.filePos;
                     prevPageSizeOnDisk = page.sizeOnDisk;
                 }
@@ -632,6 +1008,11 @@ void RamSaver::writeIndex() {
 }
 
 void RamSaver::writePage(WriteInfo&& wi) {
+    if (mPageStore) {
+        writePageToStore(std::move(wi));
+        return;
+    }
+
     int64_t nextStreamPos = mCurrentStreamPos;
 
     FileIndex::Block& block = mIndex.blocks[size_t(wi.blockIndex)];
@@ -655,6 +1036,17 @@ void RamSaver::writePage(WriteInfo&& wi) {
                 auto& page = block.pages[size_t(pageIndex)];
 
                 if (page.loaderPage) {
+                    const RamLoader::Page& loaderPage = *page.loaderPage;
+                    if (loaderPage.baseSizeOnDisk && !page.baseSizeOnDisk) {
+                        // Not a delta anymore, its base can go.
+                        mGaps->add(loaderPage.baseFilePos,
+                                   loaderPage.baseSizeOnDisk);
+                    }
+                    if (page.baseSizeOnDisk && !loaderPage.baseSizeOnDisk) {
+                        // The previous version is the base of the new delta,
+                        // it stays in place.
+                        continue;
+                    }
                     if (page.sizeOnDisk <= page.loaderPage->sizeOnDisk) {
                         page.filePos = page.loaderPage->filePos;
                         ++reusedPos;
@@ -737,7 +1129,15 @@ void RamSaver::writePage(WriteInfo&& wi) {
                 contigBytes = sz;
             }
 
-            memcpy(writeCombinePtr, page.writePtr, sz);
+            if (sz == block.ramBlock.pageSize) {
+                // Uncompressed pages are written straight from guest RAM.
+                withGuestPage(wi.blockIndex, pageIndex,
+                              [&](const uint8_t* data) {
+                                  memcpy(writeCombinePtr, data, sz);
+                              });
+            } else {
+                memcpy(writeCombinePtr, page.writePtr, sz);
+            }
             writeCombinePtr += sz;
         }
 
@@ -751,6 +1151,178 @@ void RamSaver::writePage(WriteInfo&& wi) {
                      currStart);
         mCurrentStreamPos = nextStreamPos;
 
+        for (int32_t nzcIndex = wi.nonzeroChangedIndexStart;
+             nzcIndex < wi.nonzeroChangedIndexEnd; ++nzcIndex) {
+            markPageSaved(wi.blockIndex,
+                          block.nonzeroChangedPages[size_t(nzcIndex)]);
+        }
+    });
+
+    mIncStats.countMultiple(StatAction::ReusedPos, reusedPos);
+    mIncStats.countMultiple(StatAction::AppendedPos, appendedPos);
+}
+
+// Deltas are always against a full page, so loading one never takes more
+// than two reads.
+static void getDeltaBase(const RamLoader::Page& loaderPage,
+                         int64_t* pos,
+                         int32_t* size) {
+    const bool loaderDelta = loaderPage.baseSizeOnDisk != 0;
+    *pos = int64_t(loaderDelta ? loaderPage.baseFilePos : loaderPage.filePos);
+    *size = int32_t(loaderDelta ? loaderPage.baseSizeOnDisk
+                                : loaderPage.sizeOnDisk);
+}
+
+void RamSaver::readDeltaBases(const FileIndex::Block& block,
+                              const QueuedPageInfo& pi,
+                              DeltaBases* bases) {
+    // Reading the bases one page at a time would stall the worker on every
+    // changed page; instead read them in file order, merging the ones that
+    // are close enough into a single read.
+    static constexpr int64_t kMaxGap = 16 * kDefaultPageSize;
+
+    struct Base {
+        int64_t pos;
+        int32_t size;
+        int32_t page;
+    };
+    std::vector<Base> wanted;
+    const auto count = size_t(pi.nonzeroChangedIndexEnd -
+                              pi.nonzeroChangedIndexStart);
+    bases->offsets.assign(count, -1);
+    if (block.ramBlock.pageSize != kDefaultPageSize) {
+        return;
+    }
+    wanted.reserve(count);
+    for (int32_t i = 0; i < int32_t(count); ++i) {
+        const auto& page = block.pages[size_t(
+                block.nonzeroChangedPages[size_t(pi.nonzeroChangedIndexStart +
+                                                 i)])];
+        if (!page.loaderPage || page.loaderPage->zeroed()) {
+            continue;
+        }
+        Base base;
+        base.page = i;
+        getDeltaBase(*page.loaderPage, &base.pos, &base.size);
+        if (base.size > 0 && base.size <= kDefaultPageSize) {
+            wanted.push_back(base);
+        }
+    }
+    if (wanted.empty()) {
+        return;
+    }
+    std::sort(wanted.begin(), wanted.end(),
+              [](const Base& l, const Base& r) { return l.pos < r.pos; });
+
+    // The file range that each merged read covers, and where it goes.
+    struct Read {
+        int64_t pos;
+        int64_t end;
+        size_t dataOffset;
+    };
+    std::vector<Read> reads;
+    size_t dataSize = 0;
+    for (const Base& base : wanted) {
+        const int64_t end = base.pos + base.size;
+        if (reads.empty() || base.pos > reads.back().end + kMaxGap) {
+            reads.push_back({base.pos, end, dataSize});
+        } else if (end > reads.back().end) {
+            dataSize += size_t(end - reads.back().end);
+            reads.back().end = end;
+            continue;
+        } else {
+            continue;
+        }
+        dataSize += size_t(base.size);
+    }
+
+    bases->data.resize(dataSize);
+    auto read = reads.begin();
+    bool readOk = false;
+    for (size_t i = 0; i < wanted.size(); ++i) {
+        const Base& base = wanted[i];
+        if (i == 0 || base.pos >= read->end) {
+            if (i != 0) {
+                ++read;
+            }
+            const auto size = size_t(read->end - read->pos);
+            readOk = HANDLE_EINTR(base::pread(
+                             mStreamFd, bases->data.data() + read->dataOffset,
+                             size, read->pos)) == int64_t(size);
+        }
+        if (readOk) {
+            bases->offsets[size_t(base.page)] =
+                    int32_t(read->dataOffset + size_t(base.pos - read->pos));
+        }
+    }
+}
+
+int32_t RamSaver::encodeDelta(FileIndex::Block::Page* page,
+                              const uint8_t* data,
+                              const uint8_t* storedBase,
+                              uint8_t* out,
+                              int32_t outSize) {
+    int64_t basePos;
+    int32_t baseSize;
+    getDeltaBase(*page->loaderPage, &basePos, &baseSize);
+
+    uint8_t base[kDefaultPageSize];
+    if (baseSize < kDefaultPageSize) {
+        if (!mCodec->decompress(storedBase, baseSize, base,
+                                kDefaultPageSize)) {
+            return 0;
+        }
+        storedBase = base;
+    }
+
+    const int32_t size =
+            delta::encode(storedBase, data, kDefaultPageSize, out, outSize);
+    if (size > 0) {
+        page->baseFilePos = basePos;
+        page->baseSizeOnDisk = baseSize;
+    }
+    return size;
+}
+
+bool RamSaver::writePageRefs() {
+    std::vector<int64_t> offsets;
+    for (const FileIndex::Block& block : mIndex.blocks) {
+        for (const FileIndex::Block::Page& page : block.pages) {
+            if (page.filePos) {
+                offsets.push_back(page.filePos);
+            }
+        }
+    }
+    return PageStore::writeRefs(mPageRefsFile, offsets);
+}
+
+void RamSaver::writePageToStore(WriteInfo&& wi) {
+    FileIndex::Block& block = mIndex.blocks[size_t(wi.blockIndex)];
+
+    // Pages already in the store from other snapshots count as reused.
+    int64_t reusedPos = 0;
+    int64_t appendedPos = 0;
+
+    mIncStats.measure(StatTime::DiskWriteCombine, [&] {
+        for (int32_t nzcIndex = wi.nonzeroChangedIndexStart;
+             nzcIndex < wi.nonzeroChangedIndexEnd; ++nzcIndex) {
+
+            int32_t pageIndex = block.nonzeroChangedPages[size_t(nzcIndex)];
+            auto& page = block.pages[size_t(pageIndex)];
+            assert(page.hashFilled);
+
+            bool added = false;
+            withGuestPage(wi.blockIndex, pageIndex,
+                          [&](const uint8_t* data) {
+                              page.filePos =
+                                      mPageStore->put(page.hash, data, &added);
+                          });
+            if (!page.filePos) {
+                mHasError = true;
+            }
+            markPageSaved(wi.blockIndex, pageIndex);
+            added ? ++appendedPos : ++reusedPos;
+        }
     });
 
     mIncStats.countMultiple(StatAction::ReusedPos, reusedPos);
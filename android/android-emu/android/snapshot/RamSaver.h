@@ -15,6 +15,7 @@
 #include "android/base/EnumFlags.h"
 #include "android/base/containers/SmallVector.h"
 #include "android/base/files/StdioStream.h"
+#include "android/base/synchronization/ConditionVariable.h"
 #include "android/base/synchronization/Lock.h"
 #include "android/base/synchronization/MessageChannel.h"
 #include "android/base/system/System.h"
@@ -24,12 +25,15 @@
 #include "android/snapshot/FastReleasePool.h"
 #include "android/snapshot/GapTracker.h"
 #include "android/snapshot/IncrementalStats.h"
+#include "android/snapshot/MemoryWatch.h"
+#include "android/snapshot/PageStore.h"
 #include "android/snapshot/RamLoader.h"
 #include "android/snapshot/common.h"
 
 #include <array>
 #include <atomic>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <vector>
 
@@ -47,27 +51,50 @@ public:
     enum class Flags : uint8_t {
         None = 0,
         Async = 0x1,
-        // TODO: add "CopyOnWrite = 0x3  // implies |Async|"
+        // Write-protect guest RAM and save it in the background after the
+        // guest resumes, copying out pages right before they get modified.
+        CopyOnWrite = 0x2,
         Compress = 0x4,
+        // In compressed incremental saves, store a changed page as a diff
+        // against its previous version when that's much smaller.
+        DeltaPages = 0x8,
     };
 
+    // |codec| is only used for compressed saves; incremental saves keep
+    // using the codec of the snapshot being overwritten.
+    // With a |pageStore|, pages go there uncompressed and deduplicated, and
+    // |fileName| only gets the index; |loader| must be null then.
     RamSaver(const std::string& fileName,
              Flags preferredFlags,
              RamLoader* loader,
-             bool isOnExit);
+             bool isOnExit,
+             compress::CodecPtr codec = compress::Codec::lz4(),
+             PageStore::Ptr pageStore = nullptr);
     ~RamSaver();
 
     void registerBlock(const RamBlock& block);
     void savePage(int64_t blockOffset, int64_t pageOffset, int32_t pageSize);
     void complete();
+    // In CopyOnWrite mode, lets the guest continue running while the
+    // remaining pages are saved on a background thread; join() waits for it.
+    void continueInBackground();
+    // Calls |func| once the background save is over, on the thread that
+    // finished it, or right away if it's over already.
+    void onBackgroundSaveDone(std::function<void()> func);
     void join();
     void cancel();
+    bool canceled() const { return mCanceled.load(std::memory_order_acquire); }
     bool hasError() const { return mHasError; }
     bool compressed() const {
         return mIndex.flags & int32_t(IndexFlags::CompressedPages);
     }
     uint64_t diskSize() const { return mDiskSize; }
     bool incremental() const { return mLoader != nullptr; }
+    const compress::CodecPtr& codec() const { return mCodec; }
+    bool copyOnWrite() const {
+        return nonzero(mFlags & Flags::CopyOnWrite);
+    }
+    const IncrementalStats& stats() const { return mIncStats; }
 
     // getDuration():
     // Returns true if there was save with measurable time
@@ -91,6 +118,19 @@ private:
         int32_t nonzeroChangedIndexEnd;
     };
 
+    // A contiguous range of pages in a single RAM block that one hashing
+    // worker zero-checks or hashes. Each shard only ever touches its own
+    // pages, so the results don't depend on the scheduling order.
+    struct HashShard {
+        enum class Phase : uint8_t { ZeroCheck, Hashing };
+
+        int blockIndex;
+        int worker;
+        int32_t pageStart;
+        int32_t pageEnd;
+        Phase phase;
+    };
+
     // The file structure is as follows:
     //
     // 0: 8 bytes, index offset in the file (indexOffset)
@@ -110,6 +150,10 @@ private:
                 bool same;
                 bool hashFilled;
                 int64_t filePos;
+                // The full page that a delta page applies to (size 0 for
+                // regular pages).
+                int64_t baseFilePos;
+                int32_t baseSizeOnDisk;
                 Hash hash;
                 const RamLoader::Page* loaderPage;
                 uint8_t* writePtr;
@@ -136,6 +180,14 @@ private:
     using CompressBuffer =
             std::array<uint8_t, kCompressBufferBatchSize * compress::maxCompressedSize(kDefaultPageSize)>;
 
+    // The bases of the pages in a batch that may be saved as deltas, as they
+    // are stored in the file being overwritten.
+    struct DeltaBases {
+        std::vector<uint8_t> data;
+        // Per page of the batch: offset of its base in |data|, or -1.
+        std::vector<int32_t> offsets;
+    };
+
     struct WriteInfo {
         int blockIndex;
         int32_t nonzeroChangedIndexStart;
@@ -143,22 +195,66 @@ private:
         CompressBuffer* toRelease;
     };
 
+    // Original contents of the write-protected pages of a block, copied out
+    // on the first guest write into them. Pages that are already saved aren't
+    // copied anymore.
+    struct CowBlock {
+        // >= 0: number of readers of the guest page, or one of the values
+        // below.
+        enum : int32_t { kCopying = -1, kCopied = -2, kSaved = -3 };
+
+        std::unique_ptr<std::atomic<int32_t>[]> pageStates;
+        std::unique_ptr<std::unique_ptr<uint8_t[]>[]> pageCopies;
+    };
+
+    void saveBlock(int blockIndex);
+    bool protectBlock(int blockIndex);
+    void onGuestWrite(void* ptr);
+    void saveInBackground();
+
+    // Calls |func| with the page contents as of the save start, even if the
+    // guest is already running and writing into it.
+    template <class Func>
+    void withGuestPage(int blockIndex, int32_t pageIndex, Func&& func);
+    // Tells that the saver is done with the page, so the guest can write
+    // into it without a copy, and frees the copy if there is one.
+    void markPageSaved(int blockIndex, int32_t pageIndex);
+
     void calcHash(FileIndex::Block::Page& page,
                   const FileIndex::Block& block,
                   const void* ptr);
 
+    void runHashShards(int blockIndex,
+                       int32_t numPages,
+                       HashShard::Phase phase);
+    void processHashShard(const HashShard& shard);
+
     void passToSaveHandler(QueuedPageInfo&& pi);
     bool handlePageSave(QueuedPageInfo&& pi);
     void writeIndex();
     void writePage(WriteInfo&& wi);
+    void writePageToStore(WriteInfo&& wi);
+    bool writePageRefs();
+    void readDeltaBases(const FileIndex::Block& block,
+                        const QueuedPageInfo& pi,
+                        DeltaBases* bases);
+    int32_t encodeDelta(FileIndex::Block::Page* page,
+                        const uint8_t* data,
+                        const uint8_t* storedBase,
+                        uint8_t* out,
+                        int32_t outSize);
 
     RamLoader* mLoader = nullptr;
     base::StdioStream mStream;
     int mStreamFd;
     Flags mFlags;
+    compress::CodecPtr mCodec;
+    PageStore::Ptr mPageStore;
+    std::string mPageRefsFile;
     bool mJoined = false;
     bool mHasError = false;
     bool mLoaderOnDemand = false;
+    bool mDeltaPages = false;
     int mLastBlockIndex = -1;
     int64_t mCurrentStreamPos = 8;
 
@@ -167,6 +263,25 @@ private:
     base::Optional<base::ThreadPool<QueuedPageInfo>> mWorkers;
     base::Optional<base::WorkerThread<WriteInfo>> mWriter;
 
+    // Blocks smaller than this many pages per worker are zero-checked and
+    // hashed inline on the calling thread.
+    static const int32_t kMinPagesPerHashShard = 4096;
+
+    base::Lock mHashShardLock;
+    base::ConditionVariable mHashShardCv;
+    int mHashShardsPending = 0;
+    std::array<int32_t, IncrementalStats::kMaxWorkers> mHashShardZeroPages{};
+    base::Optional<base::ThreadPool<HashShard>> mHashers;
+
+    base::Optional<MemoryWriteWatch> mWriteWatch;
+    std::vector<CowBlock> mCowBlocks;
+    std::vector<int> mCowPendingBlocks;
+    base::Optional<base::FunctorThread> mCowThread;
+    bool mCowStarted = false;
+    base::Lock mCowDoneLock;
+    bool mCowDone = false;
+    std::function<void()> mOnCowDone;
+
     GapTracker::Ptr mGaps;
 
     FileIndex mIndex;
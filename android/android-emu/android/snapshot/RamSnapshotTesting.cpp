@@ -14,7 +14,9 @@
 #include "android/base/files/StdioStream.h"
 #include "android/utils/file_io.h"
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <random>
 
 using android::base::c_str;
@@ -35,7 +37,7 @@ namespace snapshot {
 
 using TestRamBuffer = AlignedBuf<uint8_t, kTestingPageSize>;
 
-static void mockQemuPageSave(RamSaver& saver, const RamBlock& block) {
+void mockQemuPageSave(RamSaver& saver, const RamBlock& block) {
     const int blockIndex = 0;
 
     for (int64_t i = block.startOffset; i < block.startOffset + block.totalSize;
@@ -61,8 +63,11 @@ RamBlock makeRam(android::base::StringView name,
 
 void saveRamSingleBlock(const RamSaver::Flags flags,
                         const RamBlock& block,
-                        android::base::StringView filename) {
-    RamSaver s(filename, flags, nullptr, true);
+                        android::base::StringView filename,
+                        compress::CodecPtr codec,
+                        PageStore::Ptr pageStore) {
+    RamSaver s(filename, flags, nullptr, true, std::move(codec),
+               std::move(pageStore));
 
     s.registerBlock(block);
 
@@ -71,6 +76,24 @@ void saveRamSingleBlock(const RamSaver::Flags flags,
     s.join();
 }
 
+bool saveRamSingleBlockCopyOnWrite(const RamBlock& block,
+                                   android::base::StringView filename,
+                                   const std::function<void()>& whileSaving) {
+    RamSaver s(filename, RamSaver::Flags::CopyOnWrite, nullptr, false);
+
+    s.registerBlock(block);
+
+    mockQemuPageSave(s, block);
+
+    const bool copyOnWrite = s.copyOnWrite();
+    s.continueInBackground();
+    if (copyOnWrite) {
+        whileSaving();
+    }
+    s.join();
+    return copyOnWrite;
+}
+
 void loadRamSingleBlock(const RamBlock& block,
                         android::base::StringView filename) {
     auto ram = android_fopen(c_str(filename), "rb");
@@ -145,6 +168,55 @@ TestRamBuffer generateRandomRam(size_t numPages, float zeroPageChance, int seed)
     return res;
 }
 
+TestRamBuffer generateMixedRam(size_t numPages,
+                               const RamPageMix& mix,
+                               int seed) {
+    std::default_random_engine generator;
+    generator.seed(seed);
+
+    std::uniform_real_distribution<float> kindDistribution(0.0f, 1.0f);
+    std::uniform_int_distribution<uint32_t> wordDistribution;
+    // Compressible pages are runs of a few distinct bytes, roughly like text.
+    std::uniform_int_distribution<int> letterDistribution('a', 'h');
+    std::uniform_int_distribution<int> runDistribution(1, 16);
+
+    TestRamBuffer res(numPages * kTestingPageSize);
+    uint8_t* ram = res.data();
+
+    for (size_t i = 0; i < numPages; ++i) {
+        uint8_t* currentPage = ram + i * kTestingPageSize;
+        float kind = kindDistribution(generator);
+        if (kind < mix.zero) {
+            memset(currentPage, 0x0, kTestingPageSize);
+            continue;
+        }
+        kind -= mix.zero;
+        if (kind < mix.duplicate && i > 0) {
+            std::uniform_int_distribution<size_t> pageDistribution(0, i - 1);
+            memcpy(currentPage,
+                   ram + pageDistribution(generator) * kTestingPageSize,
+                   kTestingPageSize);
+            continue;
+        }
+        kind -= mix.duplicate;
+        if (kind < mix.compressible) {
+            for (int pos = 0; pos < kTestingPageSize;) {
+                const int run = std::min(runDistribution(generator),
+                                         kTestingPageSize - pos);
+                memset(currentPage + pos, letterDistribution(generator), run);
+                pos += run;
+            }
+            continue;
+        }
+        for (int pos = 0; pos < kTestingPageSize; pos += sizeof(uint32_t)) {
+            const uint32_t word = wordDistribution(generator);
+            memcpy(currentPage + pos, &word, sizeof(word));
+        }
+    }
+
+    return res;
+}
+
 void randomMutateRam(TestRamBuffer& ram, float noChangeChance, float zeroPageChance, int seed) {
     std::default_random_engine generator;
     generator.seed(seed);
@@ -16,6 +16,7 @@
 #include "android/snapshot/RamLoader.h"
 #include "android/snapshot/RamSaver.h"
 
+#include <functional>
 #include <vector>
 
 namespace android {
@@ -29,9 +30,21 @@ RamBlock makeRam(android::base::StringView name,
                  uint8_t* hostPtr,
                  int64_t size);
 
+// Feeds all pages of |block| to |saver| the way QEMU does on a save.
+void mockQemuPageSave(RamSaver& saver, const RamBlock& block);
+
 void saveRamSingleBlock(const RamSaver::Flags flags,
                         const RamBlock& block,
-                        android::base::StringView filename);
+                        android::base::StringView filename,
+                        compress::CodecPtr codec = compress::Codec::lz4(),
+                        PageStore::Ptr pageStore = nullptr);
+
+// Saves |block| in CopyOnWrite mode and runs |whileSaving| at the point
+// where the guest would've been resumed. Returns false if the mode isn't
+// available and the save happened synchronously.
+bool saveRamSingleBlockCopyOnWrite(const RamBlock& block,
+                                   android::base::StringView filename,
+                                   const std::function<void()>& whileSaving);
 
 void loadRamSingleBlock(const RamBlock& block,
                         android::base::StringView filename);
@@ -43,6 +56,18 @@ void incrementalSaveSingleBlock(const RamSaver::Flags flags,
 
 TestRamBuffer generateRandomRam(size_t numPages, float zeroPageChance, int seed = 0);
 
+// Fractions of each kind of page in generateMixedRam(); the rest of the pages
+// are random bytes.
+struct RamPageMix {
+    float zero;
+    float duplicate;     // Copies of earlier pages.
+    float compressible;  // Text-like pages.
+};
+
+TestRamBuffer generateMixedRam(size_t numPages,
+                               const RamPageMix& mix,
+                               int seed = 0);
+
 void randomMutateRam(TestRamBuffer& ram, float noChangeChance, float zeroPageChance, int seed = 0);
 
 }  // namespace snapshot
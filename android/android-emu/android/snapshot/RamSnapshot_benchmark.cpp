@@ -0,0 +1,263 @@
+// Copyright 2020 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// Benchmarks for saving and loading snapshot RAM, on synthetic RAM with a mix
+// of zero, duplicate, compressible and random pages.
+//
+// Each benchmark reports the RAM throughput and how much the RSS grew while it
+// ran.
+// Save benchmarks also report the per-phase times from IncrementalStats, but
+// only in builds with SNAPSHOT_PROFILE > 1.
+
+#include "android/base/StringFormat.h"
+#include "android/base/files/PathUtils.h"
+#include "android/base/files/StdioStream.h"
+#include "android/base/system/System.h"
+#include "android/snapshot/MemoryWatch.h"
+#include "android/snapshot/RamSnapshotTesting.h"
+#include "android/utils/file_io.h"
+#include "benchmark/benchmark_api.h"
+
+#include <algorithm>
+#include <array>
+#include <string>
+
+using android::base::PathUtils;
+using android::base::StdioStream;
+using android::base::StringFormat;
+using android::base::System;
+using android::snapshot::IncrementalStats;
+using android::snapshot::MemoryAccessWatch;
+using android::snapshot::RamBlock;
+using android::snapshot::RamLoader;
+using android::snapshot::RamPageMix;
+using android::snapshot::RamSaver;
+using android::snapshot::TestRamBuffer;
+using android::snapshot::generateMixedRam;
+using android::snapshot::kTestingPageSize;
+using android::snapshot::makeRam;
+using android::snapshot::mockQemuPageSave;
+using android::snapshot::randomMutateRam;
+using android::snapshot::saveRamSingleBlock;
+
+// 256 MB of RAM, with zero pages dominating as they do in a freshly booted
+// guest.
+static constexpr size_t kRamPages = 65536;
+static constexpr RamPageMix kRamMix = {0.5f, 0.1f, 0.3f};
+
+static std::string ramPath() {
+    return PathUtils::join(System::get()->getTempDir(),
+                           "snapshot_benchmark_ram.bin");
+}
+
+static RamLoader::RamBlockStructure blockStructure(const RamBlock& block) {
+    RamLoader::RamBlockStructure res;
+    res.pageSize = kTestingPageSize;
+    res.blocks = {block};
+    return res;
+}
+
+// Sums the save phase times of all iterations.
+class SavePhases {
+public:
+    void add(const IncrementalStats& stats) {
+        for (size_t i = 0; i < mTimesUs.size(); ++i) {
+            mTimesUs[i] += stats.timeUs(IncrementalStats::Time(i));
+        }
+    }
+
+    std::string format(size_t iterations) const {
+        using Time = IncrementalStats::Time;
+        if (!iterations || !timeMs(Time::TotalHandlingPageSave, 1)) {
+            return {};
+        }
+        return StringFormat(
+                ", per save: iszero %.1f ms, hash %.1f ms, compress %.1f ms, "
+                "waitdisk %.1f ms, write %.1f ms, index %.1f ms",
+                timeMs(Time::ZeroCheck, iterations),
+                timeMs(Time::Hashing, iterations),
+                timeMs(Time::Compressing, iterations),
+                timeMs(Time::WaitingForDisk, iterations),
+                timeMs(Time::DiskWriteCombine, iterations),
+                timeMs(Time::DiskIndexWrite, iterations));
+    }
+
+private:
+    double timeMs(IncrementalStats::Time time, size_t iterations) const {
+        return mTimesUs[size_t(time)] / 1000.0 / iterations;
+    }
+
+    std::array<int64_t, size_t(IncrementalStats::Time::Count)> mTimesUs{};
+};
+
+// Tracks the largest RSS growth over the one at the benchmark start. The
+// process' peak RSS can't be used here: it's the same for all benchmarks
+// after the most memory hungry one.
+class RssGrowth {
+public:
+    RssGrowth() : mStart(resident()) {}
+
+    // Call while the saver or loader still holds on to its memory.
+    void sample() { mMax = std::max(mMax, resident() - mStart); }
+
+    int64_t maxMb() const { return mMax >> 20; }
+
+private:
+    static int64_t resident() {
+        return int64_t(System::get()->getMemUsage().resident);
+    }
+
+    const int64_t mStart;
+    int64_t mMax = 0;
+};
+
+static void report(benchmark::State& state,
+                   const TestRamBuffer& ram,
+                   const RssGrowth& rss,
+                   const std::string& details = {}) {
+    state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(ram.size()));
+    state.SetLabel(StringFormat("RSS +%lld MB%s", (long long)rss.maxMb(),
+                                details));
+}
+
+// Arg: whether to compress the pages.
+static void BM_SaveRam(benchmark::State& state) {
+    const auto flags =
+            state.range_x() ? RamSaver::Flags::Compress : RamSaver::Flags::None;
+    RssGrowth rss;
+    auto ram = generateMixedRam(kRamPages, kRamMix);
+    const auto block = makeRam("benchmarkRam", ram.data(), int64_t(ram.size()));
+    const auto path = ramPath();
+
+    SavePhases phases;
+    while (state.KeepRunning()) {
+        RamSaver saver(path, flags, nullptr, true);
+        saver.registerBlock(block);
+        mockQemuPageSave(saver, block);
+        saver.join();
+        rss.sample();
+        phases.add(saver.stats());
+    }
+
+    report(state, ram, rss, phases.format(state.iterations()));
+    System::get()->deleteFile(path);
+}
+
+// Arg: percentage of the pages changing between the saves.
+static void BM_SaveRamIncremental(benchmark::State& state) {
+    RssGrowth rss;
+    auto ram = generateMixedRam(kRamPages, kRamMix);
+    const auto block = makeRam("benchmarkRam", ram.data(), int64_t(ram.size()));
+    const auto path = ramPath();
+    saveRamSingleBlock(RamSaver::Flags::None, block, path);
+
+    SavePhases phases;
+    int seed = 0;
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        randomMutateRam(ram, 1.0f - state.range_x() / 100.0f, kRamMix.zero,
+                        ++seed);
+        // This is how Loader::synchronize() gets a loader to save over.
+        RamLoader loader(StdioStream(android_fopen(path.c_str(), "rb"),
+                                     StdioStream::kOwner),
+                         RamLoader::Flags::LoadIndexOnly,
+                         blockStructure(block));
+        state.ResumeTiming();
+
+        RamSaver saver(path, RamSaver::Flags::None, &loader, true);
+        saver.registerBlock(block);
+        mockQemuPageSave(saver, block);
+        saver.join();
+        rss.sample();
+        phases.add(saver.stats());
+    }
+
+    report(state, ram, rss, phases.format(state.iterations()));
+    System::get()->deleteFile(path);
+}
+
+// Arg: whether the pages are compressed.
+static void BM_LoadRam(benchmark::State& state) {
+    const auto flags =
+            state.range_x() ? RamSaver::Flags::Compress : RamSaver::Flags::None;
+    RssGrowth rss;
+    {
+        auto ram = generateMixedRam(kRamPages, kRamMix);
+        saveRamSingleBlock(
+                flags, makeRam("benchmarkRam", ram.data(), int64_t(ram.size())),
+                ramPath());
+    }
+
+    TestRamBuffer ram(kRamPages * kTestingPageSize);
+    const auto block = makeRam("benchmarkRam", ram.data(), int64_t(ram.size()));
+    while (state.KeepRunning()) {
+        RamLoader loader(StdioStream(android_fopen(ramPath().c_str(), "rb"),
+                                     StdioStream::kOwner),
+                         RamLoader::Flags::None, RamLoader::RamBlockStructure());
+        loader.registerBlock(block);
+        loader.start(false);
+        loader.join();
+        rss.sample();
+    }
+
+    report(state, ram, rss);
+    System::get()->deleteFile(ramPath());
+}
+
+// Loads on demand, with the guest touching every page right away: the worst
+// case for the background loader.
+static void BM_LoadRamOnDemand(benchmark::State& state) {
+    if (!MemoryAccessWatch::isSupported()) {
+        state.SetLabel("on-demand loading isn't supported");
+        while (state.KeepRunning()) {
+        }
+        return;
+    }
+
+    RssGrowth rss;
+    {
+        auto ram = generateMixedRam(kRamPages, kRamMix);
+        saveRamSingleBlock(
+                RamSaver::Flags::None,
+                makeRam("benchmarkRam", ram.data(), int64_t(ram.size())),
+                ramPath());
+    }
+
+    TestRamBuffer ram(kRamPages * kTestingPageSize);
+    const auto block = makeRam("benchmarkRam", ram.data(), int64_t(ram.size()));
+    while (state.KeepRunning()) {
+        RamLoader loader(StdioStream(android_fopen(ramPath().c_str(), "rb"),
+                                     StdioStream::kOwner),
+                         RamLoader::Flags::OnDemandAllowed,
+                         RamLoader::RamBlockStructure());
+        loader.registerBlock(block);
+        loader.start(false);
+
+        uint8_t sum = 0;
+        for (size_t i = 0; i < ram.size(); i += kTestingPageSize) {
+            sum += *static_cast<volatile uint8_t*>(ram.data() + i);
+        }
+        benchmark::DoNotOptimize(sum);
+
+        loader.join();
+        rss.sample();
+    }
+
+    report(state, ram, rss);
+    System::get()->deleteFile(ramPath());
+}
+
+BENCHMARK(BM_SaveRam)->Arg(0)->Arg(1)->UseRealTime();
+BENCHMARK(BM_SaveRamIncremental)->Arg(1)->Arg(10)->Arg(50)->UseRealTime();
+BENCHMARK(BM_LoadRam)->Arg(0)->Arg(1)->UseRealTime();
+BENCHMARK(BM_LoadRamOnDemand)->UseRealTime();
+
+BENCHMARK_MAIN()
@@ -11,14 +11,24 @@
 
 #include "android/base/AlignedBuf.h"
 #include "android/base/StringView.h"
+#include "android/base/files/MemStream.h"
 #include "android/base/misc/FileUtils.h"
+#include "android/base/sockets/SocketUtils.h"
 #include "android/base/testing/TestTempDir.h"
+#include "android/snapshot/PageDelta.h"
 #include "android/snapshot/RamSnapshotTesting.h"
+#include "android/snapshot/SnapshotStream.h"
+#include "android/utils/file_io.h"
+#include "android/utils/path.h"
 
 #include <gtest/gtest.h>
 
+#include <cstring>
 #include <memory>
 #include <random>
+#include <set>
+#include <string>
+#include <thread>
 #include <vector>
 
 using android::AlignedBuf;
@@ -70,6 +80,33 @@ TEST_F(RamSnapshotTest, SimpleRandom) {
     }
 }
 
+// Uncompressed pages are read in runs, straight into RAM where the zero pages
+// don't break them up.
+TEST_F(RamSnapshotTest, UncompressedRandom) {
+    std::string ramPath = mTempDir->makeSubPath("ram.bin");
+
+    const int numPages = 100;
+    const int numTrials = 4;
+
+    for (int i = 0; i < numTrials; i++) {
+        auto testRam = generateRandomRam(numPages, 0.25f * i, i);
+
+        auto blockForTest =
+            makeRam("testRam", testRam.data(), (int64_t)testRam.size());
+
+        saveRamSingleBlock(RamSaver::Flags::None, blockForTest, ramPath);
+
+        TestRamBuffer testRamOut(numPages * kTestingPageSize);
+
+        auto blockForTestOutput =
+            makeRam("testRam", testRamOut.data(), (int64_t)testRamOut.size());
+
+        loadRamSingleBlock(blockForTestOutput, ramPath);
+
+        EXPECT_EQ(testRam, testRamOut);
+    }
+}
+
 TEST_F(RamSnapshotTest, IncrementalSaveRandomNoChanges) {
     std::string ramPath = mTempDir->makeSubPath("ram.bin");
 
@@ -181,5 +218,380 @@ TEST_F(RamSnapshotTest, IncrementalSaveRandomMultiStep) {
     }
 }
 
+TEST_F(RamSnapshotTest, PageDeltaRoundTrip) {
+    auto pages = generateRandomRam(2, 0.0);
+    const uint8_t* base = pages.data();
+    uint8_t page[kTestingPageSize];
+    memcpy(page, base, kTestingPageSize);
+
+    uint8_t diff[kTestingPageSize];
+    EXPECT_EQ(0, delta::encode(base, page, kTestingPageSize, diff,
+                               sizeof(diff)));
+
+    page[0] ^= 1;
+    page[100] ^= 1;
+    page[101] ^= 1;
+    page[kTestingPageSize - 1] ^= 1;
+    const auto size =
+            delta::encode(base, page, kTestingPageSize, diff, sizeof(diff));
+    ASSERT_GT(size, 0);
+    EXPECT_LT(size, 32);
+
+    uint8_t applied[kTestingPageSize];
+    memcpy(applied, base, kTestingPageSize);
+    ASSERT_TRUE(delta::apply(diff, size, applied, kTestingPageSize));
+    EXPECT_EQ(0, memcmp(page, applied, kTestingPageSize));
+
+    // A completely different page doesn't fit into half a page.
+    EXPECT_EQ(0, delta::encode(base, pages.data() + kTestingPageSize,
+                               kTestingPageSize, diff, kTestingPageSize / 2));
+
+    // Truncated diffs are rejected.
+    EXPECT_FALSE(delta::apply(diff, size - 1, applied, kTestingPageSize));
+}
+
+TEST_F(RamSnapshotTest, IncrementalSaveDeltaPagesMultiStep) {
+    std::string ramPath = mTempDir->makeSubPath("ram.bin");
+
+    const int numPages = 20;
+    const int steps = 6;
+    const auto flags = RamSaver::Flags::Compress | RamSaver::Flags::DeltaPages;
+
+    auto ramToSave = generateRandomRam(numPages, 0.25, 0);
+    saveRamSingleBlock(flags, makeRam("testRam", ramToSave.data(),
+                                      (int64_t)ramToSave.size()),
+                       ramPath);
+
+    std::default_random_engine generator(1);
+    std::uniform_int_distribution<int> offsetDistribution(
+            0, kTestingPageSize - 1);
+    for (int j = 0; j < steps; j++) {
+        auto ramToLoad = TestRamBuffer(numPages * kTestingPageSize);
+        if (j == 3) {
+            // Rewrite most pages so the deltas get replaced by full pages.
+            randomMutateRam(ramToSave, 0.25, 0.1, j);
+        } else {
+            // Touch a few bytes in every other page.
+            for (int page = j % 2; page < numPages; page += 2) {
+                for (int k = 0; k < 4; k++) {
+                    ramToSave.data()[page * kTestingPageSize +
+                                     offsetDistribution(generator)] += 1;
+                }
+            }
+        }
+
+        incrementalSaveSingleBlock(
+                flags,
+                makeRam("testRam", ramToLoad.data(), (int64_t)ramToLoad.size()),
+                makeRam("testRam", ramToSave.data(), (int64_t)ramToSave.size()),
+                ramPath);
+
+        TestRamBuffer testRamOut(numPages * kTestingPageSize);
+        loadRamSingleBlock(makeRam("testRam", testRamOut.data(),
+                                   (int64_t)testRamOut.size()),
+                           ramPath);
+
+        EXPECT_EQ(ramToSave, testRamOut);
+    }
+}
+
+TEST_F(RamSnapshotTest, ZstdRandom) {
+    std::string ramPath = mTempDir->makeSubPath("ram.bin");
+
+    const int numPages = 100;
+    const int numTrials = 4;
+    const float zeroPageChance = 0.5;
+
+    auto dictionary = generateRandomRam(4, 0.0);
+    const compress::CodecPtr codecs[] = {
+        compress::Codec::create(compress::Codec::Type::Zstd),
+        compress::Codec::create(compress::Codec::Type::Zstd, 19),
+        compress::Codec::create(
+                compress::Codec::Type::Zstd, 0,
+                std::vector<uint8_t>(dictionary.data(),
+                                     dictionary.data() + dictionary.size())),
+    };
+
+    for (const auto& codec : codecs) {
+        ASSERT_TRUE(codec);
+        for (int i = 0; i < numTrials; i++) {
+            auto testRam = generateRandomRam(numPages, zeroPageChance, i);
+
+            auto blockForTest =
+                makeRam("testRam", testRam.data(), (int64_t)testRam.size());
+
+            saveRamSingleBlock(RamSaver::Flags::Compress,
+                               blockForTest,
+                               ramPath,
+                               codec);
+
+            TestRamBuffer testRamOut(numPages * kTestingPageSize);
+
+            auto blockForTestOutput =
+                makeRam("testRam", testRamOut.data(), (int64_t)testRamOut.size());
+
+            loadRamSingleBlock(blockForTestOutput, ramPath);
+
+            EXPECT_EQ(testRam, testRamOut);
+        }
+    }
+}
+
+TEST_F(RamSnapshotTest, CodecFromString) {
+    EXPECT_EQ(compress::Codec::lz4(), compress::Codec::fromString("lz4"));
+
+    auto codec = compress::Codec::fromString("zstd:7");
+    ASSERT_TRUE(codec);
+    EXPECT_EQ(compress::Codec::Type::Zstd, codec->type());
+    EXPECT_EQ(7, codec->level());
+
+    EXPECT_FALSE(compress::Codec::fromString("zstd:"));
+    EXPECT_FALSE(compress::Codec::fromString("zstd:fast"));
+    EXPECT_FALSE(compress::Codec::fromString("gzip"));
+}
+
+TEST_F(RamSnapshotTest, PageStoreSharesPages) {
+    std::string storeDir = mTempDir->makeSubPath("pagestore");
+    std::string ramPaths[] = {mTempDir->makeSubPath("ram1.bin"),
+                              mTempDir->makeSubPath("ram2.bin")};
+
+    const int numPages = 100;
+
+    auto testRam = generateRandomRam(numPages, 0.0);
+    auto testRam2 = testRam;
+    randomMutateRam(testRam2, 0.9, 0.0, 1);
+
+    // Identical pages, within a snapshot or across them, are stored once.
+    std::set<std::string> distinctPages;
+    for (int i = 0; i < 2; i++) {
+        // Reopen the store each time to check that it persists.
+        auto store = PageStore::open(storeDir);
+        ASSERT_TRUE(store);
+
+        auto& ram = i ? testRam2 : testRam;
+        for (int page = 0; page < numPages; page++) {
+            const auto data = ram.data() + page * kTestingPageSize;
+            std::string contents(data, data + kTestingPageSize);
+            // Zero pages aren't saved at all.
+            if (contents != std::string(kTestingPageSize, '\0')) {
+                distinctPages.insert(std::move(contents));
+            }
+        }
+
+        auto blockForTest = makeRam("testRam", ram.data(), (int64_t)ram.size());
+        saveRamSingleBlock(RamSaver::Flags::Compress, blockForTest,
+                           ramPaths[i], compress::Codec::lz4(), store);
+
+        EXPECT_EQ(distinctPages.size(), store->pageCount());
+    }
+
+    // Both snapshots load correctly from the shared store.
+    for (int i = 0; i < 2; i++) {
+        TestRamBuffer testRamOut(numPages * kTestingPageSize);
+        auto blockForTestOutput =
+            makeRam("testRam", testRamOut.data(), (int64_t)testRamOut.size());
+        loadRamSingleBlock(blockForTestOutput, ramPaths[i]);
+        EXPECT_EQ(i ? testRam2 : testRam, testRamOut);
+    }
+}
+
+TEST_F(RamSnapshotTest, PageStoreFreesUnusedPages) {
+    std::string storeDir = mTempDir->makeSubPath("pagestore");
+    std::string ramPaths[] = {mTempDir->makeSubPath("ram1.bin"),
+                              mTempDir->makeSubPath("ram2.bin")};
+    std::vector<std::string> refsFiles = {PageStore::refsPath(ramPaths[0]),
+                                          PageStore::refsPath(ramPaths[1])};
+    const auto dataPath = PageStore::dataPath(storeDir);
+
+    const int numPages = 100;
+
+    auto testRam = generateRandomRam(numPages, 0.0);
+    auto testRam2 = testRam;
+    randomMutateRam(testRam2, 0.5, 0.0, 1);
+
+    std::set<std::string> distinctPages2;
+    for (int page = 0; page < numPages; page++) {
+        const auto data = testRam2.data() + page * kTestingPageSize;
+        std::string contents(data, data + kTestingPageSize);
+        if (contents != std::string(kTestingPageSize, '\0')) {
+            distinctPages2.insert(std::move(contents));
+        }
+    }
+
+    auto store = PageStore::open(storeDir);
+    ASSERT_TRUE(store);
+    for (int i = 0; i < 2; i++) {
+        auto& ram = i ? testRam2 : testRam;
+        auto blockForTest = makeRam("testRam", ram.data(), (int64_t)ram.size());
+        saveRamSingleBlock(RamSaver::Flags::None, blockForTest, ramPaths[i],
+                           compress::Codec::lz4(), store);
+    }
+    const auto allPages = store->pageCount();
+    const auto fullDataSize = System::get()->pathFileSize(dataPath);
+    ASSERT_TRUE(fullDataSize);
+
+    // Nothing is freed while both snapshots use the pages.
+    EXPECT_EQ(0u, store->collectGarbage(refsFiles, 0));
+
+    // Once the first snapshot is gone, its own pages are freed, but only
+    // if there are enough of them.
+    path_delete_file(ramPaths[0].c_str());
+    path_delete_file(refsFiles[0].c_str());
+    EXPECT_EQ(0u, store->collectGarbage(refsFiles, 100));
+    EXPECT_EQ(allPages - distinctPages2.size(),
+              store->collectGarbage(refsFiles, 0));
+    EXPECT_EQ(distinctPages2.size(), store->pageCount());
+
+    // The second snapshot is intact, and the store remembers what's freed.
+    store.reset();
+    store = PageStore::open(storeDir);
+    ASSERT_TRUE(store);
+    EXPECT_EQ(distinctPages2.size(), store->pageCount());
+    {
+        TestRamBuffer testRamOut(numPages * kTestingPageSize);
+        auto blockForTestOutput = makeRam("testRam", testRamOut.data(),
+                                          (int64_t)testRamOut.size());
+        loadRamSingleBlock(blockForTestOutput, ramPaths[1]);
+        EXPECT_EQ(testRam2, testRamOut);
+    }
+
+    // Saving the first snapshot again reuses the freed space.
+    auto blockForTest =
+            makeRam("testRam", testRam.data(), (int64_t)testRam.size());
+    saveRamSingleBlock(RamSaver::Flags::None, blockForTest, ramPaths[0],
+                       compress::Codec::lz4(), store);
+    EXPECT_EQ(allPages, store->pageCount());
+    EXPECT_EQ(fullDataSize, System::get()->pathFileSize(dataPath));
+    {
+        TestRamBuffer testRamOut(numPages * kTestingPageSize);
+        auto blockForTestOutput = makeRam("testRam", testRamOut.data(),
+                                          (int64_t)testRamOut.size());
+        loadRamSingleBlock(blockForTestOutput, ramPaths[0]);
+        EXPECT_EQ(testRam, testRamOut);
+    }
+}
+
+TEST_F(RamSnapshotTest, CopyOnWriteKeepsOriginalPages) {
+    std::string ramPath = mTempDir->makeSubPath("ram.bin");
+
+    const int numPages = 100;
+    const float noChangeChance = 0.25;
+    const float zeroPageChance = 0.5;
+
+    auto ram = generateRandomRam(numPages, zeroPageChance);
+    const auto originalRam = ram;
+
+    auto blockForTest = makeRam("testRam", ram.data(), (int64_t)ram.size());
+
+    if (!saveRamSingleBlockCopyOnWrite(blockForTest, ramPath, [&] {
+            randomMutateRam(ram, noChangeChance, zeroPageChance);
+        })) {
+        // Write protection isn't supported on this host.
+        return;
+    }
+
+    TestRamBuffer testRamOut(numPages * kTestingPageSize);
+    auto blockForTestOutput =
+        makeRam("testRam", testRamOut.data(), (int64_t)testRamOut.size());
+
+    loadRamSingleBlock(blockForTestOutput, ramPath);
+
+    EXPECT_EQ(originalRam, testRamOut);
+}
+
+TEST_F(RamSnapshotTest, StreamedSnapshot) {
+    const std::string sourceDir = mTempDir->makeSubPath("source");
+    const std::string receivedDir = mTempDir->makeSubPath("received");
+    ASSERT_EQ(0, path_mkdir_if_needed(sourceDir.c_str(), 0755));
+
+    const int numPages = 1000;
+    auto testRam = generateRandomRam(numPages, 0.3, 0);
+    saveRamSingleBlock(
+            RamSaver::Flags::Compress,
+            makeRam("testRam", testRam.data(), (int64_t)testRam.size()),
+            PathUtils::join(sourceDir, kRamFileName));
+    const std::string textures = "not really textures";
+    {
+        const auto texturesPath = PathUtils::join(sourceDir, kTexturesFileName);
+        StdioStream texturesFile(android_fopen(texturesPath.c_str(), "wb"),
+                                 StdioStream::kOwner);
+        texturesFile.write(textures.data(), textures.size());
+    }
+
+    int sendSocket;
+    int receiveSocket;
+    ASSERT_EQ(0, base::socketCreatePair(&sendSocket, &receiveSocket));
+    auto receiver = SnapshotReceiver::start(receivedDir, receiveSocket);
+    ASSERT_TRUE(receiver);
+    EXPECT_EQ(receiver, SnapshotReceiver::active(receivedDir));
+
+    std::thread sender([&sourceDir, sendSocket] {
+        EXPECT_TRUE(sendSnapshot(sourceDir, sendSocket));
+        base::socketClose(sendSocket);
+    });
+
+    ASSERT_TRUE(receiver->waitUntilLoadable());
+    EXPECT_EQ(textures,
+              readFileIntoString(
+                      PathUtils::join(receivedDir, kTexturesFileName))
+                      .valueOr({}));
+
+    TestRamBuffer testRamOut(numPages * kTestingPageSize);
+    {
+        const auto ramPath = PathUtils::join(receivedDir, kRamFileName);
+        RamLoader loader(StdioStream(android_fopen(ramPath.c_str(), "rb"),
+                                     StdioStream::kOwner),
+                         RamLoader::Flags::None,
+                         RamLoader::RamBlockStructure());
+        loader.setDataWaiter([receiver](int64_t pos, int64_t size) {
+            return receiver->waitForRamData(pos, size);
+        });
+        loader.registerBlock(makeRam("testRam", testRamOut.data(),
+                                     (int64_t)testRamOut.size()));
+        EXPECT_TRUE(loader.start(false));
+        loader.join();
+        EXPECT_FALSE(loader.hasError());
+    }
+
+    sender.join();
+    EXPECT_TRUE(receiver->waitUntilDone());
+    EXPECT_EQ(testRam, testRamOut);
+}
+
+TEST_F(RamSnapshotTest, StreamedSnapshotEndsEarly) {
+    const std::string receivedDir = mTempDir->makeSubPath("received");
+
+    int sendSocket;
+    int receiveSocket;
+    ASSERT_EQ(0, base::socketCreatePair(&sendSocket, &receiveSocket));
+    auto receiver = SnapshotReceiver::start(receivedDir, receiveSocket);
+    ASSERT_TRUE(receiver);
+
+    // A well-formed stream that ends before all of ram.bin has been sent.
+    const std::string ramData(100, 'x');
+    base::MemStream stream;
+    stream.putBe32(0x45534e50);  // 'ESNP'
+    stream.putBe32(1);
+    stream.putByte(1);  // File
+    stream.putString(kRamFileName);
+    stream.putBe64(8192);
+    stream.putByte(3);  // Loadable
+    stream.putByte(2);  // Data
+    stream.putBe32(0);
+    stream.putBe64(8);
+    stream.putBe32(uint32_t(ramData.size()));
+    stream.write(ramData.data(), ramData.size());
+    stream.putByte(4);  // Done
+    ASSERT_TRUE(base::socketSendAll(sendSocket, stream.buffer().data(),
+                                    stream.buffer().size()));
+    base::socketClose(sendSocket);
+
+    ASSERT_TRUE(receiver->waitUntilLoadable());
+    EXPECT_TRUE(receiver->waitForRamData(8, int64_t(ramData.size())));
+    EXPECT_TRUE(receiver->waitUntilDone());
+    // The rest of RAM never came.
+    EXPECT_FALSE(receiver->waitForRamData(8 + int64_t(ramData.size()), 4096));
+}
+
 }  // namespace snapshot
 }  // namespace android
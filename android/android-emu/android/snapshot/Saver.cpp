@@ -14,6 +14,10 @@
 #include "android/base/files/FileShareOpen.h"
 #include "android/base/files/PathUtils.h"
 #include "android/base/files/StdioStream.h"
+#include "android/base/misc/FileUtils.h"
+#include "android/snapshot/MemoryWatch.h"
+#include "android/snapshot/PageStore.h"
+#include "android/snapshot/PathUtils.h"
 #include "android/snapshot/RamLoader.h"
 #include "android/snapshot/TextureSaver.h"
 #include "android/snapshot/common.h"
@@ -47,6 +51,20 @@ Saver::Saver(const Snapshot& snapshot, RamLoader* loader, bool isOnExit,
             flags |= RamSaver::Flags::Async;
         }
 
+        // Let the guest run while RAM is being saved, unless we're exiting
+        // anyway. Off by default until it's seen more testing.
+        const auto cowEnvVar =
+                System::get()->envGet("ANDROID_SNAPSHOT_COPY_ON_WRITE");
+        if ((cowEnvVar == "1" || cowEnvVar == "yes" || cowEnvVar == "true") &&
+            !isOnExit && !nonzero(flags & RamSaver::Flags::Async) &&
+            MemoryWriteWatch::isSupported()) {
+            VERBOSE_PRINT(snapshot,
+                          "autoconfig: enabled copy-on-write RAM saving from "
+                          "environment [ANDROID_SNAPSHOT_COPY_ON_WRITE=%s]",
+                          cowEnvVar.c_str());
+            flags |= RamSaver::Flags::CopyOnWrite;
+        }
+
         const auto compressEnvVar =
                 System::get()->envGet("ANDROID_SNAPSHOT_COMPRESS");
         if (compressEnvVar == "1" || compressEnvVar == "yes" ||
@@ -96,13 +114,82 @@ Saver::Saver(const Snapshot& snapshot, RamLoader* loader, bool isOnExit,
             }
         }
 
-        const bool tryIncremental =
-            loader && !loader->hasError() && loader->hasGaps();
+        // The page codec for compressed snapshots: "lz4" (default), "zstd"
+        // or "zstd:<level>", with an optional zstd dictionary file.
+        auto codec = compress::Codec::lz4();
+        const auto codecEnvVar =
+                System::get()->envGet("ANDROID_SNAPSHOT_CODEC");
+        if (!codecEnvVar.empty()) {
+            auto requested = compress::Codec::fromString(codecEnvVar);
+            const auto dictPath =
+                    System::get()->envGet("ANDROID_SNAPSHOT_ZSTD_DICT");
+            if (requested &&
+                requested->type() == compress::Codec::Type::Zstd &&
+                !dictPath.empty()) {
+                auto dict = readFileIntoString(dictPath);
+                requested = dict ? compress::Codec::create(
+                                           requested->type(),
+                                           requested->level(),
+                                           std::vector<uint8_t>(dict->begin(),
+                                                                dict->end()))
+                                 : nullptr;
+            }
+            if (requested) {
+                VERBOSE_PRINT(snapshot,
+                              "autoconfig: using snapshot RAM codec from "
+                              "environment [ANDROID_SNAPSHOT_CODEC=%s]",
+                              codecEnvVar.c_str());
+                codec = std::move(requested);
+            } else {
+                dwarning("Ignoring invalid snapshot RAM codec '%s'",
+                         codecEnvVar.c_str());
+            }
+        }
+
+        // Share identical pages between all snapshots of the AVD through a
+        // content-addressed store next to the snapshots directory.
+        PageStore::Ptr pageStore;
+        const auto pageStoreEnvVar =
+                System::get()->envGet("ANDROID_SNAPSHOT_PAGE_STORE");
+        if ((pageStoreEnvVar == "1" || pageStoreEnvVar == "yes" ||
+             pageStoreEnvVar == "true") &&
+            !nonzero(flags & RamSaver::Flags::Async)) {
+            pageStore = PageStore::open(
+                    PathUtils::join(getAvdDir(), kPageStoreDirName));
+            if (pageStore) {
+                VERBOSE_PRINT(snapshot,
+                              "autoconfig: using a shared RAM page store from "
+                              "environment [ANDROID_SNAPSHOT_PAGE_STORE=%s]",
+                              pageStoreEnvVar.c_str());
+            } else {
+                dwarning("Failed to open the snapshot page store, saving "
+                         "RAM pages into the snapshot");
+            }
+        }
+
+        // Store slightly changed pages as diffs against their previous
+        // contents when saving compressed snapshots incrementally.
+        const auto deltaEnvVar =
+                System::get()->envGet("ANDROID_SNAPSHOT_DELTA_PAGES");
+        if (deltaEnvVar == "1" || deltaEnvVar == "yes" ||
+            deltaEnvVar == "true") {
+            VERBOSE_PRINT(snapshot,
+                          "autoconfig: enabled delta RAM pages from "
+                          "environment [ANDROID_SNAPSHOT_DELTA_PAGES=%s]",
+                          deltaEnvVar.c_str());
+            flags |= RamSaver::Flags::DeltaPages;
+        }
+
+        // Pages in a store are never overwritten, so there's nothing to save
+        // incrementally.
+        const bool tryIncremental = !pageStore && loader &&
+                                    !loader->hasError() && loader->hasGaps();
 
         mIncrementallySaved = tryIncremental;
+        mUsesPageStore = pageStore != nullptr;
 
         mRamSaver.emplace(ramFile, flags, tryIncremental ? loader : nullptr,
-                          isOnExit);
+                          isOnExit, std::move(codec), std::move(pageStore));
         if (mRamSaver->hasError()) {
             mRamSaver.clear();
             return;
@@ -125,6 +212,7 @@ Saver::Saver(const Snapshot& snapshot, RamLoader* loader, bool isOnExit,
 }
 
 Saver::~Saver() {
+    finishBackgroundSave();
     const bool deleteDirectory =
             mStatus != OperationStatus::Ok && (mRamSaver || mTextureSaver);
     mRamSaver.clear();
@@ -151,10 +239,74 @@ void Saver::complete(bool succeeded) {
     if (!mRamSaver || mRamSaver->hasError()) {
         return;
     }
+    if (mRamSaver->copyOnWrite()) {
+        // RAM keeps being saved after the guest resumes; RamSaver's index
+        // offset is only written at the very end, so an interrupted save
+        // can't be mistaken for a complete one. The snapshot isn't good
+        // until the background thread says so.
+        mStatus = OperationStatus::NotStarted;
+        {
+            base::AutoLock lock(mBackgroundLock);
+            mSavingInBackground = true;
+        }
+        mRamSaver->continueInBackground();
+        mRamSaver->onBackgroundSaveDone([this] { finishInBackground(); });
+        return;
+    }
     mRamSaver->join();
+    if (finish()) {
+        mStatus = OperationStatus::Ok;
+    }
+}
+
+bool Saver::savingInBackground() const {
+    base::AutoLock lock(mBackgroundLock);
+    return mSavingInBackground;
+}
+
+void Saver::onBackgroundSaveDone(std::function<void(Saver&)> func) {
+    {
+        base::AutoLock lock(mBackgroundLock);
+        if (mSavingInBackground) {
+            mOnBackgroundSaveDone = std::move(func);
+            return;
+        }
+    }
+    func(*this);
+}
+
+void Saver::finishBackgroundSave() {
+    if (mRamSaver && savingInBackground()) {
+        // The background thread finishes the save before it exits.
+        mRamSaver->join();
+    }
+}
+
+void Saver::finishInBackground() {
+    if (mRamSaver->canceled()) {
+        mStatus = OperationStatus::Canceled;
+    } else if (!mRamSaver->hasError() && finish()) {
+        mStatus = OperationStatus::Ok;
+    } else {
+        mStatus = OperationStatus::Error;
+    }
+
+    std::function<void(Saver&)> onDone;
+    {
+        base::AutoLock lock(mBackgroundLock);
+        mSavingInBackground = false;
+        onDone = std::move(mOnBackgroundSaveDone);
+    }
+    if (onDone) {
+        onDone(*this);
+    }
+}
+
+bool Saver::finish() {
+    mEndTime = base::System::get()->getHighResTimeUs();
     if (!mTextureSaver ||
         (static_cast<void>(mTextureSaver->done()), mTextureSaver->hasError())) {
-        return;
+        return false;
     }
 
     base::System::Duration ramDuration = 0;
@@ -171,18 +323,22 @@ void Saver::complete(bool succeeded) {
     }
 
     if (!mSnapshot.save()) {
-        return;
+        return false;
     }
-
-    mStatus = OperationStatus::Ok;
+    if (mUsesPageStore) {
+        // An overwritten snapshot may have left pages no one uses.
+        PageStore::collectAvdGarbage();
+    }
+    return true;
 }
 
 void Saver::cancel() {
-    mStatus = OperationStatus::Canceled;
-
+    // Stop the background save first, so it can't finish the snapshot after
+    // it's been canceled.
     if (mRamSaver) {
         mRamSaver->cancel();
     }
+    mStatus = OperationStatus::Canceled;
 
     // TODO next: texture save cancel
     path_delete_dir(c_str(mSnapshot.dataDir()));
@@ -14,11 +14,15 @@
 #include "android/base/Compiler.h"
 #include "android/base/Optional.h"
 #include "android/base/StringView.h"
+#include "android/base/synchronization/Lock.h"
 #include "android/base/system/System.h"
 #include "android/snapshot/common.h"
 #include "android/snapshot/RamSaver.h"
 #include "android/snapshot/Snapshot.h"
 
+#include <atomic>
+#include <functional>
+
 namespace android {
 namespace snapshot {
 
@@ -43,6 +47,19 @@ public:
 
     void prepare();
     void complete(bool succeeded);
+    // In copy-on-write mode complete() leaves RAM saving running after the
+    // guest resumes, and the status stays NotStarted until the background
+    // thread finishes the save.
+    bool savingInBackground() const;
+    // Calls |func| once the background save is finished, on the thread that
+    // finished it, or right away if there's none.
+    void onBackgroundSaveDone(std::function<void(Saver&)> func);
+    // Waits for the background save to finish.
+    void finishBackgroundSave();
+    // Time from the save start until all of the snapshot was written.
+    base::System::Duration durableAfterMs() const {
+        return (mEndTime - mStartTime) / 1000;
+    }
 
     bool incrementallySaved() const { return mIncrementallySaved; }
 
@@ -55,11 +72,23 @@ public:
                                     base::System::DiskKind::Hdd; }
 
 private:
-    OperationStatus mStatus;
+    // Records the save stats and writes the snapshot's metadata once all of
+    // its data is written; returns false if anything failed.
+    bool finish();
+    void finishInBackground();
+
+    std::atomic<OperationStatus> mStatus;
     Snapshot mSnapshot;
     base::Optional<RamSaver> mRamSaver;
     std::shared_ptr<TextureSaver> mTextureSaver;
     bool mIncrementallySaved = false;
+    bool mUsesPageStore = false;
+    mutable base::Lock mBackgroundLock;
+    bool mSavingInBackground = false;
+    std::function<void(Saver&)> mOnBackgroundSaveDone;
+    base::System::Duration mStartTime =
+            base::System::get()->getHighResTimeUs();
+    base::System::Duration mEndTime = 0;
     base::System::MemUsage mMemUsage;
     base::Optional<base::System::DiskKind> mDiskKind = {};
 };
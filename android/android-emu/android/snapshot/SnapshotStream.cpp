@@ -0,0 +1,362 @@
+// Copyright 2020 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+#include "android/snapshot/SnapshotStream.h"
+
+#include "android/base/EintrWrapper.h"
+#include "android/base/files/PathUtils.h"
+#include "android/base/files/StdioStream.h"
+#include "android/base/files/Stream.h"
+#include "android/base/files/preadwrite.h"
+#include "android/base/memory/LazyInstance.h"
+#include "android/base/misc/FileUtils.h"
+#include "android/base/sockets/SocketUtils.h"
+#include "android/base/system/System.h"
+#include "android/base/threads/Async.h"
+#include "android/snapshot/common.h"
+#include "android/utils/debug.h"
+#include "android/utils/file_io.h"
+#include "android/utils/path.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+using android::base::AutoLock;
+using android::base::LazyInstance;
+using android::base::PathUtils;
+using android::base::StdioStream;
+using android::base::StringView;
+using android::base::System;
+
+namespace android {
+namespace snapshot {
+
+static constexpr uint32_t kMagic = 0x45534e50;  // 'ESNP'
+static constexpr uint32_t kVersion = 1;
+static constexpr int64_t kChunkSize = 1024 * 1024;
+
+enum class Message : uint8_t {
+    File = 1,      // Name and size of the next file.
+    Data = 2,      // File index, position, size and the bytes.
+    Loadable = 3,  // Only RAM pages are left.
+    Done = 4,
+};
+
+namespace {
+
+// A blocking socket as a Stream; it stays failed after the first error.
+class SocketStream : public base::Stream {
+public:
+    explicit SocketStream(int socket) : mSocket(socket) {
+        base::socketSetBlocking(socket);
+    }
+
+    ssize_t read(void* buffer, size_t size) override {
+        if (mFailed || !base::socketRecvAll(mSocket, buffer, size)) {
+            mFailed = true;
+            memset(buffer, 0, size);
+            return -1;
+        }
+        return ssize_t(size);
+    }
+
+    ssize_t write(const void* buffer, size_t size) override {
+        if (mFailed || !base::socketSendAll(mSocket, buffer, size)) {
+            mFailed = true;
+            return -1;
+        }
+        return ssize_t(size);
+    }
+
+    bool failed() const { return mFailed; }
+
+private:
+    const int mSocket;
+    bool mFailed = false;
+};
+
+struct ReceiverRegistry {
+    base::Lock lock;
+    std::unordered_map<std::string, std::weak_ptr<SnapshotReceiver>> receivers;
+};
+
+LazyInstance<ReceiverRegistry> sRegistry = LAZY_INSTANCE_INIT;
+
+}  // namespace
+
+static bool sendFileData(SocketStream& out,
+                         uint32_t fileIndex,
+                         int fd,
+                         int64_t pos,
+                         int64_t size,
+                         std::vector<char>* buffer) {
+    while (size > 0) {
+        const auto chunk = std::min(size, kChunkSize);
+        buffer->resize(size_t(chunk));
+        if (HANDLE_EINTR(base::pread(fd, buffer->data(), size_t(chunk), pos)) !=
+            chunk) {
+            return false;
+        }
+        out.putByte(uint8_t(Message::Data));
+        out.putBe32(fileIndex);
+        out.putBe64(uint64_t(pos));
+        out.putBe32(uint32_t(chunk));
+        out.write(buffer->data(), size_t(chunk));
+        if (out.failed()) {
+            return false;
+        }
+        pos += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool sendSnapshot(StringView dataDir, int socket) {
+    auto names = System::get()->scanDirEntries(dataDir);
+    names.erase(std::remove_if(names.begin(), names.end(),
+                               [dataDir](const std::string& name) {
+                                   return name == kRamFileName ||
+                                          !System::get()->pathIsFile(
+                                                  PathUtils::join(dataDir,
+                                                                  name));
+                               }),
+                names.end());
+    if (!System::get()->pathIsFile(PathUtils::join(dataDir, kRamFileName))) {
+        return false;
+    }
+    // The RAM file goes last, as its pages are the only part the receiver
+    // doesn't wait for before loading.
+    names.push_back(kRamFileName);
+
+    SocketStream out(socket);
+    out.putBe32(kMagic);
+    out.putBe32(kVersion);
+
+    std::vector<char> buffer;
+    for (uint32_t i = 0; i < names.size(); ++i) {
+        const auto& name = names[i];
+        StdioStream file(
+                android_fopen(PathUtils::join(dataDir, name).c_str(), "rb"),
+                StdioStream::kOwner);
+        System::FileSize size;
+        if (!file.get() ||
+            !System::get()->fileSize(fileno(file.get()), &size)) {
+            derror("Failed to open snapshot file '%s' for sending",
+                   name.c_str());
+            return false;
+        }
+        const int fd = fileno(file.get());
+
+        out.putByte(uint8_t(Message::File));
+        out.putString(name);
+        out.putBe64(size);
+
+        if (name != kRamFileName) {
+            if (!sendFileData(out, i, fd, 0, int64_t(size), &buffer)) {
+                return false;
+            }
+            continue;
+        }
+
+        const auto indexPos = int64_t(file.getBe64());
+        if (indexPos < int64_t(sizeof(uint64_t)) || indexPos > int64_t(size)) {
+            return false;
+        }
+        if (!sendFileData(out, i, fd, 0, sizeof(uint64_t), &buffer) ||
+            !sendFileData(out, i, fd, indexPos, int64_t(size) - indexPos,
+                          &buffer)) {
+            return false;
+        }
+        out.putByte(uint8_t(Message::Loadable));
+        if (!sendFileData(out, i, fd, sizeof(uint64_t),
+                          indexPos - int64_t(sizeof(uint64_t)), &buffer)) {
+            return false;
+        }
+    }
+
+    out.putByte(uint8_t(Message::Done));
+    return !out.failed();
+}
+
+SnapshotReceiver::SnapshotReceiver(StringView dataDir, int socket)
+    : mDataDir(dataDir), mSocket(socket) {}
+
+SnapshotReceiver::~SnapshotReceiver() {
+    auto& registry = sRegistry.get();
+    AutoLock lock(registry.lock);
+    const auto it = registry.receivers.find(mDataDir);
+    if (it != registry.receivers.end() && it->second.expired()) {
+        registry.receivers.erase(it);
+    }
+}
+
+SnapshotReceiver::Ptr SnapshotReceiver::start(StringView dataDir, int socket) {
+    Ptr receiver(new SnapshotReceiver(dataDir, socket));
+    {
+        auto& registry = sRegistry.get();
+        AutoLock lock(registry.lock);
+        auto& entry = registry.receivers[receiver->mDataDir];
+        if (entry.lock()) {
+            derror("Already receiving a snapshot into '%s'",
+                   receiver->mDataDir.c_str());
+            return nullptr;
+        }
+        entry = receiver;
+    }
+
+    // The thread keeps the receiver alive until the transfer is over.
+    if (!base::async([receiver] { receiver->receive(); })) {
+        receiver->setState(false, true, true);
+        return nullptr;
+    }
+    return receiver;
+}
+
+SnapshotReceiver::Ptr SnapshotReceiver::active(StringView dataDir) {
+    auto& registry = sRegistry.get();
+    AutoLock lock(registry.lock);
+    const auto it = registry.receivers.find(dataDir);
+    return it != registry.receivers.end() ? it->second.lock() : nullptr;
+}
+
+bool SnapshotReceiver::waitUntilLoadable() {
+    AutoLock lock(mLock);
+    mCv.wait(&lock, [this] { return mLoadable || mFailed; });
+    return !mFailed;
+}
+
+bool SnapshotReceiver::waitForRamData(int64_t pos, int64_t size) {
+    AutoLock lock(mLock);
+    mCv.wait(&lock, [this, pos, size] {
+        return mDone || pos + size <= mRamDataEnd;
+    });
+    return pos + size <= mRamDataEnd;
+}
+
+bool SnapshotReceiver::waitUntilDone() {
+    AutoLock lock(mLock);
+    mCv.wait(&lock, [this] { return mDone; });
+    return !mFailed;
+}
+
+void SnapshotReceiver::setState(bool loadable, bool done, bool failed) {
+    AutoLock lock(mLock);
+    mLoadable |= loadable;
+    mDone |= done;
+    mFailed |= failed;
+    mCv.broadcastAndUnlock(&lock);
+}
+
+void SnapshotReceiver::receive() {
+    const bool res = receiveFiles();
+    mSocket.close();
+    if (!res) {
+        derror("Failed to receive a snapshot into '%s'", mDataDir.c_str());
+    }
+    setState(false, true, !res);
+}
+
+bool SnapshotReceiver::receiveFiles() {
+    if (path_mkdir_if_needed(mDataDir.c_str(), 0755) != 0) {
+        return false;
+    }
+
+    SocketStream in(mSocket.get());
+    if (in.getBe32() != kMagic || in.getBe32() != kVersion) {
+        return false;
+    }
+
+    std::vector<StdioStream> files;
+    // The sizes announced in Message::File; data can't go past them.
+    std::vector<int64_t> fileSizes;
+    int ramFileIndex = -1;
+    bool loadable = false;
+    std::vector<char> buffer;
+    for (;;) {
+        const auto message = Message(in.getByte());
+        if (in.failed()) {
+            return false;
+        }
+        switch (message) {
+            case Message::File: {
+                const auto name = in.getString();
+                const auto size = int64_t(in.getBe64());
+                // Only plain file names, nothing outside of the directory.
+                if (in.failed() || size < 0 || name.empty() || name == "." ||
+                    name == ".." ||
+                    name.find_first_of("/\\") != std::string::npos) {
+                    return false;
+                }
+                files.emplace_back(
+                        android_fopen(
+                                PathUtils::join(mDataDir, name).c_str(), "wb"),
+                        StdioStream::kOwner);
+                fileSizes.push_back(size);
+                if (!files.back().get() ||
+                    !setFileSize(fileno(files.back().get()), size)) {
+                    return false;
+                }
+                if (name == kRamFileName) {
+                    ramFileIndex = int(files.size()) - 1;
+                }
+                break;
+            }
+            case Message::Data: {
+                const auto fileIndex = in.getBe32();
+                const auto pos = int64_t(in.getBe64());
+                const auto size = int64_t(in.getBe32());
+                if (in.failed() || fileIndex >= files.size() ||
+                    size > kChunkSize || pos < 0 ||
+                    pos + size > fileSizes[fileIndex]) {
+                    return false;
+                }
+                buffer.resize(size_t(size));
+                in.read(buffer.data(), size_t(size));
+                if (in.failed() ||
+                    HANDLE_EINTR(base::pwrite(fileno(files[fileIndex].get()),
+                                              buffer.data(), size_t(size),
+                                              pos)) != size) {
+                    return false;
+                }
+                if (loadable && int(fileIndex) == ramFileIndex) {
+                    AutoLock lock(mLock);
+                    // RAM pages arrive in the file order.
+                    if (pos != mRamDataEnd) {
+                        return false;
+                    }
+                    mRamDataEnd = pos + size;
+                    mCv.broadcastAndUnlock(&lock);
+                }
+                break;
+            }
+            case Message::Loadable: {
+                if (ramFileIndex < 0) {
+                    return false;
+                }
+                loadable = true;
+                AutoLock lock(mLock);
+                mRamDataEnd = sizeof(uint64_t);
+                mLoadable = true;
+                mCv.broadcastAndUnlock(&lock);
+                break;
+            }
+            case Message::Done:
+                return loadable;
+            default:
+                return false;
+        }
+    }
+}
+
+}  // namespace snapshot
+}  // namespace android
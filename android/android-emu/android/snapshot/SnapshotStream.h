@@ -0,0 +1,89 @@
+// Copyright 2020 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+#pragma once
+
+#include "android/base/Compiler.h"
+#include "android/base/StringView.h"
+#include "android/base/sockets/ScopedSocket.h"
+#include "android/base/synchronization/ConditionVariable.h"
+#include "android/base/synchronization/Lock.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace android {
+namespace snapshot {
+
+//
+// Streaming a saved snapshot to another emulator on the same host, e.g. over
+// a Unix domain socket, so the receiver can start loading it before the whole
+// snapshot has arrived.
+//
+// The snapshot files are sent as they are on disk, in the same layout. All
+// files except RAM pages go first: the RAM file's header and index, the
+// textures and the rest of the snapshot. Then the RAM pages follow in the
+// file order, and the receiver's RamLoader waits for the pages it needs.
+//
+
+// Sends the snapshot in |dataDir| over |socket|. Returns false if the
+// snapshot couldn't be read or the receiver went away.
+bool sendSnapshot(base::StringView dataDir, int socket);
+
+// SnapshotReceiver - receives a snapshot sent with sendSnapshot() into a
+// snapshot directory, on a thread of its own.
+class SnapshotReceiver {
+    DISALLOW_COPY_AND_ASSIGN(SnapshotReceiver);
+
+public:
+    using Ptr = std::shared_ptr<SnapshotReceiver>;
+
+    // Starts receiving into |dataDir| from |socket|, which it takes over.
+    static Ptr start(base::StringView dataDir, int socket);
+
+    // Returns the receiver writing into |dataDir|, if there's one running.
+    static Ptr active(base::StringView dataDir);
+
+    ~SnapshotReceiver();
+
+    // Blocks until everything but the RAM pages has arrived, so the snapshot
+    // can be loaded. Returns false if the transfer failed.
+    bool waitUntilLoadable();
+
+    // Blocks until bytes [pos, pos + size) of the RAM file have arrived.
+    // Returns false if the transfer ended without them.
+    bool waitForRamData(int64_t pos, int64_t size);
+
+    // Blocks until the whole snapshot has arrived.
+    bool waitUntilDone();
+
+private:
+    SnapshotReceiver(base::StringView dataDir, int socket);
+
+    void receive();
+    bool receiveFiles();
+    void setState(bool loadable, bool done, bool failed);
+
+    const std::string mDataDir;
+    base::ScopedSocket mSocket;
+
+    base::Lock mLock;
+    base::ConditionVariable mCv;
+    // RAM file bytes before this position have arrived.
+    int64_t mRamDataEnd = 0;
+    bool mLoadable = false;
+    bool mDone = false;
+    bool mFailed = false;
+};
+
+}  // namespace snapshot
+}  // namespace android
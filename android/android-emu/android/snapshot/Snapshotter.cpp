@@ -13,6 +13,7 @@
 
 #include "android/base/files/PathUtils.h"
 #include "android/base/memory/LazyInstance.h"
+#include "android/base/sockets/SocketUtils.h"
 #include "android/base/Stopwatch.h"
 #include "android/base/StringFormat.h"
 #include "android/crashreport/CrashReporter.h"
@@ -31,9 +32,11 @@
 #include "android/opengl/emugl_config.h"
 #include "android/snapshot/Hierarchy.h"
 #include "android/snapshot/Loader.h"
+#include "android/snapshot/PageStore.h"
 #include "android/snapshot/PathUtils.h"
 #include "android/snapshot/Quickboot.h"
 #include "android/snapshot/Saver.h"
+#include "android/snapshot/SnapshotStream.h"
 #include "android/snapshot/TextureLoader.h"
 #include "android/snapshot/TextureSaver.h"
 #include "android/snapshot/interface.h"
@@ -231,8 +234,13 @@ void Snapshotter::initialize(const QAndroidVmOperations& vmOperations,
              // savingComplete
              [](void* opaque) {
                  auto snapshot = static_cast<Snapshotter*>(opaque);
-                 snapshot->mSaver->ramSaver().join();
-                 return snapshot->mSaver->ramSaver().hasError() ? -1 : 0;
+                 auto& ramSaver = snapshot->mSaver->ramSaver();
+                 if (ramSaver.copyOnWrite()) {
+                     ramSaver.continueInBackground();
+                 } else {
+                     ramSaver.join();
+                 }
+                 return ramSaver.hasError() ? -1 : 0;
              },
              // loadRam
              [](void* opaque, void* hostRamPtr, uint64_t size) {
@@ -421,7 +429,16 @@ void Snapshotter::fillSnapshotMetrics(pb::EmulatorSnapshot* snapshot,
 
 Snapshotter::SnapshotOperationStats Snapshotter::getSaveStats(const char* name,
                                                               System::Duration durationMs) {
-    auto& save = saver();
+    // The sizes and durations of a copy-on-write save are only final once
+    // it's done.
+    saver().finishBackgroundSave();
+    return getSaveStats(saver(), name, durationMs);
+}
+
+// static
+Snapshotter::SnapshotOperationStats Snapshotter::getSaveStats(Saver& save,
+                                                              const char* name,
+                                                              System::Duration durationMs) {
     const auto compressedRam = save.ramSaver().compressed();
     const auto compressedTextures = save.textureSaver()->compressed();
     const auto diskSize = save.snapshot().diskSize();
@@ -484,13 +501,16 @@ Snapshotter::SnapshotOperationStats Snapshotter::getLoadStats(const char* name,
 }
 
 
-void Snapshotter::appendSuccessfulSave(const char* name,
+// static
+void Snapshotter::appendSuccessfulSave(Saver& saver,
+                                       const char* name,
                                        System::Duration durationMs) {
 #if SNAPSHOT_METRICS
-    if (!mSaver ||
-        !mSaver->textureSaver()) return;
+    if (!saver.textureSaver()) return;
 
-    auto stats = getSaveStats(name, durationMs);
+    // With copy-on-write, |durationMs| is just the guest pause, and the RAM
+    // save duration runs until RAM was on disk.
+    auto stats = getSaveStats(saver, name, durationMs);
     MetricsReporter::get().report([stats](pb::AndroidStudioEvent* event) {
         fillSnapshotMetrics(event, stats);
     });
@@ -654,13 +674,42 @@ void Snapshotter::handleGenericSave(const char* name,
         deleteSnapshot(name);
 
     } else {
-        if (reportMetrics) {
-            appendSuccessfulSave(name,
-                                 mLastSaveDuration ? *mLastSaveDuration : 1234);
+        if (reportMetrics && mSaver) {
+            const auto pauseMs = mLastSaveDuration ? *mLastSaveDuration : 1234;
+            mSaver->onBackgroundSaveDone(
+                    [pauseMs, name = std::string(name)](Saver& saver) {
+                        onSaveDone(saver, name, pauseMs);
+                    });
         }
     }
 }
 
+// static
+void Snapshotter::onSaveDone(Saver& saver,
+                             const std::string& name,
+                             System::Duration pauseMs) {
+    if (saver.status() == OperationStatus::Canceled) {
+        return;
+    }
+    if (saver.status() != OperationStatus::Ok) {
+        // The snapshot's metadata isn't written, so it won't ever load; its
+        // data goes away with the saver.
+        derror("Background save of snapshot '%s' failed", name.c_str());
+        auto failureReason = saver.snapshot().failureReason();
+        appendFailedSave(
+                pb::EmulatorSnapshotSaveState::EMULATOR_SNAPSHOT_SAVE_FAILED,
+                failureReason ? *failureReason : FailureReason::InternalError);
+        return;
+    }
+    if (saver.ramSaver().copyOnWrite()) {
+        VERBOSE_PRINT(snapshot,
+                      "Snapshot '%s' paused the guest for %d ms, and was on "
+                      "disk after %d ms",
+                      name.c_str(), int(pauseMs), int(saver.durableAfterMs()));
+    }
+    appendSuccessfulSave(saver, name.c_str(), pauseMs);
+}
+
 void Snapshotter::handleGenericLoad(const char* name,
                                     OperationStatus loadStatus,
                                     bool reportMetrics) {
@@ -737,9 +786,15 @@ OperationStatus Snapshotter::save(bool isOnExit, const char* name) {
         mVmOperations.setExiting();
     }
     mVmOperations.snapshotSave(name, this, nullptr);
+    // This is how long the guest was paused. A copy-on-write save keeps
+    // writing RAM in the background after that, and reports its result
+    // when it's done; the next save, load or delete waits for it.
     mLastSaveDuration.emplace(sw.elapsedUs() / 1000);
     // In unit tests, we don't have a saver, so trivially succeed.
-    return mSaver ? mSaver->status() : OperationStatus::Ok;
+    if (!mSaver || mSaver->savingInBackground()) {
+        return OperationStatus::Ok;
+    }
+    return mSaver->status();
 }
 
 void Snapshotter::setRamFile(const char* path, bool shared) {
@@ -788,6 +843,25 @@ OperationStatus Snapshotter::loadGeneric(const char* name) {
     return res;
 }
 
+bool Snapshotter::send(const char* name, int socket) {
+    if (!name) {
+        return false;
+    }
+    return sendSnapshot(getSnapshotDir(name), socket);
+}
+
+OperationStatus Snapshotter::receiveAndLoad(const char* name, int socket) {
+    if (!name) {
+        base::socketClose(socket);
+        return OperationStatus::Error;
+    }
+    auto receiver = SnapshotReceiver::start(getSnapshotDir(name), socket);
+    if (!receiver || !receiver->waitUntilLoadable()) {
+        return OperationStatus::Error;
+    }
+    return loadGeneric(name);
+}
+
 void Snapshotter::deleteSnapshot(const char* name) {
     std::string nameWithStorage(name);
     fprintf(stderr, "%s: for %s\n", __func__, nameWithStorage.c_str());
@@ -795,6 +869,7 @@ void Snapshotter::deleteSnapshot(const char* name) {
 
     // then delete the folder and refresh hierarchy
     path_delete_dir(getSnapshotDir(nameWithStorage.c_str()).c_str());
+    PageStore::collectAvdGarbage();
     // bug: 129763714
     // Hierarchy::get()->currentInfo();
 }
@@ -866,6 +941,9 @@ bool Snapshotter::onStartSaving(const char* name) {
 #endif
     callCallbacks(Operation::Save, Stage::Start);
     prepareLoaderForSaving(name);
+    if (mSaver) {
+        mSaver->finishBackgroundSave();
+    }
     if (!mSaver || isComplete(*mSaver)) {
         mSaver.reset(new Saver(
                 name, (mLoader && mLoader->hasRamLoader() &&
@@ -978,10 +1056,13 @@ void Snapshotter::onLoadingFailed(const char* name, int err) {
                     *failureReason : errnoToFailure(-err)));
 }
 
-bool Snapshotter::onStartDelete(const char*) {
+bool Snapshotter::onStartDelete(const char* name) {
 #ifndef AEMU_MIN
     CrashReporter::get()->hangDetector().pause(true);
 #endif
+    if (mSaver && mSaver->snapshot().name() == name) {
+        mSaver->finishBackgroundSave();
+    }
     return true;
 }
 
@@ -995,6 +1076,7 @@ bool Snapshotter::onDeletingComplete(const char* name, int res) {
         }
         if (!mIsInvalidating) {
             path_delete_dir(base::c_str(Snapshot::dataDir(name)));
+            PageStore::collectAvdGarbage();
         }
     }
 #ifndef AEMU_MIN
@@ -68,6 +68,9 @@ public:
         const SnapshotOperationStats& stats);
     SnapshotOperationStats getLoadStats(const char* name, base::System::Duration durationMs);
     SnapshotOperationStats getSaveStats(const char* name, base::System::Duration durationMs);
+    static SnapshotOperationStats getSaveStats(Saver& save,
+                                               const char* name,
+                                               base::System::Duration durationMs);
 
     void initialize(const QAndroidVmOperations& vmOperations,
                     const QAndroidEmulatorWindowAgent& windowAgent);
@@ -95,6 +98,13 @@ public:
     OperationStatus saveGeneric(const char* name);
     OperationStatus loadGeneric(const char* name);
 
+    // Streams the saved snapshot |name| to another emulator over |socket|.
+    bool send(const char* name, int socket);
+    // Receives snapshot |name| from another emulator over |socket| and loads
+    // it as soon as only its RAM pages are left to arrive; the pages are then
+    // loaded as they come.
+    OperationStatus receiveAndLoad(const char* name, int socket);
+
     void deleteSnapshot(const char* name);
     void invalidateSnapshot(const char* name);
     bool areSavesSlow(const char* name);
@@ -154,8 +164,14 @@ private:
     void prepareLoaderForSaving(const char* name);
     void callCallbacks(Operation op, Stage stage);
 
-    void appendSuccessfulSave(const char* name,
-                              base::System::Duration durationMs);
+    // Reports the result of a save once all of it is on disk; |pauseMs| is
+    // how long the guest was paused for it.
+    static void onSaveDone(Saver& saver,
+                           const std::string& name,
+                           base::System::Duration pauseMs);
+    static void appendSuccessfulSave(Saver& saver,
+                                     const char* name,
+                                     base::System::Duration durationMs);
     void appendSuccessfulLoad(const char* name,
                               base::System::Duration durationMs);
     void showError(const std::string& msg);
@@ -13,10 +13,14 @@
 
 #include "android/base/EintrWrapper.h"
 #include "android/base/files/DecompressingStream.h"
+#include "android/base/files/MemStream.h"
+#include "android/base/files/preadwrite.h"
 
 #include <assert.h>
+#include <memory>
 
 using android::base::DecompressingStream;
+using android::base::MemStream;
 
 namespace android {
 namespace snapshot {
@@ -39,9 +43,19 @@ bool TextureLoader::start() {
 }
 
 void TextureLoader::loadTexture(uint32_t texId, const loader_t& loader) {
+    const auto it = mIndex.find(texId);
+    assert(it != mIndex.end());
+    const Texture& texture = it->second;
+    if (mVersion > 2) {
+        // Textures are read with pread(), so the background loader and the
+        // render threads restoring textures on first use don't wait for each
+        // other.
+        loadTextureData(texture, loader);
+        return;
+    }
+
     android::base::AutoLock scopedLock(mLock);
-    assert(mIndex.count(texId));
-    HANDLE_EINTR(fseeko64(mStream.get(), mIndex[texId], SEEK_SET));
+    HANDLE_EINTR(fseeko64(mStream.get(), texture.filePos, SEEK_SET));
     switch (mVersion) {
         case 1:
             loader(&mStream);
@@ -56,6 +70,35 @@ void TextureLoader::loadTexture(uint32_t texId, const loader_t& loader) {
     }
 }
 
+void TextureLoader::loadTextureData(const Texture& texture,
+                                    const loader_t& loader) {
+    MemStream::Buffer data(texture.size);
+    std::unique_ptr<uint8_t[]> compressed;
+    const bool isCompressed = texture.sizeOnDisk < texture.size;
+    if (isCompressed) {
+        compressed.reset(new uint8_t[texture.sizeOnDisk]);
+    }
+    uint8_t* const readTo = isCompressed
+                                    ? compressed.get()
+                                    : reinterpret_cast<uint8_t*>(data.data());
+    const bool res =
+            HANDLE_EINTR(base::pread(mStreamFd, readTo, texture.sizeOnDisk,
+                                     texture.filePos)) ==
+                    int64_t(texture.sizeOnDisk) &&
+            (!isCompressed ||
+             mCodec->decompress(compressed.get(), int32_t(texture.sizeOnDisk),
+                                reinterpret_cast<uint8_t*>(data.data()),
+                                int32_t(texture.size)));
+    if (!res) {
+        mHasError = true;
+        return;
+    }
+    compressed.reset();
+
+    MemStream stream(std::move(data));
+    loader(&stream);
+}
+
 bool TextureLoader::readIndex() {
 #if SNAPSHOT_PROFILE > 1
     auto start = android::base::System::get()->getHighResTimeUs();
@@ -68,15 +111,27 @@ bool TextureLoader::readIndex() {
     auto indexPos = mStream.getBe64();
     HANDLE_EINTR(fseeko64(mStream.get(), static_cast<int64_t>(indexPos), SEEK_SET));
     mVersion = mStream.getBe32();
-    if (mVersion < 1 || mVersion > 2) {
+    if (mVersion < 1 || mVersion > 3) {
         return false;
     }
+    if (mVersion > 2) {
+        mCodec = compress::Codec::load(mStream);
+        if (!mCodec) {
+            return false;
+        }
+        mStreamFd = fileno(mStream.get());
+    }
     uint32_t texCount = mStream.getBe32();
     mIndex.reserve(texCount);
     for (uint32_t i = 0; i < texCount; i++) {
         uint32_t tex = mStream.getBe32();
-        uint64_t filePos = mStream.getBe64();
-        mIndex.emplace(tex, filePos);
+        Texture texture = {};
+        texture.filePos = int64_t(mStream.getBe64());
+        if (mVersion > 2) {
+            texture.sizeOnDisk = mStream.getBe32();
+            texture.size = mStream.getBe32();
+        }
+        mIndex.emplace(tex, texture);
     }
 #if SNAPSHOT_PROFILE > 1
     printf("Texture readIndex() time: %.03f\n",
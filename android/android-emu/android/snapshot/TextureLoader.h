@@ -17,8 +17,10 @@
 #include "android/base/synchronization/Lock.h"
 #include "android/base/system/System.h"
 #include "android/base/threads/Thread.h"
+#include "android/snapshot/Compressor.h"
 #include "android/snapshot/common.h"
 
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <unordered_map>
@@ -55,7 +57,9 @@ public:
 
     AEMU_EXPORT bool start() override;
     AEMU_EXPORT void loadTexture(uint32_t texId, const loader_t& loader) override;
-    AEMU_EXPORT bool hasError() const override { return mHasError; }
+    AEMU_EXPORT bool hasError() const override {
+        return mHasError.load(std::memory_order_relaxed);
+    }
     AEMU_EXPORT uint64_t diskSize() const override { return mDiskSize; }
     AEMU_EXPORT bool compressed() const override { return mVersion > 1; }
 
@@ -98,13 +102,23 @@ public:
     }
 
 private:
+    struct Texture {
+        int64_t filePos;
+        uint32_t sizeOnDisk;
+        uint32_t size;
+    };
+
     bool readIndex();
+    void loadTextureData(const Texture& texture, const loader_t& loader);
 
     android::base::StdioStream mStream;
-    std::unordered_map<uint32_t, int64_t> mIndex;
+    int mStreamFd = -1;
+    compress::CodecPtr mCodec;
+    std::unordered_map<uint32_t, Texture> mIndex;
+    // Only needed for the old formats, which load through |mStream|.
     android::base::Lock mLock;
     bool mStarted = false;
-    bool mHasError = false;
+    std::atomic<bool> mHasError{false};
     int mVersion = 0;
     uint64_t mDiskSize = 0;
     LoaderThreadPtr mLoaderThread;
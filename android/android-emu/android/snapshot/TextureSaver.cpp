@@ -11,24 +11,40 @@
 
 #include "android/snapshot/TextureSaver.h"
 
-#include "android/base/files/CompressingStream.h"
+#include "android/base/EintrWrapper.h"
+#include "android/base/files/preadwrite.h"
 #include "android/base/system/System.h"
 
 #include <algorithm>
 #include <cassert>
 #include <iterator>
+#include <memory>
 #include <utility>
 
-using android::base::CompressingStream;
+using android::base::AutoLock;
+using android::base::MemStream;
 using android::base::System;
 
 namespace android {
 namespace snapshot {
 
+// Stop reading back textures while the workers are this much behind, so
+// saving a lot of textures doesn't keep them all in RAM at once.
+static constexpr int64_t kMaxQueuedBytes = 64 * 1024 * 1024;
+
 TextureSaver::TextureSaver(android::base::StdioStream&& stream)
     : mStream(std::move(stream)) {
     // Put a placeholder for the index offset right now.
     mStream.putBe64(0);
+    fflush(mStream.get());
+    mStreamFd = fileno(mStream.get());
+
+    mWorkers.emplace(compress::workerCount(), [this](QueuedTexture&& texture) {
+        writeTexture(std::move(texture));
+    });
+    if (!mWorkers->start()) {
+        mWorkers.clear();
+    }
 }
 
 TextureSaver::~TextureSaver() {
@@ -46,24 +62,83 @@ void TextureSaver::saveTexture(uint32_t texId, const saver_t& saver) {
                         [texId](FileIndex::Texture& tex) {
                             return tex.texId == texId;
                         }));
-    mIndex.textures.push_back({texId, ftello64(mStream.get())});
 
-    CompressingStream stream(mStream);
-    saver(&stream, &mBuffer);
+    QueuedTexture texture = {texId, MemStream()};
+    saver(&texture.data, &mBuffer);
+
+    const int64_t size = texture.data.writtenSize();
+    if (!mWorkers) {
+        writeTexture(std::move(texture));
+        return;
+    }
+    {
+        AutoLock lock(mLock);
+        mQueuedCv.wait(&lock, [this] {
+            return mQueuedBytes < kMaxQueuedBytes;
+        });
+        mQueuedBytes += size;
+    }
+    mWorkers->enqueue(std::move(texture));
+}
+
+void TextureSaver::writeTexture(QueuedTexture&& texture) {
+    const auto& data = texture.data.buffer();
+    const auto size = int32_t(texture.data.writtenSize());
+
+    std::unique_ptr<uint8_t[]> compressed;
+    const uint8_t* toWrite = reinterpret_cast<const uint8_t*>(data.data());
+    int32_t sizeOnDisk = size;
+    if (size > 0) {
+        const int32_t maxSize = compress::maxCompressedSize(size);
+        compressed.reset(new uint8_t[maxSize]);
+        const int32_t compressedSize =
+                mCodec->compress(toWrite, size, compressed.get(), maxSize);
+        // Same as with RAM pages: the texture is compressed iff it's
+        // smaller on disk.
+        if (compressedSize > 0 && compressedSize < size) {
+            toWrite = compressed.get();
+            sizeOnDisk = compressedSize;
+        }
+    }
+
+    int64_t filePos;
+    {
+        AutoLock lock(mLock);
+        filePos = mEndPos;
+        mEndPos += sizeOnDisk;
+        mIndex.textures.push_back(
+                {texture.texId, filePos, uint32_t(sizeOnDisk), uint32_t(size)});
+    }
+
+    const bool written =
+            HANDLE_EINTR(base::pwrite(mStreamFd, toWrite, size_t(sizeOnDisk),
+                                      filePos)) == sizeOnDisk;
+
+    AutoLock lock(mLock);
+    mHasError |= !written;
+    if (mWorkers) {
+        mQueuedBytes -= size;
+        mQueuedCv.signalAndUnlock(&lock);
+    }
 }
 
 void TextureSaver::done() {
     if (mFinished) {
         return;
     }
-    mIndex.startPosInFile = ftello64(mStream.get());
+    if (mWorkers) {
+        mWorkers->done();
+        mWorkers->join();
+    }
+    mIndex.startPosInFile = mEndPos;
+    HANDLE_EINTR(fseeko64(mStream.get(), mEndPos, SEEK_SET));
     writeIndex();
     mEndTime = System::get()->getHighResTimeUs();
 #if SNAPSHOT_PROFILE > 1
     printf("Texture saving time: %.03f\n",
            (mEndTime - mStartTime) / 1000.0);
 #endif
-    mHasError = ferror(mStream.get()) != 0;
+    mHasError |= ferror(mStream.get()) != 0;
     mFinished = true;
     mStream.close();
 }
@@ -74,10 +149,13 @@ void TextureSaver::writeIndex() {
 #endif
 
     mStream.putBe32(static_cast<uint32_t>(mIndex.version));
+    mCodec->save(mStream);
     mStream.putBe32(static_cast<uint32_t>(mIndex.textures.size()));
     for (const FileIndex::Texture& b : mIndex.textures) {
         mStream.putBe32(b.texId);
         mStream.putBe64(static_cast<uint64_t>(b.filePos));
+        mStream.putBe32(b.sizeOnDisk);
+        mStream.putBe32(b.size);
     }
     auto end = ftello64(mStream.get());
     mDiskSize = uint64_t(end);
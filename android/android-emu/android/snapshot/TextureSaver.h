@@ -13,8 +13,14 @@
 
 #include "android/base/containers/SmallVector.h"
 #include "android/base/export.h"
+#include "android/base/Optional.h"
+#include "android/base/files/MemStream.h"
 #include "android/base/files/StdioStream.h"
+#include "android/base/synchronization/ConditionVariable.h"
+#include "android/base/synchronization/Lock.h"
 #include "android/base/system/System.h"
+#include "android/base/threads/ThreadPool.h"
+#include "android/snapshot/Compressor.h"
 #include "android/snapshot/common.h"
 
 #include <functional>
@@ -52,7 +58,10 @@ public:
     AEMU_EXPORT void saveTexture(uint32_t texId, const saver_t& saver) override;
     AEMU_EXPORT void done();
 
-    AEMU_EXPORT bool hasError() const override { return mHasError; }
+    AEMU_EXPORT bool hasError() const override {
+        base::AutoLock lock(mLock);
+        return mHasError;
+    }
     AEMU_EXPORT uint64_t diskSize() const override { return mDiskSize; }
     AEMU_EXPORT bool compressed() const override { return mIndex.version > 1; }
 
@@ -76,19 +85,40 @@ private:
         struct Texture {
             uint32_t texId;
             int64_t filePos;
+            uint32_t sizeOnDisk;
+            uint32_t size;
         };
 
         int64_t startPosInFile;
-        int32_t version = 2;
+        int32_t version = 3;
         std::vector<Texture> textures;
     };
 
+    // A texture read back from the GPU, waiting to be compressed and written.
+    struct QueuedTexture {
+        uint32_t texId;
+        android::base::MemStream data;
+    };
+
+    void writeTexture(QueuedTexture&& texture);
     void writeIndex();
 
     android::base::StdioStream mStream;
+    int mStreamFd;
     // A buffer for fetching data from GPU memory to RAM.
     android::base::SmallFixedVector<unsigned char, 128> mBuffer;
 
+    // Textures are read back on the caller's thread and then compressed and
+    // written by the workers, each one at its own position in the file.
+    compress::CodecPtr mCodec = compress::Codec::lz4();
+    base::Optional<base::ThreadPool<QueuedTexture>> mWorkers;
+
+    mutable base::Lock mLock;
+    base::ConditionVariable mQueuedCv;
+    // Read back texture bytes the workers haven't written yet.
+    int64_t mQueuedBytes = 0;
+    int64_t mEndPos = sizeof(uint64_t);
+
     FileIndex mIndex;
     uint64_t mDiskSize = 0;
     bool mFinished = false;
@@ -0,0 +1,108 @@
+// Copyright 2020 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+#include "android/snapshot/TextureLoader.h"
+#include "android/snapshot/TextureSaver.h"
+
+#include "android/base/files/StdioStream.h"
+#include "android/base/testing/TestTempDir.h"
+#include "android/utils/file_io.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using android::base::StdioStream;
+using android::base::TestTempDir;
+
+namespace android {
+namespace snapshot {
+
+// Texture contents: empty, random or repeating so they compress.
+static std::vector<char> textureData(uint32_t texId) {
+    std::vector<char> data((texId % 5) * 3000 * texId);
+    std::default_random_engine generator(texId);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = texId % 2 ? char(generator()) : char(i % 7);
+    }
+    return data;
+}
+
+static void saveTextures(const std::string& path, uint32_t count) {
+    TextureSaver saver(
+            StdioStream(android_fopen(path.c_str(), "wb"), StdioStream::kOwner));
+    for (uint32_t texId = 1; texId <= count; ++texId) {
+        saver.saveTexture(texId, [texId](base::Stream* stream,
+                                         ITextureSaver::Buffer*) {
+            const auto data = textureData(texId);
+            stream->putBe32(texId);
+            stream->write(data.data(), data.size());
+        });
+    }
+    saver.done();
+    EXPECT_FALSE(saver.hasError());
+    EXPECT_TRUE(saver.compressed());
+}
+
+static void expectTexture(TextureLoader& loader, uint32_t texId) {
+    loader.loadTexture(texId, [texId](base::Stream* stream) {
+        EXPECT_EQ(texId, stream->getBe32());
+        const auto expected = textureData(texId);
+        std::vector<char> data(expected.size());
+        stream->read(data.data(), data.size());
+        EXPECT_EQ(expected, data);
+    });
+}
+
+TEST(TextureSnapshot, SaveLoad) {
+    TestTempDir tempDir("texturesnapshot");
+    const std::string path = tempDir.makeSubPath("textures.bin");
+    const uint32_t count = 40;
+    saveTextures(path, count);
+
+    TextureLoader loader(
+            StdioStream(android_fopen(path.c_str(), "rb"), StdioStream::kOwner));
+    ASSERT_TRUE(loader.start());
+    for (uint32_t texId = count; texId >= 1; --texId) {
+        expectTexture(loader, texId);
+    }
+    EXPECT_FALSE(loader.hasError());
+}
+
+TEST(TextureSnapshot, ConcurrentLoad) {
+    TestTempDir tempDir("texturesnapshot");
+    const std::string path = tempDir.makeSubPath("textures.bin");
+    const uint32_t count = 40;
+    saveTextures(path, count);
+
+    TextureLoader loader(
+            StdioStream(android_fopen(path.c_str(), "rb"), StdioStream::kOwner));
+    ASSERT_TRUE(loader.start());
+    std::vector<std::thread> threads;
+    for (uint32_t start = 1; start <= 4; ++start) {
+        threads.emplace_back([&loader, start, count] {
+            for (uint32_t texId = start; texId <= count; texId += 4) {
+                expectTexture(loader, texId);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_FALSE(loader.hasError());
+}
+
+}  // namespace snapshot
+}  // namespace android
@@ -54,6 +54,8 @@ enum class IndexFlags {
     Empty = 0,
     CompressedPages = 0x01,
     SeparateBackingStore = 0x02,
+    // Pages live in a PageStore, the index has its location (version 3+).
+    PageStore = 0x04,
 };
 
 enum class OperationStatus {
@@ -122,6 +124,8 @@ constexpr uint64_t kDecommitChunkSize = 4096 * 4096; // 16 MB
 constexpr const char* kDefaultBootSnapshot = "default_boot";
 constexpr const char* kRamFileName = "ram.bin";
 constexpr const char* kTexturesFileName = "textures.bin";
+constexpr const char* kRamAccessTraceFileName = "ram_access.bin";
+constexpr const char* kPageStoreDirName = "pagestore";
 constexpr const char* kMappedRamFileName = "ram.img";
 constexpr const char* kMappedRamFileDirtyName = "ram.img.dirty";
 
@@ -22,6 +22,7 @@
 
 #include "android/utils/debug.h"
 #include "android/utils/path.h"
+#include "android/utils/sockets.h"
 
 #include <fstream>
 
@@ -72,6 +73,46 @@ bool androidSnapshot_areSavesSlow(const char* name) {
     return Snapshotter::get().areSavesSlow(name);
 }
 
+bool androidSnapshot_send(const char* name, const char* socketPath) {
+#ifdef _WIN32
+    derror("Streaming snapshots isn't supported on Windows");
+    return false;
+#else
+    const int socket = socket_unix_client(socketPath, SOCKET_STREAM);
+    if (socket < 0) {
+        derror("Failed to connect to '%s' to send snapshot '%s'", socketPath,
+               name);
+        return false;
+    }
+    const bool res = Snapshotter::get().send(name, socket);
+    socket_close(socket);
+    return res;
+#endif
+}
+
+AndroidSnapshotStatus androidSnapshot_receive(const char* name,
+                                              const char* socketPath) {
+#ifdef _WIN32
+    derror("Streaming snapshots isn't supported on Windows");
+    return SNAPSHOT_STATUS_ERROR;
+#else
+    const int server = socket_unix_server(socketPath, SOCKET_STREAM);
+    if (server < 0) {
+        derror("Failed to listen at '%s' for snapshot '%s'", socketPath,
+               name);
+        return SNAPSHOT_STATUS_ERROR;
+    }
+    const int socket = socket_accept_any(server);
+    socket_close(server);
+    path_delete_file(socketPath);
+    if (socket < 0) {
+        return SNAPSHOT_STATUS_ERROR;
+    }
+    return AndroidSnapshotStatus(
+            Snapshotter::get().receiveAndLoad(name, socket));
+#endif
+}
+
 int64_t androidSnapshot_lastLoadUptimeMs() {
     return Snapshotter::get().lastLoadUptimeMs();
 }
@@ -48,6 +48,15 @@ void androidSnapshot_invalidate(const char* name);
 
 bool androidSnapshot_areSavesSlow(const char* name);
 
+// Streams the saved snapshot |name| to another emulator on the same host,
+// which waits for it at the Unix domain socket |socketPath|.
+bool androidSnapshot_send(const char* name, const char* socketPath);
+
+// Listens at |socketPath| for a snapshot sent with androidSnapshot_send(),
+// saves it as |name| and loads it while its RAM is still arriving.
+AndroidSnapshotStatus androidSnapshot_receive(const char* name,
+                                              const char* socketPath);
+
 // Returns the name of the snapshot file that was loaded to start
 // the current image.
 // Returns an empty string if the AVD was cold-booted.
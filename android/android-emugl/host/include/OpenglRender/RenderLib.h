@@ -26,6 +26,7 @@
 extern "C" {
 
 struct address_space_device_control_ops;
+struct hmd_pose_ring;
 
 } // extern "C"
 
@@ -81,6 +82,10 @@ public:
     virtual void setVmOps(const QAndroidVmOperations &vm_operations) = 0;
     virtual void setAddressSpaceDeviceControlOps(struct address_space_device_control_ops* ops) = 0;
 
+    // Sets the guest-visible ring the VR compositor publishes headset
+    // poses to.
+    virtual void setHmdPoseRing(struct hmd_pose_ring* ring) = 0;
+
     virtual void setWindowOps(const QAndroidEmulatorWindowAgent &window_operations,
                               const QAndroidMultiDisplayAgent &multi_display_operations) = 0;
 
@@ -295,6 +295,15 @@ public:
             android::snapshot::Snapshotter::Operation op,
             android::snapshot::Snapshotter::Stage stage) = 0;
 
+    // Per-frame latency tracing of the post pipeline, from the guest's
+    // eglSwapBuffers to the window and headset. Starting drops the frames
+    // traced before; the summary and the export cover the last 1024.
+    virtual void setFrameTracing(bool enabled) = 0;
+    // p50/p99 per pipeline stage, as a table.
+    virtual std::string getFrameTraceSummary() = 0;
+    // Writes the traced frames to |path| as Chrome trace JSON.
+    virtual bool exportFrameTrace(const char* path) = 0;
+
 protected:
     ~Renderer() = default;
 };
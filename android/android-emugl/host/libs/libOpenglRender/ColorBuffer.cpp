@@ -508,10 +508,13 @@ void ColorBuffer::reformat(GLint internalformat, GLenum type) {
     // EGL images need to be recreated because the EGL_KHR_image_base spec
     // states that respecifying an image (i.e. glTexImage2D) will generally
     // result in orphaning of the EGL image.
-    s_egl.eglDestroyImageKHR(m_display, m_eglImage);
-    m_eglImage = s_egl.eglCreateImageKHR(
-            m_display, s_egl.eglGetCurrentContext(), EGL_GL_TEXTURE_2D_KHR,
-            (EGLClientBuffer)SafePointerFromUInt(m_tex), NULL);
+    {
+        android::base::AutoLock lock(m_eglImageLock);
+        s_egl.eglDestroyImageKHR(m_display, m_eglImage);
+        m_eglImage = s_egl.eglCreateImageKHR(
+                m_display, s_egl.eglGetCurrentContext(), EGL_GL_TEXTURE_2D_KHR,
+                (EGLClientBuffer)SafePointerFromUInt(m_tex), NULL);
+    }
 
     s_egl.eglDestroyImageKHR(m_display, m_blitEGLImage);
     m_blitEGLImage = s_egl.eglCreateImageKHR(
@@ -813,6 +816,7 @@ bool ColorBuffer::blitFromCurrentReadBuffer() {
 }
 
 bool ColorBuffer::bindToTexture() {
+    android::base::AutoLock lock(m_eglImageLock);
     if (!m_eglImage) {
         return false;
     }
@@ -832,6 +836,7 @@ bool ColorBuffer::bindToTexture() {
 }
 
 bool ColorBuffer::bindToTexture2() {
+    android::base::AutoLock lock(m_eglImageLock);
     if (!m_eglImage) {
         return false;
     }
@@ -841,6 +846,7 @@ bool ColorBuffer::bindToTexture2() {
 }
 
 bool ColorBuffer::bindToRenderbuffer() {
+    android::base::AutoLock lock(m_eglImageLock);
     if (!m_eglImage) {
         return false;
     }
@@ -1071,10 +1077,13 @@ bool ColorBuffer::importMemory(
         m_BRSwizzle = false;
     }
 
-    s_egl.eglDestroyImageKHR(m_display, m_eglImage);
-    m_eglImage = s_egl.eglCreateImageKHR(
-            m_display, s_egl.eglGetCurrentContext(), EGL_GL_TEXTURE_2D_KHR,
-            (EGLClientBuffer)SafePointerFromUInt(m_tex), NULL);
+    {
+        android::base::AutoLock lock(m_eglImageLock);
+        s_egl.eglDestroyImageKHR(m_display, m_eglImage);
+        m_eglImage = s_egl.eglCreateImageKHR(
+                m_display, s_egl.eglGetCurrentContext(), EGL_GL_TEXTURE_2D_KHR,
+                (EGLClientBuffer)SafePointerFromUInt(m_tex), NULL);
+    }
 
     if (!vulkanOnly) {
         replaceContents(prevContents.data(), m_numBytes);
@@ -21,6 +21,7 @@
 #include <GLES/gl.h>
 #include <GLES3/gl3.h>
 #include "android/base/files/Stream.h"
+#include "android/base/synchronization/Lock.h"
 #include "android/skin/rect.h"
 #include "android/snapshot/LazySnapshotObj.h"
 #include "emugl/common/smart_ptr.h"
@@ -294,6 +295,10 @@ private:
     GLuint m_tex = 0;
     GLuint m_blitTex = 0;
     EGLImageKHR m_eglImage = nullptr;
+    // Held while m_eglImage is replaced, and by bindToTexture(),
+    // bindToTexture2() and bindToRenderbuffer(), which FrameBuffer calls
+    // without its lock.
+    android::base::Lock m_eglImageLock;
     EGLImageKHR m_blitEGLImage = nullptr;
     GLuint m_width = 0;
     GLuint m_height = 0;
@@ -0,0 +1,104 @@
+/*
+* Copyright (C) 2021 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Routing of guest command packets to the decoder of their API.
+//
+// Every packet starts with a 32-bit opcode and the 32-bit size of the whole
+// packet, and each API owns a range of opcodes: the base_opcode of its
+// .attrib file (GLESv1_dec, GLESv2_dec, renderControl_dec) up to the next
+// API's, and OP_vkFirst_old..OP_vkLast_old and OP_vkFirst..OP_vkLast for
+// Vulkan. The render thread reads the opcode once per packet here and hands
+// each run of consecutive packets of one API to that API's decoder, instead
+// of offering the whole buffer to every decoder in turn.
+
+enum class DecoderApi {
+    Unknown,
+    Gles1,
+    Gles2,
+    RenderControl,
+    Vulkan,
+};
+
+static constexpr uint32_t kGles1BaseOpcode = 1024;
+static constexpr uint32_t kGles2BaseOpcode = 2048;
+static constexpr uint32_t kRenderControlBaseOpcode = 10000;
+static constexpr uint32_t kVulkanFirstOpcodeOld = 20000;
+static constexpr uint32_t kVulkanLastOpcodeOld = 30000;
+static constexpr uint32_t kVulkanFirstOpcode = 200000000;
+static constexpr uint32_t kVulkanLastOpcode = 300000000;
+
+static constexpr size_t kPacketHeaderSize = 8;
+
+static inline DecoderApi decoderApiOf(uint32_t opcode) {
+    if (opcode >= kGles1BaseOpcode && opcode < kGles2BaseOpcode) {
+        return DecoderApi::Gles1;
+    }
+    if (opcode >= kGles2BaseOpcode && opcode < kRenderControlBaseOpcode) {
+        return DecoderApi::Gles2;
+    }
+    if (opcode >= kRenderControlBaseOpcode && opcode < kVulkanFirstOpcodeOld) {
+        return DecoderApi::RenderControl;
+    }
+    if ((opcode >= kVulkanFirstOpcodeOld && opcode < kVulkanLastOpcodeOld) ||
+        (opcode >= kVulkanFirstOpcode && opcode < kVulkanLastOpcode)) {
+        return DecoderApi::Vulkan;
+    }
+    return DecoderApi::Unknown;
+}
+
+// GLES packets have to be decoded under the FrameBuffer's context structure
+// read lock; see RenderThread::main().
+static inline bool isGlesApi(DecoderApi api) {
+    return api == DecoderApi::Gles1 || api == DecoderApi::Gles2;
+}
+
+struct DecoderRun {
+    DecoderApi api;
+    // Bytes of complete packets at the start of the buffer that all belong
+    // to |api|; 0 if the first packet isn't complete yet.
+    size_t size;
+};
+
+// Finds the run of packets at the start of |buf| that one decoder can take
+// in a single call.
+static inline DecoderRun findDecoderRun(const uint8_t* buf, size_t len) {
+    DecoderRun run = {DecoderApi::Unknown, 0};
+    size_t pos = 0;
+    while (len - pos >= kPacketHeaderSize) {
+        uint32_t opcode;
+        uint32_t packetSize;
+        memcpy(&opcode, buf + pos, sizeof(opcode));
+        memcpy(&packetSize, buf + pos + 4, sizeof(packetSize));
+
+        const DecoderApi api = decoderApiOf(opcode);
+        if (pos == 0) {
+            run.api = api;
+        } else if (api != run.api) {
+            break;
+        }
+        if (packetSize < kPacketHeaderSize || packetSize > len - pos) {
+            break;
+        }
+        pos += packetSize;
+    }
+    run.size = run.api == DecoderApi::Unknown ? 0 : pos;
+    return run;
+}
@@ -18,6 +18,7 @@
 
 #include "DispatchTables.h"
 #include "EglGlobalInfo.h"
+#include "FrameTracer.h"
 #include "GLESVersionDetector.h"
 #include "NativeSubWindow.h"
 #include "RenderControl.h"
@@ -296,8 +297,14 @@ void FrameBuffer::finalize() {
 
     sweepColorBuffersLocked();
 
-    m_buffers.clear();
-    m_colorbuffers.clear();
+    {
+        emugl::ReadWriteMutex::AutoWriteLock mapLock(m_bufferMapLock);
+        m_buffers.clear();
+    }
+    {
+        emugl::ReadWriteMutex::AutoWriteLock mapLock(m_colorBufferMapLock);
+        m_colorbuffers.clear();
+    }
     m_colorBufferDelayedCloseList.clear();
     if (m_useSubWindow) {
         removeSubWindow_locked();
@@ -810,7 +817,7 @@ WorkerProcessingResult
 FrameBuffer::postWorkerFunc(const Post& post) {
     switch (post.cmd) {
         case PostCmd::Post:
-            m_postWorker->post(post.cb);
+            m_postWorker->post(post.cb, post.traceFrame);
             break;
         case PostCmd::Viewport:
             m_postWorker->viewport(post.viewport.width,
@@ -1220,12 +1227,13 @@ HandleType FrameBuffer::createColorBufferWithHandleLocked(
                                           m_fastBlitSupported));
     if (cb.get() != NULL) {
         assert(m_colorbuffers.count(handle) == 0);
+        uint32_t refcount = 0;
         // When guest feature flag RefCountPipe is on, no reference counting is
         // needed. We only memoize the mapping from handle to ColorBuffer.
         // Explicitly set refcount to 1 to avoid the colorbuffer being added to
         // m_colorBufferDelayedCloseList in FrameBuffer::onLoad().
         if (m_refCountPipeEnabled) {
-            m_colorbuffers[handle] = { std::move(cb), 1, false, 0 };
+            refcount = 1;
         } else {
             // Android master default api level is 1000
             int apiLevel = 1000;
@@ -1233,18 +1241,17 @@ HandleType FrameBuffer::createColorBufferWithHandleLocked(
             // pre-O and post-O use different color buffer memory management
             // logic
             if (apiLevel > 0 && apiLevel < 26) {
-                m_colorbuffers[handle] = {std::move(cb), 1, false, 0};
+                refcount = 1;
 
                 RenderThreadInfo* tInfo = RenderThreadInfo::get();
                 uint64_t puid = tInfo->m_puid;
                 if (puid) {
                     m_procOwnedColorBuffers[puid].insert(handle);
                 }
-
-            } else {
-                m_colorbuffers[handle] = {std::move(cb), 0, false, 0};
             }
         }
+        emugl::ReadWriteMutex::AutoWriteLock mapLock(m_colorBufferMapLock);
+        m_colorbuffers[handle] = {std::move(cb), refcount, false, 0};
     } else {
         handle = 0;
         DBG("Create color buffer failed.\n");
@@ -1284,6 +1291,7 @@ HandleType FrameBuffer::createBufferWithHandleLocked(int p_size,
     BufferPtr buffer(Buffer::create(p_size, handle));
 
     if (buffer) {
+        emugl::ReadWriteMutex::AutoWriteLock mapLock(m_bufferMapLock);
         m_buffers[handle] = {std::move(buffer)};
     } else {
         handle = 0;
@@ -1563,6 +1571,7 @@ void FrameBuffer::closeBuffer(HandleType p_buffer) {
             static_cast<uint32_t>(p_buffer));
     } else {
         goldfish_vk::teardownVkBuffer(p_buffer);
+        emugl::ReadWriteMutex::AutoWriteLock mapLock(m_bufferMapLock);
         m_buffers.erase(p_buffer);
     }
 }
@@ -1597,6 +1606,7 @@ bool FrameBuffer::closeColorBufferLocked(HandleType p_colorbuffer,
     if (--c->second.refcount == 0) {
         if (forced) {
             eraseDelayedCloseColorBufferLocked(c->first, c->second.closedTs);
+            emugl::ReadWriteMutex::AutoWriteLock mapLock(m_colorBufferMapLock);
             m_colorbuffers.erase(c);
             deleted = true;
         } else {
@@ -1626,6 +1636,7 @@ void FrameBuffer::performDelayedColorBufferCloseLocked(bool forced) {
         if (it->cbHandle != 0) {
             const auto& cb = m_colorbuffers.find(it->cbHandle);
             if (cb != m_colorbuffers.end()) {
+                emugl::ReadWriteMutex::AutoWriteLock mapLock(m_colorBufferMapLock);
                 m_colorbuffers.erase(cb);
             }
         }
@@ -2092,7 +2103,7 @@ bool FrameBuffer::getColorBufferInfo(
 }
 
 bool FrameBuffer::getBufferInfo(HandleType p_buffer, int* size) {
-    AutoLock mutex(m_lock);
+    emugl::ReadWriteMutex::AutoReadLock mapLock(m_bufferMapLock);
 
     BufferMap::iterator c(m_buffers.find(p_buffer));
     if (c == m_buffers.end()) {
@@ -2105,19 +2116,22 @@ bool FrameBuffer::getBufferInfo(HandleType p_buffer, int* size) {
     return true;
 }
 
-bool FrameBuffer::bindColorBufferToTexture(HandleType p_colorbuffer) {
-    AutoLock mutex(m_lock);
-
-    ColorBufferMap::iterator c(m_colorbuffers.find(p_colorbuffer));
-    if (c == m_colorbuffers.end()) {
-        // bad colorbuffer handle
-        return false;
+template <class Op>
+bool FrameBuffer::withColorBuffer(HandleType p_colorbuffer, Op&& op) {
+    {
+        // |op| must not take m_lock in here: a thread that holds m_lock may
+        // be waiting for the write lock.
+        emugl::ReadWriteMutex::AutoReadLock mapLock(m_colorBufferMapLock);
+        ColorBufferMap::iterator c(m_colorbuffers.find(p_colorbuffer));
+        if (c == m_colorbuffers.end()) {
+            // bad colorbuffer handle
+            return false;
+        }
+        if (!c->second.cb->needRestore()) {
+            return op(c->second.cb.get());
+        }
     }
 
-    return (*c).second.cb->bindToTexture();
-}
-
-bool FrameBuffer::bindColorBufferToTexture2(HandleType p_colorbuffer) {
     AutoLock mutex(m_lock);
 
     ColorBufferMap::iterator c(m_colorbuffers.find(p_colorbuffer));
@@ -2126,19 +2140,25 @@ bool FrameBuffer::bindColorBufferToTexture2(HandleType p_colorbuffer) {
         return false;
     }
 
-    return (*c).second.cb->bindToTexture2();
+    return op(c->second.cb.get());
 }
 
-bool FrameBuffer::bindColorBufferToRenderbuffer(HandleType p_colorbuffer) {
-    AutoLock mutex(m_lock);
+bool FrameBuffer::bindColorBufferToTexture(HandleType p_colorbuffer) {
+    return withColorBuffer(p_colorbuffer, [](ColorBuffer* cb) {
+        return cb->bindToTexture();
+    });
+}
 
-    ColorBufferMap::iterator c(m_colorbuffers.find(p_colorbuffer));
-    if (c == m_colorbuffers.end()) {
-        // bad colorbuffer handle
-        return false;
-    }
+bool FrameBuffer::bindColorBufferToTexture2(HandleType p_colorbuffer) {
+    return withColorBuffer(p_colorbuffer, [](ColorBuffer* cb) {
+        return cb->bindToTexture2();
+    });
+}
 
-    return (*c).second.cb->bindToRenderbuffer();
+bool FrameBuffer::bindColorBufferToRenderbuffer(HandleType p_colorbuffer) {
+    return withColorBuffer(p_colorbuffer, [](ColorBuffer* cb) {
+        return cb->bindToRenderbuffer();
+    });
 }
 
 bool FrameBuffer::bindContext(HandleType p_context,
@@ -2452,14 +2472,16 @@ bool FrameBuffer::post(HandleType p_colorbuffer, bool needLockAndBind) {
         goldfish_vk::updateColorBufferFromVkImage(p_colorbuffer);
     }
 
-    bool res = postImpl(p_colorbuffer, needLockAndBind);
+    const uint64_t traceFrame = FrameTracer::get()->beginFrame();
+    bool res = postImpl(p_colorbuffer, needLockAndBind, false, traceFrame);
     if (res) setGuestPostedAFrame();
     return res;
 }
 
 bool FrameBuffer::postImpl(HandleType p_colorbuffer,
                            bool needLockAndBind,
-                           bool repaint) {
+                           bool repaint,
+                           uint64_t traceFrame) {
     if (needLockAndBind) {
         m_lock.lock();
     }
@@ -2482,6 +2504,7 @@ bool FrameBuffer::postImpl(HandleType p_colorbuffer,
         Post postCmd;
         postCmd.cmd = PostCmd::Post;
         postCmd.cb = c->second.cb.get();
+        postCmd.traceFrame = traceFrame;
         sendPostWorkerCmd(postCmd);
     } else {
         markOpened(&c->second);
@@ -2800,6 +2823,7 @@ bool FrameBuffer::decColorBufferRefCountLocked(HandleType p_colorbuffer) {
     if (it != m_colorbuffers.end()) {
         it->second.refcount -= 1;
         if (it->second.refcount == 0) {
+            emugl::ReadWriteMutex::AutoWriteLock mapLock(m_colorBufferMapLock);
             m_colorbuffers.erase(p_colorbuffer);
             return true;
         }
@@ -2963,6 +2987,7 @@ bool FrameBuffer::onLoad(Stream* stream,
             // process owned objects. We need to force cleanup everything
             m_contexts.clear();
             m_windows.clear();
+            emugl::ReadWriteMutex::AutoWriteLock mapLock(m_colorBufferMapLock);
             m_colorbuffers.clear();
         } else {
             std::vector<HandleType> colorBuffersToCleanup;
@@ -3031,6 +3056,7 @@ bool FrameBuffer::onLoad(Stream* stream,
         assert(m_windows.empty());
         if (!m_colorbuffers.empty()) {
             fprintf(stderr, "%s: warning: on load, stale colorbuffers: %zu\n", __func__, m_colorbuffers.size());
+            emugl::ReadWriteMutex::AutoWriteLock mapLock(m_colorBufferMapLock);
             m_colorbuffers.clear();
         }
         assert(m_colorbuffers.empty());
@@ -3066,20 +3092,23 @@ bool FrameBuffer::onLoad(Stream* stream,
     assert(!android::base::find(m_contexts, 0));
 
     auto now = System::get()->getUnixTime();
-    loadCollection(stream, &m_colorbuffers,
-                   [this, now](Stream* stream) -> ColorBufferMap::value_type {
-        ColorBufferPtr cb(ColorBuffer::onLoad(stream, m_eglDisplay,
-                                              m_colorBufferHelper,
-                                              m_fastBlitSupported));
-        const HandleType handle = cb->getHndl();
-        const unsigned refCount = stream->getBe32();
-        const bool opened = stream->getByte();
-        const System::Duration closedTs = now - stream->getBe32();
-        if (refCount == 0) {
-            m_colorBufferDelayedCloseList.push_back({closedTs, handle});
-        }
-        return { handle, { std::move(cb), refCount, opened, closedTs } };
-    });
+    {
+        emugl::ReadWriteMutex::AutoWriteLock mapLock(m_colorBufferMapLock);
+        loadCollection(stream, &m_colorbuffers,
+                       [this, now](Stream* stream) -> ColorBufferMap::value_type {
+            ColorBufferPtr cb(ColorBuffer::onLoad(stream, m_eglDisplay,
+                                                  m_colorBufferHelper,
+                                                  m_fastBlitSupported));
+            const HandleType handle = cb->getHndl();
+            const unsigned refCount = stream->getBe32();
+            const bool opened = stream->getByte();
+            const System::Duration closedTs = now - stream->getBe32();
+            if (refCount == 0) {
+                m_colorBufferDelayedCloseList.push_back({closedTs, handle});
+            }
+            return { handle, { std::move(cb), refCount, opened, closedTs } };
+        });
+    }
     m_lastPostedColorBuffer = static_cast<HandleType>(stream->getBe32());
     GL_LOG("Got lasted posted color buffer from snapshot");
 
@@ -3134,6 +3163,7 @@ void FrameBuffer::unlock() {
 }
 
 ColorBufferPtr FrameBuffer::findColorBuffer(HandleType p_colorbuffer) {
+    emugl::ReadWriteMutex::AutoReadLock mapLock(m_colorBufferMapLock);
     ColorBufferMap::iterator c(m_colorbuffers.find(p_colorbuffer));
     if (c == m_colorbuffers.end()) {
         return nullptr;
@@ -663,8 +663,17 @@ private:
     void performDelayedColorBufferCloseLocked(bool forced = false);
     void eraseDelayedCloseColorBufferLocked(
             HandleType cb, android::base::System::Duration ts);
-
-    bool postImpl(HandleType p_colorbuffer, bool needLockAndBind = true, bool repaint = false);
+    // Runs |op| on the ColorBuffer |p_colorbuffer| under a read lock of the
+    // color buffer table only, for ops that use just the caller's current
+    // context. Color buffers that still have to be restored from a snapshot
+    // need the FrameBuffer's context, so those are done under m_lock.
+    // Returns false for a bad handle.
+    template <class Op>
+    bool withColorBuffer(HandleType p_colorbuffer, Op&& op);
+
+    // |traceFrame| is the FrameTracer id of the frame, 0 if not traced.
+    bool postImpl(HandleType p_colorbuffer, bool needLockAndBind = true,
+                  bool repaint = false, uint64_t traceFrame = 0);
     void setGuestPostedAFrame() {
         m_guestPostedAFrame = true;
         fireEvent({ emugl::FrameBufferChange::FrameReady,  mFrameNumber++ });
@@ -709,6 +718,14 @@ private:
     uint64_t mFrameNumber;
     emugl::Mutex m_lock;
     emugl::ReadWriteMutex m_contextStructureLock;
+    // Write-locked, with m_lock held, whenever entries are added to or
+    // removed from m_colorbuffers and m_buffers, so that lookups can take a
+    // read lock instead of m_lock. The entries themselves are still
+    // guarded by m_lock, so only binds and plain lookups go through these;
+    // open, close, update, readback and post all still take m_lock, as do
+    // the context, window surface and ownership tables.
+    emugl::ReadWriteMutex m_colorBufferMapLock;
+    emugl::ReadWriteMutex m_bufferMapLock;
     FbConfigList* m_configs = nullptr;
     FBNativeWindowType m_nativeWindow = 0;
     FrameBufferCaps m_caps = {};
@@ -841,6 +858,8 @@ private:
         PostCmd cmd;
         int composeVersion;
         std::vector<char> composeBuffer;
+        // The FrameTracer id of a posted frame.
+        uint64_t traceFrame = 0;
         union {
             ColorBuffer* cb;
             struct {
@@ -0,0 +1,268 @@
+/*
+* Copyright (C) 2021 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+#include "FrameTracer.h"
+
+#include "android/base/Tracing.h"
+#include "android/base/memory/LazyInstance.h"
+#include "android/base/system/System.h"
+#include "android/utils/file_io.h"
+
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+#include <vector>
+
+using android::base::LazyInstance;
+using android::base::System;
+
+static LazyInstance<FrameTracer> sFrameTracer = LAZY_INSTANCE_INIT;
+
+// When the current thread last decoded a post, or 0.
+static thread_local uint64_t tPendingDecodeUs = 0;
+
+static const std::array<FrameTracer::Span, FrameTracer::kSpanCount> kSpans = {{
+    {"guest swap to decode", "frame.guestSwapToDecodeUs",
+     FrameTracer::GuestSwap, FrameTracer::Decode},
+    {"decode to post", "frame.decodeToPostUs",
+     FrameTracer::Decode, FrameTracer::Post},
+    {"post queue", "frame.postQueueUs",
+     FrameTracer::Post, FrameTracer::PostWorkerStart},
+    {"post to vr handoff", "frame.postToVrHandoffUs",
+     FrameTracer::PostWorkerStart, FrameTracer::VrHandoff},
+    {"post to window swap", "frame.postToWindowSwapUs",
+     FrameTracer::PostWorkerStart, FrameTracer::WindowSwap},
+    {"vr queue to submit", "frame.vrQueueToSubmitUs",
+     FrameTracer::VrHandoff, FrameTracer::VrSubmit},
+    {"guest swap to window", "frame.guestSwapToWindowUs",
+     FrameTracer::GuestSwap, FrameTracer::WindowSwap},
+    {"motion to photon", "frame.motionToPhotonUs",
+     FrameTracer::RenderPose, FrameTracer::VrSubmit},
+}};
+
+static uint64_t nowUs() {
+    return System::get()->getHighResTimeUs();
+}
+
+// The nearest rank percentile of sorted |values|.
+static uint64_t percentile(const std::vector<uint64_t>& values, int pct) {
+    if (values.empty()) {
+        return 0;
+    }
+    size_t rank = (values.size() * pct + 99) / 100;
+    return values[rank ? rank - 1 : 0];
+}
+
+FrameTracer::FrameTracer() : mRecords(new Record[kMaxFrames]) {}
+
+FrameTracer::~FrameTracer() = default;
+
+// static
+FrameTracer* FrameTracer::get() {
+    return sFrameTracer.ptr();
+}
+
+// static
+const std::array<FrameTracer::Span, FrameTracer::kSpanCount>&
+FrameTracer::spans() {
+    return kSpans;
+}
+
+void FrameTracer::setEnabled(bool enabled) {
+    if (enabled && !mEnabled) {
+        for (size_t i = 0; i < kMaxFrames; ++i) {
+            mRecords[i].frame.store(0, std::memory_order_relaxed);
+        }
+        mPendingGuestSwapUs = 0;
+    }
+    mEnabled = enabled;
+}
+
+void FrameTracer::markGuestSwap() {
+    if (!enabled()) {
+        return;
+    }
+    uint64_t expected = 0;
+    mPendingGuestSwapUs.compare_exchange_strong(expected, nowUs());
+}
+
+void FrameTracer::markDecode() {
+    if (!enabled()) {
+        return;
+    }
+    tPendingDecodeUs = nowUs();
+}
+
+uint64_t FrameTracer::beginFrame() {
+    if (!enabled()) {
+        return 0;
+    }
+    return beginFrame(nowUs());
+}
+
+uint64_t FrameTracer::beginFrame(uint64_t timeUs) {
+    if (!enabled()) {
+        return 0;
+    }
+    const uint64_t frame = ++mNextFrame;
+    Record& record = mRecords[frame % kMaxFrames];
+
+    // Hide the record while it's reset, so late marks for the frame it held
+    // before don't land in the new one.
+    record.frame.store(0, std::memory_order_relaxed);
+    for (auto& time : record.timeUs) {
+        time.store(0, std::memory_order_relaxed);
+    }
+    record.timeUs[GuestSwap].store(mPendingGuestSwapUs.exchange(0),
+                                   std::memory_order_relaxed);
+    record.timeUs[Decode].store(tPendingDecodeUs, std::memory_order_relaxed);
+    record.timeUs[Post].store(timeUs, std::memory_order_relaxed);
+    tPendingDecodeUs = 0;
+    record.frame.store(frame, std::memory_order_release);
+
+    reportSpans(record, Decode);
+    reportSpans(record, Post);
+    return frame;
+}
+
+void FrameTracer::mark(uint64_t frame, Stage stage) {
+    if (!frame) {
+        return;
+    }
+    mark(frame, stage, nowUs());
+}
+
+void FrameTracer::mark(uint64_t frame, Stage stage, uint64_t timeUs) {
+    Record* record = findRecord(frame);
+    if (!record) {
+        return;
+    }
+    uint64_t expected = 0;
+    if (record->timeUs[stage].compare_exchange_strong(expected, timeUs)) {
+        reportSpans(*record, stage);
+    }
+}
+
+FrameTracer::Record* FrameTracer::findRecord(uint64_t frame) {
+    if (!frame) {
+        return nullptr;
+    }
+    Record& record = mRecords[frame % kMaxFrames];
+    if (record.frame.load(std::memory_order_acquire) != frame) {
+        return nullptr;
+    }
+    return &record;
+}
+
+void FrameTracer::reportSpans(const Record& record, Stage stage) {
+    for (const Span& span : kSpans) {
+        if (span.to != stage) {
+            continue;
+        }
+        const uint64_t from = record.timeUs[span.from].load(std::memory_order_relaxed);
+        const uint64_t to = record.timeUs[span.to].load(std::memory_order_relaxed);
+        if (from && to >= from) {
+            android::base::traceCounter(span.counter, to - from);
+        }
+    }
+}
+
+std::array<FrameTracer::SpanSummary, FrameTracer::kSpanCount>
+FrameTracer::summarize() const {
+    std::array<std::vector<uint64_t>, kSpanCount> latencies;
+    for (size_t i = 0; i < kMaxFrames; ++i) {
+        const Record& record = mRecords[i];
+        if (!record.frame.load(std::memory_order_acquire)) {
+            continue;
+        }
+        for (size_t s = 0; s < kSpanCount; ++s) {
+            const uint64_t from = record.timeUs[kSpans[s].from].load(std::memory_order_relaxed);
+            const uint64_t to = record.timeUs[kSpans[s].to].load(std::memory_order_relaxed);
+            if (from && to >= from) {
+                latencies[s].push_back(to - from);
+            }
+        }
+    }
+
+    std::array<SpanSummary, kSpanCount> summary;
+    for (size_t s = 0; s < kSpanCount; ++s) {
+        std::vector<uint64_t>& values = latencies[s];
+        std::sort(values.begin(), values.end());
+        summary[s] = {kSpans[s].name, values.size(), percentile(values, 50),
+                      percentile(values, 99), values.empty() ? 0 : values.back()};
+    }
+    return summary;
+}
+
+std::string FrameTracer::summaryText() const {
+    std::string text;
+    char line[128];
+    snprintf(line, sizeof(line), "%-22s %8s %10s %10s %10s\n", "span (us)",
+             "frames", "p50", "p99", "max");
+    text += line;
+    for (const SpanSummary& span : summarize()) {
+        if (!span.count) {
+            continue;
+        }
+        snprintf(line, sizeof(line),
+                 "%-22s %8zu %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+                 span.name, span.count, span.p50Us, span.p99Us, span.maxUs);
+        text += line;
+    }
+    return text;
+}
+
+bool FrameTracer::exportChromeTrace(const char* path) const {
+    FILE* file = android_fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+
+    // One track per span, each frame a complete ("X") event on it.
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (size_t s = 0; s < kSpanCount; ++s) {
+        fprintf(file,
+                "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,"
+                "\"args\":{\"name\":\"%s\"}},\n",
+                s, kSpans[s].name);
+    }
+    bool first = true;
+    for (size_t i = 0; i < kMaxFrames; ++i) {
+        const Record& record = mRecords[i];
+        const uint64_t frame = record.frame.load(std::memory_order_acquire);
+        if (!frame) {
+            continue;
+        }
+        for (size_t s = 0; s < kSpanCount; ++s) {
+            const uint64_t from = record.timeUs[kSpans[s].from].load(std::memory_order_relaxed);
+            const uint64_t to = record.timeUs[kSpans[s].to].load(std::memory_order_relaxed);
+            if (!from || to < from) {
+                continue;
+            }
+            fprintf(file,
+                    "%s{\"name\":\"frame %" PRIu64 "\",\"cat\":\"frame\","
+                    "\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%" PRIu64
+                    ",\"dur\":%" PRIu64 ",\"args\":{\"frame\":%" PRIu64 "}}",
+                    first ? "" : ",\n", frame, s, from, to - from, frame);
+            first = false;
+        }
+    }
+    // Keep the array valid if there were no frames: the metadata events
+    // above all end with a comma.
+    fprintf(file, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+                  "\"args\":{\"name\":\"frames\"}}\n]}\n",
+            first ? "" : ",\n");
+    return fclose(file) == 0;
+}
@@ -0,0 +1,127 @@
+/*
+* Copyright (C) 2021 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+#pragma once
+
+#include "android/base/Compiler.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// FrameTracer follows guest frames through the host's post pipeline and
+// records when each of them reached each stage, so that when frames are late
+// it's possible to tell which stage to blame.
+//
+// A frame gets its id in FrameBuffer::post(), and the id travels with the
+// frame to the post worker and the VR compositor, which mark the stages they
+// own. The records live in a fixed ring of the last kMaxFrames frames, so
+// tracing costs no allocations once it's on, and one relaxed load when off.
+//
+// Latencies are reported per span between two stages, as Tracing.h counters
+// while a trace is being captured, as a p50/p99 summary, and as a Chrome
+// trace JSON file (chrome://tracing or ui.perfetto.dev) with one track per
+// span.
+class FrameTracer {
+public:
+    enum Stage {
+        // When the poses the frame was rendered with were sampled.
+        RenderPose,
+        // The guest's eglSwapBuffers (rcFlushWindowColorBuffer).
+        GuestSwap,
+        // rcFBPost was decoded.
+        Decode,
+        // FrameBuffer::post() queued the frame for the post worker.
+        Post,
+        // The post worker started on the frame.
+        PostWorkerStart,
+        // The frame was handed to the VR compositor.
+        VrHandoff,
+        // eglSwapBuffers on the emulator window returned.
+        WindowSwap,
+        // The frame was first submitted to the headset.
+        VrSubmit,
+        StageCount
+    };
+
+    struct Span {
+        const char* name;
+        // The Tracing.h counter the span's latencies go to.
+        const char* counter;
+        Stage from;
+        Stage to;
+    };
+
+    struct SpanSummary {
+        const char* name;
+        size_t count;
+        uint64_t p50Us;
+        uint64_t p99Us;
+        uint64_t maxUs;
+    };
+
+    static constexpr size_t kMaxFrames = 1024;
+    static constexpr size_t kSpanCount = 8;
+
+    FrameTracer();
+    ~FrameTracer();
+
+    static FrameTracer* get();
+
+    // Turning tracing on drops the frames recorded before.
+    void setEnabled(bool enabled);
+    bool enabled() const { return mEnabled.load(std::memory_order_relaxed); }
+
+    // Record when the guest swapped and when the current thread decoded a
+    // post; the next frame that begins picks them up.
+    void markGuestSwap();
+    void markDecode();
+
+    // Starts a frame at the Post stage. Returns its id, or 0 if tracing is
+    // off, in which case marking it does nothing.
+    uint64_t beginFrame();
+    uint64_t beginFrame(uint64_t timeUs);
+
+    // Records that |frame| reached |stage|. Only the first time counts, so
+    // a frame shown several times keeps the time it was first shown.
+    void mark(uint64_t frame, Stage stage);
+    void mark(uint64_t frame, Stage stage, uint64_t timeUs);
+
+    static const std::array<Span, kSpanCount>& spans();
+    std::array<SpanSummary, kSpanCount> summarize() const;
+    // A table of summarize(), for the console.
+    std::string summaryText() const;
+    bool exportChromeTrace(const char* path) const;
+
+private:
+    struct Record {
+        std::atomic<uint64_t> frame{0};
+        std::array<std::atomic<uint64_t>, StageCount> timeUs;
+    };
+
+    Record* findRecord(uint64_t frame);
+    void reportSpans(const Record& record, Stage stage);
+
+    std::atomic<bool> mEnabled{false};
+    std::atomic<uint64_t> mNextFrame{0};
+    // The first guest swap since the last frame began, or 0.
+    std::atomic<uint64_t> mPendingGuestSwapUs{0};
+    std::unique_ptr<Record[]> mRecords;
+
+    DISALLOW_COPY_AND_ASSIGN(FrameTracer);
+};
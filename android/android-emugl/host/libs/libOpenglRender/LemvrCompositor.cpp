@@ -0,0 +1,266 @@
+/*
+* Copyright (C) 2021 Andrew Sumsion
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "LemvrCompositor.h"
+
+#include "ColorBuffer.h"
+#include "DispatchTables.h"
+#include "FrameBuffer.h"
+#include "FrameTracer.h"
+#include "OpenGLESDispatch/EGLDispatch.h"
+#include "OpenGLESDispatch/GLESv2Dispatch.h"
+#include "TextureCompat.h"
+
+#include "android/base/system/System.h"
+
+#include <cstring>
+#include <string>
+#include <utility>
+
+using android::base::AutoLock;
+using android::base::System;
+
+namespace lemvr {
+
+Compositor::Compositor(Hmd* hmd, LemvrServer* server, hmd_pose_ring* poseRing)
+    : hmd(hmd),
+      server(server),
+      poseRing(poseRing) {}
+
+void Compositor::post(ColorBuffer* cb, uint64_t traceFrame) {
+    AutoLock postAutoLock(postLock);
+    if(released) {
+        return;
+    }
+
+    Slot& slot = slots[writeIndex];
+    const GLuint width = cb->getWidth();
+    const GLuint height = cb->getHeight();
+
+    if(!slot.texture || slot.width != width || slot.height != height) {
+        if(!slot.texture) {
+            s_gles2.glGenTextures(1, &slot.texture);
+        }
+        s_gles2.glBindTexture(GL_TEXTURE_2D, slot.texture);
+        s_gles2.glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+                             GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        s_gles2.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        s_gles2.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        s_gles2.glBindTexture(GL_TEXTURE_2D, 0);
+        slot.width = width;
+        slot.height = height;
+    }
+
+    // A GPU copy, so the guest can draw into the ColorBuffer again right
+    // away while the headset still shows this frame. The framebuffers only
+    // live as long as the copy: they can't be shared with the compositor's
+    // context, which is the one that cleans up.
+    GLuint readFbo = 0;
+    GLuint drawFbo = 0;
+    s_gles2.glGenFramebuffers(1, &readFbo);
+    s_gles2.glGenFramebuffers(1, &drawFbo);
+    s_gles2.glBindFramebuffer(GL_READ_FRAMEBUFFER, readFbo);
+    s_gles2.glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                   GL_TEXTURE_2D, cb->getTexture(), 0);
+    s_gles2.glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFbo);
+    s_gles2.glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                   GL_TEXTURE_2D, slot.texture, 0);
+    s_gles2.glBlitFramebuffer(0, 0, width, height, 0, 0, width, height,
+                              GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    s_gles2.glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    s_gles2.glDeleteFramebuffers(1, &readFbo);
+    s_gles2.glDeleteFramebuffers(1, &drawFbo);
+
+    uint64_t renderPoseTimeUs = 0;
+    slot.hasRenderPose = findRenderPose(&slot.renderPose, &renderPoseTimeUs);
+    slot.traceFrame = traceFrame;
+    if(slot.hasRenderPose) {
+        FrameTracer::get()->mark(traceFrame, FrameTracer::RenderPose, renderPoseTimeUs);
+    }
+
+    if(slot.fence) {
+        s_gles2.glDeleteSync(slot.fence);
+    }
+    slot.fence = s_gles2.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    // The compositor's context waits for the fence, so it has to reach the
+    // GPU.
+    s_gles2.glFlush();
+
+    AutoLock autoLock(lock);
+    std::swap(writeIndex, readyIndex);
+    if(hasNewFrame) {
+        ++frameStats.dropped;
+    }
+    hasNewFrame = true;
+    ++frameStats.posted;
+}
+
+bool Compositor::acquireFrame() {
+    AutoLock autoLock(lock);
+    if(!hasNewFrame) {
+        return false;
+    }
+    std::swap(readIndex, readyIndex);
+    hasNewFrame = false;
+    return true;
+}
+
+void Compositor::stop() {
+    stopRequested = true;
+    wait();
+}
+
+void Compositor::getPoses(vr::TrackedDevicePose_t* out) {
+    AutoLock autoLock(posesLock);
+    memcpy(out, poses, sizeof(poses));
+}
+
+bool Compositor::findRenderPose(vr::TrackedDevicePose_t* pose, uint64_t* timeUs) {
+    uint64_t frame = poseRing ? hmd_pose_ring_get_render_frame(poseRing) : 0;
+
+    AutoLock autoLock(posesLock);
+    if(!frame) {
+        // The guest doesn't say, so it probably used the newest poses.
+        frame = latestFrame;
+    }
+    const PoseRecord& record = poseHistory[frame % poseHistory.size()];
+    if(!frame || record.frame != frame || !record.pose.bPoseIsValid) {
+        return false;
+    }
+    *pose = record.pose;
+    *timeUs = record.timeUs;
+    return true;
+}
+
+void Compositor::releaseSlots() {
+    AutoLock postAutoLock(postLock);
+    released = true;
+    for(Slot& slot : slots) {
+        if(slot.fence) {
+            s_gles2.glDeleteSync(slot.fence);
+            slot.fence = nullptr;
+        }
+        if(slot.texture) {
+            s_gles2.glDeleteTextures(1, &slot.texture);
+            slot.texture = 0;
+        }
+    }
+}
+
+GLuint Compositor::reproject(const Slot& slot, const vr::TrackedDevicePose_t& hmdPose) {
+    if(!reprojector || !slot.hasRenderPose) {
+        return 0;
+    }
+    const vr::TrackedDevicePose_t displayPose = predictPose(hmdPose, hmd->secondsToPhotons());
+    if(!displayPose.bPoseIsValid) {
+        return 0;
+    }
+    return reprojector->reproject(slot.texture, slot.width, slot.height,
+                                  sourceFromDisplay(slot.renderPose, displayPose),
+                                  hmd->getEyeFov(vr::Eye_Left),
+                                  hmd->getEyeFov(vr::Eye_Right));
+}
+
+uint64_t Compositor::publishPoses(const vr::TrackedDevicePose_t* framePoses, uint64_t timeUs) {
+    static_assert(HMD_POSE_MAX_DEVICES >= vr::k_unMaxTrackedDeviceCount,
+                  "The pose ring can't hold every tracked device");
+
+    hmd_pose_slot* slot = hmd_pose_ring_begin_write(poseRing);
+    slot->timestamp_ns = timeUs * 1000;
+    slot->device_count = vr::k_unMaxTrackedDeviceCount;
+    for(uint32_t i = 0; i < vr::k_unMaxTrackedDeviceCount; ++i) {
+        const vr::TrackedDevicePose_t& in = framePoses[i];
+        hmd_device_pose& out = slot->poses[i];
+        memcpy(out.device_to_absolute, in.mDeviceToAbsoluteTracking.m, sizeof(out.device_to_absolute));
+        memcpy(out.velocity, in.vVelocity.v, sizeof(out.velocity));
+        memcpy(out.angular_velocity, in.vAngularVelocity.v, sizeof(out.angular_velocity));
+        out.tracking_result = in.eTrackingResult;
+        out.flags = (in.bPoseIsValid ? HMD_POSE_FLAG_VALID : 0) |
+                    (in.bDeviceIsConnected ? HMD_POSE_FLAG_CONNECTED : 0);
+    }
+    hmd_pose_ring_end_write(poseRing, slot);
+    return slot->frame;
+}
+
+Compositor::Stats Compositor::stats() {
+    AutoLock autoLock(lock);
+    return frameStats;
+}
+
+intptr_t Compositor::main() {
+    EGLContext context = EGL_NO_CONTEXT;
+    EGLSurface surface = EGL_NO_SURFACE;
+    FrameBuffer::getFB()->createAndBindTrivialSharedContext(&context, &surface);
+
+    if(System::get()->envGet("LEMVR_REPROJECTION") == "1") {
+        reprojector.reset(new Reprojector());
+    }
+
+    vr::TrackedDevicePose_t framePoses[vr::k_unMaxTrackedDeviceCount];
+    uint64_t frame = 0;
+    while(!stopRequested) {
+        hmd->waitGetPoses(framePoses, vr::k_unMaxTrackedDeviceCount);
+        const uint64_t poseTimeUs = System::get()->getHighResTimeUs();
+        frame = poseRing ? publishPoses(framePoses, poseTimeUs) : frame + 1;
+        {
+            AutoLock autoLock(posesLock);
+            memcpy(poses, framePoses, sizeof(poses));
+            latestFrame = frame;
+            PoseRecord& record = poseHistory[frame % poseHistory.size()];
+            record.frame = frame;
+            record.timeUs = poseTimeUs;
+            record.pose = framePoses[vr::k_unTrackedDeviceIndex_Hmd];
+        }
+
+        if(!server->hasClientConnected() && !hmd->headless()) {
+            continue;
+        }
+
+        const bool newFrame = acquireFrame();
+        Slot& slot = slots[readIndex];
+        if(!slot.texture) {
+            continue;
+        }
+        if(slot.fence) {
+            s_gles2.glWaitSync(slot.fence, 0, GL_TIMEOUT_IGNORED);
+            s_gles2.glDeleteSync(slot.fence);
+            slot.fence = nullptr;
+        }
+
+        const GLuint reprojected = reproject(slot, framePoses[vr::k_unTrackedDeviceIndex_Hmd]);
+        hmd->submit(getGlobalTextureName(reprojected ? reprojected : slot.texture));
+        if(newFrame) {
+            FrameTracer::get()->mark(slot.traceFrame, FrameTracer::VrSubmit);
+        }
+
+        AutoLock autoLock(lock);
+        ++frameStats.submitted;
+        if(!newFrame) {
+            ++frameStats.repeated;
+        }
+        if(reprojected) {
+            ++frameStats.reprojected;
+        }
+    }
+
+    reprojector.reset();
+    releaseSlots();
+
+    FrameBuffer::getFB()->unbindAndDestroyTrivialSharedContext(context, surface);
+    return 0;
+}
+
+}
@@ -0,0 +1,136 @@
+/*
+* Copyright (C) 2021 Andrew Sumsion
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include "openvr.h"
+
+#include "LemvrHmd.h"
+#include "LemvrReprojection.h"
+#include "LemvrServer.h"
+#include "android/base/synchronization/Lock.h"
+#include "android/emulation/hmd_pose_ring.h"
+#include "emugl/common/thread.h"
+
+#include <EGL/egl.h>
+#include <GLES3/gl3.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+class ColorBuffer;
+
+namespace lemvr {
+
+// Shows the emulator's frames on the headset from a thread of its own, so
+// posting to the emulator window never waits for the headset's vsync.
+//
+// Frames are handed over through three textures: the post thread copies each
+// ColorBuffer into the back one and swaps it with the ready one, and the
+// compositor thread picks up the ready one at every headset frame. Frames the
+// headset is too slow for are dropped, and the last one is shown again if
+// there's no new one.
+//
+// With LEMVR_REPROJECTION=1, each frame remembers the head pose it was
+// rendered with, and is reprojected to the pose predicted for when it's shown.
+// It's off by default: a guest that doesn't report the pose it rendered with
+// gets the newest one assumed, which is wrong for a guest that's behind.
+class Compositor : public emugl::Thread {
+public:
+    struct Stats {
+        uint64_t posted;
+        uint64_t dropped;
+        uint64_t submitted;
+        uint64_t repeated;
+        uint64_t reprojected;
+    };
+
+    // Poses are also published to |poseRing| for the guest, if it's set.
+    Compositor(Hmd* hmd, LemvrServer* server, hmd_pose_ring* poseRing);
+
+    // Called on the post thread, with its GL context current. |traceFrame|
+    // is the frame's FrameTracer id, 0 if it isn't traced. Does nothing once
+    // the compositor has stopped.
+    void post(ColorBuffer* cb, uint64_t traceFrame);
+
+    // Stops the thread and waits for it; the frame textures are deleted.
+    void stop();
+
+    // The poses the headset predicted for its current frame.
+    void getPoses(vr::TrackedDevicePose_t* poses);
+
+    Stats stats();
+
+    intptr_t main() override;
+
+private:
+    struct Slot {
+        GLuint texture = 0;
+        GLsync fence = nullptr;
+        GLuint width = 0;
+        GLuint height = 0;
+        bool hasRenderPose = false;
+        vr::TrackedDevicePose_t renderPose;
+        uint64_t traceFrame = 0;
+    };
+
+    struct PoseRecord {
+        uint64_t frame = 0;
+        uint64_t timeUs = 0;
+        vr::TrackedDevicePose_t pose;
+    };
+
+    bool acquireFrame();
+    // Deletes the slots' textures and fences, and stops post() from making
+    // new ones. Called on the compositor thread before its context goes.
+    void releaseSlots();
+    // Returns the frame number the poses were published as.
+    uint64_t publishPoses(const vr::TrackedDevicePose_t* framePoses, uint64_t timeUs);
+    // The head pose the frame being posted was rendered with, and when it
+    // was sampled.
+    bool findRenderPose(vr::TrackedDevicePose_t* pose, uint64_t* timeUs);
+    GLuint reproject(const Slot& slot, const vr::TrackedDevicePose_t& hmdPose);
+
+    Hmd* hmd;
+    LemvrServer* server;
+    hmd_pose_ring* poseRing;
+    std::atomic<bool> stopRequested{false};
+
+    // Held by post() for the whole copy, so the slots can't be released from
+    // under it.
+    android::base::Lock postLock;
+    bool released = false;
+
+    android::base::Lock lock;
+    std::array<Slot, 3> slots;
+    int writeIndex = 0;  // Only touched by the post thread.
+    int readyIndex = 1;
+    int readIndex = 2;   // Only touched by the compositor thread.
+    bool hasNewFrame = false;
+    Stats frameStats = {};
+
+    android::base::Lock posesLock;
+    vr::TrackedDevicePose_t poses[vr::k_unMaxTrackedDeviceCount] = {};
+    uint64_t latestFrame = 0;
+    std::array<PoseRecord, HMD_POSE_RING_SLOTS> poseHistory;
+
+    // Only used on the compositor thread.
+    std::unique_ptr<Reprojector> reprojector;
+};
+
+}
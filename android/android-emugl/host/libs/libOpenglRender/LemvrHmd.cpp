@@ -0,0 +1,181 @@
+/*
+* Copyright (C) 2021 Andrew Sumsion
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "LemvrHmd.h"
+
+#include "android/base/system/System.h"
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <stdint.h>
+
+using android::base::System;
+
+namespace lemvr {
+
+namespace {
+
+class OpenVrHmd : public Hmd {
+public:
+    bool init() {
+        if(!vr::VR_IsHmdPresent()) {
+            std::cerr << "Error: No HMD detected\n";
+            return false;
+        }
+
+        if(!vr::VR_IsRuntimeInstalled()) {
+            std::cerr << "Error: OpenVR runtime not detected\n";
+            return false;
+        }
+
+        vr::EVRInitError err = vr::VRInitError_None;
+        hmd = vr::VR_Init(&err, vr::VRApplication_Scene);
+
+        if(err != vr::VRInitError_None) {
+            std::cerr << "Error: " << vr::VR_GetVRInitErrorAsEnglishDescription(err) << std::endl;
+            hmd = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    void waitGetPoses(vr::TrackedDevicePose_t* poses, uint32_t count) override {
+        vr::VRCompositor()->WaitGetPoses(poses, count, nullptr, 0);
+    }
+
+    bool submit(GLuint texture) override {
+        vr::Texture_t vrTexture = {(void*)(uintptr_t)texture, vr::TextureType_OpenGL, vr::ColorSpace_Gamma};
+
+        vr::VRTextureBounds_t leftBounds;
+        leftBounds.uMin = 0;
+        leftBounds.uMax = 0.5;
+        leftBounds.vMin = 1; // Fix VR displaying upside down
+        leftBounds.vMax = 0;
+
+        vr::VRTextureBounds_t rightBounds;
+        rightBounds.uMin = 0.5;
+        rightBounds.uMax = 1;
+        rightBounds.vMin = 1;
+        rightBounds.vMax = 0;
+
+        vr::EVRCompositorError errorL = vr::VRCompositor()->Submit(vr::Eye_Left, &vrTexture, &leftBounds, vr::Submit_Default);
+        vr::EVRCompositorError errorR = vr::VRCompositor()->Submit(vr::Eye_Right, &vrTexture, &rightBounds, vr::Submit_Default);
+
+        if(errorL != 0) {
+            std::cerr << "Left  Eye Error: " << errorL << std::endl;
+        }
+
+        if(errorR != 0) {
+            std::cerr << "Right Eye Error: " << errorR << std::endl;
+        }
+        return errorL == 0 && errorR == 0;
+    }
+
+    // WaitGetPoses() already predicts the poses for when the frame is shown.
+    float secondsToPhotons() const override { return 0; }
+
+    EyeFov getEyeFov(vr::EVREye eye) const override {
+        EyeFov fov;
+        hmd->GetProjectionRaw(eye, &fov.left, &fov.right, &fov.top, &fov.bottom);
+        return fov;
+    }
+
+    void shutdown() override {
+        if(hmd) {
+            vr::VR_Shutdown();
+            hmd = nullptr;
+        }
+    }
+
+private:
+    vr::IVRSystem* hmd = nullptr;
+};
+
+// Paces frames like a 90 Hz headset and drops them. The head turns around
+// the vertical axis at |yawRate| radians per second, which makes for a
+// synthetic pose source to test prediction and reprojection with.
+class NullHmd : public Hmd {
+public:
+    static constexpr System::WallDuration kFrameUs = 1000000 / 90;
+
+    NullHmd(float yawRate)
+        : yawRate(yawRate),
+          startUs(System::get()->getHighResTimeUs()) {}
+
+    void waitGetPoses(vr::TrackedDevicePose_t* poses, uint32_t count) override {
+        const auto now = System::get()->getHighResTimeUs();
+        if(nextFrameUs > now) {
+            System::get()->sleepUs(unsigned(nextFrameUs - now));
+            nextFrameUs += kFrameUs;
+        } else {
+            nextFrameUs = now + kFrameUs;
+        }
+
+        memset(poses, 0, sizeof(*poses) * count);
+        if(count > vr::k_unTrackedDeviceIndex_Hmd) {
+            // The pose is sampled now; it's shown a frame later.
+            const float yaw = yawRate * (System::get()->getHighResTimeUs() - startUs) / 1000000.0f;
+            vr::TrackedDevicePose_t& hmdPose = poses[vr::k_unTrackedDeviceIndex_Hmd];
+            hmdPose.mDeviceToAbsoluteTracking.m[0][0] = cosf(yaw);
+            hmdPose.mDeviceToAbsoluteTracking.m[0][2] = sinf(yaw);
+            hmdPose.mDeviceToAbsoluteTracking.m[1][1] = 1;
+            hmdPose.mDeviceToAbsoluteTracking.m[2][0] = -sinf(yaw);
+            hmdPose.mDeviceToAbsoluteTracking.m[2][2] = cosf(yaw);
+            hmdPose.vAngularVelocity.v[1] = yawRate;
+            hmdPose.eTrackingResult = vr::TrackingResult_Running_OK;
+            hmdPose.bPoseIsValid = true;
+            hmdPose.bDeviceIsConnected = true;
+        }
+    }
+
+    bool submit(GLuint texture) override { return true; }
+    bool headless() const override { return true; }
+    float secondsToPhotons() const override { return kFrameUs / 1000000.0f; }
+
+    // 90 degrees across for each eye.
+    EyeFov getEyeFov(vr::EVREye eye) const override { return {-1, 1, -1, 1}; }
+
+    void shutdown() override {}
+
+private:
+    const float yawRate;
+    const System::WallDuration startUs;
+    System::WallDuration nextFrameUs = 0;
+};
+
+}  // namespace
+
+std::unique_ptr<Hmd> Hmd::create() {
+    const std::string backend = System::get()->envGet("LEMVR_HMD");
+    if(backend == "null") {
+        std::cout << "Using the headless null HMD\n";
+        return std::unique_ptr<Hmd>(new NullHmd(0));
+    }
+    if(backend == "synthetic") {
+        std::cout << "Using the headless synthetic HMD\n";
+        return std::unique_ptr<Hmd>(new NullHmd(1.0f));
+    }
+
+    std::unique_ptr<OpenVrHmd> hmd(new OpenVrHmd());
+    if(!hmd->init()) {
+        return nullptr;
+    }
+    return std::move(hmd);
+}
+
+}
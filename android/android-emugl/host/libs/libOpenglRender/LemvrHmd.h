@@ -0,0 +1,72 @@
+/*
+* Copyright (C) 2021 Andrew Sumsion
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include "openvr.h"
+
+#include <GLES2/gl2.h>
+
+#include <cstdint>
+#include <memory>
+
+namespace lemvr {
+
+// Tangents of the angles from the view direction to the edges of an eye's
+// view, as OpenVR's GetProjectionRaw() returns them: up and left are
+// negative.
+struct EyeFov {
+    float left;
+    float right;
+    float top;
+    float bottom;
+};
+
+// The headset frames are shown on. Only used from the VR compositor thread,
+// with its GL context current.
+class Hmd {
+public:
+    virtual ~Hmd() = default;
+
+    // Picks the backend: the OpenVR runtime, or a headless one if the
+    // LEMVR_HMD environment variable is "null", or one whose head turns at a
+    // constant rate if it's "synthetic".
+    // Returns nullptr if there's no usable headset.
+    static std::unique_ptr<Hmd> create();
+
+    // Blocks until it's time to start the next frame, and fills |poses|
+    // with the device poses predicted for it.
+    virtual void waitGetPoses(vr::TrackedDevicePose_t* poses,
+                              uint32_t count) = 0;
+
+    // Shows |texture|, a global texture name, with the left eye in its left
+    // half and the right eye in the right one.
+    virtual bool submit(GLuint texture) = 0;
+
+    // How far the poses from waitGetPoses() are from the time the frame
+    // will be shown.
+    virtual float secondsToPhotons() const { return 0; }
+
+    virtual EyeFov getEyeFov(vr::EVREye eye) const = 0;
+
+    // Whether frames are shown without a LEMVR client connected; the
+    // headless backend is there for benchmarking.
+    virtual bool headless() const { return false; }
+
+    virtual void shutdown() = 0;
+};
+
+}
@@ -20,56 +20,24 @@
 
 #include "FrameBuffer.h"
 #include "GLcommon/GLutils.h"
+#include "emugl/common/logging.h"
 
 #include "openvr.h"
 
+#include <cstring>
 #include <iostream>
 #include <stdint.h>
 
 namespace lemvr {
 
-class ServerInitThread : public emugl::Thread {
-public:
-    LemvrServer* server;
-
-    ServerInitThread(LemvrServer* server) : Thread() {
-        this->server = server;
-    }
-
-    virtual intptr_t main() {
-        int err = server->waitForClient();
-        if(err != 0) {
-            std::cerr << "An error occurred waiting for a client to connect: " << err << std::endl;
-            return 1;
-        }
-
-        return 0;
-    }
-};
+static hmd_pose_ring* poseRing = nullptr;
 
 LemvrApplication::LemvrApplication()
-    : poses(nullptr),
-      hmd(nullptr),
-      server(nullptr),
+    : server(nullptr),
+      compositor(nullptr),
       error(0) {
-    if(!vr::VR_IsHmdPresent()) {
-        std::cerr << "Error: No HMD detected\n";
-        error = 1;
-        return;
-    }
-
-    if(!vr::VR_IsRuntimeInstalled()) {
-        std::cerr << "Error: OpenVR runtime not detected\n";
-        error = 1;
-        return;
-    }
-
-    vr::EVRInitError err = vr::VRInitError_None;
-	hmd = vr::VR_Init(&err, vr::VRApplication_Scene);
-
-    if(err != vr::VRInitError_None) {
-        std::cerr << "Error: " << vr::VR_GetVRInitErrorAsEnglishDescription(err) << std::endl;
-        hmd = NULL;
+    hmd = Hmd::create();
+    if(!hmd) {
         error = 1;
         return;
     }
@@ -81,73 +49,50 @@ LemvrApplication::LemvrApplication()
         return;
     }
 
-    std::cout << "Waiting for client on another thread..." << std::endl;
-    serverInitThread = new ServerInitThread(server);
-    serverInitThread->start();
+    std::cout << "Waiting for clients on another thread..." << std::endl;
 
-    poses = new vr::TrackedDevicePose_t[vr::k_unMaxTrackedDeviceCount];
-    waitGetPoses();
+    compositor = new Compositor(hmd.get(), server, poseRing);
+    compositor->start();
 }
 
 LemvrApplication::~LemvrApplication() {
-    if(hmd) {
-        hmd = NULL;
-        delete [] poses;
-    }
+    delete compositor;
+    hmd.reset();
 }
 
 void LemvrApplication::shutdown() {
-    server->stopServer();
-    vr::VR_Shutdown();
-}
-
-void LemvrApplication::submitFrame(GLuint texture) {
-    if(!hmd) {
-        return;
+    if(compositor) {
+        compositor->stop();
+        Compositor::Stats stats = compositor->stats();
+        GL_LOG("VR frames posted: %llu, dropped: %llu, submitted: %llu, "
+               "repeated: %llu, reprojected: %llu",
+               (unsigned long long)stats.posted,
+               (unsigned long long)stats.dropped,
+               (unsigned long long)stats.submitted,
+               (unsigned long long)stats.repeated,
+               (unsigned long long)stats.reprojected);
     }
-    if(!server->hasClientConnected()) {
-        return;
+    if(server) {
+        server->stopServer();
     }
-
-    unsigned int globalTexture = getGlobalTextureName(texture);
-
-    vr::Texture_t vrTexture = {(void*)(uintptr_t)globalTexture, vr::TextureType_OpenGL, vr::ColorSpace_Gamma};
-
-    vr::VRTextureBounds_t leftBounds;
-    leftBounds.uMin = 0;
-    leftBounds.uMax = 0.5;
-    leftBounds.vMin = 1; // Fix VR displaying upside down
-    leftBounds.vMax = 0;
-
-    vr::VRTextureBounds_t rightBounds;
-    rightBounds.uMin = 0.5;
-    rightBounds.uMax = 1;
-    rightBounds.vMin = 1;
-    rightBounds.vMax = 0;
-
-    vr::EVRCompositorError errorL = vr::VRCompositor()->Submit(vr::Eye_Left, &vrTexture, &leftBounds, vr::Submit_Default);
-    vr::EVRCompositorError errorR = vr::VRCompositor()->Submit(vr::Eye_Right, &vrTexture, &rightBounds, vr::Submit_Default);
-
-    if(errorL != 0) {
-        std::cerr << "Left  Eye Error: " << errorL << std::endl;
+    if(hmd) {
+        hmd->shutdown();
     }
+}
 
-    if(errorR != 0) {
-        std::cerr << "Right Eye Error: " << errorR << std::endl;
+void LemvrApplication::postFrame(ColorBuffer* cb, uint64_t traceFrame) {
+    if(!compositor) {
+        return;
     }
-
-    waitGetPoses();
+    compositor->post(cb, traceFrame);
 }
 
-void LemvrApplication::waitGetPoses() {
-    vr::VRCompositor()->WaitGetPoses(poses, vr::k_unMaxTrackedDeviceCount, nullptr, 0);
-    if(!server->hasClientConnected()) {
+void LemvrApplication::getPoses(vr::TrackedDevicePose_t* poses) const {
+    if(!compositor) {
+        memset(poses, 0, sizeof(*poses) * vr::k_unMaxTrackedDeviceCount);
         return;
     }
-    int err = server->mainLoop();
-    if(err != 0) {
-        std::cerr << "An error occured in the server main loop: " << err << std::endl;
-    }
+    compositor->getPoses(poses);
 }
 
 LemvrApplication* vrApp;
@@ -160,7 +105,11 @@ void lemvrMain() {
         return;
     }
 
-    std::cout << "OpenVR Initialized!\n";
+    std::cout << "VR Initialized!\n";
+}
+
+void setPoseRing(hmd_pose_ring* ring) {
+    poseRing = ring;
 }
 
 LemvrApplication* getVrApp() {
@@ -173,4 +122,4 @@ void shutdown() {
     socketQuit();
 }
 
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -18,6 +18,8 @@
 
 #include "openvr.h"
 
+#include "LemvrCompositor.h"
+#include "LemvrHmd.h"
 #include "LemvrServer.h"
 #include "emugl/common/thread.h"
 
@@ -25,16 +27,18 @@
 #include <EGL/eglext.h>
 #include <GLES2/gl2.h>
 
+#include <memory>
+
+class ColorBuffer;
+struct hmd_pose_ring;
+
 namespace lemvr {
 
 class LemvrApplication {
 private:
-    vr::IVRSystem* hmd;
-    vr::TrackedDevicePose_t* poses;
+    std::unique_ptr<Hmd> hmd;
     LemvrServer* server;
-    emugl::Thread* serverInitThread;
-
-    void waitGetPoses();
+    Compositor* compositor;
 
 public:
     int error;
@@ -44,13 +48,18 @@ public:
 
     void shutdown();
 
-    void submitFrame(GLuint texture);
+    // Hands a posted frame to the compositor thread; called on the post
+    // thread, with its GL context current. |traceFrame| is the frame's
+    // FrameTracer id.
+    void postFrame(ColorBuffer* cb, uint64_t traceFrame);
 
-    vr::IVRSystem* getHMD() const { return hmd; }
-    vr::TrackedDevicePose_t* getPoses() const { return poses; }
+    Hmd* getHMD() const { return hmd.get(); }
+    void getPoses(vr::TrackedDevicePose_t* poses) const;
 };
 
 LemvrApplication* getVrApp();
+// Sets where poses are published for the guest; call before lemvrMain().
+void setPoseRing(hmd_pose_ring* ring);
 void lemvrMain();
 void shutdown();
 
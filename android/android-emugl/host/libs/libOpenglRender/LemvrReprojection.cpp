@@ -0,0 +1,297 @@
+/*
+* Copyright (C) 2021 Andrew Sumsion
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "LemvrReprojection.h"
+
+#include "DispatchTables.h"
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+namespace lemvr {
+
+namespace {
+
+// How long to wait for the headset to be done with an output, about a frame.
+constexpr GLuint64 kOutputWaitNs = 20 * 1000 * 1000;
+
+Mat3 multiply(const Mat3& a, const Mat3& b) {
+    Mat3 result = {};
+    for(int i = 0; i < 3; ++i) {
+        for(int j = 0; j < 3; ++j) {
+            for(int k = 0; k < 3; ++k) {
+                result.m[i][j] += a.m[i][k] * b.m[k][j];
+            }
+        }
+    }
+    return result;
+}
+
+Mat3 transpose(const Mat3& a) {
+    Mat3 result;
+    for(int i = 0; i < 3; ++i) {
+        for(int j = 0; j < 3; ++j) {
+            result.m[i][j] = a.m[j][i];
+        }
+    }
+    return result;
+}
+
+// Rotation by |angle| radians around the unit vector |axis|.
+Mat3 axisAngle(const float axis[3], float angle) {
+    const float c = cosf(angle);
+    const float s = sinf(angle);
+    const float t = 1 - c;
+    const float x = axis[0];
+    const float y = axis[1];
+    const float z = axis[2];
+    return {{
+        {t * x * x + c,     t * x * y - s * z, t * x * z + s * y},
+        {t * x * y + s * z, t * y * y + c,     t * y * z - s * x},
+        {t * x * z - s * y, t * y * z + s * x, t * z * z + c},
+    }};
+}
+
+// Draws a full screen quad; maps each output pixel back to the pixel of the
+// source frame that looked in the same direction.
+const char kVertexShaderSource[] =
+    "attribute vec2 position;\n"
+    "varying vec2 uv;\n"
+    "void main(void) {\n"
+    "  uv = position * 0.5 + 0.5;\n"
+    "  gl_Position = vec4(position, 0.0, 1.0);\n"
+    "}\n";
+
+// Frames are side by side, upside down: v = 1 is the top of the view.
+const char kFragmentShaderSource[] =
+    "precision highp float;\n"
+    "varying vec2 uv;\n"
+    "uniform sampler2D tex;\n"
+    "uniform mat3 rotation;\n"
+    "uniform vec4 fov[2];\n"  // left, right, top, bottom
+    "void main(void) {\n"
+    "  float eye = step(0.5, uv.x);\n"
+    "  vec4 f = eye < 0.5 ? fov[0] : fov[1];\n"
+    "  vec2 view = vec2(uv.x * 2.0 - eye, 1.0 - uv.y);\n"
+    "  vec3 ray = vec3(mix(f.x, f.y, view.x), -mix(f.z, f.w, view.y), -1.0);\n"
+    "  vec3 src = rotation * ray;\n"
+    "  if (src.z >= 0.0) {\n"
+    "    gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0);\n"
+    "    return;\n"
+    "  }\n"
+    "  vec2 t = vec2(src.x / -src.z, src.y / src.z);\n"
+    "  vec2 s = vec2((t.x - f.x) / (f.y - f.x), (t.y - f.z) / (f.w - f.z));\n"
+    "  if (any(lessThan(s, vec2(0.0))) || any(greaterThan(s, vec2(1.0)))) {\n"
+    "    gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0);\n"
+    "    return;\n"
+    "  }\n"
+    "  gl_FragColor = texture2D(tex, vec2((s.x + eye) * 0.5, 1.0 - s.y));\n"
+    "}\n";
+
+const GLfloat kVertices[] = {
+    -1, -1,
+    +1, -1,
+    -1, +1,
+    +1, +1,
+};
+
+GLuint createShader(GLenum type, const char* source) {
+    GLuint shader = s_gles2.glCreateShader(type);
+    if(!shader) {
+        return 0;
+    }
+    s_gles2.glShaderSource(shader, 1, &source, nullptr);
+    s_gles2.glCompileShader(shader);
+
+    GLint success = GL_FALSE;
+    s_gles2.glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if(success == GL_FALSE) {
+        GLint length = 0;
+        s_gles2.glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+        std::string log(length + 1, '\0');
+        s_gles2.glGetShaderInfoLog(shader, length, nullptr, &log[0]);
+        std::cerr << "Reprojection shader compile failed: " << log << std::endl;
+        s_gles2.glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+}  // namespace
+
+Mat3 rotationOf(const vr::HmdMatrix34_t& transform) {
+    Mat3 result;
+    for(int i = 0; i < 3; ++i) {
+        for(int j = 0; j < 3; ++j) {
+            result.m[i][j] = transform.m[i][j];
+        }
+    }
+    return result;
+}
+
+vr::TrackedDevicePose_t predictPose(const vr::TrackedDevicePose_t& pose, float seconds) {
+    vr::TrackedDevicePose_t result = pose;
+    if(!pose.bPoseIsValid || seconds == 0) {
+        return result;
+    }
+
+    const float* w = pose.vAngularVelocity.v;
+    const float speed = sqrtf(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]);
+    Mat3 rotation = rotationOf(pose.mDeviceToAbsoluteTracking);
+    if(speed > 1e-6f) {
+        const float axis[3] = {w[0] / speed, w[1] / speed, w[2] / speed};
+        rotation = multiply(axisAngle(axis, speed * seconds), rotation);
+    }
+
+    for(int i = 0; i < 3; ++i) {
+        for(int j = 0; j < 3; ++j) {
+            result.mDeviceToAbsoluteTracking.m[i][j] = rotation.m[i][j];
+        }
+        result.mDeviceToAbsoluteTracking.m[i][3] += pose.vVelocity.v[i] * seconds;
+    }
+    return result;
+}
+
+Mat3 sourceFromDisplay(const vr::TrackedDevicePose_t& renderPose,
+                       const vr::TrackedDevicePose_t& displayPose) {
+    return multiply(transpose(rotationOf(renderPose.mDeviceToAbsoluteTracking)),
+                    rotationOf(displayPose.mDeviceToAbsoluteTracking));
+}
+
+Reprojector::Reprojector() {
+    GLuint vertexShader = createShader(GL_VERTEX_SHADER, kVertexShaderSource);
+    GLuint fragmentShader = createShader(GL_FRAGMENT_SHADER, kFragmentShaderSource);
+    if(!vertexShader || !fragmentShader) {
+        s_gles2.glDeleteShader(vertexShader);
+        s_gles2.glDeleteShader(fragmentShader);
+        return;
+    }
+
+    program = s_gles2.glCreateProgram();
+    s_gles2.glAttachShader(program, vertexShader);
+    s_gles2.glAttachShader(program, fragmentShader);
+    s_gles2.glLinkProgram(program);
+    s_gles2.glDeleteShader(vertexShader);
+    s_gles2.glDeleteShader(fragmentShader);
+
+    GLint success = GL_FALSE;
+    s_gles2.glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if(success == GL_FALSE) {
+        GLchar messages[256];
+        s_gles2.glGetProgramInfoLog(program, sizeof(messages), nullptr, messages);
+        std::cerr << "Reprojection program link failed: " << messages << std::endl;
+        s_gles2.glDeleteProgram(program);
+        program = 0;
+        return;
+    }
+
+    positionSlot = s_gles2.glGetAttribLocation(program, "position");
+    textureSlot = s_gles2.glGetUniformLocation(program, "tex");
+    rotationSlot = s_gles2.glGetUniformLocation(program, "rotation");
+    fovSlot = s_gles2.glGetUniformLocation(program, "fov");
+
+    s_gles2.glGenBuffers(1, &vertexBuffer);
+    s_gles2.glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    s_gles2.glBufferData(GL_ARRAY_BUFFER, sizeof(kVertices), kVertices, GL_STATIC_DRAW);
+    s_gles2.glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    s_gles2.glGenFramebuffers(1, &framebuffer);
+}
+
+Reprojector::~Reprojector() {
+    for(Output& out : outputs) {
+        if(out.fence) {
+            s_gles2.glDeleteSync(out.fence);
+        }
+        s_gles2.glDeleteTextures(1, &out.texture);
+    }
+    s_gles2.glDeleteFramebuffers(1, &framebuffer);
+    s_gles2.glDeleteBuffers(1, &vertexBuffer);
+    s_gles2.glDeleteProgram(program);
+}
+
+GLuint Reprojector::reproject(GLuint texture, GLuint width, GLuint height,
+                              const Mat3& rotation, const EyeFov& left, const EyeFov& right) {
+    if(!program) {
+        return 0;
+    }
+
+    // The headset may still be reading the last output, so draw into the
+    // other one, once the headset is done with that.
+    if(lastOutput >= 0) {
+        Output& last = outputs[lastOutput];
+        if(last.fence) {
+            s_gles2.glDeleteSync(last.fence);
+        }
+        last.fence = s_gles2.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    lastOutput = (lastOutput + 1) % int(outputs.size());
+    Output& out = outputs[lastOutput];
+    if(out.fence) {
+        s_gles2.glClientWaitSync(out.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                 kOutputWaitNs);
+        s_gles2.glDeleteSync(out.fence);
+        out.fence = nullptr;
+    }
+
+    if(!out.texture || out.width != width || out.height != height) {
+        if(!out.texture) {
+            s_gles2.glGenTextures(1, &out.texture);
+        }
+        s_gles2.glBindTexture(GL_TEXTURE_2D, out.texture);
+        s_gles2.glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+                             GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        s_gles2.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        s_gles2.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        out.width = width;
+        out.height = height;
+    }
+
+    s_gles2.glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    s_gles2.glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                   GL_TEXTURE_2D, out.texture, 0);
+    s_gles2.glViewport(0, 0, width, height);
+    s_gles2.glUseProgram(program);
+
+    // GLSL wants the matrix column major.
+    const Mat3 columns = transpose(rotation);
+    s_gles2.glUniformMatrix3fv(rotationSlot, 1, GL_FALSE, &columns.m[0][0]);
+    const GLfloat fov[8] = {
+        left.left, left.right, left.top, left.bottom,
+        right.left, right.right, right.top, right.bottom,
+    };
+    s_gles2.glUniform4fv(fovSlot, 2, fov);
+
+    s_gles2.glActiveTexture(GL_TEXTURE0);
+    s_gles2.glBindTexture(GL_TEXTURE_2D, texture);
+    s_gles2.glUniform1i(textureSlot, 0);
+
+    s_gles2.glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    s_gles2.glEnableVertexAttribArray(positionSlot);
+    s_gles2.glVertexAttribPointer(positionSlot, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    s_gles2.glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    s_gles2.glDisableVertexAttribArray(positionSlot);
+    s_gles2.glBindBuffer(GL_ARRAY_BUFFER, 0);
+    s_gles2.glBindTexture(GL_TEXTURE_2D, 0);
+    s_gles2.glUseProgram(0);
+    s_gles2.glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return out.texture;
+}
+
+}
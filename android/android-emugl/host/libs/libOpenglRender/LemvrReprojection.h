@@ -0,0 +1,84 @@
+/*
+* Copyright (C) 2021 Andrew Sumsion
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include "openvr.h"
+
+#include "LemvrHmd.h"
+
+#include <GLES3/gl3.h>
+
+#include <array>
+
+namespace lemvr {
+
+// A row major rotation.
+struct Mat3 {
+    float m[3][3];
+};
+
+Mat3 rotationOf(const vr::HmdMatrix34_t& transform);
+
+// Extrapolates |pose| |seconds| into the future from its linear and angular
+// velocity, both of which OpenVR reports in tracking space.
+vr::TrackedDevicePose_t predictPose(const vr::TrackedDevicePose_t& pose, float seconds);
+
+// The rotation that takes a view direction in the head space of
+// |displayPose| to the head space of |renderPose|; the identity if the head
+// didn't turn.
+Mat3 sourceFromDisplay(const vr::TrackedDevicePose_t& renderPose,
+                       const vr::TrackedDevicePose_t& displayPose);
+
+// Warps side by side frames rendered for one head orientation to another,
+// which hides how long the frame took to get from the guest to the headset.
+// Only rotation is corrected; for the far away content of most VR scenes
+// that's what matters. Must be used on a single thread with a GL context.
+class Reprojector {
+public:
+    Reprojector();
+    ~Reprojector();
+
+    // Returns a texture with |texture| reprojected by |rotation|, or 0 on
+    // failure. The texture is left alone by the next call, so the headset
+    // can still be reading it while the next frame is reprojected; it's
+    // reused by the one after that.
+    GLuint reproject(GLuint texture, GLuint width, GLuint height,
+                     const Mat3& rotation, const EyeFov& left, const EyeFov& right);
+
+private:
+    GLuint program = 0;
+    GLuint vertexBuffer = 0;
+    GLuint framebuffer = 0;
+
+    struct Output {
+        GLuint texture = 0;
+        GLuint width = 0;
+        GLuint height = 0;
+        // Signaled once the commands that used the texture after it was
+        // returned, including its submission to the headset, are done.
+        GLsync fence = nullptr;
+    };
+    std::array<Output, 2> outputs;
+    int lastOutput = -1;
+
+    GLint positionSlot = -1;
+    GLint textureSlot = -1;
+    GLint rotationSlot = -1;
+    GLint fovSlot = -1;
+};
+
+}
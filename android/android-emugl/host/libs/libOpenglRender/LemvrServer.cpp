@@ -1,139 +1,235 @@
 #include "LemvrServer.h"
 
+#include <errno.h>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 
+#ifndef _WIN32
+  #include <sys/select.h>
+#endif
+
 using std::uint8_t;
 using std::uint16_t;
 
 namespace lemvr {
 
+namespace {
+    // How often the server thread wakes up to notice stopServer().
+    constexpr long kSelectTimeoutUs = 100 * 1000;
+}
+
 LemvrServer::LemvrServer()
     : server(nullptr),
-      client(nullptr),
+      thread(nullptr),
+      stopRequested(false),
+      clientCount(0),
       isLittleEndian(false) {
     uint16_t num = 1;
     isLittleEndian = *(uint8_t*)&num == 1;
+
+    setHandler(3, [this](int client, const uint8_t* data, uint16_t size) {
+        return packetGetMetadata(client, data, size);
+    });
 }
 
 LemvrServer::~LemvrServer() {
+    delete thread;
+    delete server;
+}
+
+void LemvrServer::setHandler(uint8_t id, PacketHandler handler) {
+    handlers[id] = std::move(handler);
 }
 
 int LemvrServer::startServer(int port) {
-    server = TcpServer::createServer(5892);
+    server = TcpServer::createServer(port);
+
+    if(!server || !server->isValid()) {
+        return 1;
+    }
 
-    if(!server->isValid()) {
+    scratch.reset(new uint8_t[kRingSize]);
+    thread = new ServerThread(this);
+    if(!thread->start()) {
         return 1;
     }
     return 0;
 }
 
 int LemvrServer::stopServer() {
-    client->close();
-    server->close();
+    if(thread) {
+        stopRequested = true;
+        thread->wait();
+    }
+    if(server) {
+        server->close();
+    }
     return 0;
 }
 
-int LemvrServer::waitForClient() {
-    if(client) {
-        client->close();
-        delete client;
-        client = nullptr;
-    }
+intptr_t LemvrServer::run() {
+    while(!stopRequested) {
+        fd_set readSet;
+        FD_ZERO(&readSet);
+        SOCKET maxHandle = server->getHandle();
+        FD_SET(server->getHandle(), &readSet);
+        for(const Client& client : clients) {
+            if(client.socket) {
+                FD_SET(client.socket->getHandle(), &readSet);
+                maxHandle = std::max(maxHandle, client.socket->getHandle());
+            }
+        }
 
-    TcpSocket* acceptedClient = server->accept();
-    if(!acceptedClient->isValid()) {
-        return 1;
-    }
+        timeval timeout = {0, kSelectTimeoutUs};
+        int ready = select((int)maxHandle + 1, &readSet, nullptr, nullptr, &timeout);
+        if(ready < 0) {
+#ifndef _WIN32
+            if(errno == EINTR) {
+                continue;
+            }
+#endif
+            std::cerr << "Error waiting for client sockets" << std::endl;
+            break;
+        }
+        if(ready == 0) {
+            continue;
+        }
 
-    uint8_t recvBuffer[4] = {0};
-    int bytes = 0;
+        if(FD_ISSET(server->getHandle(), &readSet)) {
+            acceptClient();
+        }
 
-    if(acceptedClient->readAll(recvBuffer, 4) != SocketStatus::OK) {
-        return 1;
+        for(int i = 0; i < kMaxClients; ++i) {
+            Client& client = clients[i];
+            if(!client.socket || !FD_ISSET(client.socket->getHandle(), &readSet)) {
+                continue;
+            }
+            if(!readClient(client) || processPackets(i) != 0) {
+                disconnect(client);
+            }
+        }
     }
 
-    if(!(recvBuffer[0] == 2 && recvBuffer[1] == 1 && recvBuffer[2] == 8 && recvBuffer[3] == 7)) {
-        return 2;
+    for(Client& client : clients) {
+        if(client.socket) {
+            disconnect(client);
+        }
     }
+    return 0;
+}
 
-    uint8_t sendBuffer[] = {1, 1, 3, 8};
-
-    if(acceptedClient->write(sendBuffer, 4, bytes) != SocketStatus::OK) {
-        return 1;
+void LemvrServer::acceptClient() {
+    TcpSocket* socket = server->accept();
+    if(!socket->isValid()) {
+        delete socket;
+        return;
     }
 
-    if(acceptedClient->setBlocking(false) != SocketStatus::OK) {
-        return 1;
+    for(Client& client : clients) {
+        if(client.socket) {
+            continue;
+        }
+        if(!client.ring) {
+            client.ring.reset(new uint8_t[kRingSize]);
+        }
+        client.socket = socket;
+        client.handshakeDone = false;
+        client.readPos = 0;
+        client.writePos = 0;
+        return;
     }
 
-    client = acceptedClient;
-    return 0;
+    std::cerr << "Too many clients, dropping a new connection" << std::endl;
+    socket->close();
+    delete socket;
 }
 
-int LemvrServer::mainLoop() {
-    SocketStatus status = SocketStatus::OK;
-    while(true) {
-        uint8_t id = 0;
-        uint8_t* buffer = readPacket(id, status);
-        if(status != SocketStatus::OK) {
-            break;
-        }
-            
-        int packetErr = handlePacket(id, buffer);
-        if(packetErr != 0) {
-            std::cerr << "Error occured handling packet. id=" << id << std::endl;
-            return packetErr;
-        }
-    }
+bool LemvrServer::readClient(Client& client) {
+    const uint64_t used = client.writePos - client.readPos;
+    const uint32_t offset = (uint32_t)(client.writePos & kRingMask);
+    const int length = (int)std::min<uint64_t>(kRingSize - used, kRingSize - offset);
 
-    if(status != SocketStatus::WOULDBLOCK) {
+    int bytes = 0;
+    SocketStatus status = client.socket->read(client.ring.get() + offset, length, bytes);
+    if(status == SocketStatus::WOULDBLOCK) {
+        return true;
+    }
+    if(status != SocketStatus::OK) {
         std::cerr << "Error occured reading packet. status=" << (int)status << std::endl;
-        return (int)status;
+        return false;
     }
-
-    return 0;
+    if(bytes == 0) {
+        // The client went away.
+        return false;
+    }
+    client.writePos += bytes;
+    return true;
 }
 
-uint8_t* LemvrServer::readPacket(uint8_t& id, SocketStatus& result) {
-    uint8_t recvBuffer[3] = {};
-    int bytes = 0;
+int LemvrServer::processPackets(int index) {
+    Client& client = clients[index];
 
-    SocketStatus status = SocketStatus::UNKNOWN;
+    if(!client.handshakeDone) {
+        if(client.writePos - client.readPos < 4) {
+            return 0;
+        }
+        const uint8_t* hello = peek(client, client.readPos, 4);
+        if(!(hello[0] == 2 && hello[1] == 1 && hello[2] == 8 && hello[3] == 7)) {
+            std::cerr << "Client sent an invalid handshake" << std::endl;
+            return 2;
+        }
 
-    status = client->read(recvBuffer, 3, bytes);
-    if(status != SocketStatus::OK) {
-        result = status;
-        return nullptr;
-    }
-    if(bytes == 0) {
-        result = SocketStatus::WOULDBLOCK;
-        return nullptr;
+        uint8_t sendBuffer[] = {1, 1, 3, 8};
+        int bytes = 0;
+        if(client.socket->write(sendBuffer, 4, bytes) != SocketStatus::OK || bytes != 4) {
+            return 1;
+        }
+        client.readPos += 4;
+        client.handshakeDone = true;
+        ++clientCount;
     }
 
-    uint8_t packetId = recvBuffer[0];
-    uint16_t size = getuint16(recvBuffer[1], recvBuffer[2]);
-    uint8_t* buffer = new uint8_t[size];
+    while(client.writePos - client.readPos >= kHeaderSize) {
+        const uint8_t* header = peek(client, client.readPos, kHeaderSize);
+        const uint8_t id = header[0];
+        const uint16_t size = getuint16(header[1], header[2]);
+        if(client.writePos - client.readPos < kHeaderSize + size) {
+            break;
+        }
 
-    status = client->readAll(buffer, size);
-    if(status != SocketStatus::OK) {
-        result = status;
-        return nullptr;
+        int err = 0;
+        if(handlers[id]) {
+            err = handlers[id](index, peek(client, client.readPos + kHeaderSize, size), size);
+        }
+        client.readPos += kHeaderSize + size;
+        if(err != 0) {
+            std::cerr << "Error occured handling packet. id=" << (int)id << std::endl;
+            return err;
+        }
     }
-        
-    id = packetId;
-    result = SocketStatus::OK;
-    return buffer;
+    return 0;
 }
 
-int LemvrServer::handlePacket(uint8_t id, uint8_t* buffer) {
-    int err = 0;
-
-    if(id == 3) {
-        packetGetMetadata(buffer, err);
+void LemvrServer::disconnect(Client& client) {
+    if(client.handshakeDone) {
+        --clientCount;
     }
+    client.socket->close();
+    delete client.socket;
+    client.socket = nullptr;
+    client.handshakeDone = false;
+}
 
-    delete[] buffer;
-    return err;
+const uint8_t* LemvrServer::peek(const Client& client, uint64_t pos, uint32_t size) {
+    const uint32_t offset = (uint32_t)(pos & kRingMask);
+    if(offset + size <= kRingSize) {
+        return client.ring.get() + offset;
+    }
+    const uint32_t head = kRingSize - offset;
+    memcpy(scratch.get(), client.ring.get() + offset, head);
+    memcpy(scratch.get() + head, client.ring.get(), size - head);
+    return scratch.get();
 }
 
 uint16_t LemvrServer::getuint16(uint8_t part1, uint8_t part2) {
@@ -144,8 +240,12 @@ uint16_t LemvrServer::getuint16(uint8_t part1, uint8_t part2) {
     }
 }
 
-void LemvrServer::packetGetMetadata(uint8_t* data, int& err) {
+int LemvrServer::packetGetMetadata(int client, const uint8_t* data, uint16_t size) {
+    if(size < 1) {
+        return 1;
+    }
     std::cout << "packetGetMetadata received: " << (int)data[0] << std::endl;
+    return 0;
 }
 
 } // namespace lemvr
@@ -3,34 +3,85 @@
 #include "TcpServer.h"
 #include "TcpSocket.h"
 
+#include "emugl/common/thread.h"
+
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
 
 using std::uint8_t;
 using std::uint16_t;
 
 namespace lemvr {
+    // Serves LEMVR clients from a thread of its own.
+    //
+    // Packets are a 1 byte id and a 2 byte size followed by the payload. They
+    // are framed in place in each client's ring buffer and passed to the
+    // handler registered for their id, so nothing is allocated per packet.
     class LemvrServer {
     public:
+        static constexpr int kMaxClients = 8;
+
+        // Gets the client index, the payload and its size. The payload is
+        // only valid during the call. Returning nonzero disconnects the client.
+        using PacketHandler = std::function<int(int client, const uint8_t* data, uint16_t size)>;
+
         LemvrServer();
         ~LemvrServer();
 
-        int startServer(int port);
-        int waitForClient();
-        bool hasClientConnected() const { return client != nullptr; }
-        int mainLoop();
+        // Handlers have to be registered before the server starts.
+        void setHandler(uint8_t id, PacketHandler handler);
 
+        int startServer(int port);
+        bool hasClientConnected() const { return clientCount > 0; }
         int stopServer();
-    
+
     private:
+        struct Client {
+            TcpSocket* socket = nullptr;
+            bool handshakeDone = false;
+            // Read and write positions in the ring; they only grow, and are
+            // wrapped with kRingMask.
+            uint64_t readPos = 0;
+            uint64_t writePos = 0;
+            std::unique_ptr<uint8_t[]> ring;
+        };
+
+        // A packet is at most 3 + 65535 bytes, so a whole one always fits.
+        static constexpr uint32_t kRingSize = 128 * 1024;
+        static constexpr uint32_t kRingMask = kRingSize - 1;
+        static constexpr uint32_t kHeaderSize = 3;
+
+        class ServerThread : public emugl::Thread {
+        public:
+            ServerThread(LemvrServer* server) : Thread(), server(server) {}
+            intptr_t main() override { return server->run(); }
+
+        private:
+            LemvrServer* server;
+        };
+
         TcpServer* server;
-        TcpSocket* client;
+        ServerThread* thread;
+        std::atomic<bool> stopRequested;
+        std::atomic<int> clientCount;
+        std::array<Client, kMaxClients> clients;
+        std::array<PacketHandler, 256> handlers;
+        // Where packets that wrap around the end of a ring are put together.
+        std::unique_ptr<uint8_t[]> scratch;
         bool isLittleEndian;
 
-        uint8_t* readPacket(uint8_t& id, SocketStatus& status);
-        int handlePacket(uint8_t id, uint8_t* data);
+        intptr_t run();
+        void acceptClient();
+        bool readClient(Client& client);
+        int processPackets(int index);
+        void disconnect(Client& client);
+        const uint8_t* peek(const Client& client, uint64_t pos, uint32_t size);
         uint16_t getuint16(uint8_t part1, uint8_t part2);
-        
-        void packetGetMetadata(uint8_t* data, int& err);
+
+        int packetGetMetadata(int client, const uint8_t* data, uint16_t size);
     };
 }
\ No newline at end of file
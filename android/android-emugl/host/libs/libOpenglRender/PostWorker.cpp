@@ -18,6 +18,7 @@
 #include "ColorBuffer.h"
 #include "DispatchTables.h"
 #include "FrameBuffer.h"
+#include "FrameTracer.h"
 #include "RenderThreadInfo.h"
 #include "OpenGLESDispatch/EGLDispatch.h"
 #include "OpenGLESDispatch/GLESv2Dispatch.h"
@@ -67,7 +68,10 @@ void PostWorker::fillMultiDisplayPostStruct(ComposeLayer* l,
     l->crop = cropArea;
 }
 
-void PostWorker::postImpl(ColorBuffer* cb) {
+void PostWorker::postImpl(ColorBuffer* cb, uint64_t traceFrame) {
+    FrameTracer* tracer = FrameTracer::get();
+    tracer->mark(traceFrame, FrameTracer::PostWorkerStart);
+
     // bind the subwindow eglSurface
     if (!m_mainThreadPostingOnly && !m_initialized) {
         m_initialized = mBindSubwin();
@@ -159,12 +163,14 @@ void PostWorker::postImpl(ColorBuffer* cb) {
     }
     else {
         // render the color buffer to the window and apply the overlay
-        lemvr::getVrApp()->submitFrame(cb->getTexture());
+        lemvr::getVrApp()->postFrame(cb, traceFrame);
+        tracer->mark(traceFrame, FrameTracer::VrHandoff);
         GLuint tex = cb->scale();
         cb->postWithOverlay(tex, zRot, dx, dy);
     }
 
     s_egl.eglSwapBuffers(mFb->getDisplay(), mFb->getWindowSurface());
+    tracer->mark(traceFrame, FrameTracer::WindowSwap);
 }
 
 // Called whenever the subwindow needs a refresh (FrameBuffer::setupSubWindow).
@@ -358,10 +364,11 @@ PostWorker::~PostWorker() {
     }
 }
 
-void PostWorker::post(ColorBuffer* cb) {
+void PostWorker::post(ColorBuffer* cb, uint64_t traceFrame) {
     if (m_mainThreadPostingOnly) {
         PostArgs args = {
             .postCb = cb,
+            .traceFrame = traceFrame,
         };
 
         m_toUiThread.send(args);
@@ -371,12 +378,12 @@ void PostWorker::post(ColorBuffer* cb) {
             PostArgs uiThreadArgs;
             p->m_toUiThread.receive(&uiThreadArgs);
             p->bind();
-            p->postImpl(uiThreadArgs.postCb);
+            p->postImpl(uiThreadArgs.postCb, uiThreadArgs.traceFrame);
         },
         this,
         false /* no wait */);
     } else {
-        postImpl(cb);
+        postImpl(cb, traceFrame);
     }
 }
 
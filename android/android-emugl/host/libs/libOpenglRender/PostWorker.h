@@ -45,9 +45,9 @@ public:
                EGLSurface eglSurface);
     ~PostWorker();
 
-    // post: posts the next color buffer.
+    // post: posts the next color buffer. |traceFrame| is its FrameTracer id.
     // Assumes framebuffer lock is held.
-    void post(ColorBuffer* cb);
+    void post(ColorBuffer* cb, uint64_t traceFrame = 0);
 
     // viewport: (re)initializes viewport dimensions.
     // Assumes framebuffer lock is held.
@@ -76,7 +76,7 @@ public:
 
 private:
     // Impl versions of the above, so we can run it from separate threads
-    void postImpl(ColorBuffer* cb);
+    void postImpl(ColorBuffer* cb, uint64_t traceFrame);
     void viewportImpl(int width, int height);
     void composeImpl(ComposeDevice* p);
     void composev2Impl(ComposeDevice_v2* p);
@@ -96,6 +96,7 @@ private:
     using UiThreadRunner = std::function<void(UiUpdateFunc, void*, bool)>;
     struct PostArgs {
         ColorBuffer* postCb;
+        uint64_t traceFrame;
         int width;
         int height;
         std::vector<char> composeBuffer;
@@ -23,17 +23,146 @@
 #include <string.h>
 #include <limits.h>
 
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 namespace emugl {
 
+#if defined(__linux__) || defined(__APPLE__)
+
+static size_t pageSize() {
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+// An unlinked shared memory file of |size| bytes.
+static int createSharedMemory(size_t size) {
+    int fd = -1;
+#if defined(__linux__) && defined(__NR_memfd_create)
+    // Not through memfd_create(), which the oldest glibc we build against
+    // doesn't have.
+    fd = syscall(__NR_memfd_create, "emugl-readbuffer", 1 /* MFD_CLOEXEC */);
+#elif defined(__APPLE__)
+    char name[64];
+    static int counter = 0;
+    snprintf(name, sizeof(name), "/emugl-rb-%d-%d", (int)getpid(),
+             __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        shm_unlink(name);
+    }
+#endif
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Maps |size| bytes, a multiple of the page size, twice in a row: whatever
+// is written past the end of the first mapping shows up at its start.
+// Returns nullptr if that fails.
+static unsigned char* allocMirrored(size_t size) {
+    const int fd = createSharedMemory(size);
+    if (fd < 0) {
+        return nullptr;
+    }
+    // Reserve the address range for both halves first so nothing else can
+    // land in the middle.
+    void* base = mmap(nullptr, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANON,
+                      -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+    unsigned char* buf = (unsigned char*)base;
+    const bool mapped =
+            mmap(buf, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 fd, 0) != MAP_FAILED &&
+            mmap(buf + size, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED;
+    close(fd);
+    if (!mapped) {
+        munmap(base, 2 * size);
+        return nullptr;
+    }
+    return buf;
+}
+
+static void freeMirrored(unsigned char* buf, size_t size) {
+    munmap(buf, 2 * size);
+}
+
+#else  // !__linux__ && !__APPLE__
+
+static size_t pageSize() {
+    return 4096;
+}
+
+static unsigned char* allocMirrored(size_t size) {
+    return nullptr;
+}
+
+static void freeMirrored(unsigned char* buf, size_t size) {}
+
+#endif
+
 ReadBuffer::ReadBuffer(size_t bufsize) {
-    m_size = bufsize;
-    m_buf = (unsigned char*)malloc(m_size);
+    const size_t page = pageSize();
+    const size_t ringSize = (bufsize + page - 1) / page * page;
+    m_buf = allocMirrored(ringSize);
+    if (m_buf) {
+        m_mirrored = true;
+        m_size = ringSize;
+    } else {
+        m_size = bufsize;
+        m_buf = (unsigned char*)malloc(m_size);
+    }
     m_validData = 0;
     m_readPtr = m_buf;
 }
 
 ReadBuffer::~ReadBuffer() {
-    free(m_buf);
+    if (m_mirrored) {
+        freeMirrored(m_buf, m_size);
+    } else {
+        free(m_buf);
+    }
+}
+
+bool ReadBuffer::reallocate(size_t size) {
+    unsigned char* newBuf = nullptr;
+    if (m_mirrored) {
+        const size_t page = pageSize();
+        size = (size + page - 1) / page * page;
+        newBuf = allocMirrored(size);
+    } else {
+        newBuf = (unsigned char*)malloc(size);
+    }
+    if (!newBuf) {
+        ERR("Failed to alloc %zu bytes for ReadBuffer\n", size);
+        return false;
+    }
+
+    memcpy(newBuf, m_readPtr, m_validData);
+    if (m_mirrored) {
+        freeMirrored(m_buf, m_size);
+    } else {
+        free(m_buf);
+    }
+    m_buf = newBuf;
+    m_readPtr = m_buf;
+    m_size = size;
+    ++m_reallocations;
+    return true;
 }
 
 void ReadBuffer::setNeededFreeTailSize(int size) {
@@ -50,41 +179,47 @@ int ReadBuffer::getData(IOStream* stream, int minSize) {
                  m_neededFreeTailSize);
 
     int maxSizeToRead;
-    const int freeTailSize = m_buf + m_size - (m_readPtr + m_validData);
-    if (freeTailSize >= neededFreeTailThisTime) {
-        maxSizeToRead = freeTailSize;
-    } else {
-        if (freeTailSize + (m_readPtr - m_buf) >= neededFreeTailThisTime) {
-            // There's some gap in the beginning, if we move the data over it
-            // that's going to be enough.
-            memmove(m_buf, m_readPtr, m_validData);
-        } else {
-            // Not enough space even with moving, reallocate.
-            // Note: make sure we can fit at least two of the requested packets
-            //  into the new buffer to minimize the reallocations and
-            //  memmove()-ing stuff around.
-            size_t new_size = std::max<size_t>(
-                    2 * minSizeToRead + m_validData,
-                    2 * m_size);
-            if (new_size < m_size) {  // overflow check
-                new_size = INT_MAX;
-            }
-
-            const auto new_buf = (unsigned char*)malloc(new_size);
-            if (!new_buf) {
-                ERR("Failed to alloc %zu bytes for ReadBuffer\n", new_size);
+    if (m_mirrored) {
+        // The free part of the ring always follows the valid data, even
+        // when it wraps.
+        if (m_size - m_validData < (size_t)neededFreeTailThisTime) {
+            // Make room for at least two packets of this size, as below.
+            const size_t newSize = std::max<size_t>(
+                    2 * minSizeToRead + m_validData, 2 * m_size);
+            if (newSize > INT_MAX || !reallocate(newSize)) {
                 return -1;
             }
-
-            memcpy(new_buf, m_readPtr, m_validData);
-            free(m_buf);
-            m_buf = new_buf;
-            m_size = new_size;
         }
-        // We can read more now, let's request it in case all data is ready
-        // for reading.
         maxSizeToRead = m_size - m_validData;
-        m_readPtr = m_buf;
+    } else {
+        const int freeTailSize = m_buf + m_size - (m_readPtr + m_validData);
+        if (freeTailSize >= neededFreeTailThisTime) {
+            maxSizeToRead = freeTailSize;
+        } else {
+            if (freeTailSize + (m_readPtr - m_buf) >= neededFreeTailThisTime) {
+                // There's some gap in the beginning, if we move the data over it
+                // that's going to be enough.
+                memmove(m_buf, m_readPtr, m_validData);
+                m_readPtr = m_buf;
+            } else {
+                // Not enough space even with moving, reallocate.
+                // Note: make sure we can fit at least two of the requested packets
+                //  into the new buffer to minimize the reallocations and
+                //  memmove()-ing stuff around.
+                size_t new_size = std::max<size_t>(
+                        2 * minSizeToRead + m_validData,
+                        2 * m_size);
+                if (new_size < m_size) {  // overflow check
+                    new_size = INT_MAX;
+                }
+                if (!reallocate(new_size)) {
+                    return -1;
+                }
+            }
+            // We can read more now, let's request it in case all data is ready
+            // for reading.
+            maxSizeToRead = m_size - m_validData;
+        }
     }
 
     // get fresh data into the buffer;
@@ -111,6 +246,10 @@ void ReadBuffer::consume(size_t amount) {
     assert(amount <= m_validData);
     m_validData -= amount;
     m_readPtr += amount;
+    if (m_mirrored && m_readPtr >= m_buf + m_size) {
+        // Back to the same place in the first mapping.
+        m_readPtr -= m_size;
+    }
 }
 
 void ReadBuffer::onSave(android::base::Stream* stream) {
@@ -121,10 +260,9 @@ void ReadBuffer::onSave(android::base::Stream* stream) {
 
 void ReadBuffer::onLoad(android::base::Stream* stream) {
     const auto size = stream->getBe32();
+    m_validData = 0;
     if (size > m_size) {
-        m_size = size;
-        free(m_buf);
-        m_buf = (unsigned char*)malloc(m_size);
+        reallocate(size);
     }
     m_readPtr = m_buf;
     m_validData = stream->getBe32();
@@ -133,8 +271,12 @@ void ReadBuffer::onLoad(android::base::Stream* stream) {
 }
 
 void ReadBuffer::printStats() {
-    printf("ReadBuffer::%s: tail move time %f ms\n", __func__,
-            (float)m_tailMoveTimeUs / 1000.0f);
+    printf("ReadBuffer::%s: tail move time %f ms, %s buffer of %zu bytes, "
+           "%llu reallocations\n", __func__,
+            (float)m_tailMoveTimeUs / 1000.0f,
+            m_mirrored ? "ring" : "linear", m_size,
+            (unsigned long long)m_reallocations);
     m_tailMoveTimeUs = 0;
+    m_reallocations = 0;
 }
 }  // namespace emugl
@@ -19,8 +19,16 @@
 
 namespace emugl {
 
+// Where the render thread reads guest commands into.
+//
+// Where the platform allows it, the buffer is a ring whose pages are mapped
+// twice in a row, so data that wraps around its end can still be read in one
+// piece from buf(), and new data is read straight behind the old: nothing is
+// ever moved, and the buffer only grows (once) for a packet larger than it.
+// Elsewhere, unconsumed data is moved to the front to make room.
 class ReadBuffer {
 public:
+    // |bufSize| is rounded up to a whole number of pages for the ring.
     explicit ReadBuffer(size_t bufSize);
     ~ReadBuffer();
 
@@ -35,12 +43,19 @@ public:
 
     void printStats();
 private:
+    // (Re)allocates the buffer for |size| bytes, keeping the valid data.
+    bool reallocate(size_t size);
+
     unsigned char *m_buf;
     unsigned char *m_readPtr;
     size_t m_size;
     size_t m_validData;
 
+    // Whether m_buf is a ring mapped twice in a row.
+    bool m_mirrored = false;
+
     uint64_t m_tailMoveTimeUs = 0;
+    uint64_t m_reallocations = 0;
     int m_neededFreeTailSize = 0;
 };
 
@@ -20,6 +20,7 @@
 #include "FbConfig.h"
 #include "FenceSync.h"
 #include "FrameBuffer.h"
+#include "FrameTracer.h"
 #include "GLESVersionDetector.h"
 #include "RenderContext.h"
 #include "RenderThreadInfo.h"
@@ -860,6 +861,8 @@ static void rcCloseColorBuffer(uint32_t colorbuffer)
 
 static int rcFlushWindowColorBuffer(uint32_t windowSurface)
 {
+    FrameTracer::get()->markGuestSwap();
+
     GRSYNC_DPRINT("waiting for gralloc cb lock");
     GrallocSyncPostLock lock(sGrallocSync.get());
     GRSYNC_DPRINT("lock gralloc cb lock {");
@@ -941,6 +944,8 @@ static EGLint rcMakeCurrent(uint32_t context,
 
 static void rcFBPost(uint32_t colorBuffer)
 {
+    FrameTracer::get()->markDecode();
+
     FrameBuffer *fb = FrameBuffer::getFB();
     if (!fb) {
         return;
@@ -14,6 +14,7 @@
 #include "RenderLibImpl.h"
 
 #include "FrameBuffer.h"
+#include "LemvrMain.h"
 #include "RendererImpl.h"
 
 #include "android/base/CpuUsage.h"
@@ -89,6 +90,10 @@ void RenderLibImpl::setAddressSpaceDeviceControlOps(struct address_space_device_
     set_emugl_address_space_device_control_ops(ops);
 }
 
+void RenderLibImpl::setHmdPoseRing(struct hmd_pose_ring* ring) {
+    lemvr::setPoseRing(ring);
+}
+
 void RenderLibImpl::setWindowOps(const QAndroidEmulatorWindowAgent &window_operations,
                                  const QAndroidMultiDisplayAgent &multi_display_operations) {
     set_emugl_window_operations(window_operations);
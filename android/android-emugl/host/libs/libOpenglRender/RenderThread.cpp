@@ -16,6 +16,7 @@
 #include "RenderThread.h"
 
 #include "ChannelStream.h"
+#include "DecoderDispatch.h"
 #include "RingStream.h"
 #include "ErrorLog.h"
 #include "FrameBuffer.h"
@@ -412,9 +413,18 @@ intptr_t RenderThread::main() {
         }
 
         auto progressStart = currTimeUs(benchmarkEnabled);
-        bool progress;
 
-        do {
+        //
+        // Hand each run of consecutive packets of one API to its decoder.
+        // Packets are routed by opcode range (see DecoderDispatch.h), so no
+        // decoder has to look at packets that aren't its own.
+        //
+        while (true) {
+            DecoderRun run = findDecoderRun(readBuf.buf(), readBuf.validData());
+            if (!run.size) {
+                // The next packet isn't complete yet.
+                break;
+            }
 
             if (!seqnoPtr && tInfo.m_puid) {
                 seqnoPtr = FrameBuffer::getFB()->getProcessSequenceNumberPtr(tInfo.m_puid);
@@ -424,73 +434,44 @@ intptr_t RenderThread::main() {
                 sThreadRunLimiter.lock();
             }
 
-            progress = false;
-
-            size_t last;
-
-            //
-            // try to process some of the command buffer using the
-            // Vulkan decoder
-            //
-            {
-                (void)seqnoPtr;
-                last = tInfo.m_vkDec.decode(readBuf.buf(), readBuf.validData(),
-                                            ioStream, seqnoPtr);
-                if (last > 0) {
-                    readBuf.consume(last);
-                    progress = true;
-                }
-            }
-
-            // try to process some of the command buffer using the GLESv1
-            // decoder
-            //
-            // DRIVER WORKAROUND:
-            // On Linux with NVIDIA GPU's at least, we need to avoid performing
-            // GLES ops while someone else holds the FrameBuffer write lock.
-            //
-            // To be more specific, on Linux with NVIDIA Quadro K2200 v361.xx,
-            // we get a segfault in the NVIDIA driver when glTexSubImage2D
-            // is called at the same time as glXMake(Context)Current.
-            //
-            // To fix, this driver workaround avoids calling
-            // any sort of GLES call when we are creating/destroying EGL
-            // contexts.
-            {
+            bool progress = false;
+
+            if (isGlesApi(run.api)) {
+                // DRIVER WORKAROUND:
+                // On Linux with NVIDIA GPU's at least, we need to avoid performing
+                // GLES ops while someone else holds the FrameBuffer write lock.
+                //
+                // To be more specific, on Linux with NVIDIA Quadro K2200 v361.xx,
+                // we get a segfault in the NVIDIA driver when glTexSubImage2D
+                // is called at the same time as glXMake(Context)Current.
+                //
+                // To fix, this driver workaround avoids calling
+                // any sort of GLES call when we are creating/destroying EGL
+                // contexts.
+                //
+                // The lock is held across all the GLES packets in a row,
+                // whether they are GLESv1 or GLESv2.
                 FrameBuffer::getFB()->lockContextStructureRead();
-            }
-
-            {
-                last = tInfo.m_glDec.decode(
-                        readBuf.buf(), readBuf.validData(), ioStream, &checksumCalc);
-                if (last > 0) {
-                    progress = true;
+                do {
+                    const size_t last = run.api == DecoderApi::Gles1
+                            ? tInfo.m_glDec.decode(readBuf.buf(), run.size,
+                                                   ioStream, &checksumCalc)
+                            : tInfo.m_gl2Dec.decode(readBuf.buf(), run.size,
+                                                    ioStream, &checksumCalc);
+                    if (!last) {
+                        break;
+                    }
                     readBuf.consume(last);
-                }
-            }
-
-            //
-            // try to process some of the command buffer using the GLESv2
-            // decoder
-            //
-            {
-                last = tInfo.m_gl2Dec.decode(readBuf.buf(), readBuf.validData(),
-                                             ioStream, &checksumCalc);
-
-                if (last > 0) {
                     progress = true;
-                    readBuf.consume(last);
-                }
-            }
-
-            FrameBuffer::getFB()->unlockContextStructureRead();
-            //
-            // try to process some of the command buffer using the
-            // renderControl decoder
-            //
-            {
-                last = tInfo.m_rcDec.decode(readBuf.buf(), readBuf.validData(),
-                                            ioStream, &checksumCalc);
+                    run = findDecoderRun(readBuf.buf(), readBuf.validData());
+                } while (run.size && isGlesApi(run.api));
+                FrameBuffer::getFB()->unlockContextStructureRead();
+            } else {
+                const size_t last = run.api == DecoderApi::Vulkan
+                        ? tInfo.m_vkDec.decode(readBuf.buf(), run.size,
+                                               ioStream, seqnoPtr)
+                        : tInfo.m_rcDec.decode(readBuf.buf(), run.size,
+                                               ioStream, &checksumCalc);
                 if (last > 0) {
                     readBuf.consume(last);
                     progress = true;
@@ -501,7 +482,10 @@ intptr_t RenderThread::main() {
                 sThreadRunLimiter.unlock();
             }
 
-        } while (progress);
+            if (!progress) {
+                break;
+            }
+        }
     }
 
     if (dumpFP) {
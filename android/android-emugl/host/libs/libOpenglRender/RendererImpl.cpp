@@ -23,6 +23,7 @@
 #include "ErrorLog.h"
 #include "FenceSync.h"
 #include "FrameBuffer.h"
+#include "FrameTracer.h"
 
 #include "LemvrMain.h"
 
@@ -106,6 +107,9 @@ bool RendererImpl::initialize(int width, int height, bool useSubWindow, bool egl
     if (android::base::System::get()->envGet("ANDROID_EMUGL_VERBOSE") == "1") {
         base_enable_verbose_logs();
     }
+    if (android::base::System::get()->envGet("ANDROID_EMUGL_FRAME_TRACE") == "1") {
+        FrameTracer::get()->setEnabled(true);
+    }
 
     if (mRenderWindow) {
         return false;
@@ -383,6 +387,18 @@ int RendererImpl::getScreenshot(unsigned int nChannels,
     return -1;
 }
 
+void RendererImpl::setFrameTracing(bool enabled) {
+    FrameTracer::get()->setEnabled(enabled);
+}
+
+std::string RendererImpl::getFrameTraceSummary() {
+    return FrameTracer::get()->summaryText();
+}
+
+bool RendererImpl::exportFrameTrace(const char* path) {
+    return FrameTracer::get()->exportChromeTrace(path);
+}
+
 void RendererImpl::setMultiDisplay(uint32_t id,
                                    int32_t x,
                                    int32_t y,
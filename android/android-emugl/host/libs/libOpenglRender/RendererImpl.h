@@ -120,6 +120,10 @@ public:
             android::snapshot::Snapshotter::Operation op,
             android::snapshot::Snapshotter::Stage stage) final;
 
+    void setFrameTracing(bool enabled) final;
+    std::string getFrameTraceSummary() final;
+    bool exportFrameTrace(const char* path) final;
+
     void addListener(FrameBufferChangeEventListener* listener) override;
     void removeListener(FrameBufferChangeEventListener* listener) override;
 
@@ -16,6 +16,7 @@
 
 #include "SyncThread.h"
 
+#include "android/base/Tracing.h"
 #include "android/base/memory/LazyInstance.h"
 #include "android/base/system/System.h"
 #include "android/base/threads/Thread.h"
@@ -69,8 +70,15 @@ static const uint32_t kTimelineInterval = 1;
 static const uint64_t kDefaultTimeoutNsecs = 5ULL * 1000ULL * 1000ULL * 1000ULL;
 static const uint64_t kNumWorkerThreads = 4u;
 
+// The sync worker for commands keyed by |key|, a guest timeline or fence.
+// Mixes the bits since the keys are pointers, which share their low bits.
+static size_t shardOf(uint64_t key) {
+    return (key * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
 SyncThread::SyncThread()
     : emugl::Thread(android::base::ThreadFlags::MaskSignals, 512 * 1024),
+      mWorkerContexts(kNumWorkerThreads),
       mWorkerThreadPool(kNumWorkerThreads, [this](SyncThreadCmd&& cmd) {
           doSyncThreadCmd(&cmd);
       }) {
@@ -92,7 +100,7 @@ void SyncThread::triggerWait(FenceSync* fenceSync,
     to_send.fenceSync = fenceSync;
     to_send.timeline = timeline;
     DPRINT("opcode=%u", to_send.opCode);
-    sendAsync(to_send);
+    sendAsync(to_send, shardOf(timeline));
     DPRINT("exit");
 }
 
@@ -103,7 +111,7 @@ void SyncThread::triggerWaitVk(VkFence vkFence, uint64_t timeline) {
     to_send.vkFence = vkFence;
     to_send.timeline = timeline;
     DPRINT("opcode=%u", to_send.opCode);
-    sendAsync(to_send);
+    sendAsync(to_send, shardOf(timeline));
     DPRINT("exit");
 }
 
@@ -113,15 +121,22 @@ void SyncThread::triggerBlockedWaitNoTimeline(FenceSync* fenceSync) {
     to_send.opCode = SYNC_THREAD_BLOCKED_WAIT_NO_TIMELINE;
     to_send.fenceSync = fenceSync;
     DPRINT("opcode=%u", to_send.opCode);
-    sendAndWaitForResult(to_send);
+    sendAndWaitForResult(to_send, shardOf((uint64_t)(uintptr_t)fenceSync));
     DPRINT("exit");
 }
 
 void SyncThread::cleanup() {
     DPRINT("enter");
-    SyncThreadCmd to_send;
-    to_send.opCode = SYNC_THREAD_EXIT;
-    sendAndWaitForResult(to_send);
+    for (size_t i = 0; i < mWorkerContexts.size(); ++i) {
+        if (mWorkerThreadPool.indexedWorker(i) != i) {
+            // Never started; its shards went to another worker.
+            continue;
+        }
+        SyncThreadCmd to_send;
+        to_send.opCode = SYNC_THREAD_EXIT;
+        to_send.workerIndex = i;
+        sendAndWaitForResult(to_send, i);
+    }
     DPRINT("signal");
     mLock.lock();
     mExiting = true;
@@ -133,9 +148,17 @@ void SyncThread::cleanup() {
 
 void SyncThread::initSyncContext() {
     DPRINT("enter");
-    SyncThreadCmd to_send;
-    to_send.opCode = SYNC_THREAD_INIT;
-    sendAndWaitForResult(to_send);
+    for (size_t i = 0; i < mWorkerContexts.size(); ++i) {
+        // Only workers that run get a context; the shards of the others
+        // are served by the worker they fall back to, with its context.
+        if (mWorkerThreadPool.indexedWorker(i) != i) {
+            continue;
+        }
+        SyncThreadCmd to_send;
+        to_send.opCode = SYNC_THREAD_INIT;
+        to_send.workerIndex = i;
+        sendAndWaitForResult(to_send, i);
+    }
     DPRINT("exit");
 }
 
@@ -150,7 +173,7 @@ intptr_t SyncThread::main() {
     return 0;
 }
 
-int SyncThread::sendAndWaitForResult(SyncThreadCmd& cmd) {
+int SyncThread::sendAndWaitForResult(SyncThreadCmd& cmd, size_t shard) {
     DPRINT("send with opcode=%d", cmd.opCode);
     android::base::Lock lock;
     android::base::ConditionVariable cond;
@@ -160,21 +183,32 @@ int SyncThread::sendAndWaitForResult(SyncThreadCmd& cmd) {
     cmd.result = &result;
 
     lock.lock();
-    mWorkerThreadPool.enqueue(std::move(cmd));
+    if (!mWorkerThreadPool.enqueueIndexed(shard, std::move(cmd))) {
+        lock.unlock();
+        fprintf(stderr, "SyncThread::%s: no sync worker for opcode=%d\n",
+                __func__, cmd.opCode);
+        return -1;
+    }
     cond.wait(&lock, [&result] { return result.hasValue(); });
 
     DPRINT("result=%d", *result);
     return *result;
 }
 
-void SyncThread::sendAsync(SyncThreadCmd& cmd) {
+void SyncThread::sendAsync(SyncThreadCmd& cmd, size_t shard) {
     DPRINT("send with opcode=%u fenceSyncInfo=0x%llx",
            cmd.opCode, cmd.fenceSync);
-    mWorkerThreadPool.enqueue(std::move(cmd));
+    cmd.sendTimeUs = android::base::System::get()->getHighResTimeUs();
+    if (!mWorkerThreadPool.enqueueIndexed(shard, std::move(cmd))) {
+        // Waiting here holds up the caller, but dropping the command would
+        // leave the guest waiting for its fence forever.
+        doSyncThreadCmd(&cmd);
+    }
 }
 
-void SyncThread::doSyncContextInit() {
+void SyncThread::doSyncContextInit(SyncThreadCmd* cmd) {
     const EGLDispatch* egl = emugl::LazyLoadedEGLDispatch::get();
+    WorkerContext& worker = mWorkerContexts[cmd->workerIndex];
 
     mDisplay = egl->eglGetDisplay(EGL_DEFAULT_DISPLAY);
     int eglMaj, eglMin;
@@ -200,13 +234,13 @@ void SyncThread::doSyncContextInit() {
         EGL_NONE,
     };
 
-    mSurface =
+    worker.surface =
         egl->eglCreatePbufferSurface(mDisplay, config, pbufferAttribs);
 
     const EGLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE };
-    mContext = egl->eglCreateContext(mDisplay, config, EGL_NO_CONTEXT, contextAttribs);
+    worker.context = egl->eglCreateContext(mDisplay, config, EGL_NO_CONTEXT, contextAttribs);
 
-    egl->eglMakeCurrent(mDisplay, mSurface, mSurface, mContext);
+    egl->eglMakeCurrent(mDisplay, worker.surface, worker.surface, worker.context);
 }
 
 void SyncThread::doSyncWait(SyncThreadCmd* cmd) {
@@ -217,6 +251,7 @@ void SyncThread::doSyncWait(SyncThreadCmd* cmd) {
 
     if (!fenceSync) {
         emugl::emugl_sync_timeline_inc(cmd->timeline, kTimelineInterval);
+        reportSignaled(*cmd);
         return;
     }
 
@@ -261,6 +296,7 @@ void SyncThread::doSyncWait(SyncThreadCmd* cmd) {
     //   So, despite the faulty GPU driver, not incrementing is too heavyweight a response.
 
     emugl::emugl_sync_timeline_inc(cmd->timeline, kTimelineInterval);
+    reportSignaled(*cmd);
     FenceSync::incrementTimelineAndDeleteOldFences();
 
     DPRINT("done timeline increment");
@@ -287,6 +323,7 @@ int SyncThread::doSyncWaitVk(SyncThreadCmd* cmd) {
     // if the call to vkWaitForFences returned abnormally.
     // See comments in |doSyncWait| about the rationale.
     emugl::emugl_sync_timeline_inc(cmd->timeline, kTimelineInterval);
+    reportSignaled(*cmd);
 
     DPRINT("done timeline increment");
 
@@ -319,17 +356,26 @@ void SyncThread::doSyncBlockedWaitNoTimeline(SyncThreadCmd* cmd) {
     }
 }
 
-void SyncThread::doExit() {
+void SyncThread::doExit(SyncThreadCmd* cmd) {
+    WorkerContext& worker = mWorkerContexts[cmd->workerIndex];
 
-    if (mContext == EGL_NO_CONTEXT) return;
+    if (worker.context == EGL_NO_CONTEXT) return;
 
     const EGLDispatch* egl = emugl::LazyLoadedEGLDispatch::get();
 
     egl->eglMakeCurrent(mDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
-    egl->eglDestroyContext(mDisplay, mContext);
-    egl->eglDestroySurface(mDisplay, mContext);
-    mContext = EGL_NO_CONTEXT;
-    mSurface = EGL_NO_SURFACE;
+    egl->eglDestroyContext(mDisplay, worker.context);
+    egl->eglDestroySurface(mDisplay, worker.surface);
+    worker.context = EGL_NO_CONTEXT;
+    worker.surface = EGL_NO_SURFACE;
+}
+
+void SyncThread::reportSignaled(const SyncThreadCmd& cmd) {
+    const uint64_t nowUs = android::base::System::get()->getHighResTimeUs();
+    if (cmd.sendTimeUs && nowUs >= cmd.sendTimeUs) {
+        android::base::traceCounter("sync.fenceToSignalUs",
+                                    nowUs - cmd.sendTimeUs);
+    }
 }
 
 int SyncThread::doSyncThreadCmd(SyncThreadCmd* cmd) {
@@ -344,7 +390,7 @@ int SyncThread::doSyncThreadCmd(SyncThreadCmd* cmd) {
     switch (cmd->opCode) {
     case SYNC_THREAD_INIT:
         DPRINT("exec SYNC_THREAD_INIT");
-        doSyncContextInit();
+        doSyncContextInit(cmd);
         break;
     case SYNC_THREAD_WAIT:
         DPRINT("exec SYNC_THREAD_WAIT");
@@ -356,7 +402,7 @@ int SyncThread::doSyncThreadCmd(SyncThreadCmd* cmd) {
         break;
     case SYNC_THREAD_EXIT:
         DPRINT("exec SYNC_THREAD_EXIT");
-        doExit();
+        doExit(cmd);
         break;
     case SYNC_THREAD_BLOCKED_WAIT_NO_TIMELINE:
         DPRINT("exec SYNC_THREAD_BLOCKED_WAIT_NO_TIMELINE");
@@ -31,20 +31,26 @@
 #include "emugl/common/thread.h"
 #include "vulkan/VkDecoderGlobalState.h"
 
+#include <vector>
+
 // SyncThread///////////////////////////////////////////////////////////////////
 // The purpose of SyncThread is to track sync device timelines and give out +
 // signal FD's that correspond to the completion of host-side GL fence commands.
 
+// Waits are spread over a pool of sync workers, sharded by guest timeline:
+// fences of one guest process are signaled in order by the same worker, and a
+// long fence wait only holds up the process that issued it.
+
 // We communicate with the sync thread in 3 ways:
 enum SyncThreadOpCode {
-    // Nonblocking command to initialize sync thread's contents,
+    // Blocking command to initialize a sync worker's contents,
     // such as the EGL context for sync operations
     SYNC_THREAD_INIT = 0,
     // Nonblocking command to wait on a given FenceSync object
     // and timeline handle.
     // A fence FD object in the guest is signaled.
     SYNC_THREAD_WAIT = 1,
-    // Blocking command to clean up and exit the sync thread.
+    // Blocking command to clean up a sync worker's contents.
     SYNC_THREAD_EXIT = 2,
     // Blocking command to wait on a given FenceSync object.
     // No timeline handling is done.
@@ -62,6 +68,10 @@ struct SyncThreadCmd {
         VkFence vkFence;
     };
     uint64_t timeline = 0;
+    // The sync worker that SYNC_THREAD_INIT and SYNC_THREAD_EXIT are for.
+    size_t workerIndex = 0;
+    // When the command was sent, for the fence to signal latency.
+    uint64_t sendTimeUs = 0;
 
     android::base::Lock* lock = nullptr;
     android::base::ConditionVariable* cond = nullptr;
@@ -115,39 +125,47 @@ public:
     static void recreate();
 
 private:
-    // |initSyncContext| creates an EGL context expressly for calling
-    // eglClientWaitSyncKHR in the processing caused by |triggerWait|.
-    // This is used by the constructor only. It is non-blocking.
-    // - Triggers a |SyncThreadCmd| with op code |SYNC_THREAD_INIT|
+    // |initSyncContext| creates an EGL context on each sync worker
+    // expressly for calling eglClientWaitSyncKHR in the processing caused by
+    // |triggerWait|. This is used by the constructor only.
+    // - Triggers a |SyncThreadCmd| with op code |SYNC_THREAD_INIT| per worker
     void initSyncContext();
 
     // Thread function.
     // It keeps the workers runner until |mExiting| is set.
     virtual intptr_t main() override final;
 
-    // These two functions are used to communicate with the sync thread
-    // from another thread:
-    // - |sendAndWaitForResult| issues |cmd| to the sync thread,
+    // These two functions are used to communicate with the sync workers
+    // from another thread. Commands with the same |shard| run in order on
+    // the same worker.
+    // - |sendAndWaitForResult| issues |cmd| to the sync worker,
     //   and blocks until it receives the result of the command.
-    // - |sendAsync| issues |cmd| to the sync thread and does not
+    // - |sendAsync| issues |cmd| to the sync worker and does not
     //   wait for the result, returning immediately after.
-    int sendAndWaitForResult(SyncThreadCmd& cmd);
-    void sendAsync(SyncThreadCmd& cmd);
+    int sendAndWaitForResult(SyncThreadCmd& cmd, size_t shard);
+    void sendAsync(SyncThreadCmd& cmd, size_t shard);
 
     // |doSyncThreadCmd| and related functions below
     // execute the actual commands. These run on the sync thread.
     int doSyncThreadCmd(SyncThreadCmd* cmd);
-    void doSyncContextInit();
+    void doSyncContextInit(SyncThreadCmd* cmd);
     void doSyncWait(SyncThreadCmd* cmd);
     int doSyncWaitVk(SyncThreadCmd* cmd);
     void doSyncBlockedWaitNoTimeline(SyncThreadCmd* cmd);
-    void doExit();
+    void doExit(SyncThreadCmd* cmd);
+
+    // Reports how long the guest waited for the fence of |cmd| to signal.
+    void reportSignaled(const SyncThreadCmd& cmd);
 
     // EGL objects / object handles specific to
-    // a sync thread.
+    // a sync worker.
+    struct WorkerContext {
+        EGLContext context = EGL_NO_CONTEXT;
+        EGLSurface surface = EGL_NO_SURFACE;
+    };
+
     EGLDisplay mDisplay = EGL_NO_DISPLAY;
-    EGLContext mContext = EGL_NO_CONTEXT;
-    EGLSurface mSurface = EGL_NO_SURFACE;
+    std::vector<WorkerContext> mWorkerContexts;
 
     bool mExiting = false;
     android::base::Lock mLock;
@@ -18,6 +18,7 @@ namespace lemvr {
 #endif
 
         TcpSocket* accept();
+        SOCKET getHandle() const { return socketHandle; }
         SocketStatus close();
 
     private:
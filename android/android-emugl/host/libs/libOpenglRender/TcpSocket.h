@@ -39,6 +39,8 @@ namespace lemvr {
         bool isBlocking() const { return blocking; }
         SocketStatus close();
 
+        SOCKET getHandle() const { return socketHandle; }
+
         static SocketStatus errnoToSocketStatus();
 
 #ifdef _WIN32
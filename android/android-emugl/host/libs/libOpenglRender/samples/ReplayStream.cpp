@@ -0,0 +1,566 @@
+// Copyright (C) 2021 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Replays a render thread command stream through the host decoders, without
+// a guest or a window, and reports how fast it decodes.
+//
+// Capture a stream by running the emulator with RENDERER_DUMP_DIR set; every
+// render thread then writes what it decodes to <dir>/stream_<thread>. Replay
+// one of them with:
+//
+//   ReplayStream <stream file> [--null] [--runs] [--size <w>x<h>]
+//                [--golden <png> [--update-golden] [--tolerance <n>]]
+//
+// By default GLES calls go to SwiftShader (or to the host GPU with
+// ANDROID_EMU_TEST_WITH_HOST_GPU=1). --null sends them to a dispatch table
+// of no-ops that answer every query with zeroes instead, which leaves just
+// the cost of decoding. Packets are timed one by one for the per-opcode
+// table; --runs hands each run of packets of one API to its decoder in a
+// single call like RenderThread does, and skips the table. --golden compares
+// the last frame the stream posted with a PNG, or writes it with
+// --update-golden.
+
+#include "android/base/GLObjectCounter.h"
+#include "android/console.h"
+#include "android/loadpng.h"
+#include "android/utils/file_io.h"
+
+#include "ChecksumCalculatorThreadInfo.h"
+#include "DecoderDispatch.h"
+#include "OpenGLESDispatch/gldefs.h"
+#include "OpenGLESDispatch/gles_functions.h"
+#include "RenderControl.h"
+#include "Standalone.h"
+#include "vulkan/VkCommonOperations.h"
+
+#include <algorithm>
+#include <chrono>
+#include <inttypes.h>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace emugl;
+
+namespace {
+
+// Swallows the replies that the decoders write back to the guest.
+class SinkStream : public IOStream {
+public:
+    SinkStream() : IOStream(0) {}
+
+    void* allocBuffer(size_t minSize) override {
+        if (mBuffer.size() < minSize) {
+            mBuffer.resize(minSize);
+        }
+        return mBuffer.data();
+    }
+    int commitBuffer(size_t) override { return 0; }
+    int writeFully(const void*, size_t) override { return 0; }
+    const unsigned char* readFully(void*, size_t) override { return nullptr; }
+    void* getDmaForReading(uint64_t) override { return nullptr; }
+    void unlockDma(uint64_t) override {}
+
+protected:
+    const unsigned char* readRaw(void*, size_t*) override { return nullptr; }
+    void onSave(android::base::Stream*) override {}
+    unsigned char* onLoad(android::base::Stream*) override { return nullptr; }
+
+private:
+    std::vector<unsigned char> mBuffer;
+};
+
+// The GL entry points with --null: one no-op per function, with its exact
+// signature, returning 0.
+#define NULL_GL_FUNCTION(return_type, function_name, signature, callargs) \
+    return_type KHRONOS_APIENTRY null_##function_name signature {          \
+        return (return_type)0;                                             \
+    }
+
+LIST_GLES_FUNCTIONS(NULL_GL_FUNCTION, NULL_GL_FUNCTION)
+
+// The decoders read back some of the results themselves, so the queries
+// they use have to fill them in. Everything is 0, and the lists whose
+// length is queried separately are empty, so nothing gets written there.
+template <class T>
+void KHRONOS_APIENTRY nullGetv(GLenum pname, T* params) {
+    switch (pname) {
+        case GL_COMPRESSED_TEXTURE_FORMATS:
+        case GL_SHADER_BINARY_FORMATS:
+        case GL_PROGRAM_BINARY_FORMATS:
+            return;
+        default:
+            *params = T();
+    }
+}
+
+void KHRONOS_APIENTRY nullGen(GLsizei n, GLuint* names) {
+    std::fill_n(names, std::max<GLsizei>(n, 0), 0);
+}
+
+void KHRONOS_APIENTRY nullGetSynciv(GLsync,
+                                    GLenum,
+                                    GLsizei,
+                                    GLsizei* length,
+                                    GLint*) {
+    if (length) {
+        *length = 0;
+    }
+}
+
+void* nullGetProc(const char* name, void*) {
+    static const auto* const functions = [] {
+        auto res = new std::unordered_map<std::string, void*>{
+#define NULL_GL_ENTRY(return_type, function_name, signature, callargs) \
+    {#function_name, (void*)&null_##function_name},
+                LIST_GLES_FUNCTIONS(NULL_GL_ENTRY, NULL_GL_ENTRY)};
+        (*res)["glGetBooleanv"] = (void*)&nullGetv<GLboolean>;
+        (*res)["glGetFixedv"] = (void*)&nullGetv<GLfixed>;
+        (*res)["glGetFloatv"] = (void*)&nullGetv<GLfloat>;
+        (*res)["glGetInteger64v"] = (void*)&nullGetv<GLint64>;
+        (*res)["glGetIntegerv"] = (void*)&nullGetv<GLint>;
+        (*res)["glGetSynciv"] = (void*)&nullGetSynciv;
+        for (const char* gen :
+             {"glGenBuffers", "glGenFramebuffers", "glGenFramebuffersEXT",
+              "glGenFramebuffersOES", "glGenProgramPipelines", "glGenQueries",
+              "glGenRenderbuffers", "glGenRenderbuffersEXT",
+              "glGenRenderbuffersOES", "glGenSamplers", "glGenSemaphoresEXT",
+              "glGenTextures", "glGenTransformFeedbacks", "glGenVertexArrays",
+              "glGenVertexArraysOES"}) {
+            (*res)[gen] = (void*)&nullGen;
+        }
+        return res;
+    }();
+    const auto it = functions->find(name);
+    return it != functions->end() ? it->second : nullptr;
+}
+
+const char* apiName(DecoderApi api) {
+    switch (api) {
+        case DecoderApi::Gles1:
+            return "gles1";
+        case DecoderApi::Gles2:
+            return "gles2";
+        case DecoderApi::RenderControl:
+            return "rc";
+        case DecoderApi::Vulkan:
+            return "vk";
+        default:
+            return "?";
+    }
+}
+
+uint32_t baseOpcodeOf(DecoderApi api, uint32_t opcode) {
+    switch (api) {
+        case DecoderApi::Gles1:
+            return kGles1BaseOpcode;
+        case DecoderApi::Gles2:
+            return kGles2BaseOpcode;
+        case DecoderApi::RenderControl:
+            return kRenderControlBaseOpcode;
+        case DecoderApi::Vulkan:
+            return opcode >= kVulkanFirstOpcode ? kVulkanFirstOpcode
+                                                : kVulkanFirstOpcodeOld;
+        default:
+            return 0;
+    }
+}
+
+struct OpcodeStats {
+    uint64_t count = 0;
+    uint64_t totalNs = 0;
+    uint64_t maxNs = 0;
+};
+
+struct Options {
+    const char* streamPath = nullptr;
+    bool nullGl = false;
+    bool runs = false;
+    int width = 720;
+    int height = 1280;
+    const char* goldenPath = nullptr;
+    bool updateGolden = false;
+    int tolerance = 2;
+};
+
+bool parseOptions(int argc, char** argv, Options* options) {
+    for (int i = 1; i < argc; ++i) {
+        const bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--null")) {
+            options->nullGl = true;
+        } else if (!strcmp(argv[i], "--runs")) {
+            options->runs = true;
+        } else if (!strcmp(argv[i], "--size") && hasValue) {
+            if (sscanf(argv[++i], "%dx%d", &options->width,
+                       &options->height) != 2) {
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--golden") && hasValue) {
+            options->goldenPath = argv[++i];
+        } else if (!strcmp(argv[i], "--update-golden")) {
+            options->updateGolden = true;
+        } else if (!strcmp(argv[i], "--tolerance") && hasValue) {
+            options->tolerance = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && !options->streamPath) {
+            options->streamPath = argv[i];
+        } else {
+            return false;
+        }
+    }
+    return options->streamPath &&
+           (options->goldenPath || !options->updateGolden);
+}
+
+bool readFile(const char* path, std::vector<uint8_t>* contents) {
+    FILE* file = android_fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    uint8_t chunk[64 * 1024];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        contents->insert(contents->end(), chunk, chunk + read);
+    }
+    const bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+class Replayer {
+public:
+    Replayer(const Options& options)
+        : mOptions(options), mChecksumCalc(mChecksumInfo.get()) {
+        mTInfo.m_glDec.initGL(
+                options.nullGl ? nullGetProc : gles1_dispatch_get_proc_func,
+                nullptr);
+        mTInfo.m_gl2Dec.initGL(
+                options.nullGl ? nullGetProc : gles2_dispatch_get_proc_func,
+                nullptr);
+        initRenderControlContext(&mTInfo.m_rcDec);
+        mHasVulkan = goldfish_vk::getGlobalVkEmulation() != nullptr;
+    }
+
+    ~Replayer() {
+        FrameBuffer::getFB()->bindContext(0, 0, 0);
+    }
+
+    // Decodes all of |buf|, returning false if it stopped at a packet it
+    // couldn't decode.
+    bool replay(const uint8_t* buf, size_t len) {
+        const auto start = std::chrono::steady_clock::now();
+        size_t pos = 0;
+        while (pos < len) {
+            const size_t last = mOptions.runs ? decodeRun(buf + pos, len - pos)
+                                              : decodePacket(buf + pos, len - pos);
+            if (!last) {
+                break;
+            }
+            pos += last;
+        }
+        mWallNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+        mBytes = pos;
+        if (pos < len) {
+            uint32_t opcode = 0;
+            memcpy(&opcode, buf + pos, std::min<size_t>(sizeof(opcode), len - pos));
+            fprintf(stderr,
+                    "Stopped at byte %zu of %zu (opcode %u); the rest of the "
+                    "stream wasn't decoded.\n",
+                    pos, len, opcode);
+            return false;
+        }
+        return true;
+    }
+
+    void printStats() const {
+        const double seconds = mWallNs / 1e9;
+        printf("Decoded %" PRIu64 " calls, %zu bytes in %.3f ms\n", mCalls,
+               mBytes, mWallNs / 1e6);
+        if (seconds > 0) {
+            printf("  %.0f calls/s, %.2f MB/s\n", mCalls / seconds,
+                   mBytes / seconds / (1024 * 1024));
+        }
+        if (mSkippedVulkanPackets) {
+            printf("  Skipped %" PRIu64 " Vulkan packets: no Vulkan emulation\n",
+                   mSkippedVulkanPackets);
+        }
+        if (mOpcodes.empty()) {
+            return;
+        }
+
+        std::vector<std::pair<uint32_t, OpcodeStats>> byTime(mOpcodes.begin(),
+                                                             mOpcodes.end());
+        std::sort(byTime.begin(), byTime.end(),
+                  [](const std::pair<uint32_t, OpcodeStats>& a,
+                     const std::pair<uint32_t, OpcodeStats>& b) {
+                      return a.second.totalNs > b.second.totalNs;
+                  });
+        uint64_t totalNs = 0;
+        for (const auto& entry : byTime) {
+            totalNs += entry.second.totalNs;
+        }
+
+        printf("\n%-6s %10s %10s %12s %10s %10s %7s\n", "api", "opcode",
+               "calls", "total (us)", "mean (ns)", "max (ns)", "time %");
+        for (const auto& entry : byTime) {
+            const uint32_t opcode = entry.first;
+            const OpcodeStats& stats = entry.second;
+            const DecoderApi api = decoderApiOf(opcode);
+            printf("%-6s %10u %10" PRIu64 " %12.1f %10" PRIu64 " %10" PRIu64
+                   " %6.1f%%\n",
+                   apiName(api), opcode - baseOpcodeOf(api, opcode), stats.count,
+                   stats.totalNs / 1e3, stats.totalNs / stats.count,
+                   stats.maxNs, totalNs ? 100.0 * stats.totalNs / totalNs : 0.0);
+        }
+    }
+
+private:
+    // Times one packet at a time so each call can be put down to its opcode.
+    size_t decodePacket(const uint8_t* buf, size_t len) {
+        if (len < kPacketHeaderSize) {
+            return 0;
+        }
+        uint32_t opcode;
+        uint32_t packetSize;
+        memcpy(&opcode, buf, sizeof(opcode));
+        memcpy(&packetSize, buf + 4, sizeof(packetSize));
+        if (packetSize < kPacketHeaderSize || packetSize > len) {
+            return 0;
+        }
+        const DecoderApi api = decoderApiOf(opcode);
+
+        const auto start = std::chrono::steady_clock::now();
+        const size_t last = decode(api, buf, packetSize);
+        const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                    std::chrono::steady_clock::now() - start)
+                                    .count();
+        if (last && !(api == DecoderApi::Vulkan && !mHasVulkan)) {
+            OpcodeStats& stats = mOpcodes[opcode];
+            ++stats.count;
+            stats.totalNs += ns;
+            stats.maxNs = std::max(stats.maxNs, ns);
+        }
+        return last;
+    }
+
+    size_t decodeRun(const uint8_t* buf, size_t len) {
+        const DecoderRun run = findDecoderRun(buf, len);
+        if (!run.size) {
+            return 0;
+        }
+        size_t pos = 0;
+        while (pos < run.size) {
+            const size_t last = decode(run.api, buf + pos, run.size - pos);
+            if (!last) {
+                break;
+            }
+            pos += last;
+        }
+        return pos;
+    }
+
+    // Decodes complete packets of |api| from the start of |buf|.
+    size_t decode(DecoderApi api, const uint8_t* buf, size_t len) {
+        // The decoders take a non-const buffer, but don't write to it.
+        void* data = const_cast<uint8_t*>(buf);
+        if (api == DecoderApi::Vulkan && !mHasVulkan) {
+            return skipPackets(buf, len);
+        }
+        const size_t last = decodeWith(api, data, len);
+        mCalls += countPackets(buf, last);
+        return last;
+    }
+
+    size_t decodeWith(DecoderApi api, void* data, size_t len) {
+        switch (api) {
+            case DecoderApi::Gles1:
+            case DecoderApi::Gles2: {
+                // Same locking as RenderThread::main().
+                FrameBuffer::getFB()->lockContextStructureRead();
+                const size_t last =
+                        api == DecoderApi::Gles1
+                                ? mTInfo.m_glDec.decode(data, len, &mSink,
+                                                        &mChecksumCalc)
+                                : mTInfo.m_gl2Dec.decode(data, len, &mSink,
+                                                         &mChecksumCalc);
+                FrameBuffer::getFB()->unlockContextStructureRead();
+                return last;
+            }
+            case DecoderApi::RenderControl:
+                return mTInfo.m_rcDec.decode(data, len, &mSink, &mChecksumCalc);
+            case DecoderApi::Vulkan:
+                if (!mSeqnoPtr && mTInfo.m_puid) {
+                    mSeqnoPtr = FrameBuffer::getFB()->getProcessSequenceNumberPtr(
+                            mTInfo.m_puid);
+                }
+                return mTInfo.m_vkDec.decode(data, len, &mSink, mSeqnoPtr);
+            default:
+                return 0;
+        }
+    }
+
+    static size_t countPackets(const uint8_t* buf, size_t len) {
+        size_t count = 0;
+        size_t pos = 0;
+        while (len - pos >= kPacketHeaderSize) {
+            uint32_t packetSize;
+            memcpy(&packetSize, buf + pos + 4, sizeof(packetSize));
+            if (packetSize < kPacketHeaderSize || packetSize > len - pos) {
+                break;
+            }
+            pos += packetSize;
+            ++count;
+        }
+        return count;
+    }
+
+    size_t skipPackets(const uint8_t* buf, size_t len) {
+        mSkippedVulkanPackets += countPackets(buf, len);
+        const DecoderRun run = findDecoderRun(buf, len);
+        return run.size;
+    }
+
+    const Options& mOptions;
+    RenderThreadInfo mTInfo;
+    ChecksumCalculatorThreadInfo mChecksumInfo;
+    ChecksumCalculator& mChecksumCalc;
+    SinkStream mSink;
+    uint32_t* mSeqnoPtr = nullptr;
+    bool mHasVulkan = false;
+
+    std::map<uint32_t, OpcodeStats> mOpcodes;
+    uint64_t mCalls = 0;
+    uint64_t mSkippedVulkanPackets = 0;
+    uint64_t mWallNs = 0;
+    size_t mBytes = 0;
+};
+
+// Compares the last posted frame with |options.goldenPath|, or overwrites it
+// with the frame.
+bool checkGolden(const Options& options) {
+    FrameBuffer* fb = FrameBuffer::getFB();
+    unsigned int width = 0;
+    unsigned int height = 0;
+    size_t size = 0;
+    fb->getScreenshot(4, &width, &height, nullptr, &size, 0, 0, 0,
+                      SKIN_ROTATION_0);
+    if (!size) {
+        fprintf(stderr, "The stream didn't post a frame\n");
+        return false;
+    }
+    std::vector<uint8_t> frame(size);
+    if (fb->getScreenshot(4, &width, &height, frame.data(), &size, 0, 0, 0,
+                          SKIN_ROTATION_0)) {
+        fprintf(stderr, "Failed to read back the last posted frame\n");
+        return false;
+    }
+
+    if (options.updateGolden) {
+        savepng(options.goldenPath, 4, width, height, SKIN_ROTATION_0,
+                frame.data());
+        printf("Wrote %ux%u golden image to %s\n", width, height,
+               options.goldenPath);
+        return true;
+    }
+
+    unsigned int goldenWidth = 0;
+    unsigned int goldenHeight = 0;
+    uint8_t* golden =
+            (uint8_t*)loadpng(options.goldenPath, &goldenWidth, &goldenHeight);
+    if (!golden) {
+        fprintf(stderr, "Failed to load golden image %s\n", options.goldenPath);
+        return false;
+    }
+    if (goldenWidth != width || goldenHeight != height) {
+        fprintf(stderr, "Frame is %ux%u, golden image is %ux%u\n", width,
+                height, goldenWidth, goldenHeight);
+        free(golden);
+        return false;
+    }
+
+    size_t mismatched = 0;
+    int maxDiff = 0;
+    for (size_t i = 0; i < size; i += 4) {
+        int pixelDiff = 0;
+        for (size_t c = 0; c < 4; ++c) {
+            pixelDiff = std::max(pixelDiff, abs(frame[i + c] - golden[i + c]));
+        }
+        maxDiff = std::max(maxDiff, pixelDiff);
+        if (pixelDiff > options.tolerance) {
+            ++mismatched;
+        }
+    }
+    free(golden);
+
+    printf("Golden %s: %zu of %u pixels differ by more than %d (max %d)\n",
+           mismatched ? "MISMATCH" : "match", mismatched, width * height,
+           options.tolerance, maxDiff);
+    return mismatched == 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, &options)) {
+        fprintf(stderr,
+                "Usage: %s <stream file> [--null] [--runs] [--size <w>x<h>]\n"
+                "       [--golden <png> [--update-golden] [--tolerance <n>]]\n",
+                argv[0]);
+        return 1;
+    }
+
+    std::vector<uint8_t> stream;
+    if (!readFile(options.streamPath, &stream)) {
+        fprintf(stderr, "Failed to read %s\n", options.streamPath);
+        return 1;
+    }
+
+    setupStandaloneLibrarySearchPaths();
+    setGLObjectCounter(android::base::GLObjectCounter::get());
+    set_emugl_window_operations(*getConsoleAgents()->emu);
+    set_emugl_multi_display_operations(*getConsoleAgents()->multi_display);
+    LazyLoadedEGLDispatch::get();
+    LazyLoadedGLESv1Dispatch::get();
+    LazyLoadedGLESv2Dispatch::get();
+
+    const bool useHostGpu = shouldUseHostGpu();
+    if (!FrameBuffer::initialize(options.width, options.height,
+                                 false /* useSubWindow */,
+                                 !useHostGpu /* egl2egl */)) {
+        fprintf(stderr, "Failed to initialize the FrameBuffer\n");
+        return 1;
+    }
+    printf("Replaying %s (%zu bytes) on %s\n", options.streamPath,
+           stream.size(),
+           options.nullGl ? "null GL" : useHostGpu ? "host GPU" : "SwiftShader");
+
+    bool ok;
+    {
+        Replayer replayer(options);
+        ok = replayer.replay(stream.data(), stream.size());
+        replayer.printStats();
+    }
+    if (options.goldenPath) {
+        ok = checkGolden(options) && ok;
+    }
+
+    FrameBuffer::getFB()->finalize();
+    return ok ? 0 : 1;
+}
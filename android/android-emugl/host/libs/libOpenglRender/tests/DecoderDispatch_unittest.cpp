@@ -0,0 +1,99 @@
+// Copyright (C) 2021 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "DecoderDispatch.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+namespace {
+
+// Appends a packet with |payloadSize| bytes of payload.
+void addPacket(std::vector<uint8_t>* stream, uint32_t opcode, uint32_t payloadSize) {
+    const uint32_t size = kPacketHeaderSize + payloadSize;
+    const size_t pos = stream->size();
+    stream->resize(pos + size, 0xab);
+    memcpy(stream->data() + pos, &opcode, sizeof(opcode));
+    memcpy(stream->data() + pos + 4, &size, sizeof(size));
+}
+
+}  // namespace
+
+TEST(DecoderDispatch, OpcodeRanges) {
+    EXPECT_EQ(DecoderApi::Unknown, decoderApiOf(0));
+    EXPECT_EQ(DecoderApi::Unknown, decoderApiOf(1023));
+    EXPECT_EQ(DecoderApi::Gles1, decoderApiOf(1024));
+    EXPECT_EQ(DecoderApi::Gles1, decoderApiOf(2047));
+    EXPECT_EQ(DecoderApi::Gles2, decoderApiOf(2048));
+    EXPECT_EQ(DecoderApi::RenderControl, decoderApiOf(10000));
+    EXPECT_EQ(DecoderApi::Vulkan, decoderApiOf(20000));
+    EXPECT_EQ(DecoderApi::Unknown, decoderApiOf(30000));
+    EXPECT_EQ(DecoderApi::Vulkan, decoderApiOf(200000000));
+    EXPECT_EQ(DecoderApi::Unknown, decoderApiOf(300000000));
+}
+
+TEST(DecoderDispatch, RunOfOneApi) {
+    std::vector<uint8_t> stream;
+    addPacket(&stream, 2048, 4);
+    addPacket(&stream, 2100, 0);
+    addPacket(&stream, 2049, 12);
+    addPacket(&stream, 10000, 4);
+
+    const DecoderRun run = findDecoderRun(stream.data(), stream.size());
+    EXPECT_EQ(DecoderApi::Gles2, run.api);
+    EXPECT_EQ(3 * kPacketHeaderSize + 16, run.size);
+
+    const DecoderRun next = findDecoderRun(stream.data() + run.size,
+                                           stream.size() - run.size);
+    EXPECT_EQ(DecoderApi::RenderControl, next.api);
+    EXPECT_EQ(kPacketHeaderSize + 4, next.size);
+}
+
+TEST(DecoderDispatch, StopsAtIncompletePacket) {
+    std::vector<uint8_t> stream;
+    addPacket(&stream, 1024, 4);
+    addPacket(&stream, 1025, 100);
+
+    // The second packet is cut short.
+    DecoderRun run = findDecoderRun(stream.data(), stream.size() - 1);
+    EXPECT_EQ(DecoderApi::Gles1, run.api);
+    EXPECT_EQ(kPacketHeaderSize + 4, run.size);
+
+    // Not even the first header is there.
+    run = findDecoderRun(stream.data(), kPacketHeaderSize - 1);
+    EXPECT_EQ(0u, run.size);
+
+    // The first packet is cut short.
+    run = findDecoderRun(stream.data(), kPacketHeaderSize + 3);
+    EXPECT_EQ(0u, run.size);
+}
+
+TEST(DecoderDispatch, UnknownOpcode) {
+    std::vector<uint8_t> stream;
+    addPacket(&stream, 5, 4);
+    addPacket(&stream, 2048, 4);
+    EXPECT_EQ(0u, findDecoderRun(stream.data(), stream.size()).size);
+}
+
+TEST(DecoderDispatch, BadPacketSize) {
+    std::vector<uint8_t> stream;
+    addPacket(&stream, 2048, 4);
+    addPacket(&stream, 2048, 4);
+    const uint32_t zero = 0;
+    memcpy(stream.data() + kPacketHeaderSize + 4 + 4, &zero, sizeof(zero));
+
+    // Only the packet before the broken one is handed out.
+    EXPECT_EQ(kPacketHeaderSize + 4, findDecoderRun(stream.data(), stream.size()).size);
+}
@@ -18,6 +18,7 @@
 #include "android/base/perflogger/BenchmarkLibrary.h"
 #include "android/base/system/System.h"
 #include "android/base/testing/TestSystem.h"
+#include "android/base/threads/FunctorThread.h"
 #include "android/console.h"
 #include "android/emulation/control/multi_display_agent.h"
 #include "android/emulation/control/window_agent.h"
@@ -30,7 +31,12 @@
 #include "Standalone.h"
 
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <vector>
 
 
 #ifdef _MSC_VER
@@ -142,6 +148,87 @@ protected:
         m_texture_loader->join();
     }
 
+    // Runs |op| on one color buffer |opsPerThread| times from each of 8
+    // render threads at once, while another thread keeps uploading to a
+    // different color buffer, and prints the rate as "8 threads |what| ...".
+    void measureColorBufferRateUnderContention(
+            const char* what,
+            int opsPerThread,
+            const std::function<bool(HandleType)>& op) {
+        constexpr int kThreads = 8;
+
+        HandleType colorBuffer =
+            mFb->createColorBuffer(mWidth, mHeight, GL_RGBA, FRAMEWORK_FORMAT_GL_COMPATIBLE);
+        HandleType uploadColorBuffer =
+            mFb->createColorBuffer(mWidth, mHeight, GL_RGBA, FRAMEWORK_FORMAT_GL_COMPATIBLE);
+        // Hold a reference, so ops that open and close it never free it.
+        mFb->openColorBuffer(colorBuffer);
+        std::vector<uint8_t> pixels(mWidth * mHeight * 4, 0x7f);
+
+        std::atomic<bool> uploading{true};
+        android::base::FunctorThread uploader([&] {
+            RenderThreadInfo threadInfo;
+            while (uploading) {
+                mFb->updateColorBuffer(uploadColorBuffer, 0, 0, mWidth, mHeight,
+                                       GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+            }
+            return 0;
+        });
+        ASSERT_TRUE(uploader.start());
+
+        std::atomic<int> ready{0};
+        std::atomic<int> failures{0};
+        std::vector<uint64_t> durationsUs(kThreads);
+        std::vector<std::unique_ptr<android::base::FunctorThread>> renderThreads;
+        for (int i = 0; i < kThreads; ++i) {
+            renderThreads.emplace_back(new android::base::FunctorThread([&, i] {
+                RenderThreadInfo threadInfo;
+                HandleType context = mFb->createRenderContext(0, 0, GLESApi_3_0);
+                HandleType surface = mFb->createWindowSurface(0, 1, 1);
+                mFb->bindContext(context, surface, surface);
+
+                // Start together.
+                ++ready;
+                while (ready < kThreads) {
+                }
+
+                const auto start = std::chrono::steady_clock::now();
+                for (int j = 0; j < opsPerThread; ++j) {
+                    if (!op(colorBuffer)) {
+                        ++failures;
+                    }
+                }
+                durationsUs[i] = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start).count();
+
+                mFb->bindContext(0, 0, 0);
+                mFb->DestroyWindowSurface(surface);
+                mFb->DestroyRenderContext(context);
+                return 0;
+            }));
+            ASSERT_TRUE(renderThreads.back()->start());
+        }
+        for (auto& thread : renderThreads) {
+            thread->wait();
+        }
+        uploading = false;
+        uploader.wait();
+
+        EXPECT_EQ(0, failures.load());
+
+        uint64_t duration_us = 1;
+        for (uint64_t threadUs : durationsUs) {
+            duration_us = std::max(duration_us, threadUs);
+        }
+        const int ops = kThreads * opsPerThread;
+        printf("%d threads %s %d times in %f ms. Rate: %f Hz\n", kThreads,
+               what, ops, duration_us / 1000.0f, ops / (duration_us / 1000000.0f));
+
+        mFb->closeColorBuffer(colorBuffer);
+        mFb->closeColorBuffer(colorBuffer);
+        mFb->closeColorBuffer(uploadColorBuffer);
+    }
+
     bool mUseSubWindow = false;
     OSWindow* mWindow = nullptr;
     FrameBuffer* mFb = nullptr;
@@ -729,6 +816,41 @@ TEST_F(FrameBufferTest, HostDrawCallRate) {
     mFb->DestroyWindowSurface(surface);
 }
 
+// Tests the rate of color buffer texture binds from many render threads at
+// once, while another thread keeps uploading to a color buffer. Binds only
+// take the color buffer table's read lock.
+TEST_F(FrameBufferTest, ColorBufferBindRateUnderContention) {
+    measureColorBufferRateUnderContention("bound", 20000, [this](HandleType cb) {
+        return mFb->bindColorBufferToTexture(cb);
+    });
+}
+
+// The same for opening and closing a color buffer, posting it and reading
+// back from it, which all still take the FrameBuffer lock.
+TEST_F(FrameBufferTest, ColorBufferOpenRateUnderContention) {
+    measureColorBufferRateUnderContention("opened", 20000, [this](HandleType cb) {
+        if (mFb->openColorBuffer(cb) != 0) {
+            return false;
+        }
+        mFb->closeColorBuffer(cb);
+        return true;
+    });
+}
+
+TEST_F(FrameBufferTest, ColorBufferPostRateUnderContention) {
+    measureColorBufferRateUnderContention("posted", 500, [this](HandleType cb) {
+        return mFb->post(cb);
+    });
+}
+
+TEST_F(FrameBufferTest, ColorBufferReadbackRateUnderContention) {
+    measureColorBufferRateUnderContention("read back", 2000, [this](HandleType cb) {
+        uint8_t pixel[4];
+        mFb->readColorBuffer(cb, 0, 0, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixel);
+        return true;
+    });
+}
+
 // Tests Vulkan interop query.
 TEST_F(FrameBufferTest, VulkanInteropQuery) {
     auto egl = LazyLoadedEGLDispatch::get();
@@ -0,0 +1,142 @@
+// Copyright (C) 2021 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "FrameTracer.h"
+
+#include "android/base/files/PathUtils.h"
+#include "android/base/testing/TestTempDir.h"
+
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace {
+
+// The summary of the span called |name|.
+FrameTracer::SpanSummary findSpan(const FrameTracer& tracer, const char* name) {
+    for (const auto& span : tracer.summarize()) {
+        if (std::string(span.name) == name) {
+            return span;
+        }
+    }
+    ADD_FAILURE() << "No span " << name;
+    return {};
+}
+
+// Traces a frame through the window path, each stage |stepUs| after the last.
+uint64_t traceWindowFrame(FrameTracer* tracer, uint64_t startUs, uint64_t stepUs) {
+    const uint64_t frame = tracer->beginFrame(startUs);
+    tracer->mark(frame, FrameTracer::GuestSwap, startUs - 2 * stepUs);
+    tracer->mark(frame, FrameTracer::PostWorkerStart, startUs + stepUs);
+    tracer->mark(frame, FrameTracer::WindowSwap, startUs + 2 * stepUs);
+    return frame;
+}
+
+}  // namespace
+
+TEST(FrameTracer, DisabledByDefault) {
+    FrameTracer tracer;
+    EXPECT_FALSE(tracer.enabled());
+    EXPECT_EQ(0u, tracer.beginFrame(1000));
+    for (const auto& span : tracer.summarize()) {
+        EXPECT_EQ(0u, span.count);
+    }
+}
+
+TEST(FrameTracer, SpansBetweenStages) {
+    FrameTracer tracer;
+    tracer.setEnabled(true);
+    const uint64_t frame = traceWindowFrame(&tracer, 10000, 100);
+    EXPECT_NE(0u, frame);
+
+    EXPECT_EQ(100u, findSpan(tracer, "post queue").p50Us);
+    EXPECT_EQ(100u, findSpan(tracer, "post to window swap").p50Us);
+    EXPECT_EQ(400u, findSpan(tracer, "guest swap to window").p50Us);
+    // Stages the frame didn't go through don't count.
+    EXPECT_EQ(0u, findSpan(tracer, "motion to photon").count);
+    EXPECT_EQ(0u, findSpan(tracer, "decode to post").count);
+}
+
+TEST(FrameTracer, FirstMarkWins) {
+    FrameTracer tracer;
+    tracer.setEnabled(true);
+    const uint64_t frame = tracer.beginFrame(1000);
+    tracer.mark(frame, FrameTracer::VrHandoff, 1100);
+    tracer.mark(frame, FrameTracer::VrSubmit, 1500);
+    // Shown again on the next headset frame.
+    tracer.mark(frame, FrameTracer::VrSubmit, 2500);
+    EXPECT_EQ(400u, findSpan(tracer, "vr queue to submit").maxUs);
+}
+
+TEST(FrameTracer, Percentiles) {
+    FrameTracer tracer;
+    tracer.setEnabled(true);
+    // 1..100 us in the post queue.
+    for (uint64_t i = 1; i <= 100; ++i) {
+        const uint64_t frame = tracer.beginFrame(i * 10000);
+        tracer.mark(frame, FrameTracer::PostWorkerStart, i * 10000 + i);
+    }
+    const auto span = findSpan(tracer, "post queue");
+    EXPECT_EQ(100u, span.count);
+    EXPECT_EQ(50u, span.p50Us);
+    EXPECT_EQ(99u, span.p99Us);
+    EXPECT_EQ(100u, span.maxUs);
+}
+
+TEST(FrameTracer, KeepsLastFrames) {
+    FrameTracer tracer;
+    tracer.setEnabled(true);
+    const uint64_t first = tracer.beginFrame(1000);
+    for (size_t i = 0; i < FrameTracer::kMaxFrames + 10; ++i) {
+        traceWindowFrame(&tracer, 2000 + i * 1000, 10);
+    }
+    EXPECT_EQ(FrameTracer::kMaxFrames, findSpan(tracer, "post queue").count);
+
+    // The first frame's record was reused, so late marks for it are dropped.
+    tracer.mark(first, FrameTracer::PostWorkerStart, 1000000);
+    EXPECT_EQ(10u, findSpan(tracer, "post queue").maxUs);
+}
+
+TEST(FrameTracer, RestartDropsFrames) {
+    FrameTracer tracer;
+    tracer.setEnabled(true);
+    traceWindowFrame(&tracer, 10000, 100);
+    tracer.setEnabled(false);
+    EXPECT_EQ(1u, findSpan(tracer, "post queue").count);
+    tracer.setEnabled(true);
+    EXPECT_EQ(0u, findSpan(tracer, "post queue").count);
+}
+
+TEST(FrameTracer, ExportChromeTrace) {
+    android::base::TestTempDir dir("frametracer");
+    const std::string path = android::base::PathUtils::join(dir.path(), "trace.json");
+
+    FrameTracer tracer;
+    tracer.setEnabled(true);
+    const uint64_t frame = traceWindowFrame(&tracer, 10000, 100);
+    ASSERT_TRUE(tracer.exportChromeTrace(path.c_str()));
+
+    std::ifstream file(path);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    const std::string json = contents.str();
+    EXPECT_EQ('{', json.front());
+    EXPECT_NE(std::string::npos, json.find("\"traceEvents\""));
+    EXPECT_NE(std::string::npos, json.find("\"name\":\"post queue\""));
+    EXPECT_NE(std::string::npos,
+              json.find("\"ts\":10000,\"dur\":100,\"args\":{\"frame\":" +
+                        std::to_string(frame) + "}"));
+}
@@ -0,0 +1,125 @@
+// Copyright (C) 2021 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "LemvrReprojection.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+
+namespace lemvr {
+
+namespace {
+
+constexpr float kEpsilon = 1e-5f;
+
+// A synthetic pose source: the head turns around the vertical axis at
+// |yawRate| and moves at |speed| along x.
+vr::TrackedDevicePose_t syntheticPose(float seconds, float yawRate, float speed) {
+    const float yaw = yawRate * seconds;
+    vr::TrackedDevicePose_t pose = {};
+    pose.mDeviceToAbsoluteTracking.m[0][0] = cosf(yaw);
+    pose.mDeviceToAbsoluteTracking.m[0][2] = sinf(yaw);
+    pose.mDeviceToAbsoluteTracking.m[1][1] = 1;
+    pose.mDeviceToAbsoluteTracking.m[2][0] = -sinf(yaw);
+    pose.mDeviceToAbsoluteTracking.m[2][2] = cosf(yaw);
+    pose.mDeviceToAbsoluteTracking.m[0][3] = speed * seconds;
+    pose.vVelocity.v[0] = speed;
+    pose.vAngularVelocity.v[1] = yawRate;
+    pose.eTrackingResult = vr::TrackingResult_Running_OK;
+    pose.bPoseIsValid = true;
+    pose.bDeviceIsConnected = true;
+    return pose;
+}
+
+void expectSameTransform(const vr::HmdMatrix34_t& a, const vr::HmdMatrix34_t& b) {
+    for(int i = 0; i < 3; ++i) {
+        for(int j = 0; j < 4; ++j) {
+            EXPECT_NEAR(a.m[i][j], b.m[i][j], kEpsilon) << "at " << i << "," << j;
+        }
+    }
+}
+
+void apply(const Mat3& r, const float in[3], float out[3]) {
+    for(int i = 0; i < 3; ++i) {
+        out[i] = r.m[i][0] * in[0] + r.m[i][1] * in[1] + r.m[i][2] * in[2];
+    }
+}
+
+}  // namespace
+
+TEST(LemvrReprojection, PredictNothing) {
+    const vr::TrackedDevicePose_t pose = syntheticPose(0.3f, 2.0f, 1.0f);
+    expectSameTransform(predictPose(pose, 0).mDeviceToAbsoluteTracking,
+                        pose.mDeviceToAbsoluteTracking);
+}
+
+TEST(LemvrReprojection, PredictInvalidPose) {
+    vr::TrackedDevicePose_t pose = syntheticPose(0.3f, 2.0f, 1.0f);
+    pose.bPoseIsValid = false;
+    expectSameTransform(predictPose(pose, 0.1f).mDeviceToAbsoluteTracking,
+                        pose.mDeviceToAbsoluteTracking);
+}
+
+TEST(LemvrReprojection, PredictMatchesSyntheticSource) {
+    for(float dt : {0.001f, 0.011f, 0.05f}) {
+        const vr::TrackedDevicePose_t predicted =
+                predictPose(syntheticPose(0.2f, 1.5f, 0.5f), dt);
+        expectSameTransform(predicted.mDeviceToAbsoluteTracking,
+                            syntheticPose(0.2f + dt, 1.5f, 0.5f).mDeviceToAbsoluteTracking);
+    }
+}
+
+TEST(LemvrReprojection, PredictAroundTiltedAxis) {
+    vr::TrackedDevicePose_t pose = syntheticPose(0, 0, 0);
+    // A quarter turn per second around x.
+    pose.vAngularVelocity.v[0] = float(M_PI / 2);
+    pose.vAngularVelocity.v[1] = 0;
+
+    const Mat3 r = rotationOf(predictPose(pose, 1).mDeviceToAbsoluteTracking);
+    // Forward (-z) now points up (+y).
+    const float forward[3] = {0, 0, -1};
+    float out[3];
+    apply(r, forward, out);
+    EXPECT_NEAR(out[0], 0, kEpsilon);
+    EXPECT_NEAR(out[1], 1, kEpsilon);
+    EXPECT_NEAR(out[2], 0, kEpsilon);
+}
+
+TEST(LemvrReprojection, NoHeadMotion) {
+    const vr::TrackedDevicePose_t pose = syntheticPose(0.7f, 1.0f, 0);
+    const Mat3 r = sourceFromDisplay(pose, pose);
+    for(int i = 0; i < 3; ++i) {
+        for(int j = 0; j < 3; ++j) {
+            EXPECT_NEAR(r.m[i][j], i == j ? 1 : 0, kEpsilon);
+        }
+    }
+}
+
+TEST(LemvrReprojection, HeadTurnedLeft) {
+    const float yaw = 0.1f;
+    const vr::TrackedDevicePose_t renderPose = syntheticPose(0, 1.0f, 0);
+    const vr::TrackedDevicePose_t displayPose = syntheticPose(yaw, 1.0f, 0);
+
+    // What's straight ahead when the frame is shown was to the left of the
+    // center of the rendered frame.
+    const float forward[3] = {0, 0, -1};
+    float source[3];
+    apply(sourceFromDisplay(renderPose, displayPose), forward, source);
+    EXPECT_NEAR(source[0], -sinf(yaw), kEpsilon);
+    EXPECT_NEAR(source[1], 0, kEpsilon);
+    EXPECT_NEAR(source[2], -cosf(yaw), kEpsilon);
+}
+
+}
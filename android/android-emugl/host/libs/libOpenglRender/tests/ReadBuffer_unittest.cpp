@@ -0,0 +1,95 @@
+// Copyright (C) 2021 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ReadBuffer.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace emugl {
+
+namespace {
+
+// Serves the bytes 0, 1, 2, ... (mod 251), at most |chunk| per read.
+class CountingStream : public IOStream {
+public:
+    explicit CountingStream(size_t chunk) : IOStream(0), mChunk(chunk) {}
+
+    void* allocBuffer(size_t) override { return nullptr; }
+    int commitBuffer(size_t) override { return 0; }
+    int writeFully(const void*, size_t) override { return 0; }
+    const unsigned char* readFully(void*, size_t) override { return nullptr; }
+    void* getDmaForReading(uint64_t) override { return nullptr; }
+    void unlockDma(uint64_t) override {}
+
+    static unsigned char byteAt(size_t pos) { return pos % 251; }
+
+protected:
+    const unsigned char* readRaw(void* buf, size_t* inout_len) override {
+        *inout_len = std::min(*inout_len, mChunk);
+        unsigned char* out = (unsigned char*)buf;
+        for (size_t i = 0; i < *inout_len; ++i) {
+            out[i] = byteAt(mPos++);
+        }
+        return out;
+    }
+    void onSave(android::base::Stream*) override {}
+    unsigned char* onLoad(android::base::Stream*) override { return nullptr; }
+
+private:
+    size_t mChunk;
+    size_t mPos = 0;
+};
+
+}  // namespace
+
+TEST(ReadBuffer, DataStaysContiguousAcrossTheEnd) {
+    CountingStream stream(1000);
+    ReadBuffer readBuf(4096);
+
+    // Consume in odd sizes so that reads keep wrapping around the ring.
+    size_t pos = 0;
+    for (int i = 0; i < 200; ++i) {
+        const size_t want = 100 + (i * 37) % 900;
+        if (readBuf.validData() < want) {
+            ASSERT_GT(readBuf.getData(&stream, want), 0);
+        }
+        ASSERT_GE(readBuf.validData(), want);
+        for (size_t j = 0; j < want; ++j) {
+            ASSERT_EQ(CountingStream::byteAt(pos + j), readBuf.buf()[j])
+                    << "at " << pos + j;
+        }
+        readBuf.consume(want);
+        pos += want;
+    }
+}
+
+TEST(ReadBuffer, GrowsForLargePackets) {
+    CountingStream stream(64 * 1024);
+    ReadBuffer readBuf(4096);
+
+    ASSERT_GT(readBuf.getData(&stream, 100), 0);
+    readBuf.consume(50);
+
+    const size_t big = 3 * 4096 + 123;
+    ASSERT_GT(readBuf.getData(&stream, big), 0);
+    ASSERT_GE(readBuf.validData(), big);
+    for (size_t j = 0; j < big; ++j) {
+        ASSERT_EQ(CountingStream::byteAt(50 + j), readBuf.buf()[j]);
+    }
+}
+
+}  // namespace emugl
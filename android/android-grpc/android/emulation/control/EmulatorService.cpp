@@ -28,6 +28,7 @@
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <new>
@@ -74,6 +75,8 @@
 #include "android/emulation/control/user_event_agent.h"
 #include "android/emulation/control/utils/AudioUtils.h"
 #include "android/emulation/control/utils/EventWaiter.h"
+#include "android/emulation/control/utils/ImageDeltaEncoder.h"
+#include "android/emulation/control/utils/ScreenshotBroker.h"
 #include "android/emulation/control/utils/ScreenshotUtils.h"
 #include "android/emulation/control/utils/SharedMemoryLibrary.h"
 #include "android/emulation/control/vm_operations.h"
@@ -504,59 +507,91 @@ public:
     Status streamScreenshot(ServerContext* context,
                             const ImageFormat* request,
                             ServerWriter<Image>* writer) override {
+        // An MMAP region holds a single image, an MMAP_RING region holds
+        // |slots| images and every image goes into the next slot.
+        const auto channel = request->transport().channel();
+        // The slots are sized from the requested image size, the native
+        // display size can change while streaming.
+        if (channel == ImageTransport::MMAP_RING &&
+            (request->width() == 0 || request->height() == 0)) {
+            return Status(::grpc::StatusCode::INVALID_ARGUMENT,
+                          "A shared memory ring needs an explicit width and "
+                          "height",
+                          "");
+        }
+        if (channel == ImageTransport::MMAP_RING &&
+            request->transport().slots() > kMaxScreenshotSlots) {
+            return Status(::grpc::StatusCode::INVALID_ARGUMENT,
+                          "A shared memory ring can have at most " +
+                                  std::to_string(kMaxScreenshotSlots) +
+                                  " slots",
+                          "");
+        }
+        const uint32_t slots =
+                channel == ImageTransport::MMAP_RING
+                        ? std::max<uint32_t>(request->transport().slots(), 1)
+                        : 1;
+        // width * height fits in 64 bits, the rest is checked against the
+        // largest region we can map before multiplying.
+        const uint64_t pixels = uint64_t(request->width()) * request->height();
+        const uint64_t bytesPerPixel =
+                ScreenshotUtils::getBytesPerPixel(*request);
+        if (pixels > std::numeric_limits<size_t>::max() / bytesPerPixel /
+                             slots) {
+            return Status(::grpc::StatusCode::INVALID_ARGUMENT,
+                          "The requested image size is too large", "");
+        }
+        const size_t slotSize = pixels * bytesPerPixel;
+        const size_t ringSize = slotSize * slots;
+        uint64_t nextSlot = 0;
         SharedMemoryLibrary::LibraryEntry entry;
-        if (request->transport().channel() == ImageTransport::MMAP) {
-            entry = mSharedMemoryLibrary.borrow(
-                    request->transport().handle(),
-                    request->width() * request->height() *
-                            ScreenshotUtils::getBytesPerPixel(*request));
+        if (channel == ImageTransport::MMAP ||
+            channel == ImageTransport::MMAP_RING) {
+            entry = mSharedMemoryLibrary.borrow(request->transport().handle(),
+                                                ringSize);
         }
 
+        // Delta encoded images are encoded for every client separately,
+        // against the last image that client received.
+        const bool useDelta =
+                request->deltaencoding() &&
+                channel == ImageTransport::TRANSPORT_CHANNEL_UNSPECIFIED &&
+                (request->format() == ImageFormat::RGB888 ||
+                 request->format() == ImageFormat::RGBA8888);
+        ImageDeltaEncoder encoder;
+        Image delta;
+
         // Make sure we always write the first frame, this can be
         // a completely empty frame if the screen is not active.
         Image reply;
-
-        // cPixels is used to verify the invariant that retrieved image
-        // is not shrinking over subsequent calls, as this might result
-        // in unexpected behavior for clients.
-        int cPixels = reply.image().size();
         bool clientAvailable = !context->IsCancelled();
 
         if (clientAvailable) {
+            // This goes into the first slot of a ring.
             getScreenshot(context, request, &reply);
-            assert(reply.image().size() >= cPixels);
-            cPixels = reply.image().size();
-            clientAvailable = !context->IsCancelled() && writer->Write(reply);
+            nextSlot++;
+            if (useDelta) {
+                encoder.encode(reply, &delta);
+            }
+            clientAvailable = !context->IsCancelled() &&
+                              writer->Write(useDelta ? delta : reply);
         }
 
         bool lastFrameWasEmpty = reply.format().width() == 0;
         int frame = 0;
 
-        // TODO(jansen): Move to ScreenshotUtils.
-        std::unique_ptr<EventWaiter> frameEvent;
-        std::unique_ptr<RaiiEventListener<emugl::Renderer,
-                                          emugl::FrameBufferChangeEvent>>
-                frameListener;
-        // Screenshots can come from either the gl renderer, or the guest.
-        const auto& renderer = android_getOpenglesRenderer();
-        if (renderer.get()) {
-            // Fast mode..
-            frameEvent = std::make_unique<EventWaiter>();
-            frameListener = std::make_unique<RaiiEventListener<
-                    emugl::Renderer, emugl::FrameBufferChangeEvent>>(
-                    renderer.get(),
-                    [&](const emugl::FrameBufferChangeEvent state) {
-                        frameEvent->newEvent();
-                    });
-        } else {
-            // slow mode, you are likely using older api..
-            LOG(VERBOSE) << "Reverting to slow callbacks";
-            frameEvent = std::make_unique<EventWaiter>(
-                    &gpu_register_shared_memory_callback,
-                    &gpu_unregister_shared_memory_callback);
-        }
+        // Frames are produced once for all the clients that stream the same
+        // variant, the shared frames always carry their pixels in the image
+        // field, and are copied out to the shared memory region of an MMAP
+        // or MMAP_RING client.
+        auto stream = screenshotStream();
+        ImageFormat sharedRequest = *request;
+        sharedRequest.clear_transport();
+        const bool useMmap = entry && entry->isOpen() && entry->isMapped();
+
         // Track percentiles, and report if we have seen at least 32 frames.
         metrics::Percentiles perfEstimator(32, {0.5, 0.95});
+        uint64_t seen = stream->frameEvent->current();
         while (clientAvailable) {
             const auto kTimeToWaitForFrame = std::chrono::milliseconds(125);
 
@@ -565,28 +600,72 @@ public:
             // interval. Since this is a synchronous call we want to wait at
             // most kTimeToWaitForFrame so we can check if the client is still
             // there. (All clients get disconnected on emulator shutdown).
-            auto arrived = frameEvent->next(kTimeToWaitForFrame);
+            auto arrived = stream->frameEvent->next(seen, kTimeToWaitForFrame);
             if (arrived > 0 && !context->IsCancelled()) {
                 frame += arrived;
+                seen += arrived;
                 Stopwatch sw;
-                getScreenshot(context, request, &reply);
-
-                // The invariant that the pixel buffer does not decrease should
-                // hold. Clients likely rely on the buffer size to match the
-                // actual number of available pixels.
-                assert(reply.image().size() >= cPixels);
-                cPixels = reply.image().size();
+                ScreenshotBroker::Variant variant = {
+                        request->display(), request->format(),
+                        request->width(), request->height(),
+                        ScreenshotUtils::deriveRotation(mAgents->sensors)};
+                auto image = stream->broker.get(
+                        variant, seen, [&](Image* out) {
+                            return getScreenshot(context, &sharedRequest, out)
+                                    .ok();
+                        });
+                if (!image) {
+                    clientAvailable = !context->IsCancelled();
+                    continue;
+                }
 
-                reply.set_seq(frame);
                 // We send the first empty frame, after that we wait for frames
                 // to come, or until the client gives up on us. So for a screen
                 // that comes in and out the client will see this timeline: (0
                 // is empty frame. F is frame) [0, ... <nothing> ..., F1, F2,
                 // F3, 0, ...<nothing>... ]
-                bool emptyFrame = reply.format().width() == 0;
+                bool emptyFrame = image->format().width() == 0;
                 if (!context->IsCancelled() &&
                     (!lastFrameWasEmpty || !emptyFrame)) {
-                    clientAvailable = writer->Write(reply);
+                    if (useMmap) {
+                        const auto& pixels = image->image();
+                        const size_t offset = (nextSlot % slots) * slotSize;
+                        if (slots > 1 && pixels.size() > slotSize) {
+                            return Status(
+                                    ::grpc::StatusCode::FAILED_PRECONDITION,
+                                    "The slots of the shared memory ring need "
+                                    "to have a size of at least: " +
+                                            std::to_string(pixels.size()),
+                                    "");
+                        }
+                        if (offset + pixels.size() > entry->size()) {
+                            return Status(
+                                    ::grpc::StatusCode::FAILED_PRECONDITION,
+                                    "The shared memory region needs to have a "
+                                    "size of at least: " +
+                                            std::to_string(offset +
+                                                           pixels.size()),
+                                    "");
+                        }
+                        memcpy(reinterpret_cast<uint8_t*>(entry->get()) +
+                                       offset,
+                               pixels.data(), pixels.size());
+                        nextSlot++;
+                        *reply.mutable_format() = image->format();
+                        auto transport =
+                                reply.mutable_format()->mutable_transport();
+                        transport->set_handle(request->transport().handle());
+                        transport->set_channel(channel);
+                        transport->set_offset(offset);
+                        reply.set_seq(image->seq());
+                        reply.set_timestampus(image->timestampus());
+                        clientAvailable = writer->Write(reply);
+                    } else if (useDelta) {
+                        encoder.encode(*image, &delta);
+                        clientAvailable = writer->Write(delta);
+                    } else {
+                        clientAvailable = writer->Write(*image);
+                    }
                     perfEstimator.addSample(sw.elapsedUs());
                 }
                 lastFrameWasEmpty = emptyFrame;
@@ -617,6 +696,49 @@ public:
         return Status::OK;
     }
 
+    // The frame notifications and the frames shared by all the clients that
+    // are currently streaming screenshots.
+    struct ScreenshotStream {
+        std::unique_ptr<EventWaiter> frameEvent;
+        std::unique_ptr<RaiiEventListener<emugl::Renderer,
+                                          emugl::FrameBufferChangeEvent>>
+                frameListener;
+        ScreenshotBroker broker;
+    };
+
+    // Returns the active screenshot stream, starting one if no client is
+    // streaming yet.
+    std::shared_ptr<ScreenshotStream> screenshotStream() {
+        std::lock_guard<std::mutex> lock(mScreenshotStreamLock);
+        auto stream = mScreenshotStream.lock();
+        if (stream) {
+            return stream;
+        }
+
+        stream = std::make_shared<ScreenshotStream>();
+        // Screenshots can come from either the gl renderer, or the guest.
+        const auto& renderer = android_getOpenglesRenderer();
+        if (renderer.get()) {
+            // Fast mode..
+            stream->frameEvent = std::make_unique<EventWaiter>();
+            auto frameEvent = stream->frameEvent.get();
+            stream->frameListener = std::make_unique<RaiiEventListener<
+                    emugl::Renderer, emugl::FrameBufferChangeEvent>>(
+                    renderer.get(),
+                    [frameEvent](const emugl::FrameBufferChangeEvent state) {
+                        frameEvent->newEvent();
+                    });
+        } else {
+            // slow mode, you are likely using older api..
+            LOG(VERBOSE) << "Reverting to slow callbacks";
+            stream->frameEvent = std::make_unique<EventWaiter>(
+                    &gpu_register_shared_memory_callback,
+                    &gpu_unregister_shared_memory_callback);
+        }
+        mScreenshotStream = stream;
+        return stream;
+    }
+
     Status getScreenshot(ServerContext* context,
                          const ImageFormat* request,
                          Image* reply) override {
@@ -760,7 +882,9 @@ public:
         rotation_reply->set_yaxis(yaxis);
         rotation_reply->set_zaxis(zaxis);
         rotation_reply->set_rotation(rotation);
-        if (request->transport().channel() == ImageTransport::MMAP) {
+        if (request->transport().channel() == ImageTransport::MMAP ||
+            request->transport().channel() == ImageTransport::MMAP_RING) {
+            // A single image always goes into the first slot of a ring.
             auto shm = mSharedMemoryLibrary.borrow(
                     request->transport().handle(), cPixels);
             if (shm->isOpen() && shm->isMapped()) {
@@ -777,7 +901,7 @@ public:
 
                 auto transport = format->mutable_transport();
                 transport->set_handle(request->transport().handle());
-                transport->set_channel(ImageTransport::MMAP);
+                transport->set_channel(request->transport().channel());
             }
         } else {
             // Make sure the image field has a string that is large enough.
@@ -1197,6 +1321,8 @@ private:
     TouchEventSender mTouchEventSender;
     SharedMemoryLibrary mSharedMemoryLibrary;
     EventWaiter mNotificationWaiter;
+    std::mutex mScreenshotStreamLock;
+    std::weak_ptr<ScreenshotStream> mScreenshotStream;
 
     VirtualSceneCamera mCamera;
     Clipboard* mClipboard;
@@ -1205,6 +1331,8 @@ private:
             mLogcatBuffer;  // A ring buffer that tracks the logcat output.
 
     static constexpr uint32_t k128KB = (128 * 1024) - 1;
+    // The most images a streamScreenshot shared memory ring can hold.
+    static constexpr uint32_t kMaxScreenshotSlots = 8;
     static constexpr std::chrono::milliseconds k5SecondsWait = 5s;
     const std::chrono::milliseconds kNoWait = 0ms;
 };
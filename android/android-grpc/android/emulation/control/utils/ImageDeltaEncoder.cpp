@@ -0,0 +1,152 @@
+// Copyright (C) 2021 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "android/emulation/control/utils/ImageDeltaEncoder.h"
+
+#include <string.h>   // for memcpy
+#include <algorithm>  // for min
+#include <string>     // for string
+#include <utility>    // for swap
+
+namespace android {
+namespace emulation {
+namespace control {
+
+static constexpr uint64_t kHashSeed = 0xcbf29ce484222325ULL;
+static constexpr uint64_t kHashMultiplier = 0x9E3779B97F4A7C15ULL;
+
+// Mixes |len| bytes into |hash|, a word at a time.
+static uint64_t hashBytes(uint64_t hash, const uint8_t* data, size_t len) {
+    while (len >= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        hash = (hash ^ word) * kHashMultiplier;
+        hash ^= hash >> 29;
+        data += sizeof(word);
+        len -= sizeof(word);
+    }
+    if (len > 0) {
+        uint64_t word = 0;
+        memcpy(&word, data, len);
+        hash = (hash ^ word ^ (len << 56)) * kHashMultiplier;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+ImageDeltaEncoder::ImageDeltaEncoder(int keyframeInterval)
+    : mKeyframeInterval(keyframeInterval) {}
+
+void ImageDeltaEncoder::encode(const Image& image, Image* delta) {
+    const auto format = image.format().format();
+    const uint32_t width = image.format().width();
+    const uint32_t height = image.format().height();
+    const size_t bpp = format == ImageFormat::RGBA8888 ? 4 : 3;
+    const size_t stride = width * bpp;
+    const uint8_t* pixels =
+            reinterpret_cast<const uint8_t*>(image.image().data());
+
+    if ((format != ImageFormat::RGB888 && format != ImageFormat::RGBA8888) ||
+        width == 0 || height == 0 || image.image().size() < stride * height) {
+        // Whatever comes next will be a keyframe.
+        mWidth = 0;
+        mHeight = 0;
+        mTileHashes.clear();
+        encodeKeyframe(image, delta);
+        return;
+    }
+
+    const uint32_t columns = (width + kTileSize - 1) / kTileSize;
+    const uint32_t rows = (height + kTileSize - 1) / kTileSize;
+    mNextTileHashes.assign(columns * rows, kHashSeed);
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t* row = pixels + y * stride;
+        uint64_t* hashes = mNextTileHashes.data() + (y / kTileSize) * columns;
+        for (uint32_t tx = 0; tx < columns; tx++) {
+            const uint32_t x = tx * kTileSize;
+            const uint32_t w = std::min(kTileSize, width - x);
+            hashes[tx] = hashBytes(hashes[tx], row + x * bpp, w * bpp);
+        }
+    }
+
+    const bool keyframe = width != mWidth || height != mHeight ||
+                          format != mFormat ||
+                          ++mSinceKeyframe >= mKeyframeInterval;
+    std::swap(mTileHashes, mNextTileHashes);
+    mWidth = width;
+    mHeight = height;
+    mFormat = format;
+    if (keyframe) {
+        mSinceKeyframe = 0;
+        encodeKeyframe(image, delta);
+        return;
+    }
+
+    delta->Clear();
+    *delta->mutable_format() = image.format();
+    delta->set_seq(image.seq());
+    delta->set_timestampus(image.timestampus());
+
+    // Runs of changed tiles in a row of tiles become a single rectangle.
+    size_t changed = 0;
+    for (uint32_t ty = 0; ty < rows; ty++) {
+        const uint64_t* now = mTileHashes.data() + ty * columns;
+        const uint64_t* before = mNextTileHashes.data() + ty * columns;
+        uint32_t tx = 0;
+        while (tx < columns) {
+            if (now[tx] == before[tx]) {
+                tx++;
+                continue;
+            }
+            const uint32_t first = tx;
+            while (tx < columns && now[tx] != before[tx]) {
+                tx++;
+            }
+            auto tile = delta->add_tiles();
+            tile->set_x(first * kTileSize);
+            tile->set_y(ty * kTileSize);
+            tile->set_width(std::min(tx * kTileSize, width) - tile->x());
+            tile->set_height(std::min((ty + 1) * kTileSize, height) -
+                             tile->y());
+            changed += tile->width() * tile->height();
+        }
+    }
+
+    // When everything changed the whole image is cheaper to apply.
+    if (changed == size_t(width) * height) {
+        mSinceKeyframe = 0;
+        encodeKeyframe(image, delta);
+        return;
+    }
+
+    std::string* out = delta->mutable_image();
+    out->resize(changed * bpp);
+    uint8_t* dst = reinterpret_cast<uint8_t*>(&(*out)[0]);
+    for (const auto& tile : delta->tiles()) {
+        const size_t bytes = tile.width() * bpp;
+        for (uint32_t y = tile.y(); y < tile.y() + tile.height(); y++) {
+            memcpy(dst, pixels + y * stride + tile.x() * bpp, bytes);
+            dst += bytes;
+        }
+    }
+}
+
+void ImageDeltaEncoder::encodeKeyframe(const Image& image, Image* delta) {
+    *delta = image;
+    delta->clear_tiles();
+    delta->set_keyframe(true);
+}
+
+}  // namespace control
+}  // namespace emulation
+}  // namespace android
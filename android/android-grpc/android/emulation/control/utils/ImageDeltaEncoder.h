@@ -0,0 +1,61 @@
+// Copyright (C) 2021 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <cstdint>  // for uint32_t, uint64_t
+#include <vector>   // for vector
+
+#include "emulator_controller.pb.h"  // for Image, ImageFormat_ImgFormat
+
+namespace android {
+namespace emulation {
+namespace control {
+
+// An ImageDeltaEncoder turns a stream of RGB888 or RGBA8888 images into the
+// delta encoded images described by ImageFormat.deltaEncoding.
+//
+// The images are cut into tiles of kTileSize x kTileSize pixels, and a tile is
+// sent when its hash differs from the hash of the same tile in the previous
+// image. Changed tiles that are next to each other in a row of tiles are sent
+// as a single rectangle.
+//
+// An encoder keeps the state of a single client, every image it encodes has to
+// be delivered to that client.
+class ImageDeltaEncoder {
+public:
+    static constexpr uint32_t kTileSize = 32;
+    static constexpr int kDefaultKeyframeInterval = 120;
+
+    explicit ImageDeltaEncoder(int keyframeInterval = kDefaultKeyframeInterval);
+
+    // Encodes |image| against the previously encoded image into |delta|.
+    // Images in other formats than RGB888 and RGBA8888, and empty images, are
+    // sent as they are, as a keyframe.
+    void encode(const Image& image, Image* delta);
+
+private:
+    void encodeKeyframe(const Image& image, Image* delta);
+
+    int mKeyframeInterval;
+    int mSinceKeyframe = 0;
+    uint32_t mWidth = 0;
+    uint32_t mHeight = 0;
+    ImageFormat_ImgFormat mFormat = ImageFormat::PNG;
+    std::vector<uint64_t> mTileHashes;
+    std::vector<uint64_t> mNextTileHashes;
+};
+
+}  // namespace control
+}  // namespace emulation
+}  // namespace android
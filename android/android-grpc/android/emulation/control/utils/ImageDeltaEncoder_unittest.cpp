@@ -0,0 +1,144 @@
+// Copyright (C) 2021 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "android/emulation/control/utils/ImageDeltaEncoder.h"
+
+#include <gtest/gtest.h>  // for Test, EXPECT_EQ, TEST
+#include <string.h>       // for memcpy
+#include <string>         // for string
+
+namespace android {
+namespace emulation {
+namespace control {
+
+static constexpr uint32_t kWidth = 100;
+static constexpr uint32_t kHeight = 70;
+static constexpr uint32_t kBpp = 4;
+
+static Image makeImage(uint32_t seq) {
+    Image image;
+    image.mutable_format()->set_format(ImageFormat::RGBA8888);
+    image.mutable_format()->set_width(kWidth);
+    image.mutable_format()->set_height(kHeight);
+    image.set_seq(seq);
+    std::string pixels(kWidth * kHeight * kBpp, 0);
+    for (size_t i = 0; i < pixels.size(); i++) {
+        pixels[i] = i % 251;
+    }
+    image.set_image(pixels);
+    return image;
+}
+
+static void setPixel(Image* image, uint32_t x, uint32_t y, uint32_t value) {
+    memcpy(&(*image->mutable_image())[(y * kWidth + x) * kBpp], &value,
+           sizeof(value));
+}
+
+// Applies |delta| the way a client would.
+static void applyDelta(const Image& delta, std::string* pixels) {
+    if (delta.keyframe()) {
+        *pixels = delta.image();
+        return;
+    }
+    size_t pos = 0;
+    for (const auto& tile : delta.tiles()) {
+        for (uint32_t y = tile.y(); y < tile.y() + tile.height(); y++) {
+            memcpy(&(*pixels)[(y * kWidth + tile.x()) * kBpp],
+                   delta.image().data() + pos, tile.width() * kBpp);
+            pos += tile.width() * kBpp;
+        }
+    }
+    EXPECT_EQ(delta.image().size(), pos);
+}
+
+TEST(ImageDeltaEncoder, first_image_is_a_keyframe) {
+    ImageDeltaEncoder encoder;
+    Image image = makeImage(0);
+    Image delta;
+    encoder.encode(image, &delta);
+    EXPECT_TRUE(delta.keyframe());
+    EXPECT_EQ(0, delta.tiles_size());
+    EXPECT_EQ(image.image(), delta.image());
+}
+
+TEST(ImageDeltaEncoder, unchanged_image_has_no_tiles) {
+    ImageDeltaEncoder encoder;
+    Image delta;
+    encoder.encode(makeImage(0), &delta);
+    encoder.encode(makeImage(1), &delta);
+    EXPECT_FALSE(delta.keyframe());
+    EXPECT_EQ(0, delta.tiles_size());
+    EXPECT_TRUE(delta.image().empty());
+    EXPECT_EQ(1u, delta.seq());
+    EXPECT_EQ(kWidth, delta.format().width());
+}
+
+TEST(ImageDeltaEncoder, sends_changed_tiles) {
+    ImageDeltaEncoder encoder;
+    Image image = makeImage(0);
+    Image delta;
+    encoder.encode(image, &delta);
+    std::string client;
+    applyDelta(delta, &client);
+
+    // Two neighboring tiles, and one on the clipped bottom right.
+    setPixel(&image, 31, 0, 0xdeadbeef);
+    setPixel(&image, 32, 1, 0xdeadbeef);
+    setPixel(&image, 99, 69, 0xdeadbeef);
+    encoder.encode(image, &delta);
+    EXPECT_FALSE(delta.keyframe());
+    ASSERT_EQ(2, delta.tiles_size());
+    EXPECT_EQ(0u, delta.tiles(0).x());
+    EXPECT_EQ(0u, delta.tiles(0).y());
+    EXPECT_EQ(64u, delta.tiles(0).width());
+    EXPECT_EQ(32u, delta.tiles(0).height());
+    EXPECT_EQ(96u, delta.tiles(1).x());
+    EXPECT_EQ(64u, delta.tiles(1).y());
+    EXPECT_EQ(4u, delta.tiles(1).width());
+    EXPECT_EQ(6u, delta.tiles(1).height());
+
+    applyDelta(delta, &client);
+    EXPECT_EQ(image.image(), client);
+}
+
+TEST(ImageDeltaEncoder, keyframes_are_repeated) {
+    ImageDeltaEncoder encoder(3);
+    Image delta;
+    for (int i = 0; i < 7; i++) {
+        encoder.encode(makeImage(i), &delta);
+        EXPECT_EQ(i % 3 == 0, delta.keyframe()) << "at " << i;
+    }
+}
+
+TEST(ImageDeltaEncoder, new_size_is_a_keyframe) {
+    ImageDeltaEncoder encoder;
+    Image delta;
+    Image image = makeImage(0);
+    encoder.encode(image, &delta);
+
+    image.mutable_format()->set_width(kWidth / 2);
+    encoder.encode(image, &delta);
+    EXPECT_TRUE(delta.keyframe());
+
+    // An empty image is passed on, and the next one starts over.
+    Image empty;
+    encoder.encode(empty, &delta);
+    EXPECT_TRUE(delta.keyframe());
+    encoder.encode(image, &delta);
+    EXPECT_TRUE(delta.keyframe());
+}
+
+}  // namespace control
+}  // namespace emulation
+}  // namespace android
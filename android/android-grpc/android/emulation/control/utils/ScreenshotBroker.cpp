@@ -0,0 +1,90 @@
+// Copyright (C) 2021 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "android/emulation/control/utils/ScreenshotBroker.h"
+
+#include <utility>  // for move
+
+#include "android/base/Stopwatch.h"           // for Stopwatch
+#include "android/metrics/MetricsReporter.h"  // for MetricsReporter
+#include "studio_stats.pb.h"                  // for AndroidStudioEvent
+
+namespace android {
+namespace emulation {
+namespace control {
+
+using android::base::Stopwatch;
+
+ScreenshotBroker::~ScreenshotBroker() {
+    for (const auto& it : mEntries) {
+        const Variant& variant = it.first;
+        const Entry& entry = *it.second;
+
+        // Only report metrics if we have a constant size per image, and
+        // if we produced sufficient amount of frames.
+        if (!entry.image || !entry.cost.isBucketized() ||
+            (variant.format != ImageFormat::RGB888 &&
+             variant.format != ImageFormat::RGBA8888)) {
+            continue;
+        }
+        const size_t size = entry.image->image().size();
+        const int frames = entry.frames;
+        const metrics::Percentiles cost = entry.cost;
+        android::metrics::MetricsReporter::get().report(
+                [size, frames, cost](android_studio::AndroidStudioEvent* event) {
+                    auto screenshot = event->mutable_emulator_details()
+                                              ->mutable_screenshot();
+                    // Kept apart from the per-client delivery_delay and
+                    // frames, which the streaming clients report.
+                    screenshot->set_size(size);
+                    screenshot->set_produced_frames(frames);
+                    cost.fillMetricsEvent(screenshot->mutable_production_cost(),
+                                          {0.5, 0.95, 1.0});
+                });
+    }
+}
+
+std::shared_ptr<const Image> ScreenshotBroker::get(const Variant& variant,
+                                                   uint64_t frame,
+                                                   const Producer& produce) {
+    std::shared_ptr<Entry> entry;
+    {
+        std::lock_guard<std::mutex> lock(mEntriesLock);
+        auto& slot = mEntries[variant];
+        if (!slot) {
+            slot = std::make_shared<Entry>();
+        }
+        entry = slot;
+    }
+
+    std::lock_guard<std::mutex> lock(entry->lock);
+    if (entry->image && entry->frame >= frame) {
+        return entry->image;
+    }
+
+    Stopwatch sw;
+    auto image = std::make_shared<Image>();
+    if (!produce(image.get())) {
+        return nullptr;
+    }
+    image->set_seq(frame);
+    entry->cost.addSample(sw.elapsedUs());
+    entry->frames++;
+    entry->frame = frame;
+    entry->image = std::move(image);
+    return entry->image;
+}
+
+}  // namespace control
+}  // namespace emulation
+}  // namespace android
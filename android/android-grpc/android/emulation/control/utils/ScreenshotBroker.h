@@ -0,0 +1,103 @@
+// Copyright (C) 2021 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <cstdint>     // for uint32_t, uint64_t
+#include <functional>  // for function
+#include <map>         // for map
+#include <memory>      // for shared_ptr
+#include <mutex>       // for mutex
+#include <tuple>       // for tie
+
+#include "android/metrics/Percentiles.h"  // for Percentiles
+#include "emulator_controller.pb.h"       // for Image, ImageFormat_ImgFormat
+
+namespace android {
+namespace emulation {
+namespace control {
+
+// A ScreenshotBroker shares the frames of a screenshot stream between all the
+// clients that are streaming the same picture.
+//
+// Every distinct (display, format, width, height, rotation) that a client asks
+// for is a variant. The first client that asks for a variant of a new frame
+// produces it, clients that want the same variant of the same frame wait for
+// it and get the same immutable image, instead of doing their own read back
+// and conversion.
+//
+// For example:
+//
+// ScreenshotBroker broker;
+// while (streaming) {
+//    frames.next(seen, timeout);
+//    seen = frames.current();
+//    auto image = broker.get(variant, seen, [&](Image* out) {
+//        return getScreenshot(out);
+//    });
+//    if (image) writer->Write(*image);
+// }
+class ScreenshotBroker {
+public:
+    struct Variant {
+        int display;
+        ImageFormat_ImgFormat format;
+        uint32_t width;
+        uint32_t height;
+        Rotation_SkinRotation rotation;
+
+        bool operator<(const Variant& other) const {
+            return std::tie(display, format, width, height, rotation) <
+                   std::tie(other.display, other.format, other.width,
+                            other.height, other.rotation);
+        }
+    };
+
+    // Fills in the given image, returns false if no image could be made.
+    using Producer = std::function<bool(Image*)>;
+
+    ScreenshotBroker() = default;
+
+    // Reports the production cost of every variant as its own metrics
+    // event, apart from the per-client delivery delay.
+    ~ScreenshotBroker();
+
+    // Returns the image of |variant| for frame number |frame| or a later
+    // frame. The image is produced by |produce| if no other client produced
+    // it yet, and carries |frame| as its sequence number.
+    //
+    // Returns nullptr if |produce| failed.
+    std::shared_ptr<const Image> get(const Variant& variant,
+                                     uint64_t frame,
+                                     const Producer& produce);
+
+private:
+    struct Entry {
+        // Held while the image is produced, so that clients of the same
+        // variant wait for it, while other variants are produced in parallel.
+        std::mutex lock;
+        uint64_t frame = 0;
+        std::shared_ptr<const Image> image;
+
+        // Time it took to produce a frame, in microseconds.
+        metrics::Percentiles cost{32, {0.5, 0.95}};
+        int frames = 0;
+    };
+
+    std::mutex mEntriesLock;
+    std::map<Variant, std::shared_ptr<Entry>> mEntries;
+};
+
+}  // namespace control
+}  // namespace emulation
+}  // namespace android
@@ -0,0 +1,107 @@
+// Copyright (C) 2021 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "android/emulation/control/utils/ScreenshotBroker.h"
+
+#include <gtest/gtest.h>  // for Test, EXPECT_EQ, TEST
+#include <atomic>         // for atomic
+#include <thread>         // for thread
+#include <vector>         // for vector
+
+namespace android {
+namespace emulation {
+namespace control {
+
+static ScreenshotBroker::Variant variant(uint32_t width) {
+    return {0, ImageFormat::RGBA8888, width, width, Rotation::PORTRAIT};
+}
+
+TEST(ScreenshotBroker, same_variant_is_produced_once) {
+    ScreenshotBroker broker;
+    int produced = 0;
+    auto produce = [&](Image* out) {
+        produced++;
+        out->set_image("pixels");
+        return true;
+    };
+
+    auto first = broker.get(variant(10), 1, produce);
+    auto second = broker.get(variant(10), 1, produce);
+    EXPECT_EQ(1, produced);
+    EXPECT_EQ(first.get(), second.get());
+    EXPECT_EQ(1u, first->seq());
+
+    // A new frame is produced again.
+    auto third = broker.get(variant(10), 2, produce);
+    EXPECT_EQ(2, produced);
+    EXPECT_EQ(2u, third->seq());
+
+    // The older image stays untouched for the clients that still hold it.
+    EXPECT_EQ(1u, first->seq());
+}
+
+TEST(ScreenshotBroker, variants_are_produced_separately) {
+    ScreenshotBroker broker;
+    auto small = broker.get(variant(10), 1, [](Image* out) {
+        out->set_image("small");
+        return true;
+    });
+    auto large = broker.get(variant(20), 1, [](Image* out) {
+        out->set_image("large");
+        return true;
+    });
+    EXPECT_EQ("small", small->image());
+    EXPECT_EQ("large", large->image());
+}
+
+TEST(ScreenshotBroker, failed_production_is_not_shared) {
+    ScreenshotBroker broker;
+    EXPECT_EQ(nullptr,
+              broker.get(variant(10), 1, [](Image* out) { return false; }));
+
+    int produced = 0;
+    broker.get(variant(10), 1, [&](Image* out) {
+        produced++;
+        return true;
+    });
+    EXPECT_EQ(1, produced);
+}
+
+TEST(ScreenshotBroker, concurrent_clients_share_a_frame) {
+    ScreenshotBroker broker;
+    std::atomic<int> produced{0};
+    std::vector<std::shared_ptr<const Image>> images(8);
+    std::vector<std::thread> clients;
+    for (size_t i = 0; i < images.size(); i++) {
+        clients.emplace_back([&, i]() {
+            images[i] = broker.get(variant(10), 1, [&](Image* out) {
+                produced++;
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                return true;
+            });
+        });
+    }
+    for (auto& client : clients) {
+        client.join();
+    }
+
+    EXPECT_EQ(1, produced.load());
+    for (const auto& image : images) {
+        EXPECT_EQ(images[0].get(), image.get());
+    }
+}
+
+}  // namespace control
+}  // namespace emulation
+}  // namespace android
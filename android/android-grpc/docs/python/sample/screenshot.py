@@ -39,6 +39,7 @@ IMAGE_FORMATS = {
 TRANSPORT = {
     "gRPC": p.ImageTransport.TRANSPORT_CHANNEL_UNSPECIFIED,
     "mmap": p.ImageTransport.MMAP,
+    "ring": p.ImageTransport.MMAP_RING,
 }
 
 
@@ -47,7 +48,7 @@ tmp_file = "/tmp/current_screen.img"
 
 def prepare_shm(args):
     with open(args.mmap_file, "wb") as out:
-        out.truncate(args.width * args.height * 4 + 1024)
+        out.truncate(args.slots * args.width * args.height * 4 + 1024)
 
 
 def center_window(root, width=300, height=200):
@@ -70,7 +71,9 @@ def stream_screenshots(args):
         height=args.height,
         display=0,
         transport=p.ImageTransport(
-            channel=TRANSPORT[args.transport], handle="file://" + args.mmap_file
+            channel=TRANSPORT[args.transport],
+            handle="file://" + args.mmap_file,
+            slots=args.slots,
         ),
     )
     # We should get a continous sequence of frames..
@@ -80,7 +83,7 @@ def stream_screenshots(args):
 
 def _img_consumer(canvas, root, args):
     """Consumes the images from the queue, and displaying them on the ui."""
-    use_mmap = args.transport == "mmap"
+    use_mmap = args.transport in ("mmap", "ring")
     mm = None
     if use_mmap:
         print("Using mmap: {}".format(args.mmap_file))
@@ -95,8 +98,11 @@ def _img_consumer(canvas, root, args):
     for img in stream_screenshots(args):
         img_bytes = img.image
         if mm:
-            mm.seek(0)
-            img_bytes = mm.read()
+            # The offset is always 0 for mmap, and selects the slot of the
+            # image in the ring.
+            size = img.format.width * img.format.height * len(args.format)
+            mm.seek(img.format.transport.offset)
+            img_bytes = mm.read(size)
 
         if old_h != img.format.height or old_w != img.format.width:
             emu = None
@@ -151,9 +157,15 @@ def main():
     parser.add_argument(
         "--transport",
         default="gRPC",
-        choices=("gRPC", "mmap"),
+        choices=("gRPC", "mmap", "ring"),
         help="Transport mechanism to use when retrieving images.",
     )
+    parser.add_argument(
+        "--slots",
+        type=int,
+        default=3,
+        help="Number of images in the memory mapped file with the ring transport.",
+    )
     parser.add_argument(
         "--mmap_file",
         default="/tmp/current_screen.img",
@@ -162,6 +174,8 @@ def main():
     args = parser.parse_args()
 
     if args.transport == "mmap":
+        args.slots = 1
+    if args.transport in ("mmap", "ring"):
         prepare_shm(args)
 
     root = Tk()